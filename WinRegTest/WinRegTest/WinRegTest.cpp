@@ -10,16 +10,104 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 #include <iostream>
+#include <cwchar>   // swprintf()
 #include "wreg.h"   // WinReg public header
+#include "wreg_blob.h"
+#include "wreg_columnar.h"
+#include "wreg_copy.h"
+#include "wreg_delete.h"
+#include "wreg_env.h"
+#include "wreg_footprint.h"
+#include "wreg_hive.h"
+#include "wreg_hive_edit.h"
+#include "wreg_hive_log.h"
+#include "wreg_hive_scan.h"
+#include "wreg_hive_verify.h"
+#include "wreg_index.h"
+#include "wreg_mirror.h"
+#include "wreg_overlay.h"
+#include "wreg_pmr.h"
+#include "wreg_probe.h"
+#include "wreg_query.h"
+#include "wreg_trace.h"
+#include "wreg_utf8.h"
+#include "wreg_watch.h"
+#include <cstdio>   // remove()
+#include <algorithm> // std::find
+#include <atomic>   // std::atomic
+#include <chrono>   // std::chrono::steady_clock
+#include <cstddef>  // offsetof()
+#include <filesystem> // std::filesystem::remove_all()
+#include <fstream>  // std::ifstream, std::ofstream
+#include <iterator> // std::istreambuf_iterator
+#include <map>      // std::map
+#include <memory_resource> // std::pmr::monotonic_buffer_resource
+#include <mutex>    // std::mutex
+#include <cstdlib>  // malloc(), free()
+#include <new>      // std::bad_alloc
+#include <thread>   // std::this_thread::sleep_for()
 
 using std::wcout;
 using std::wstring;
 using std::vector;
 
-// Helpers
+
 wstring ToHexString(BYTE b);
 wstring ToHexString(DWORD dw);
 void PrintRegValue(const winreg::RegValue& value);
+void Check(bool condition, const wchar_t* what);
+
+// Number of failed checks: main() returns non-zero if any
+int g_failures = 0;
+
+// Counts the heap allocations made through operator new, to check memory use
+std::atomic<size_t> g_allocations{ 0 };
+std::atomic<size_t> g_allocatedBytes{ 0 };
+
+// All the replaced operators go through this one pair. Kept out of line so that GCC
+// doesn't see the new/malloc and delete/free pairing after inlining, and doesn't warn
+// about mismatched new and delete (-Wmismatched-new-delete) at every delete expression.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* CountedAllocate(size_t size) noexcept
+{
+	g_allocations++;
+	g_allocatedBytes += size;
+	return malloc(size ? size : 1);
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void CountedFree(void* p) noexcept
+{
+	free(p);
+}
+
+void* operator new(size_t size)
+{
+	if (void* p = CountedAllocate(size))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	CountedFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	CountedFree(p);
+}
 
 winreg::RegKey return_key_with_some_values (const std::wstring & testKeyName)
 {
@@ -109,51 +197,2630 @@ void enum_values(winreg::RegKey & key)
 	}
 }
 
-/*
-*/
-int main()
+//
+// Batched read of several values
+//
+void test_query_multiple_values(const std::wstring & testKeyName)
 {
-    wcout << "*** Testing WinReg -- by Giovanni Dicanio & DBJDBJ ***\n\n";
+	wcout << L"\nReading several values at once...\n";
 
-    const wstring testKeyName = 
-		L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FolderDescriptions\\";
-	try {
-		//
-		// Enum Sub Keys
-		//
+	winreg::RegKey key = return_key_with_some_values(testKeyName);
+
+	const vector<wstring> valueNames = {
+		L"Test DWORD", L"Test REG_SZ", L"Missing value", L"Test REG_MULTI_SZ", L"Test REG_BINARY"
+	};
+	const vector<winreg::RegValueResult> results =
+		winreg::QueryMultipleValues(key.Handle(), valueNames);
+
+	Check(results.size() == valueNames.size(), L"one result per requested name");
+	Check(results[0].status == ERROR_SUCCESS && results[0].value.Dword() == 0x64, L"REG_DWORD read");
+	Check(results[1].status == ERROR_SUCCESS && results[1].value.String() == L"Hello World",
+		L"REG_SZ read");
+	Check(results[2].status == ERROR_FILE_NOT_FOUND && results[2].value.IsEmpty(),
+		L"missing value reported per name");
+	Check(results[3].status == ERROR_SUCCESS
+		&& results[3].value.MultiString() == vector<wstring>({ L"Ciao", L"Hi", L"Connie" }),
+		L"REG_MULTI_SZ read");
+	Check(results[4].status == ERROR_SUCCESS
+		&& results[4].value.Binary() == vector<BYTE>({ 0x22, 0x33, 0x44 }), L"REG_BINARY read");
+
+	for (const auto& result : results)
+	{
+		if (result.status == ERROR_SUCCESS)
 		{
-			wcout << L"\nEnumerating sub keys:\n";
+			PrintRegValue(result.value);
+			wcout << L"\n";
+		}
+	}
 
-			// KEY_READ is default access req. and this is bad to hide
-			auto key = winreg::RegKey::OpenKey(HKEY_LOCAL_MACHINE, testKeyName);
+	// Values that are all empty need no buffer at all
+	::RegSetValueEx(key.Handle(), L"Empty REG_SZ", 0, REG_SZ, nullptr, 0);
+	::RegSetValueEx(key.Handle(), L"Empty REG_BINARY", 0, REG_BINARY, nullptr, 0);
+	const vector<winreg::RegValueResult> empty =
+		winreg::QueryMultipleValues(key.Handle(), { L"Empty REG_SZ", L"Empty REG_BINARY" });
+	Check(empty.size() == 2
+		&& empty[0].status == ERROR_SUCCESS && empty[0].value.GetType() == REG_SZ && empty[0].value.String().empty()
+		&& empty[1].status == ERROR_SUCCESS && empty[1].value.GetType() == REG_BINARY && empty[1].value.Binary().empty(),
+		L"empty values read in a batch");
 
-			const vector<wstring> subNames = winreg::EnumerateSubKeyNames(key.Handle());
+	// Benchmark against reading the values one at a time
+	const vector<wstring> presentNames = {
+		L"Test DWORD", L"Test REG_SZ", L"Test REG_EXPAND_SZ", L"Test REG_MULTI_SZ", L"Test REG_BINARY"
+	};
+	const int count = 20000;
+	size_t total = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		for (const wstring& name : presentNames)
+		{
+			total += winreg::QueryValue(key.Handle(), name).GetType();
+		}
+	}
+	const auto single = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		for (const winreg::RegValueResult& result : winreg::QueryMultipleValues(key.Handle(), presentNames))
+		{
+			total -= result.value.GetType();
+		}
+	}
+	const auto batched = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	wcout << L"       " << count << L" reads of " << presentNames.size() << L" values: "
+		<< single.count() << L" ms one at a time, " << batched.count() << L" ms batched\n";
+	Check(total == 0, L"benchmark read the same values");
 
-			for (const auto& subName : subNames)
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+//
+// Enumerations filtered by value type and by name
+//
+void test_filtered_enumeration(const std::wstring & testKeyName)
+{
+	wcout << L"\nFiltered enumerations...\n";
+
+	winreg::RegKey key = return_key_with_some_values(testKeyName);
+	for (const wchar_t* name : { L"{1C2B}", L"{9F3A}", L"Plain", L"[x]" })
+	{
+		winreg::RegKey::CreateKey(key.Handle(), name);
+	}
+
+	const vector<wstring> dwordNames = winreg::EnumerateValueNames(key.Handle(),
+		winreg::ValueTypeMask(REG_DWORD), winreg::AnyName());
+	Check(dwordNames == vector<wstring>({ L"Test DWORD" }), L"REG_DWORD values only");
+
+	const vector<wstring> stringNames = winreg::EnumerateValueNames(key.Handle(),
+		winreg::ValueTypeMask(REG_SZ) | winreg::ValueTypeMask(REG_EXPAND_SZ),
+		winreg::NamePrefix(L"test reg_"));
+	Check(stringNames == vector<wstring>({ L"Test REG_SZ", L"Test REG_EXPAND_SZ" }),
+		L"string values by type mask and case-insensitive prefix");
+
+	Check(winreg::EnumerateSubKeyNames(key.Handle(), winreg::NamePrefix(L"{"))
+		== vector<wstring>({ L"{1C2B}", L"{9F3A}" }), L"sub-keys by prefix");
+	Check(winreg::EnumerateSubKeyNames(key.Handle(), winreg::NameGlob(L"{[0-9]*}"))
+		== vector<wstring>({ L"{1C2B}", L"{9F3A}" }), L"sub-keys by glob with a class");
+	Check(winreg::EnumerateSubKeyNames(key.Handle(), winreg::NameGlob(L"[[]?]"))
+		== vector<wstring>({ L"[x]" }), L"glob matching literal brackets");
+	Check(winreg::EnumerateSubKeyNames(key.Handle(), winreg::NameGlob(L"*A*"))
+		== vector<wstring>({ L"Plain", L"{9F3A}" }), L"glob ignoring case");
+	Check(winreg::EnumerateSubKeyNames(key.Handle(),
+		[](std::wstring_view name) { return name.size() == 5; })
+		== vector<wstring>({ L"Plain" }), L"sub-keys by a custom predicate");
+
+	const vector<winreg::RegValue> values = winreg::EnumerateValues(key.Handle(),
+		winreg::ValueTypeMask(REG_MULTI_SZ) | winreg::ValueTypeMask(REG_BINARY));
+	Check(values.size() == 2
+		&& values[0].MultiString() == vector<wstring>({ L"Ciao", L"Hi", L"Connie" })
+		&& values[1].Binary() == vector<BYTE>({ 0x22, 0x33, 0x44 }), L"values read with their data");
+
+	Check(winreg::EnumerateValues(key.Handle(), winreg::AllValueTypes, winreg::NameGlob(L"*dword")).size()
+		== 1, L"values by glob");
+
+	// The data of the values filtered out isn't read
+	const vector<BYTE> large(4 * 1024 * 1024, 0x5A);
+	key.SetBinaryValue(L"Large blob", large.data(), large.size());
+	const size_t allocatedBefore = g_allocatedBytes;
+	const vector<winreg::RegValue> dwords = winreg::EnumerateValues(key.Handle(), winreg::ValueTypeMask(REG_DWORD));
+	Check(dwords.size() == 1 && g_allocatedBytes - allocatedBefore < large.size() / 4,
+		L"large value filtered out without reading its data");
+	Check(winreg::EnumerateValues(key.Handle(), winreg::AllValueTypes, winreg::NamePrefix(L"large"))[0].Binary()
+		== large, L"large value read when matching");
+
+	const uint16_t shortDword = 0x1234;
+	::RegSetValueEx(key.Handle(), L"Short DWORD", 0, REG_DWORD, reinterpret_cast<const BYTE*>(&shortDword),
+		sizeof(shortDword));
+	Check(winreg::EnumerateValues(key.Handle(), winreg::AllValueTypes, winreg::NamePrefix(L"short dword"))[0].Dword()
+		== 0x1234, L"REG_DWORD of another size read zero-extended");
+	winreg::DeleteValue(key.Handle(), L"Short DWORD");
+
+	Check(winreg::NameGlob(L"a*b*c")(L"aXXbYYc") && !winreg::NameGlob(L"a*b*c")(L"aXXbYY")
+		&& winreg::NameGlob(L"**")(L"") && !winreg::NameGlob(L"[!a-c]")(L"B"), L"glob matcher");
+
+	for (const wstring& name : winreg::EnumerateSubKeyNames(key.Handle()))
+	{
+		winreg::DeleteKey(key.Handle(), name);
+	}
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+//
+// Path-glob queries over a key tree
+//
+void test_key_path_query(const std::wstring & testKeyName)
+{
+	wcout << L"\nQuerying a key tree with path patterns...\n";
+
+	winreg::RegKey root = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+
+	// Two vendors with installed products, and a wide branch of unrelated keys
+	for (const wchar_t* path : { L"Contoso\\Uninstall\\App1", L"Contoso\\Uninstall\\App2",
+		L"Fabrikam\\Uninstall\\Tool", L"Fabrikam\\Services\\Svc\\Params\\Deep" })
+	{
+		winreg::RegKey key = winreg::RegKey::CreateKey(root.Handle(), path);
+		winreg::RegValue v(L"DisplayName", REG_SZ);
+		v.String() = path;
+		key.SetValue(v);
+	}
+	for (int i = 0; i < 50; i++)
+	{
+		winreg::RegKey::CreateKey(root.Handle(), L"Contoso\\Settings\\S" + std::to_wstring(i));
+	}
+
+	vector<wstring> paths;
+	winreg::KeyPathQuery::Stats stats = winreg::KeyPathQuery(L"*\\uninstall\\*")
+		.ForEachKey(root.Handle(), [&](const wstring& path, HKEY) { paths.push_back(path); });
+	Check(paths == vector<wstring>({ L"Contoso\\uninstall\\App1", L"Contoso\\uninstall\\App2",
+		L"Fabrikam\\uninstall\\Tool" }), L"keys matching *\\Uninstall\\*");
+	Check(stats.matches == 3 && stats.keysOpened == 7,
+		L"only the keys on matching branches are opened");
+
+	vector<wstring> names;
+	stats = winreg::KeyPathQuery(L"**\\DisplayName").ForEachValue(root.Handle(),
+		[&](const wstring&, const winreg::RegValue& value) { names.push_back(value.String()); });
+	Check(names.size() == 4, L"values at any depth with **");
+
+	names.clear();
+	winreg::KeyPathQuery(L"Fabrikam\\S[a-e]*\\**\\Display*").ForEachValue(root.Handle(),
+		[&](const wstring& path, const winreg::RegValue&) { names.push_back(path); });
+	Check(names == vector<wstring>({ L"Fabrikam\\Services\\Svc\\Params\\Deep" }),
+		L"character class, ** and value glob");
+
+	Check(winreg::KeyPathQuery(L"HKCU\\" + testKeyName + L"\\Contoso").RootKey() == HKEY_CURRENT_USER,
+		L"root key named in the pattern");
+
+	for (const wchar_t* path : { L"Contoso\\Uninstall\\App1", L"Contoso\\Uninstall\\App2",
+		L"Contoso\\Uninstall", L"Fabrikam\\Uninstall\\Tool", L"Fabrikam\\Uninstall",
+		L"Fabrikam\\Services\\Svc\\Params\\Deep", L"Fabrikam\\Services\\Svc\\Params",
+		L"Fabrikam\\Services\\Svc", L"Fabrikam\\Services", L"Fabrikam" })
+	{
+		winreg::DeleteKey(root.Handle(), path);
+	}
+	for (int i = 0; i < 50; i++)
+	{
+		winreg::DeleteKey(root.Handle(), L"Contoso\\Settings\\S" + std::to_wstring(i));
+	}
+	winreg::DeleteKey(root.Handle(), L"Contoso\\Settings");
+	winreg::DeleteKey(root.Handle(), L"Contoso");
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+//
+// Inverted index of value data
+//
+void test_value_index(const std::wstring & testKeyName)
+{
+	wcout << L"\nIndexing value data...\n";
+
+	winreg::RegKey root = return_key_with_some_values(testKeyName);
+	winreg::RegKey sub = winreg::RegKey::CreateKey(root.Handle(), L"Run");
+	winreg::RegValue v(L"Updater", REG_SZ);
+	v.String() = L"C:\\Program Files\\Contoso\\update.exe /silent";
+	sub.SetValue(v);
+	v.Reset(REG_MULTI_SZ, L"Urls");
+	v.MultiString() = { L"https://example.com/a", L"https://contoso.example/b" };
+	sub.SetValue(v);
+
+	const wstring indexFile = L"WinRegTest.idx";
+	winreg::ValueIndexBuilder builder;
+	winreg::ValueIndexBuilder::UpdateStats stats = builder.AddTree(root.Handle(), testKeyName);
+	Check(stats.keysRead == 2, L"all keys read on the first build");
+	builder.Save(indexFile);
+
+	{
+		const winreg::ValueIndex index = winreg::ValueIndex::Open(indexFile);
+		Check(index.KeyCount() == 2 && index.ValueCount() == 6, L"only string and binary values indexed");
+
+		vector<winreg::ValueIndexMatch> matches = index.Find(L"contoso");
+		Check(matches.size() == 2 && matches[0].keyPath == testKeyName + L"\\Run",
+			L"case-insensitive substring search");
+		Check(index.Find(L"UPDATE.EXE /s").size() == 1 && index.Find(L"update.exe /x").empty(),
+			L"candidates confirmed against the data");
+		Check(index.Find(L"Connie").size() == 1 && index.Find(L"HiConnie").empty(),
+			L"REG_MULTI_SZ strings searched separately");
+		const BYTE bytes[] = { 0x33, 0x44 };
+		Check(index.FindBytes(bytes, 2).size() == 1, L"byte search in REG_BINARY data");
+		Check(index.Find(L"%w").size() == 1, L"short query");
+
+		// Change one key, and update the index from the file
+		v.Reset(REG_SZ, L"Updater");
+		v.String() = L"D:\\Fabrikam\\agent.exe";
+		sub.SetValue(v);
+
+		winreg::ValueIndexBuilder updater(index);
+		stats = updater.AddTree(root.Handle(), testKeyName);
+		Check(stats.keysRead == 1 && stats.keysUnchanged == 1, L"only the changed key read again");
+
+		const winreg::ValueIndex updated = winreg::ValueIndex::FromBuffer(updater.Serialize());
+		Check(updated.Find(L"fabrikam").size() == 1 && updated.Find(L"update.exe").empty(),
+			L"updated index");
+
+		// Corrupted term entries are rejected when opening
+		auto rejected = [&](auto corrupt)
+		{
+			vector<BYTE> buffer = updater.Serialize();
+			winreg::IndexHeader header;
+			memcpy(&header, buffer.data(), sizeof(header));
+			const size_t keys = winreg::index_detail::AlignUp(sizeof(header));
+			const size_t values = winreg::index_detail::AlignUp(keys + header.keyCount * sizeof(winreg::IndexKeyEntry));
+			const size_t terms = winreg::index_detail::AlignUp(values + header.valueCount * sizeof(winreg::IndexValueEntry));
+			corrupt(reinterpret_cast<winreg::IndexTermEntry*>(buffer.data() + terms));
+			try
 			{
-				winreg::RegKey subKey = winreg::RegKey::OpenKey(key.Handle(), subName);
-				wcout << L"For the key:" << subName << L" Values are \n";
-				enum_values(subKey);
-				wcout << "-----------------------------------------------------------------\n";
+				winreg::ValueIndex::FromBuffer(buffer);
+			}
+			catch (const std::runtime_error&)
+			{
+				return true;
+			}
+			return false;
+		};
+		Check(rejected([](winreg::IndexTermEntry* term) { term[1].postingOffset = ~uint64_t(0) - term[1].postingCount + 1; }),
+			L"wrapping posting offset rejected");
+		Check(rejected([](winreg::IndexTermEntry* term) { std::swap(term[0].trigram, term[1].trigram); }),
+			L"unsorted terms rejected");
+	}
+	std::remove("WinRegTest.idx");
+
+	winreg::DeleteKey(root.Handle(), L"Run");
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+#ifndef _WIN32
+//
+// Enumerations racing with concurrent modifications of the key
+// (faults injected through the emulated registry)
+//
+void test_enumerate_concurrent_change(const std::wstring & testKeyName)
+{
+	wcout << L"\nEnumerating a key modified meanwhile...\n";
+
+	winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+	for (const wchar_t* name : { L"a", L"b", L"c" })
+	{
+		winreg::RegValue v(name, REG_DWORD);
+		key.SetValue(v);
+		winreg::RegKey::CreateKey(key.Handle(), name);
+	}
+
+	// While reading index 1, another "process" removes "c" and adds names
+	// longer than the ones RegQueryInfoKey() reported.
+	const wstring longName(300, L'z');
+	bool injected = false;
+	winreg::emu::SetEnumHook([&](HKEY, DWORD index)
+	{
+		if (index == 1 && !injected)
+		{
+			injected = true;
+			winreg::RegKey other = winreg::RegKey::OpenKey(HKEY_CURRENT_USER, testKeyName,
+				KEY_READ | KEY_WRITE);
+			winreg::DeleteValue(other.Handle(), L"c");
+			winreg::DeleteKey(other.Handle(), L"c");
+			winreg::RegValue v(longName, REG_DWORD);
+			other.SetValue(v);
+			winreg::RegKey::CreateKey(other.Handle(), longName.substr(0, 200));
+		}
+	});
+
+	bool concurrentChange = false;
+	const vector<wstring> valueNames = winreg::EnumerateValueNames(key.Handle(), concurrentChange);
+	Check(valueNames == vector<wstring>({ L"a", L"b", longName }), L"value names read despite changes");
+	Check(concurrentChange, L"value enumeration reports the concurrent change");
+
+	injected = false;
+	winreg::RegValue v(L"c", REG_DWORD);
+	key.SetValue(v);
+	winreg::DeleteValue(key.Handle(), longName);
+	winreg::RegKey::CreateKey(key.Handle(), L"c");
+	winreg::DeleteKey(key.Handle(), longName.substr(0, 200));
+
+	const vector<wstring> subkeyNames = winreg::EnumerateSubKeyNames(key.Handle(), concurrentChange);
+	Check(subkeyNames == vector<wstring>({ L"a", L"b", longName.substr(0, 200) }),
+		L"sub-key names read despite changes");
+	Check(concurrentChange, L"sub-key enumeration reports the concurrent change");
+
+	winreg::emu::SetEnumHook(nullptr);
+	Check(winreg::EnumerateValueNames(key.Handle(), concurrentChange).size() == 3 && !concurrentChange,
+		L"no change reported for a quiet key");
+
+	for (const wstring& name : winreg::EnumerateSubKeyNames(key.Handle()))
+	{
+		winreg::DeleteKey(key.Handle(), name);
+	}
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+#endif // _WIN32
+
+template <typename Write>
+void check_allocations_per_write(const wchar_t* type, Write write)
+{
+	// The first write grows the scratch buffers and creates the value
+	write();
+
+	const size_t writes = 1000;
+	const size_t before = g_allocations;
+	for (size_t i = 0; i < writes; i++)
+	{
+		write();
+	}
+	const size_t allocations = g_allocations - before;
+
+	wchar_t what[100];
+	swprintf(what, 100, L"%ls: %.2f allocations per write", type, static_cast<double>(allocations) / writes);
+#ifdef _WIN32
+	// The real registry API may allocate internally: just report
+	wcout << what << L'\n';
+#else
+	Check(allocations == 0, what);
+#endif
+}
+
+void test_allocation_free_writes(const std::wstring & testKeyName)
+{
+	wcout << L"\nWriting values from views, without allocations...\n";
+
+	winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+
+	const std::wstring_view text = L"Hello from a string_view";
+	const BYTE bytes[] = { 0x10, 0x20, 0x30, 0x40 };
+	const wchar_t* const parts[] = { L"Ciao", L"Hi", L"Connie" };
+
+	check_allocations_per_write(L"REG_DWORD", [&] { key.SetDwordValue(L"View DWORD", 0x64); });
+	check_allocations_per_write(L"REG_SZ", [&] { key.SetStringValue(L"View REG_SZ", text); });
+	check_allocations_per_write(L"REG_EXPAND_SZ",
+		[&] { key.SetStringValue(L"View REG_EXPAND_SZ", L"%WinDir%", REG_EXPAND_SZ); });
+	check_allocations_per_write(L"REG_MULTI_SZ", [&] { key.SetMultiStringValue(L"View REG_MULTI_SZ", parts); });
+	check_allocations_per_write(L"REG_BINARY",
+		[&] { key.SetBinaryValue(L"View REG_BINARY", bytes, sizeof(bytes)); });
+
+	Check(winreg::QueryValue(key.Handle(), L"View DWORD").Dword() == 0x64, L"REG_DWORD written");
+	Check(winreg::QueryValue(key.Handle(), L"View REG_SZ").String() == text, L"REG_SZ written");
+	Check(winreg::QueryValue(key.Handle(), L"View REG_EXPAND_SZ").ExpandString() == L"%WinDir%",
+		L"REG_EXPAND_SZ written");
+	Check(winreg::QueryValue(key.Handle(), L"View REG_MULTI_SZ").MultiString()
+		== vector<wstring>({ L"Ciao", L"Hi", L"Connie" }), L"REG_MULTI_SZ written");
+	Check(winreg::QueryValue(key.Handle(), L"View REG_BINARY").Binary()
+		== vector<BYTE>(bytes, bytes + 4), L"REG_BINARY written");
+
+	key.SetMultiStringValue(L"View empty REG_MULTI_SZ", vector<std::wstring_view>());
+	Check(winreg::QueryValue(key.Handle(), L"View empty REG_MULTI_SZ").MultiString().empty(),
+		L"empty REG_MULTI_SZ written");
+
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+void test_large_binary_values(const std::wstring & testKeyName)
+{
+	wcout << L"\nReading and streaming large REG_BINARY values...\n";
+
+	winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+
+	const size_t blobSize = 1024 * 1024;
+	{
+		winreg::BinaryValueWriter writer(key.Handle(), L"Blob", blobSize);
+		BYTE chunk[4096];
+		for (size_t offset = 0; offset < blobSize; offset += sizeof(chunk))
+		{
+			for (size_t i = 0; i < sizeof(chunk); i++)
+			{
+				chunk[i] = static_cast<BYTE>((offset + i) * 7);
 			}
+			writer.Write(chunk, sizeof(chunk));
 		}
+		writer.Commit();
+	}
+	Check(winreg::QueryBinaryValueSize(key.Handle(), L"Blob") == blobSize, L"chunked writer");
+
+	vector<BYTE> buffer(blobSize);
+	Check(winreg::QueryBinaryValue(key.Handle(), L"Blob", buffer.data(), buffer.size()) == blobSize
+		&& buffer[12345] == static_cast<BYTE>(12345 * 7), L"read into a caller-provided buffer");
 
+	LONG error = ERROR_SUCCESS;
+	try
+	{
+		winreg::QueryBinaryValue(key.Handle(), L"Blob", buffer.data(), 100);
 	}
-	catch ( winreg::RegException & rx ) {
-		std::wcerr << L"winreg exception: " <<  rx.ErrorCode() << L" : " <<  rx.ErrorMessage() << std::endl ;
+	catch (const winreg::RegException& e)
+	{
+		error = e.ErrorCode();
 	}
-	catch (... ) {
-		std::wcerr << L"Unknown exception: " << std::endl;
+	Check(error == ERROR_MORE_DATA, L"ERROR_MORE_DATA for a small buffer");
+
+	const BYTE small[] = { 0x22, 0x33, 0x44 };
+	key.SetBinaryValue(L"Small blob", small, sizeof(small));
+
+	vector<BYTE> reused;
+	winreg::QueryBinaryValue(key.Handle(), L"Blob", reused);
+	const size_t before = g_allocations;
+	winreg::QueryBinaryValue(key.Handle(), L"Small blob", reused);
+	const bool smallRead = std::equal(reused.begin(), reused.end(), small, small + sizeof(small));
+	winreg::QueryBinaryValue(key.Handle(), L"Blob", reused);
+	Check(smallRead && reused == buffer && g_allocations == before, L"read reusing a vector's capacity");
+
+	key.SetStringValue(L"Not a blob", L"text");
+	bool wrongType = false;
+	try
+	{
+		winreg::QueryBinaryValue(key.Handle(), L"Not a blob", reused);
+	}
+	catch (const std::invalid_argument&)
+	{
+		wrongType = true;
+	}
+	Check(wrongType && reused == buffer, L"buffer untouched reading a value of another type");
+
+	size_t chunks = 0;
+	size_t streamed = 0;
+	bool sameData = true;
+	const size_t bytesBefore = g_allocatedBytes;
+	winreg::StreamBinaryValue(key.Handle(), L"Blob", [&](const BYTE* data, size_t size)
+	{
+		sameData = sameData && std::equal(data, data + size, buffer.begin() + streamed);
+		streamed += size;
+		chunks++;
+	}, 100 * 1000);
+	const size_t bytesAllocated = g_allocatedBytes - bytesBefore;
+
+	wchar_t what[100];
+	swprintf(what, 100, L"streamed %zu chunks, allocating %.2f copies of the value", chunks,
+		static_cast<double>(bytesAllocated) / blobSize);
+	Check(sameData && streamed == blobSize && chunks == 11 && bytesAllocated < blobSize * 11 / 10, what);
+
+	{
+		winreg::BinaryValueWriter copy(key.Handle(), L"Blob copy", blobSize);
+		winreg::StreamBinaryValue(key.Handle(), L"Blob", copy);
+		copy.Commit();
+	}
+	vector<BYTE> copied;
+	winreg::QueryBinaryValue(key.Handle(), L"Blob copy", copied);
+	Check(copied == buffer, L"streamed into a chunked writer");
+
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+}
+
+void test_large_value_store(const std::wstring & testKeyName)
+{
+	wcout << L"\nSide-car blob store for oversized values...\n";
+
+	namespace fs = std::filesystem;
+	const fs::path directory = "WinRegTest.blobs";
+	fs::remove_all(directory);
+
+	const BYTE abc[] = { 'a', 'b', 'c' };
+	Check(winreg::blob_detail::ToHex(winreg::blob_detail::Digest(abc, sizeof(abc)))
+		== L"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", L"SHA-256 of \"abc\"");
+
+	winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+	winreg::LargeValueStore store(directory);
+
+	vector<BYTE> blob(64 * 1024);
+	for (size_t i = 0; i < blob.size(); i++)
+	{
+		blob[i] = static_cast<BYTE>(i * 31 + 7);
+	}
+
+	store.SetBinaryValue(key.Handle(), L"Certificate", blob.data(), blob.size());
+	store.SetBinaryValue(key.Handle(), L"Same certificate", blob.data(), blob.size());
+	store.SetBinaryValue(key.Handle(), L"Small", abc, sizeof(abc));
+	winreg::RegValue longString(L"Long string", REG_SZ);
+	longString.String() = wstring(5000, L'x');
+	store.SetValue(key.Handle(), longString);
+
+	Check(winreg::QueryBinaryValueSize(key.Handle(), L"Certificate") == sizeof(winreg::BlobReference),
+		L"a reference is stored in the registry");
+	Check(winreg::QueryValue(key.Handle(), L"Small").Binary() == vector<BYTE>(abc, abc + sizeof(abc)),
+		L"values under the threshold are stored inline");
+
+	const winreg::BlobView view = store.OpenValue(key.Handle(), L"Certificate");
+	Check(view.IsExternal() && view.Type() == REG_BINARY && view.Size() == blob.size()
+		&& std::equal(blob.begin(), blob.end(), view.Data()), L"blob mapped in memory");
+	Check(store.QueryValue(key.Handle(), L"Long string").String() == longString.String(),
+		L"large REG_SZ resolved transparently");
+
+	size_t files = 0;
+	for (const auto& entry : fs::recursive_directory_iterator(directory))
+	{
+		files += entry.is_regular_file() ? 1 : 0;
+	}
+	Check(files == 2, L"equal data stored once");
+
+	winreg::DeleteValue(key.Handle(), L"Certificate");
+	winreg::LargeValueStore::GcStats stats = store.CollectGarbage({ key.Handle() });
+	Check(stats.blobsRemoved == 0 && stats.blobsKept == 2, L"garbage collection keeps referenced blobs");
+
+	winreg::DeleteValue(key.Handle(), L"Same certificate");
+	stats = store.CollectGarbage({ key.Handle() });
+	Check(stats.blobsRemoved == 0 && stats.blobsKept == 2,
+		L"garbage collection keeps unreferenced blobs within the grace period");
+	stats = store.CollectGarbage({ key.Handle() }, std::chrono::seconds(0));
+	Check(stats.blobsRemoved == 1 && stats.bytesRemoved == blob.size() && stats.blobsKept == 1,
+		L"garbage collection deletes unreferenced blobs");
+
+	// Benchmark: distinct 64 KB values, stored inline and in the blob store.
+	// (The in-memory emulation has none of the costs of large values in a real hive.)
+	const int count = 64;
+	auto run = [&](const wchar_t* what, auto write, auto read)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			blob[0] = static_cast<BYTE>(i);
+			write(L"Blob " + std::to_wstring(i));
+		}
+		size_t total = 0;
+		for (int i = 0; i < count; i++)
+		{
+			total += read(L"Blob " + std::to_wstring(i));
+		}
+		const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		wcout << L"       " << what << L": " << count << L" x 64 KB written and read in "
+			<< elapsed.count() << L" ms\n";
+		return total;
+	};
+	const size_t inlineTotal = run(L"inline", [&](const wstring& name)
+		{ key.SetBinaryValue(name, blob.data(), blob.size()); },
+		[&](const wstring& name) { return winreg::QueryValue(key.Handle(), name).Binary().size(); });
+	const size_t storeTotal = run(L"blob store", [&](const wstring& name)
+		{ store.SetBinaryValue(key.Handle(), name, blob.data(), blob.size()); },
+		[&](const wstring& name) { return store.OpenValue(key.Handle(), name).Size(); });
+	Check(inlineTotal == count * blob.size() && storeTotal == inlineTotal, L"benchmark read all the data");
+
+	winreg::DeleteKey(HKEY_CURRENT_USER, testKeyName);
+	fs::remove_all(directory);
+}
+
+void test_environment_expander()
+{
+	wcout << L"\nExpanding environment variables from a snapshot...\n";
+
+	// Same results as the Win32 API, on the process environment
+	winreg::EnvironmentExpander expander;
+	const wchar_t* const samples[] = {
+		L"%PATH%", L"no variables", L"%WinRegTest_Undefined%\\x", L"a%%b", L"%", L"%PATH",
+		L"x%PATH%%PATH%y", L"%WinRegTest_Undefined%PATH%x%", L"%%PATH%%",
+		L"a long string without any percent sign, longer than a SIMD register",
+		L"0123456789abcdefghij%PATH%0123456789abcdefghij%",
+	};
+	bool sameAsWin32 = true;
+	for (const wchar_t* sample : samples)
+	{
+		sameAsWin32 = sameAsWin32 && expander.Expand(sample) == winreg::ExpandEnvironmentStrings(sample);
+	}
+	Check(sameAsWin32, L"same expansions as ExpandEnvironmentStrings()");
+
+	// Pluggable environment, memoization and refresh
+	auto variables = std::make_shared<winreg::EnvironmentBlock>(winreg::EnvironmentBlock{
+		{ L"ROOT", L"C:\\Program Files" }, { L"APP", L"WinRegTest" } });
+	class TestEnvironment : public winreg::EnvironmentProvider
+	{
+	public:
+		explicit TestEnvironment(std::shared_ptr<winreg::EnvironmentBlock> variables)
+			: m_variables(std::move(variables)) {}
+		winreg::EnvironmentBlock Read() const override { return *m_variables; }
+	private:
+		std::shared_ptr<winreg::EnvironmentBlock> m_variables;
+	};
+	winreg::EnvironmentExpander fixed(std::make_shared<TestEnvironment>(variables));
+
+	winreg::RegValue path(L"Path", REG_EXPAND_SZ);
+	path.ExpandString() = L"%ROOT%\\%APP%\\bin;%MISSING%";
+	Check(fixed.Expand(path) == L"C:\\Program Files\\WinRegTest\\bin;%MISSING%", L"pluggable environment");
+	fixed.Expand(path);
+	Check(fixed.CacheHits() == 1 && fixed.CacheMisses() == 1, L"expansion memoized");
+
+	(*variables)[1].second = L"Other";
+	Check(fixed.Expand(path) == L"C:\\Program Files\\WinRegTest\\bin;%MISSING%", L"snapshot kept until refreshed");
+	fixed.Refresh();
+	Check(fixed.Expand(path) == L"C:\\Program Files\\Other\\bin;%MISSING%", L"refreshed snapshot");
+
+	// Benchmark against the Win32 API
+	const int count = 20000;
+	const wstring source = L"%PATH%\\WinRegTest\\%WinRegTest_Undefined%";
+	size_t total = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		total += winreg::ExpandEnvironmentStrings(source).size();
+	}
+	const auto win32 = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		total -= expander.Expand(source).size();
+	}
+	const auto cached = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	wcout << L"       " << count << L" expansions: " << win32.count() << L" ms with the Win32 API, "
+		<< cached.count() << L" ms from the snapshot\n";
+	Check(total == 0, L"benchmark expanded the same strings");
+}
+
+void test_copy_tree(const std::wstring & testKeyName)
+{
+	wcout << L"\nCopying a key tree in parallel...\n";
+
+	winreg::RegKey source = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Source");
+	size_t keys = 1;
+	for (int i = 0; i < 10; i++)
+	{
+		for (int j = 0; j < 10; j++)
+		{
+			for (int k = 0; k < 10; k++)
+			{
+				const wstring path = L"App" + std::to_wstring(i) + L"\\Module" + std::to_wstring(j)
+					+ L"\\Setting" + std::to_wstring(k);
+				winreg::RegKey key = winreg::RegKey::CreateKey(source.Handle(), path);
+				key.SetDwordValue(L"Index", i * 100 + j * 10 + k);
+				key.SetStringValue(L"Path", L"C:\\" + path);
+				key.SetStringValue(L"Cache", L"%TEMP%");
+			}
+		}
+	}
+	keys += 10 + 100 + 1000;
+
+	const unsigned long long qword = 0x0123456789ABCDEFULL;
+	::RegSetValueEx(source.Handle(), L"Big number", 0, REG_QWORD, reinterpret_cast<const BYTE*>(&qword),
+		sizeof(qword));
+
+	winreg::RegKey destination = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Copy");
+	winreg::CopyTreeStats stats = winreg::CopyTree(source.Handle(), destination.Handle());
+
+	wchar_t what[200];
+	swprintf(what, 200, L"copied %zu keys, %zu values: %.0f keys/s, %.2f MB/s", stats.keysCopied,
+		stats.valuesCopied, stats.KeysPerSecond(), stats.BytesPerSecond() / (1024 * 1024));
+	Check(stats.keysCopied == keys && stats.valuesCopied == 3000 + 1 && stats.failures.empty(), what);
+	{
+		winreg::RegKey copied = winreg::RegKey::OpenKey(destination.Handle(), L"App7\\Module3\\Setting5");
+		Check(winreg::QueryValue(copied.Handle(), L"Index").Dword() == 735
+			&& winreg::QueryValue(copied.Handle(), L"Path").String() == L"C:\\App7\\Module3\\Setting5",
+			L"values copied");
+	}
+	unsigned long long copiedQword = 0;
+	DWORD type = REG_NONE;
+	DWORD size = sizeof(copiedQword);
+	::RegQueryValueEx(destination.Handle(), L"Big number", nullptr, &type, reinterpret_cast<BYTE*>(&copiedQword),
+		&size);
+	Check(type == REG_QWORD && copiedQword == qword, L"value types not supported by RegValue copied");
+
+	// Filters, and another sink: an in-memory map
+	class MapSink : public winreg::TreeSink
+	{
+	public:
+		void WriteKey(const winreg::KeyContents& contents) override
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_keys[contents.path] = contents.values.size();
+		}
+		std::map<wstring, size_t> m_keys;
+	private:
+		std::mutex m_mutex;
+	};
+
+	MapSink sink;
+	winreg::RegistrySource registry(source.Handle());
+	winreg::CopyTreeOptions options;
+	options.readerThreads = 2;
+	options.writerThreads = 1;
+	options.queueCapacity = 8;
+	const winreg::NameGlob excluded(L"App[1-9]*");
+	options.keyFilter = [&](const wstring& path) { return !excluded(path); };
+	options.valueFilter = [](const wstring&, const wstring& name) { return name != L"Cache"; };
+	stats = winreg::CopyTree(registry, sink, options);
+	Check(stats.keysCopied == 1 + 1 + 10 + 100 && sink.m_keys.size() == stats.keysCopied
+		&& stats.keysSkipped == 9 && stats.valuesSkipped == 100
+		&& sink.m_keys[L"App0\\Module9\\Setting9"] == 2, L"copy with filters, to another backend");
+
+	// An exception thrown by a filter stops the copy, and is rethrown
+	auto filterRethrown = [&](winreg::CopyTreeOptions throwing)
+	{
+		throwing.readerThreads = 2;
+		throwing.writerThreads = 2;
+		throwing.queueCapacity = 1;
+		try
+		{
+			MapSink discarded;
+			winreg::CopyTree(registry, discarded, throwing);
+		}
+		catch (const std::logic_error&)
+		{
+			return true;
+		}
+		return false;
+	};
+	winreg::CopyTreeOptions throwing;
+	throwing.keyFilter = [](const wstring& path)
+	{
+		if (path == L"App5\\Module5")
+		{
+			throw std::logic_error("key filter");
+		}
+		return true;
+	};
+	const bool keyFilterRethrown = filterRethrown(throwing);
+	throwing.keyFilter = nullptr;
+	throwing.valueFilter = [](const wstring& path, const wstring&)
+	{
+		if (path == L"App5\\Module5\\Setting5")
+		{
+			throw std::logic_error("value filter");
+		}
+		return true;
+	};
+	Check(keyFilterRethrown && filterRethrown(throwing), L"filter exceptions rethrown by CopyTree");
+
+	// Failures are reported, and the copy goes on
+	winreg::RegKey readOnly = winreg::RegKey::OpenKey(HKEY_CURRENT_USER, testKeyName + L"\\Copy", KEY_READ);
+	stats = winreg::CopyTree(source.Handle(), readOnly.Handle());
+	Check(!stats.failures.empty() && !stats.failures[0].reading, L"write failures reported");
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName);
+}
+
+void test_delete_tree(const std::wstring & testKeyName)
+{
+	wcout << L"\nDeleting a key tree in parallel...\n";
+
+	{
+		winreg::RegKey root = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName);
+		for (int i = 0; i < 10; i++)
+		{
+			for (int j = 0; j < 10; j++)
+			{
+				for (int k = 0; k < 10; k++)
+				{
+					winreg::RegKey::CreateKey(root.Handle(), L"Product" + std::to_wstring(i) + L"\\Feature"
+						+ std::to_wstring(j) + L"\\Component" + std::to_wstring(k)).SetDwordValue(L"Installed", 1);
+				}
+			}
+		}
+	}
+
+	// A key created meanwhile makes the deletion of the root fail: everything else goes
+	vector<size_t> progress;
+	size_t progressTotal = 0;
+	bool addKey = true;
+	winreg::DeleteTreeOptions options;
+	options.progressInterval = 100;
+	options.onProgress = [&](size_t keysDeleted, size_t keysFound)
+	{
+		if (addKey)
+		{
+			winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Late");
+			addKey = false;
+		}
+		progress.push_back(keysDeleted);
+		progressTotal = keysFound;
+	};
+	winreg::DeleteTreeStats stats = winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName, options);
+
+	wchar_t what[100];
+	swprintf(what, 100, L"deleted %zu of %zu keys in %.3f s", stats.keysDeleted, stats.keysFound, stats.seconds);
+	Check(stats.keysFound == 1111 && stats.keysDeleted == 1110 && !stats.Completed(), what);
+	Check(stats.failures.size() == 1 && stats.failures[0].keyPath.empty()
+		&& stats.failures[0].errorCode == ERROR_ACCESS_DENIED, L"partial failure reported");
+	Check(progress.size() == 12 && std::is_sorted(progress.begin(), progress.end()) && progressTotal == 1111,
+		L"progress reported");
+	Check(winreg::EnumerateSubKeyNames(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, testKeyName).Handle())
+		== vector<wstring>({ L"Late" }), L"only the new key left");
+
+	// An exception thrown by onProgress stops the deletion, and is rethrown
+	for (int i = 0; i < 10; i++)
+	{
+		winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Late\\Key" + std::to_wstring(i));
+	}
+	options.threads = 1;
+	options.progressInterval = 1;
+	options.onProgress = [](size_t, size_t) { throw std::logic_error("cancelled"); };
+	bool rethrown = false;
+	try
+	{
+		winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName, options);
+	}
+	catch (const std::logic_error&)
+	{
+		rethrown = true;
+	}
+	Check(rethrown && winreg::EnumerateSubKeyNames(winreg::RegKey::OpenKey(HKEY_CURRENT_USER,
+		testKeyName + L"\\Late").Handle()).size() == 9, L"progress exception rethrown, deletion stopped");
+
+	options.onProgress = nullptr;
+	stats = winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName, options);
+	Check(stats.Completed() && stats.keysDeleted == 11, L"tree deleted");
+}
+
+void test_watch_service(const std::wstring & testKeyName)
+{
+	wcout << L"\nWatching many keys...\n";
+
+	const wstring watchKeyName = testKeyName + L"\\Watch";
+	const int keyCount = 1000;
+	for (int i = 0; i < keyCount; i++)
+	{
+		winreg::RegKey::CreateKey(HKEY_CURRENT_USER, watchKeyName + L"\\Key" + std::to_wstring(i));
+	}
+
+	std::mutex mutex;
+	std::map<winreg::WatchId, vector<winreg::KeyChange>> changes;
+	auto waitFor = [&](std::function<bool()> done)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (done() || std::chrono::steady_clock::now() > deadline)
+				{
+					return;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	};
+
+	winreg::WatchServiceOptions options;
+	options.dispatcherThreads = 2;
+	options.coalesceWindow = std::chrono::milliseconds(100);
+	winreg::WatchService service(options);
+
+	vector<winreg::WatchId> ids;
+	for (int i = 0; i < keyCount; i++)
+	{
+		ids.push_back(service.Watch(HKEY_CURRENT_USER, watchKeyName + L"\\Key" + std::to_wstring(i),
+			winreg::KeyChangeValues | winreg::KeyChangeSubKeys, [&](const winreg::KeyChange& change)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				changes[change.watch].push_back(change);
+			}));
+	}
+	Check(service.WatchCount() == keyCount, L"keys watched");
+
+	// A burst of writes to every key
+	for (int i = 0; i < keyCount; i++)
+	{
+		winreg::RegKey key = winreg::RegKey::OpenKey(HKEY_CURRENT_USER, watchKeyName + L"\\Key" + std::to_wstring(i),
+			KEY_WRITE);
+		for (int j = 0; j < 5; j++)
+		{
+			key.SetDwordValue(L"Value" + std::to_wstring(j), j);
+		}
+	}
+	waitFor([&] { return changes.size() == keyCount; });
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t deliveries = 0;
+		bool allValues = true;
+		for (const auto& watch : changes)
+		{
+			deliveries += watch.second.size();
+			for (const winreg::KeyChange& change : watch.second)
+			{
+				allValues = allValues && change.changes == winreg::KeyChangeValues && change.errorCode == ERROR_SUCCESS;
+			}
+		}
+		Check(changes.size() == keyCount && allValues, L"value changes delivered for every key");
+		Check(deliveries < keyCount * 5, L"bursts coalesced");
+		changes.clear();
+	}
+
+	// Re-armed after delivery; sub-key changes are reported as such
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, watchKeyName + L"\\Key1\\Child");
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, watchKeyName + L"\\Key2").SetStringValue(L"Again", L"x");
+	winreg::DeleteKey(HKEY_CURRENT_USER, watchKeyName + L"\\Key3");
+	waitFor([&] { return changes.count(ids[3]) != 0 && changes.count(ids[1]) != 0 && changes.count(ids[2]) != 0; });
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Check(changes.count(ids[1]) != 0 && changes[ids[1]].back().Has(winreg::KeyChangeSubKeys)
+			&& !changes[ids[1]].back().Has(winreg::KeyChangeValues), L"sub-key change delivered");
+		Check(changes.count(ids[2]) != 0 && changes[ids[2]].back().changes == winreg::KeyChangeValues,
+			L"watch re-armed");
+		Check(changes.count(ids[3]) != 0 && changes[ids[3]].back().Has(winreg::KeyChangeDeleted)
+			&& changes[ids[3]].back().errorCode == ERROR_KEY_DELETED, L"deleted key reported");
+		Check(changes.size() == 3, L"other keys quiet");
+	}
+
+	const winreg::WatchServiceStats stats = service.Stats();
+	Check(stats.deliveries <= stats.notifications && stats.callbackFailures == 0, L"service counters");
+
+	for (winreg::WatchId id : ids)
+	{
+		service.Unwatch(id);
+	}
+	Check(service.WatchCount() == 0, L"keys unwatched");
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, watchKeyName);
+}
+
+void test_registry_mirror(const std::wstring & testKeyName)
+{
+	wcout << L"\nMirroring a key tree incrementally...\n";
+
+	const wstring mirrorKeyName = testKeyName + L"\\Mirror";
+	for (int i = 0; i < 20; i++)
+	{
+		for (int j = 0; j < 20; j++)
+		{
+			winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER,
+				mirrorKeyName + L"\\Group" + std::to_wstring(i) + L"\\Setting" + std::to_wstring(j));
+			key.SetDwordValue(L"Enabled", 1);
+			key.SetStringValue(L"Name", L"Setting " + std::to_wstring(j));
+		}
+	}
+
+	winreg::RegistryMirror mirror(HKEY_CURRENT_USER, mirrorKeyName);
+	Check(mirror.KeyCount() == 1 + 20 + 400, L"tree mirrored");
+
+	winreg::MirrorDelta delta = mirror.Refresh();
+	Check(delta.Empty() && delta.keysChecked == 421 && delta.keysRead == 0, L"unchanged tree not re-read");
+
+	winreg::SetDwordValue(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group3\\Setting4",
+		KEY_WRITE).Handle(), L"Enabled", 0);
+	winreg::SetStringValue(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group3\\Setting5",
+		KEY_WRITE).Handle(), L"Extra", L"new");
+	winreg::DeleteValue(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group7\\Setting0",
+		KEY_WRITE).Handle(), L"Name");
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group9\\Setting20\\Detail")
+		.SetDwordValue(L"Level", 2);
+	winreg::DeleteTree(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group12");
+
+	delta = mirror.Refresh();
+	Check(delta.changedValues.size() == 1 && delta.changedValues[0].keyPath == L"Group3\\Setting4"
+		&& delta.changedValues[0].valueName == L"Enabled", L"changed value found");
+	Check(delta.addedValues.size() == 2 && delta.addedValues[0].keyPath == L"Group3\\Setting5",
+		L"added values found");
+	Check(delta.removedValues.size() == 1 && delta.removedValues[0].keyPath == L"Group7\\Setting0",
+		L"removed value found");
+	Check(delta.addedKeys == vector<wstring>({ L"Group9\\Setting20", L"Group9\\Setting20\\Detail" }),
+		L"added keys found");
+	Check(delta.removedKeys.size() == 21, L"removed sub-tree found");
+
+	wchar_t what[100];
+	swprintf(what, 100, L"re-read %zu of %zu keys", delta.keysRead, delta.keysChecked);
+	Check(delta.keysRead == 7, what);
+
+	const winreg::RegValue* value = mirror.FindValue(L"group3\\setting4", L"ENABLED");
+	Check(value != nullptr && value->Dword() == 0, L"mirror updated");
+	Check(mirror.FindKey(L"Group12\\Setting1") == nullptr && mirror.KeyCount() == 421 - 21 + 2,
+		L"removed keys dropped");
+
+	// A key deleted and created again
+	winreg::DeleteKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group1\\Setting1");
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, mirrorKeyName + L"\\Group1\\Setting1").SetDwordValue(L"Enabled", 1);
+	delta = mirror.Refresh();
+	Check(delta.removedValues.size() == 1 && delta.removedValues[0].valueName == L"Name"
+		&& delta.addedKeys.empty() && delta.removedKeys.empty(), L"re-created key compared");
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, mirrorKeyName);
+}
+
+void test_trace_replay(const std::wstring & testKeyName)
+{
+	wcout << L"\nRecording and replaying registry calls...\n";
+
+	const wstring traceKeyName = testKeyName + L"\\Trace";
+	const std::filesystem::path traceFile = "WinRegTest.trace";
+
+	auto workload = [&](int thread)
+	{
+		winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER,
+			traceKeyName + L"\\Thread" + std::to_wstring(thread));
+		for (int i = 0; i < 50; i++)
+		{
+			key.SetDwordValue(L"Value" + std::to_wstring(i), i);
+		}
+		key.SetStringValue(L"Name", L"trace");
+		for (int i = 0; i < 50; i++)
+		{
+			winreg::QueryValue(key.Handle(), L"Value" + std::to_wstring(i));
+		}
+		winreg::EnumerateValues(key.Handle());
+		winreg::EnumerateValueNames(key.Handle());
+		winreg::DeleteValue(key.Handle(), L"Value0");
+		try
+		{
+			winreg::QueryValue(key.Handle(), L"Value0");
+		}
+		catch (const winreg::RegException&)
+		{
+		}
+	};
+
+	size_t recorded = 0;
+	{
+		winreg::TraceRecorder recorder(traceFile);
+		recorder.Start();
+		std::thread first(workload, 1);
+		std::thread second(workload, 2);
+		first.join();
+		second.join();
+		winreg::EnumerateSubKeyNames(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, traceKeyName).Handle());
+		recorder.Stop();
+		recorded = recorder.EventCount();
+	}
+
+	const vector<winreg::TraceRecord> records = winreg::ReadTrace(traceFile);
+	std::map<uint32_t, size_t> callsPerThread;
+	size_t failures = 0;
+	for (const winreg::TraceRecord& record : records)
+	{
+		callsPerThread[record.thread]++;
+		failures += (record.status != ERROR_SUCCESS) ? 1 : 0;
+	}
+	Check(recorded == 217 && records.size() == recorded, L"calls recorded");
+	Check(callsPerThread.size() == 3 && failures == 2, L"threads and failures recorded");
+	Check(records.back().op == winreg::TraceOp::CloseKey, L"close recorded");
+
+	// Against an empty tree, as fast as possible
+	winreg::DeleteTree(HKEY_CURRENT_USER, traceKeyName);
+	winreg::ReplayStats stats = winreg::ReplayTrace(records);
+	Check(stats.calls == records.size() && stats.skipped == 0 && stats.statusMismatches == 0, L"trace replayed");
+	Check(winreg::QueryValue(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, traceKeyName + L"\\Thread2").Handle(),
+		L"Value7").Dword() == 0, L"values written again");
+
+	const winreg::ReplayLatency& queries = stats.latencies[winreg::TraceOp::QueryValue];
+	wchar_t what[200];
+	swprintf(what, 200, L"%.0f calls/s; QueryValue: %zu calls, mean %.2f us (%.2f us recorded), p99 %.2f us",
+		stats.CallsPerSecond(), queries.count, queries.mean, queries.recordedMean, queries.p99);
+	Check(queries.count == 102 && queries.p99 <= queries.max, what);
+
+	// Redirected, following the recorded timing (ten times faster)
+	winreg::RegKey replayRoot = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Replay");
+	winreg::ReplayOptions options;
+	options.redirectKey = replayRoot.Handle();
+	options.originalTiming = true;
+	options.speed = 10;
+	stats = winreg::ReplayTrace(records, options);
+	Check(stats.calls == records.size() && stats.statusMismatches == 0
+		&& winreg::EnumerateValueNames(winreg::RegKey::OpenKey(replayRoot.Handle(),
+			L"HKEY_CURRENT_USER\\" + traceKeyName + L"\\Thread1").Handle()).size() == 50,
+		L"trace replayed under another key");
+
+	// A failure reading the data (after the size was read) is traced with its status
+	class StatusSink : public winreg::TraceSink
+	{
+	public:
+		void Record(const winreg::TraceEvent& event) noexcept override
+		{
+			if (event.op == winreg::TraceOp::QueryValue)
+			{
+				m_status = event.status;
+			}
+		}
+		LONG m_status = ERROR_SUCCESS;
+	};
+	{
+		winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, traceKeyName);
+		const unsigned long long tooLong = 0;
+		::RegSetValueEx(key.Handle(), L"Long DWORD", 0, REG_DWORD, reinterpret_cast<const BYTE*>(&tooLong),
+			sizeof(tooLong));
+		StatusSink sink;
+		winreg::TraceSink* previous = winreg::SetTraceSink(&sink);
+		LONG error = ERROR_SUCCESS;
+		try
+		{
+			winreg::QueryValue(key.Handle(), L"Long DWORD");
+		}
+		catch (const winreg::RegException& e)
+		{
+			error = e.ErrorCode();
+		}
+		winreg::SetTraceSink(previous);
+		Check(error == ERROR_MORE_DATA && sink.m_status == ERROR_MORE_DATA, L"failed data read traced");
+	}
+
+	// Cost of recording
+	auto timeCalls = [&]()
+	{
+		winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, traceKeyName);
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < 20000; i++)
+		{
+			key.SetDwordValue(L"Counter", i);
+			winreg::QueryValue(key.Handle(), L"Counter");
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	const double untraced = timeCalls();
+	double traced = 0;
+	{
+		winreg::TraceRecorder recorder(traceFile);
+		recorder.Start();
+		traced = timeCalls();
+	}
+	swprintf(what, 200, L"recording overhead: %+.1f%%", (traced / untraced - 1) * 100);
+	Check(true, what);
+
+	std::filesystem::remove(traceFile);
+	winreg::DeleteTree(HKEY_CURRENT_USER, traceKeyName);
+	winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName + L"\\Replay");
+}
+
+void test_value_probe_filter(const std::wstring & testKeyName)
+{
+	wcout << L"\nProbing a key for missing values...\n";
+
+	const wstring probeKeyName = testKeyName + L"\\Probe";
+	winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, probeKeyName);
+	for (int i = 0; i < 20; i++)
+	{
+		key.SetDwordValue(L"Feature" + std::to_wstring(i), i);
+	}
+
+	// Mostly optional values, usually absent: 10 present, 90 missing
+	vector<wstring> names;
+	for (int i = 0; i < 100; i++)
+	{
+		names.push_back(L"Feature" + std::to_wstring(i * 2));
+	}
+
+	winreg::ValueProbeFilter filter(key.Handle());
+	Check(filter.QueryValue(L"feature4").value.Dword() == 4, L"present value read");
+	Check(filter.QueryValue(L"Feature21").status == ERROR_FILE_NOT_FOUND, L"missing value reported");
+
+	const int rounds = 2000;
+	size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (const wstring& name : names)
+		{
+			try
+			{
+				winreg::QueryValue(key.Handle(), name);
+				found++;
+			}
+			catch (const winreg::RegException&)
+			{
+			}
+		}
+	}
+	const double unfiltered = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (const wstring& name : names)
+		{
+			found += (filter.QueryValue(name).status == ERROR_SUCCESS) ? 1 : 0;
+		}
+	}
+	const double filtered = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	Check(found == 2 * rounds * 10, L"same values found");
+
+	winreg::ValueProbeStats stats = filter.Stats();
+	wchar_t what[200];
+	swprintf(what, 200, L"%zu probes, %zu definitely absent, false positive rate %.3f, %.1fx faster",
+		stats.probes, stats.definitelyAbsent, stats.FalsePositiveRate(), unfiltered / filtered);
+	Check(stats.rebuilds == 1 && stats.FalsePositiveRate() < 0.05, what);
+
+	// Values written later are seen
+	key.SetDwordValue(L"Feature21", 21);
+	filter.Invalidate();
+	Check(filter.QueryValue(L"Feature21").status == ERROR_SUCCESS, L"invalidated filter rebuilt");
+
+	winreg::SetDwordValue(winreg::RegKey::CreateKey(HKEY_CURRENT_USER, probeKeyName).Handle(), L"Feature23", 23);
+	bool seen = false;
+	for (int i = 0; i < 100 && !seen; i++)
+	{
+		seen = filter.MayContain(L"Feature23");
+		if (!seen)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	Check(seen && filter.Stats().rebuilds >= 3, L"filter rebuilt on change notification");
+
+	// Names are folded like the registry folds them, beyond ASCII
+	key.SetDwordValue(L"Caf\u00E9", 1);
+	filter.Invalidate();
+	bool registryFound = true;
+	try
+	{
+		winreg::QueryValue(key.Handle(), L"CAF\u00C9");
+	}
+	catch (const winreg::RegException&)
+	{
+		registryFound = false;
+	}
+	Check(filter.MayContain(L"caf\u00E9") && (filter.QueryValue(L"CAF\u00C9").status == ERROR_SUCCESS) == registryFound,
+		L"non-ASCII names folded like the registry");
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, probeKeyName);
+}
+
+void test_registry_overlay(const std::wstring & testKeyName)
+{
+	wcout << L"\nReading settings through layered keys...\n";
+
+	// Policy (not created yet), then user settings, then machine defaults
+	const wstring overlayKeyName = testKeyName + L"\\Overlay";
+	const wstring layerNames[] = { overlayKeyName + L"\\Policy", overlayKeyName + L"\\User",
+		overlayKeyName + L"\\Machine" };
+
+	winreg::RegKey machine = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[2] + L"\\App");
+	for (int i = 0; i < 20; i++)
+	{
+		machine.SetDwordValue(L"Setting" + std::to_wstring(i), 200 + i);
+	}
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[2] + L"\\App\\Plugins");
+	winreg::RegKey user = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[1] + L"\\App");
+	for (int i = 0; i < 5; i++)
+	{
+		user.SetDwordValue(L"Setting" + std::to_wstring(i * 4), 100 + i * 4);
+	}
+	user.SetStringValue(L"Theme", L"dark");
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[1] + L"\\App\\Recent");
+
+	winreg::RegistryOverlay overlay({ { HKEY_CURRENT_USER, layerNames[0] },
+		{ HKEY_CURRENT_USER, layerNames[1] }, { HKEY_CURRENT_USER, layerNames[2] } });
+
+	Check(overlay.QueryValue(L"App", L"Setting4").Dword() == 104
+		&& overlay.QueryValue(L"app", L"setting5").Dword() == 205, L"values read by precedence");
+	Check(overlay.FindValueLayer(L"App", L"Theme") == 1 && overlay.FindValueLayer(L"App", L"Missing") == -1,
+		L"layers of values found");
+	Check(overlay.EnumerateValueNames(L"App").size() == 21 && overlay.EnumerateValues(L"App").size() == 21
+		&& overlay.EnumerateSubKeyNames(L"App") == vector<wstring>({ L"Recent", L"Plugins" }),
+		L"values and sub-keys merged");
+	Check(overlay.KeyExists(L"App\\Plugins") && !overlay.KeyExists(L"App\\Missing"), L"merged keys exist");
+
+	// 30 settings, 20 found in some layer, read layer by layer or through the overlay
+	vector<wstring> names;
+	for (int i = 0; i < 30; i++)
+	{
+		names.push_back(L"Setting" + std::to_wstring(i));
+	}
+	const int rounds = 500;
+	size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (const wstring& name : names)
+		{
+			for (const wstring& layerName : layerNames)
+			{
+				try
+				{
+					winreg::QueryValue(winreg::RegKey::OpenKey(HKEY_CURRENT_USER, layerName + L"\\App").Handle(),
+						name);
+					found++;
+					break;
+				}
+				catch (const winreg::RegException&)
+				{
+				}
+			}
+		}
+	}
+	const double layered = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (const wstring& name : names)
+		{
+			found += (overlay.TryQueryValue(L"App", name).status == ERROR_SUCCESS) ? 1 : 0;
+		}
+	}
+	const double merged = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const winreg::OverlayStats stats = overlay.Stats();
+	wchar_t what[200];
+	swprintf(what, 200, L"%zu lookups, %zu index builds, %.1fx faster than trying each layer",
+		stats.lookups, stats.indexBuilds, layered / merged);
+	Check(found == 2 * rounds * 20 && stats.indexBuilds == 3, what);
+
+	// The policy layer, created later, takes precedence once its change is seen
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[0] + L"\\App").SetDwordValue(L"Setting4", 4);
+	bool seen = false;
+	for (int i = 0; i < 100 && !seen; i++)
+	{
+		seen = (overlay.QueryValue(L"App", L"Setting4").Dword() == 4);
+		if (!seen)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	Check(seen, L"new layer root seen");
+
+	winreg::DeleteValue(user.Handle(), L"Theme");
+	overlay.Invalidate();
+	Check(overlay.TryQueryValue(L"App", L"Theme").status == ERROR_FILE_NOT_FOUND, L"deleted value not found");
+
+	// Only the most recently used merge indexes are kept
+	winreg::RegistryOverlay small({ { HKEY_CURRENT_USER, layerNames[1] },
+		{ HKEY_CURRENT_USER, layerNames[2] } }, 2);
+	small.KeyExists(L"App");
+	small.KeyExists(L"App\\Plugins");
+	small.KeyExists(L"App");
+	small.KeyExists(L"App\\Recent");
+	small.KeyExists(L"app");
+	const winreg::OverlayStats smallStats = small.Stats();
+	Check(smallStats.indexBuilds == 3 && smallStats.indexesEvicted == 1, L"least recently used index evicted");
+
+#ifndef _WIN32
+	// A layer key deleted between the enumerations of its values and of its sub-keys
+	// is left out of the index as a whole
+	winreg::RegKey::CreateKey(HKEY_CURRENT_USER, layerNames[1] + L"\\Vanishing").SetDwordValue(L"Ghost", 1);
+	int enumerations = 0;
+	winreg::emu::SetEnumHook([&](HKEY, DWORD)
+	{
+		// Values 0 and 1 (no more items), then the first sub-key
+		if (++enumerations == 3)
+		{
+			winreg::DeleteTree(HKEY_CURRENT_USER, layerNames[1] + L"\\Vanishing");
+		}
+	});
+	winreg::RegistryOverlay vanishing({ { HKEY_CURRENT_USER, layerNames[1] } });
+	const winreg::RegValueResult ghost = vanishing.TryQueryValue(L"Vanishing", L"Ghost");
+	winreg::emu::SetEnumHook(nullptr);
+	Check(enumerations >= 3 && ghost.status == ERROR_FILE_NOT_FOUND && !vanishing.KeyExists(L"Vanishing"),
+		L"layer deleted while indexed left out");
+#endif // _WIN32
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, overlayKeyName);
+}
+
+void test_utf8_api(const std::wstring & testKeyName)
+{
+	wcout << L"\nUsing UTF-8 and UTF-16 key paths, names and data...\n";
+
+	const std::string keyName = winreg::utf_detail::FromWide<char>(testKeyName.data(), testKeyName.size())
+		+ "\\Utf8\\\xC3\x9C" "bersicht";
+	const std::string name = "Gr\xC3\xBC\xC3\x9F" "e";                    // "Gruesse", with u-umlaut and sharp s
+	const std::string text = "\xE4\xBD\xA0\xE5\xA5\xBD \xF0\x9F\x98\x80";  // "ni hao", and an emoji
+
+	winreg::RegKey key = winreg::CreateKey(HKEY_CURRENT_USER, keyName);
+	winreg::SetStringValue(key.Handle(), name, text);
+	winreg::SetMultiStringValue(key.Handle(), "Languages", { "English", "Fran\xC3\xA7" "ais" });
+	winreg::SetDwordValue(key.Handle(), u"Count", 3);
+
+	const winreg::RegValue wide = winreg::QueryValue(key.Handle(), L"Gr\u00FC\u00DFe");
+	Check(wide.String() == L"\u4F60\u597D \U0001F600", L"UTF-8 data written as wchar_t");
+	Check(winreg::QueryValue(key.Handle(), name).String() == text, L"UTF-8 data read back");
+	Check(winreg::QueryValue(key.Handle(), u"Gr\u00FC\u00DFe").String() == u"\u4F60\u597D \U0001F600",
+		L"UTF-16 data read back");
+	Check(winreg::QueryValue(key.Handle(), L"Languages").MultiString()
+		== vector<wstring>({ L"English", L"Fran\u00E7ais" }), L"UTF-8 multi-string written");
+	Check(winreg::QueryValue(key.Handle(), u"Languages").MultiString().size() == 2
+		&& winreg::QueryValue(key.Handle(), "Count").Dword() == 3, L"UTF-16 multi-string read");
+
+	const uint16_t shortDword = 0x1234;
+	const uint64_t longDword = 0x1122334455667788;
+	::RegSetValueEx(key.Handle(), L"Short", 0, REG_DWORD, reinterpret_cast<const BYTE*>(&shortDword), sizeof(shortDword));
+	::RegSetValueEx(key.Handle(), L"Wide", 0, REG_DWORD, reinterpret_cast<const BYTE*>(&longDword), sizeof(longDword));
+	Check(winreg::QueryValue(key.Handle(), "Short").Dword() == 0x1234
+		&& winreg::QueryValue(key.Handle(), u"Wide").Dword() == 0x55667788, L"REG_DWORD of another size read");
+	winreg::DeleteValue(key.Handle(), L"Short");
+	winreg::DeleteValue(key.Handle(), L"Wide");
+
+	std::u16string longText;
+	for (int i = 0; i < 50; i++)
+	{
+		longText += u"Settings \uFF21\u8BBE\u7F6E \U0001F600 ";
+	}
+	winreg::SetStringValue(key.Handle(), u"Long", longText);
+	const wstring longWide = winreg::QueryValue(key.Handle(), L"Long").String();
+	Check(winreg::QueryValue(key.Handle(), u"Long").String() == longText
+		&& winreg::QueryValue(key.Handle(), "Long").String()
+			== winreg::utf_detail::FromWide<char>(longWide.data(), longWide.size()),
+		L"long UTF-16 data read back");
+
+	const vector<std::string> valueNames = winreg::EnumerateValueNamesUtf8(key.Handle());
+	Check(std::find(valueNames.begin(), valueNames.end(), name) != valueNames.end()
+		&& winreg::EnumerateValuesUtf16(key.Handle()).size() == 4, L"values enumerated");
+	Check(winreg::EnumerateSubKeyNamesUtf16(winreg::OpenKey(HKEY_CURRENT_USER,
+		keyName.substr(0, keyName.rfind('\\'))).Handle()) == vector<std::u16string>({ u"\u00DCbersicht" }),
+		L"sub-keys enumerated");
+
+	// Ill-formed UTF-8 is replaced, not passed through
+	winreg::SetStringValue(key.Handle(), "Broken", "a\xFF" "b\xE4\xBD");
+	Check(winreg::QueryValue(key.Handle(), L"Broken").String() == L"a\uFFFDb\uFFFD\uFFFD",
+		L"ill-formed UTF-8 replaced");
+
+	// Transcoding throughput, against converting one character at a time
+	wstring sample;
+	for (int i = 0; sample.size() < 4 * 1024 * 1024; i++)
+	{
+		sample += L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Vendor\\Product\\Settings";
+		sample += (i % 8 == 0) ? L"\\Caf\u00E9 \u4E2D\u6587" : L"\\Value";
+	}
+	const std::string utf8 = winreg::index_detail::ToUtf8(sample, false);
+	vector<wchar_t> wideBuffer(utf8.size());
+	std::string utf8Buffer(sample.size() * winreg::utf_detail::MaxUtf8PerWide, '\0');
+
+	auto megabytesPerSecond = [&](auto transcode)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < 10; i++)
+		{
+			transcode();
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return 10 * utf8.size() / seconds / 1e6;
+	};
+	size_t wideLength = 0;
+	size_t utf8Length = 0;
+	const double decode = megabytesPerSecond([&] { wideLength = winreg::utf_detail::Utf8ToWide(
+		utf8.data(), utf8.size(), wideBuffer.data()); });
+	const double encode = megabytesPerSecond([&] { utf8Length = winreg::utf_detail::WideToUtf8(
+		sample.data(), sample.size(), &utf8Buffer[0]); });
+	const double slowDecode = megabytesPerSecond([&] { winreg::index_detail::FromUtf8(utf8.data(), utf8.size()); });
+	const double slowEncode = megabytesPerSecond([&] { winreg::index_detail::ToUtf8(sample, false); });
+
+	wchar_t what[200];
+	swprintf(what, 200, L"UTF-8 to wchar_t %.0f MB/s (%.0f one by one), wchar_t to UTF-8 %.0f MB/s (%.0f)",
+		decode, slowDecode, encode, slowEncode);
+	Check(wstring(wideBuffer.data(), wideLength) == sample && utf8Buffer.compare(0, utf8Length, utf8) == 0
+		&& utf8Length == utf8.size(), what);
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName + L"\\Utf8");
+}
+
+void test_pmr_allocation(const std::wstring & testKeyName)
+{
+	wcout << L"\nReading values and key trees into memory resources...\n";
+
+	// 4 x 8 keys, with 12 values each
+	const wstring pmrKeyName = testKeyName + L"\\Pmr";
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 8; j++)
+		{
+			winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER,
+				pmrKeyName + L"\\Group" + std::to_wstring(i) + L"\\Item" + std::to_wstring(j));
+			for (int k = 0; k < 4; k++)
+			{
+				const wstring suffix = std::to_wstring(k);
+				key.SetDwordValue(L"Count" + suffix, i * 100 + j * 10 + k);
+				key.SetStringValue(L"Path" + suffix, L"C:\\Program Files\\Vendor\\Product " + suffix);
+				key.SetMultiStringValue(L"Plugins" + suffix, { L"Spell checker", L"Thesaurus", L"Grammar" });
+			}
+		}
+	}
+
+	winreg::RegKey root = winreg::RegKey::OpenKey(HKEY_CURRENT_USER, pmrKeyName, KEY_READ);
+	winreg::RegKey item = winreg::RegKey::OpenKey(root.Handle(), L"Group1\\Item2", KEY_READ);
+
+	std::pmr::monotonic_buffer_resource arena;
+	const winreg::pmr::RegValue plugins = winreg::pmr::QueryValue(item.Handle(), L"Plugins0", &arena);
+	Check(plugins.MultiString().size() == 3 && plugins.MultiString()[1] == L"Thesaurus"
+		&& plugins.get_allocator().resource() == &arena
+		&& plugins.MultiString()[2].get_allocator().resource() == &arena, L"multi-string read into the arena");
+	Check(winreg::pmr::QueryValue(item.Handle(), L"Count3", &arena).Dword() == 123
+		&& winreg::pmr::QueryValue(item.Handle(), L"Path1", &arena).String()
+			== L"C:\\Program Files\\Vendor\\Product 1", L"DWORD and string read into the arena");
+
+	const uint16_t shortDword = 0x1234;
+	::RegSetValueEx(winreg::RegKey::OpenKey(item.Handle(), L"", KEY_WRITE).Handle(), L"Short", 0, REG_DWORD,
+		reinterpret_cast<const BYTE*>(&shortDword), sizeof(shortDword));
+	Check(winreg::pmr::QueryValue(item.Handle(), L"Short", &arena).Dword() == 0x1234,
+		L"REG_DWORD of another size read into the arena");
+	winreg::DeleteValue(winreg::RegKey::OpenKey(item.Handle(), L"", KEY_WRITE).Handle(), L"Short");
+
+	const std::pmr::vector<winreg::pmr::RegValue> values = winreg::pmr::EnumerateValues(item.Handle(), &arena);
+	const vector<winreg::RegValue> heapValues = winreg::EnumerateValues(item.Handle());
+	bool sameValues = (values.size() == heapValues.size());
+	for (size_t i = 0; sameValues && i < values.size(); i++)
+	{
+		const winreg::RegValue copy = values[i].ToRegValue();
+		sameValues = copy.name() == heapValues[i].name() && copy.GetType() == heapValues[i].GetType()
+			&& (copy.GetType() != REG_MULTI_SZ || copy.MultiString() == heapValues[i].MultiString())
+			&& (copy.GetType() != REG_SZ || copy.String() == heapValues[i].String());
+	}
+	Check(sameValues && values.back().get_allocator().resource() == &arena, L"values enumerated into the arena");
+	Check(winreg::pmr::EnumerateValueNames(item.Handle(), &arena).size() == 12
+		&& winreg::pmr::EnumerateSubKeyNames(root.Handle(), &arena)
+			== std::pmr::vector<std::pmr::wstring>({ L"Group0", L"Group1", L"Group2", L"Group3" }),
+		L"names enumerated into the arena");
+
+	// Copies into a container of another resource allocate from that resource
+	std::pmr::unsynchronized_pool_resource pool;
+	std::pmr::vector<winreg::pmr::RegValue> kept(&pool);
+	kept.push_back(plugins);
+	Check(kept[0].get_allocator().resource() == &pool && kept[0].MultiString()[0].get_allocator().resource() == &pool
+		&& kept[0].MultiString() == plugins.MultiString(), L"copied into another resource");
+
+	const winreg::pmr::KeyNode tree = winreg::pmr::ReadKeyTree(HKEY_CURRENT_USER, pmrKeyName, &arena);
+	Check(tree.KeyCount() == 37 && tree.subKeys[3].subKeys[7].values.size() == 12
+		&& tree.subKeys[3].subKeys[7].name == L"Item7"
+		&& tree.subKeys[3].subKeys[7].values[0].get_allocator().resource() == &arena, L"key tree read into the arena");
+
+	// A tree of the same keys on the global heap
+	struct HeapNode
+	{
+		wstring name;
+		vector<winreg::RegValue> values;
+		vector<HeapNode> subKeys;
+	};
+	auto readHeapTree = [](HKEY hKey, HeapNode& node, auto& self) -> void
+	{
+		node.values = winreg::EnumerateValues(hKey);
+		for (const wstring& name : winreg::EnumerateSubKeyNames(hKey))
+		{
+			node.subKeys.push_back(HeapNode{ name, {}, {} });
+			winreg::RegKey subKey = winreg::RegKey::OpenKey(hKey, name, KEY_READ);
+			self(subKey.Handle(), node.subKeys.back(), self);
+		}
+	};
+
+	// Heap allocations of one scan: the registry emulation allocates too, on both sides
+	size_t before = g_allocations;
+	{
+		HeapNode heapTree;
+		readHeapTree(root.Handle(), heapTree, readHeapTree);
+	}
+	const size_t heapAllocations = g_allocations - before;
+	std::pmr::monotonic_buffer_resource scanArena(256 * 1024);
+	before = g_allocations;
+	{
+		winreg::pmr::ReadKeyTree(root.Handle(), L"", &scanArena);
+	}
+	const size_t arenaAllocations = g_allocations - before;
+
+	// Throughput of 16 threads scanning the tree, on the global heap or each with its arena
+	const int threadCount = 16;
+	const int scansPerThread = 20;
+	auto scansPerSecond = [&](auto scan)
+	{
+		std::atomic<size_t> keys{ 0 };
+		const auto start = std::chrono::steady_clock::now();
+		vector<std::thread> threads;
+		for (int t = 0; t < threadCount; t++)
+		{
+			threads.emplace_back([&]
+			{
+				std::pmr::monotonic_buffer_resource threadArena(256 * 1024);
+				for (int i = 0; i < scansPerThread; i++)
+				{
+					keys += scan(threadArena);
+					threadArena.release();
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return std::make_pair(threadCount * scansPerThread / seconds, keys.load());
+	};
+	const auto heapScans = scansPerSecond([&](std::pmr::memory_resource&)
+	{
+		HeapNode heapTree;
+		readHeapTree(root.Handle(), heapTree, readHeapTree);
+		return heapTree.subKeys.size() * (heapTree.subKeys[0].subKeys.size() + 1) + 1;
+	});
+	const auto arenaScans = scansPerSecond([&](std::pmr::memory_resource& threadArena)
+	{
+		return winreg::pmr::ReadKeyTree(root.Handle(), L"", &threadArena).KeyCount();
+	});
+
+	wchar_t what[200];
+	swprintf(what, 200, L"heap allocations per scan: %zu on the global heap, %zu with an arena", heapAllocations,
+		arenaAllocations);
+	Check(arenaAllocations < heapAllocations, what);
+	swprintf(what, 200, L"%d threads: %.0f scans/s on the global heap, %.0f with arenas", threadCount,
+		heapScans.first, arenaScans.first);
+	Check(heapScans.second == 37 * threadCount * scansPerThread && arenaScans.second == heapScans.second, what);
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, pmrKeyName);
+}
+
+void test_memory_footprint(const std::wstring & testKeyName)
+{
+	wcout << L"\nMeasuring the memory of values and loaded trees...\n";
+
+	// A copy allocates exactly what Footprint() reports: no slack
+	winreg::RegValue multi(L"A value name longer than the small string buffer", REG_MULTI_SZ);
+	multi.MultiString() = { L"C:\\Program Files\\Vendor\\Product", L"x", L"D:\\Data\\Vendor\\Product\\Cache" };
+	size_t bytesBefore = g_allocatedBytes;
+	size_t allocationsBefore = g_allocations;
+	{
+		const winreg::RegValue copy = multi;
+		const winreg::MemoryFootprint footprint = winreg::Footprint(copy);
+		Check(footprint.HeapBytes() == g_allocatedBytes - bytesBefore
+			&& footprint.allocations == g_allocations - allocationsBefore && footprint.slackBytes == 0
+			&& footprint.overheadBytes == 3 * sizeof(wstring)
+			&& footprint.nameBytes == (copy.name().size() + 1) * sizeof(wchar_t), L"footprint of a multi-string");
+	}
+
+	winreg::RegValue binary(L"Bin", REG_BINARY);
+	binary.Binary().reserve(4096);
+	binary.Binary().assign(1000, 0x5A);
+	const winreg::MemoryFootprint binaryFootprint = winreg::Footprint(binary);
+	Check(binaryFootprint.payloadBytes == 1000 && binaryFootprint.slackBytes == 3096
+		&& binaryFootprint.nameBytes == 0, L"capacity slack counted, short names inline");
+
+	// 3 x 5 keys, with 6 values each
+	const wstring footprintKeyName = testKeyName + L"\\Footprint";
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 5; j++)
+		{
+			winreg::RegKey key = winreg::RegKey::CreateKey(HKEY_CURRENT_USER,
+				footprintKeyName + L"\\Component" + std::to_wstring(i) + L"\\Instance" + std::to_wstring(j));
+			for (int k = 0; k < 2; k++)
+			{
+				const wstring suffix = std::to_wstring(k);
+				key.SetDwordValue(L"Enabled" + suffix, 1);
+				key.SetStringValue(L"InstallLocation" + suffix, L"C:\\Program Files\\Vendor\\Component " + suffix);
+				const BYTE data[300] = {};
+				key.SetBinaryValue(L"State" + suffix, data, sizeof(data));
+			}
+		}
+	}
+
+	const winreg::LoadedTree tree = winreg::LoadTree(HKEY_CURRENT_USER, footprintKeyName);
+	const winreg::FootprintReport report = winreg::ReportFootprint(tree);
+	size_t typeBytes = 0;
+	for (const auto& type : report.byType)
+	{
+		typeBytes += type.second.HeapBytes();
+	}
+	Check(tree.complete && tree.keys.size() == 19 && report.byKey.size() == 19
+		&& report.total.HeapBytes() == winreg::Footprint(tree).HeapBytes()
+		&& report.byType.at(REG_BINARY).payloadBytes == 30 * 300 && report.byType.at(REG_DWORD).payloadBytes == 0
+		&& typeBytes < report.total.HeapBytes(), L"footprint of a tree, by key and by type");
+
+	bytesBefore = g_allocatedBytes;
+	{
+		const vector<winreg::LoadedKey> keys(tree.keys.begin(), tree.keys.end());
+		size_t copyBytes = (keys.capacity()) * sizeof(winreg::LoadedKey);
+		for (const winreg::LoadedKey& key : keys)
+		{
+			copyBytes += winreg::Footprint(key).HeapBytes();
+		}
+		Check(copyBytes == g_allocatedBytes - bytesBefore, L"footprint of a copied tree matches its allocations");
+	}
+
+	// Half the memory: stop, or spill the keys that don't fit
+	winreg::TreeLoadBudget budget;
+	budget.maxHeapBytes = report.total.HeapBytes() / 2;
+	const winreg::LoadedTree partial = winreg::LoadTree(HKEY_CURRENT_USER, footprintKeyName, budget);
+	Check(!partial.complete && !partial.keys.empty() && partial.keys.size() < 19
+		&& winreg::Footprint(partial).HeapBytes() <= budget.maxHeapBytes, L"load stopped at the budget");
+
+	vector<wstring> spilled;
+	budget.spill = [&](winreg::LoadedKey&& key) { spilled.push_back(key.path); };
+	const winreg::LoadedTree kept = winreg::LoadTree(HKEY_CURRENT_USER, footprintKeyName, budget);
+
+	wchar_t what[200];
+	swprintf(what, 200, L"load spilled %zu of 19 keys, %zu bytes kept (budget %zu)", kept.spilledKeys,
+		winreg::Footprint(kept).HeapBytes(), budget.maxHeapBytes);
+	Check(kept.complete && kept.spilledKeys == spilled.size() && kept.keys.size() + spilled.size() == 19
+		&& winreg::Footprint(kept).HeapBytes() <= budget.maxHeapBytes, what);
+
+	winreg::DeleteTree(HKEY_CURRENT_USER, footprintKeyName);
+}
+
+void test_hive_verify()
+{
+	wcout << L"\nVerifying offline hive files...\n";
+
+	namespace hd = winreg::hive_detail;
+
+	// A hive with big data, Unicode names, and a key large enough for an "ri" index
+	winreg::HiveBuilder builder(L"HiveRoot");
+	winreg::RegValue multi(L"Paths", REG_MULTI_SZ);
+	multi.MultiString() = { L"C:\\One", L"D:\\Two" };
+	winreg::RegValue big(L"Big", REG_BINARY);
+	big.Binary().resize(40000);
+	for (size_t i = 0; i < big.Binary().size(); i++)
+	{
+		big.Binary()[i] = static_cast<BYTE>(i * 7);
+	}
+	builder.SetValue(L"Software\\Vendor", multi);
+	builder.SetValue(L"Software\\Vendor", big);
+	builder.SetValue(L"Software\\Vendor\\\u0394\u03b5\u03bb\u03c4\u03b1", winreg::RegValue(L"\u00c9t\u00e9 \u4e2d", REG_SZ));
+	for (int i = 0; i < 1500; i++)
+	{
+		winreg::RegValue dw(L"Index", REG_DWORD);
+		dw.Dword() = i;
+		builder.SetValue(L"Software\\Many\\Item" + std::to_wstring(i), dw);
+	}
+
+	const vector<uint8_t> hive = builder.Build();
+	const winreg::HiveVerifyResult clean = winreg::VerifyHive(hive.data(), hive.size());
+	Check(clean.IsValid() && clean.keys == 1 + 1 + 2 + 1 + 1500 && clean.values == 3 + 1500 && clean.bins != 0,
+		L"built hive verifies clean");
+
+	const winreg::HiveView view(hive.data(), hive.size());
+	uint32_t vendor = 0;
+	uint32_t found = 0;
+	Check(view.FindKey(L"SOFTWARE\\vendor", vendor) && winreg::HiveKey(view, vendor).FindValue(L"big", found)
+		&& winreg::HiveValue(view, found).ToRegValue().Binary() == big.Binary()
+		&& winreg::HiveKey(view, vendor).FindValue(L"Paths", found) && winreg::HiveValue(view, found).ToRegValue().MultiString() == multi.MultiString()
+		&& view.FindKey(L"Software\\Vendor\\\u0394\u03b5\u03bb\u03c4\u03b1", found)
+		&& view.KeyPath(found) == L"Software\\Vendor\\\u0394\u03b5\u03bb\u03c4\u03b1", L"hive read back");
+
+	uint32_t many = 0;
+	size_t manyCount = 0;
+	wstring previous;
+	bool sorted = true;
+	view.FindKey(L"Software\\Many", many);
+	winreg::HiveKey(view, many).ForEachSubKey([&](const winreg::HiveKey& key)
+	{
+		sorted = sorted && hd::CompareNames(previous, key.Name()) < 0;
+		previous = key.Name();
+		manyCount++;
+	});
+	Check(manyCount == 1500 && sorted, L"large key listed in order");
+
+	// Names are upper-cased like Windows does, whatever the locale: beyond ASCII, and unit by
+	// unit beyond the BMP
+	winreg::HiveBuilder accents(L"Accents");
+	accents.CreateKey(L"\u00e9t\u00e9");
+	accents.CreateKey(L"\u00c9T\u00c9\\\u03c3\u03bf\u03c6\u03af\u03b1");
+	accents.CreateKey(L"\U0001F600");
+	const vector<uint8_t> accentHive = accents.Build();
+	const winreg::HiveVerifyResult accentResult = winreg::VerifyHive(accentHive.data(), accentHive.size());
+	const winreg::HiveView accentView(accentHive.data(), accentHive.size());
+	Check(accentResult.IsValid() && accentResult.keys == 1 + 2 + 1
+		&& accentView.FindKey(L"\u00c9t\u00c9\\\u03a3\u039f\u03a6\u038a\u0391", found), L"non-ASCII key names folded in a hive");
+	Check(hd::NameHash(L"\u00e9t\u00e9") == 0x43FCE && hd::NameHash(L"\U0001F600") == 0xD83Du * 37 + 0xDE00u
+		&& hd::CompareNames(L"\U0001F600", L"\uE000") < 0 && hd::CompareNames(L"\u00ff", L"\u0178") == 0,
+		L"names hashed and ordered as UTF-16 units");
+
+	// The file offset of a field of a cell
+	auto fieldAt = [](uint32_t cell, uint32_t field) { return size_t(hd::BaseBlockSize) + cell + 4 + field; };
+
+	auto corrupted = [&](auto corrupt)
+	{
+		vector<uint8_t> copy = hive;
+		corrupt(copy);
+		return winreg::VerifyHive(copy.data(), copy.size());
+	};
+	auto reportsAt = [](const winreg::HiveVerifyResult& result, winreg::HiveIssueCode code, uint64_t fileOffset)
+	{
+		return std::any_of(result.issues.begin(), result.issues.end(), [&](const winreg::HiveIssue& issue)
+		{
+			return issue.code == code && issue.fileOffset == fileOffset;
+		});
+	};
+
+	winreg::HiveVerifyResult result = corrupted([](vector<uint8_t>& h) { h[hd::RegfLastWrite] ^= 1; });
+	Check(result.issuesFound == 1 && reportsAt(result, winreg::HiveIssueCode::BadChecksum, hd::RegfChecksum),
+		L"base block checksum mismatch found");
+
+	result = corrupted([&](vector<uint8_t>& h) { hd::Put32(&h[fieldAt(vendor, 0) - 4], static_cast<uint32_t>(-100)); });
+	Check(reportsAt(result, winreg::HiveIssueCode::BadCellSize, fieldAt(vendor, 0) - 4), L"bad cell size found");
+
+	result = corrupted([&](vector<uint8_t>& h)
+	{
+		hd::Put32(&h[fieldAt(vendor, hd::NkValueList)], hd::Get32(&h[fieldAt(vendor, hd::NkValueList)]) + 8);
+	});
+	Check(reportsAt(result, winreg::HiveIssueCode::BadReference, fieldAt(vendor, hd::NkValueList)),
+		L"value list offset into the middle of a cell found");
+
+	result = corrupted([](vector<uint8_t>& h) { h.resize(h.size() - hd::BinAlignment); });
+	Check(result.Has(winreg::HiveIssueCode::Truncated), L"truncated hive found");
+
+	// A sub-key list pointing back at the key itself
+	uint32_t listSize = 0;
+	const uint32_t vendorList = hd::Get32(&hive[fieldAt(vendor, hd::NkSubKeyList)]);
+	view.Cell(vendorList, listSize);
+	result = corrupted([&](vector<uint8_t>& h) { hd::Put32(&h[fieldAt(vendorList, 4)], vendor); });
+	Check(reportsAt(result, winreg::HiveIssueCode::KeyLoop, fieldAt(vendorList, 4)), L"key loop found");
+
+	// Throughput: 1 thread and 4, on a larger hive
+	winreg::HiveBuilder large(L"Large");
+	winreg::RegValue state(L"State", REG_BINARY);
+	state.Binary().assign(1024, 0x3C);
+	winreg::RegValue location(L"InstallLocation", REG_SZ);
+	location.String() = L"C:\\Program Files\\Vendor\\Product";
+	for (int i = 0; i < 100; i++)
+	{
+		for (int j = 0; j < 200; j++)
+		{
+			const wstring path = L"Component" + std::to_wstring(i) + L"\\Instance" + std::to_wstring(j);
+			large.SetValue(path, state);
+			large.SetValue(path, location);
+		}
+	}
+	const vector<uint8_t> largeHive = large.Build();
+
+	double seconds[2] = {};
+	size_t keys[2] = {};
+	const size_t threads[2] = { 1, 4 };
+	for (int t = 0; t < 2; t++)
+	{
+		winreg::HiveVerifyOptions options;
+		options.threads = threads[t];
+		const winreg::HiveVerifyResult timed = winreg::VerifyHive(largeHive.data(), largeHive.size(), options);
+		seconds[t] = timed.seconds;
+		keys[t] = timed.IsValid() ? timed.keys : 0;
+	}
+
+	wchar_t what[200];
+	swprintf(what, 200, L"verified %zu keys, %.1f MB: %.0f MB/s on 1 thread, %.0f MB/s on 4",
+		keys[1], largeHive.size() / 1e6, largeHive.size() / 1e6 / seconds[0], largeHive.size() / 1e6 / seconds[1]);
+	Check(keys[0] == 1 + 100 + 100 * 200 && keys[1] == keys[0], what);
+}
+
+void test_hive_edit()
+{
+	wcout << L"\nEditing an offline hive in place...\n";
+
+	namespace hd = winreg::hive_detail;
+
+	// 2000 keys with 3 values each, and a key large enough for an "ri" index
+	winreg::HiveBuilder builder(L"EditRoot");
+	winreg::RegValue location(L"InstallLocation", REG_SZ);
+	winreg::RegValue state(L"State", REG_BINARY);
+	state.Binary().assign(600, 0x11);
+	winreg::RegValue enabled(L"Enabled", REG_DWORD);
+	for (int i = 0; i < 2000; i++)
+	{
+		const wstring path = L"Products\\Product" + std::to_wstring(i);
+		location.String() = L"C:\\Program Files\\Vendor\\Product " + std::to_wstring(i);
+		enabled.Dword() = 1;
+		builder.SetValue(path, location);
+		builder.SetValue(path, state);
+		builder.SetValue(path, enabled);
+	}
+	const std::filesystem::path hivePath = std::filesystem::temp_directory_path() / L"winreg_test_edit.hiv";
+	builder.Save(hivePath);
+	const uintmax_t sizeBefore = std::filesystem::file_size(hivePath);
+
+	// 200 values of 100 keys changed in place: the pages of their cells, and the base block
+	{
+		winreg::HiveEditor editor(hivePath);
+		for (int i = 0; i < 2000; i += 20)
+		{
+			const wstring path = L"Products\\Product" + std::to_wstring(i);
+			enabled.Dword() = 0;
+			editor.SetValue(path, enabled);
+			location.String() = L"D:\\Program Files\\Vendor\\Product " + std::to_wstring(i);
+			editor.SetValue(path, location);
+		}
+		editor.Flush();
+
+		wchar_t what[200];
+		swprintf(what, 200, L"200 values of a %.1f MB hive changed, %zu pages written",
+			sizeBefore / 1e6, editor.Stats().pagesWritten);
+		Check(editor.Stats().pagesWritten <= 1 + 2 * 100 && editor.Stats().cellsAllocated == 0
+			&& std::filesystem::file_size(hivePath) == sizeBefore, what);
+	}
+
+	{
+		const winreg::MappedFile file(hivePath);
+		const winreg::HiveView view(file.Data(), file.Size());
+		uint32_t key = 0;
+		uint32_t value = 0;
+		Check(winreg::VerifyHive(file.Data(), file.Size()).IsValid() && !view.IsDirty()
+			&& view.FindKey(L"Products\\Product1980", key) && winreg::HiveKey(view, key).FindValue(L"Enabled", value)
+			&& winreg::HiveValue(view, value).ToRegValue().Dword() == 0
+			&& winreg::HiveKey(view, key).FindValue(L"InstallLocation", value)
+			&& winreg::HiveValue(view, value).ToRegValue().String() == L"D:\\Program Files\\Vendor\\Product 1980",
+			L"edited hive verifies, with the new values");
+	}
+
+	// Deleted keys free cells, which new keys reuse; big data needs new bins
+	{
+		winreg::HiveEditor editor(hivePath);
+		for (int i = 0; i < 50; i++)
+		{
+			editor.DeleteTree(L"Products\\Product" + std::to_wstring(1000 + i));
+		}
+		const size_t freed = editor.Stats().cellsFreed;
+		for (int i = 0; i < 50; i++)
+		{
+			const wstring path = L"Products\\Added" + std::to_wstring(i);
+			editor.CreateKey(path);
+			editor.SetValue(path, state);
+		}
+		Check(freed == 50 * 7 && editor.Stats().binsAppended == 0, L"deleted keys' cells reused by new keys");
+
+		winreg::RegValue big(L"Big", REG_BINARY);
+		big.Binary().resize(100000);
+		for (size_t i = 0; i < big.Binary().size(); i++)
+		{
+			big.Binary()[i] = static_cast<BYTE>(i % 251);
+		}
+		editor.SetValue(L"Products\\Product7", big);
+		editor.CreateKey(L"\u00dcbersicht\\\u4e2d\u6587");
+		editor.SetValue(L"\u00dcbersicht\\\u4e2d\u6587", big);
+		editor.DeleteValue(L"Products\\Product8", L"State");
+
+		bool denied = false;
+		try
+		{
+			editor.DeleteKey(L"Products");
+		}
+		catch (const winreg::RegException& e)
+		{
+			denied = e.ErrorCode() == ERROR_ACCESS_DENIED;
+		}
+		Check(denied && editor.Stats().binsAppended != 0, L"bins appended for big data; keys with sub-keys kept");
+	}
+
+	{
+		const winreg::MappedFile file(hivePath);
+		const winreg::HiveVerifyResult result = winreg::VerifyHive(file.Data(), file.Size());
+		const winreg::HiveView view(file.Data(), file.Size());
+		uint32_t key = 0;
+		uint32_t value = 0;
+		uint32_t products = 0;
+		size_t productCount = 0;
+		wstring previous;
+		bool sorted = true;
+		view.FindKey(L"Products", products);
+		winreg::HiveKey(view, products).ForEachSubKey([&](const winreg::HiveKey& subKey)
+		{
+			sorted = sorted && hd::CompareNames(previous, subKey.Name()) < 0;
+			previous = subKey.Name();
+			productCount++;
+		});
+		Check(result.IsValid() && result.keys == 1 + 1 + 2000 + 2 && productCount == 2000 && sorted
+			&& !view.FindKey(L"Products\\Product1010", key) && view.FindKey(L"Products\\Added7", key)
+			&& view.FindKey(L"\u00dcbersicht\\\u4e2d\u6587", key) && winreg::HiveKey(view, key).FindValue(L"Big", value)
+			&& winreg::HiveValue(view, value).ToRegValue().Binary().size() == 100000
+			&& view.FindKey(L"Products\\Product8", key) && !winreg::HiveKey(view, key).FindValue(L"State", value)
+			&& winreg::HiveKey(view, key).ValueCount() == 2, L"edited hive verifies, with the new keys in order");
+	}
+
+	// In memory: a key growing past a leaf list is split under an index
+	vector<uint8_t> image = winreg::HiveBuilder(L"Small").Build();
+	{
+		winreg::HiveEditor editor(image);
+		for (int i = 1200; i > 0; i--)
+		{
+			editor.CreateKey(L"Items\\Item" + std::to_wstring(i));
+		}
+	}
+	const winreg::HiveView small(image.data(), image.size());
+	uint32_t items = 0;
+	uint32_t listSize = 0;
+	small.FindKey(L"Items", items);
+	const uint8_t* list = small.Cell(hd::Get32(small.Cell(items, listSize) + hd::NkSubKeyList), listSize);
+	Check(winreg::VerifyHive(image.data(), image.size()).IsValid() && hd::HasSignature(list, "ri")
+		&& winreg::HiveKey(small, items).SubKeyCount() == 1200, L"large sub-key list split under an index");
+
+	// A key listed in its own sub-keys is reported, and the hive left unchanged
+	winreg::HiveBuilder loopBuilder(L"Small");
+	loopBuilder.CreateKey(L"Loop\\Child");
+	vector<uint8_t> loop = loopBuilder.Build();
+	{
+		const winreg::HiveView view(loop.data(), loop.size());
+		uint32_t key = 0;
+		uint32_t size = 0;
+		view.FindKey(L"Loop", key);
+		const uint32_t loopList = hd::Get32(view.Cell(key, size) + hd::NkSubKeyList);
+		hd::Put32(loop.data() + hd::BaseBlockSize + loopList + 4 + 4, key);    // the first entry of the list
+	}
+	const vector<uint8_t> looped = loop;
+	bool rejected = false;
+	try
+	{
+		winreg::HiveEditor(loop).DeleteTree(L"Loop");
+	}
+	catch (const winreg::RegException& e)
+	{
+		rejected = e.ErrorCode() == ERROR_BADDB;
+	}
+	Check(rejected && loop == looped, L"key nested in itself rejected");
+
+	std::filesystem::remove(hivePath);
+}
+
+void test_hive_log_recovery()
+{
+	wcout << L"\nRecovering a dirty hive from its transaction logs...\n";
+
+	namespace hd = winreg::hive_detail;
+	namespace hl = winreg::hive_log_detail;
+
+	const uint8_t marvinInput[] = { 0xAF };
+	Check(hl::Marvin32(marvinInput, 1, 0x004FB61A001BDBCCULL) == 0x48E73FC77D75DDC1ULL, L"Marvin32 known answer");
+
+	// The hive as last written, then two writes of changes
+	winreg::HiveBuilder builder(L"LogRoot");
+	winreg::RegValue version(L"Version", REG_SZ);
+	for (int i = 0; i < 300; i++)
+	{
+		version.String() = L"1.0." + std::to_wstring(i);
+		builder.SetValue(L"Apps\\App" + std::to_wstring(i), version);
+	}
+	const vector<uint8_t> written = builder.Build();
+
+	vector<uint8_t> first = written;
+	{
+		winreg::HiveEditor editor(first);
+		version.String() = L"2.0.0";
+		editor.SetValue(L"Apps\\App10", version);
+		editor.DeleteTree(L"Apps\\App20");
+		editor.CreateKey(L"Apps\\Added");
+	}
+	vector<uint8_t> second = first;
+	{
+		winreg::HiveEditor editor(second);
+		winreg::RegValue big(L"Big", REG_BINARY);
+		big.Binary().assign(50000, 0x42);
+		editor.SetValue(L"Apps\\Added", big);
+		version.String() = L"3.0.0";
+		editor.SetValue(L"Apps\\App299", version);
+	}
+
+	// The 4 KB pages of the bins that differ
+	auto dirtyPages = [](const vector<uint8_t>& before, const vector<uint8_t>& after)
+	{
+		vector<std::pair<uint32_t, uint32_t>> pages;
+		for (size_t page = hd::BaseBlockSize; page < after.size(); page += 4096)
+		{
+			if (page >= before.size() || memcmp(&before[page], &after[page], 4096) != 0)
+			{
+				pages.emplace_back(static_cast<uint32_t>(page - hd::BaseBlockSize), 4096);
+			}
+		}
+		return pages;
+	};
+
+	const std::filesystem::path directory = std::filesystem::temp_directory_path();
+	const std::filesystem::path hivePath = directory / L"winreg_test_log.hiv";
+	const std::filesystem::path log1 = directory / L"winreg_test_log.hiv.LOG1";
+	const std::filesystem::path log2 = directory / L"winreg_test_log.hiv.LOG2";
+	std::filesystem::remove(log2);
+	{
+		winreg::HiveLogWriter log(log1, written.data());
+		log.Append(&first[hd::BaseBlockSize], hd::Get32(&first[hd::RegfBinsSize]), dirtyPages(written, first));
+		log.Append(&second[hd::BaseBlockSize], hd::Get32(&second[hd::RegfBinsSize]), dirtyPages(first, second));
+	}
+
+	// The primary file: a write begun (sequence numbers differ), with one page of it
+	vector<uint8_t> primary = written;
+	hd::Put32(&primary[hd::RegfPrimarySequence], hd::Get32(&primary[hd::RegfPrimarySequence]) + 1);
+	hd::Put32(&primary[hd::RegfChecksum], hd::BaseBlockChecksum(primary.data()));
+	const size_t tornPage = hd::BaseBlockSize + dirtyPages(written, first).front().first;
+	memcpy(&primary[tornPage], &first[tornPage], 4096);
+	auto saveFile = [](const std::filesystem::path& path, const vector<uint8_t>& bytes)
+	{
+		FILE* f = winreg::OpenFile(path, "wb");
+		fwrite(bytes.data(), 1, bytes.size(), f);
+		fclose(f);
+	};
+	saveFile(hivePath, primary);
+
+	auto sameBins = [](const vector<uint8_t>& lhs, const vector<uint8_t>& rhs)
+	{
+		const uint32_t binsSize = hd::Get32(&rhs[hd::RegfBinsSize]);
+		return hd::Get32(&lhs[hd::RegfBinsSize]) == binsSize && lhs.size() >= hd::BaseBlockSize + binsSize
+			&& memcmp(&lhs[hd::BaseBlockSize], &rhs[hd::BaseBlockSize], binsSize) == 0;
+	};
+
+	vector<uint8_t> image;
+	winreg::HiveRecoveryResult result = winreg::RecoverHive(hivePath, { log1, log2 }, image);
+	const winreg::HiveView view(image.data(), image.size());
+	uint32_t key = 0;
+	uint32_t value = 0;
+	Check(result.wasDirty && result.entriesApplied == 2 && !view.IsDirty()
+		&& result.logBytesRead == std::filesystem::file_size(log1) && sameBins(image, second)
+		&& winreg::VerifyHive(image.data(), image.size()).IsValid()
+		&& view.FindKey(L"Apps\\App299", key) && winreg::HiveKey(view, key).FindValue(L"Version", value)
+		&& winreg::HiveValue(view, value).ToRegValue().String() == L"3.0.0" && !view.FindKey(L"Apps\\App20", key),
+		L"both log entries replayed, in one pass over the log");
+
+	const std::filesystem::path recoveredPath = directory / L"winreg_test_log_recovered.hiv";
+	result = winreg::RecoverHiveFile(hivePath, { log1 }, recoveredPath);
+	{
+		const winreg::MappedFile recovered(recoveredPath);
+		Check(result.entriesApplied == 2 && recovered.Size() == image.size()
+			&& memcmp(recovered.Data(), image.data(), image.size()) == 0, L"recovered hive written to a file");
+	}
+
+	// A damaged second entry: the first one only is applied
+	{
+		const size_t firstPages = dirtyPages(written, first).size();
+		const size_t firstEntrySize = (hl::LogPageList + firstPages * (8 + 4096) + 511) / 512 * 512;
+		const long dataByte = static_cast<long>(hl::LogBaseBlockSize + firstEntrySize + hl::LogPageList + 100);
+		FILE* f = winreg::OpenFile(log1, "r+b");
+		fseek(f, dataByte, SEEK_SET);
+		const int byte = fgetc(f);
+		fseek(f, dataByte, SEEK_SET);
+		fputc(byte ^ 0xFF, f);
+		fclose(f);
+	}
+	result = winreg::RecoverHive(hivePath, { log1 }, image);
+	Check(result.entriesApplied == 1 && result.endReason == L"data hash mismatch" && sameBins(image, first)
+		&& winreg::VerifyHive(image.data(), image.size()).IsValid(), L"damaged log entry detected, earlier one applied");
+
+	// The entries split between the two logs, the newer one first
+	{
+		winreg::HiveLogWriter newer(log1, first.data());
+		newer.Append(&second[hd::BaseBlockSize], hd::Get32(&second[hd::RegfBinsSize]), dirtyPages(first, second));
+		winreg::HiveLogWriter older(log2, written.data());
+		older.Append(&first[hd::BaseBlockSize], hd::Get32(&first[hd::RegfBinsSize]), dirtyPages(written, first));
+	}
+	result = winreg::RecoverHive(hivePath, { log1, log2 }, image);
+	Check(result.entriesApplied == 2 && sameBins(image, second), L"entries of both logs applied in sequence order");
+
+	// A clean hive is left as is
+	saveFile(hivePath, written);
+	result = winreg::RecoverHive(hivePath, { log1, log2 }, image);
+	Check(!result.wasDirty && result.entriesApplied == 0 && image == written, L"clean hive not replayed");
+
+	for (const std::filesystem::path& path : { hivePath, log1, log2, recoveredPath })
+	{
+		std::filesystem::remove(path);
+	}
+}
+
+void test_hive_scan()
+{
+	wcout << L"\nScanning offline hive files...\n";
+
+	namespace hd = winreg::hive_detail;
+
+	// "path\\name type size" for each value, and the key paths, walking the tree
+	auto walk = [](const winreg::HiveView& view, vector<wstring>& keys, vector<wstring>& values)
+	{
+		std::function<void(const winreg::HiveKey&, const wstring&)> visit;
+		visit = [&](const winreg::HiveKey& key, const wstring& path)
+		{
+			keys.push_back(path);
+			key.ForEachValue([&](const winreg::HiveValue& value)
+			{
+				values.push_back(path + L"\\" + value.Name() + L" " + std::to_wstring(value.Type())
+					+ L" " + std::to_wstring(value.DataSize()));
+			});
+			key.ForEachSubKey([&](const winreg::HiveKey& subKey)
+			{
+				visit(subKey, path.empty() ? subKey.Name() : path + L"\\" + subKey.Name());
+			});
+		};
+		visit(view.Root(), L"");
+	};
+	auto scanned = [](const winreg::HiveScan& scan, vector<wstring>& keys, vector<wstring>& values)
+	{
+		keys = scan.KeyPaths();
+		for (const winreg::ScannedValue& value : scan.values)
+		{
+			values.push_back(keys[value.key] + L"\\" + wstring(scan.Name(value)) + L" " + std::to_wstring(value.type)
+				+ L" " + std::to_wstring(value.dataSize));
+		}
+	};
+	auto same = [&](const winreg::HiveView& view, const winreg::HiveScan& scan)
+	{
+		vector<wstring> walkedKeys, walkedValues, scannedKeys, scannedValues;
+		walk(view, walkedKeys, walkedValues);
+		scanned(scan, scannedKeys, scannedValues);
+		bool onePath = true;
+		for (size_t i = 0; i < scannedKeys.size(); i++)
+		{
+			onePath = onePath && scannedKeys[i] == scan.KeyPath(i);
+		}
+		std::sort(walkedKeys.begin(), walkedKeys.end());
+		std::sort(walkedValues.begin(), walkedValues.end());
+		std::sort(scannedKeys.begin(), scannedKeys.end());
+		std::sort(scannedValues.begin(), scannedValues.end());
+		return onePath && walkedKeys == scannedKeys && walkedValues == scannedValues;
+	};
+
+	// Value data that looks like a key, and like a value, listed by no one
+	winreg::HiveBuilder builder(L"ScanRoot");
+	winreg::RegValue fakeKey(L"LooksLikeAKey", REG_BINARY);
+	fakeKey.Binary().assign(hd::NkName + 8, 0);
+	fakeKey.Binary()[0] = 'n';
+	fakeKey.Binary()[1] = 'k';
+	hd::Put16(fakeKey.Binary().data() + hd::NkNameLength, 4);
+	winreg::RegValue fakeValue(L"LooksLikeAValue", REG_BINARY);
+	fakeValue.Binary().assign(hd::VkName + 8, 0);
+	fakeValue.Binary()[0] = 'v';
+	fakeValue.Binary()[1] = 'k';
+	builder.SetValue(L"Software\\Vendor", fakeKey);
+	builder.SetValue(L"Software\\Vendor", fakeValue);
+	builder.SetValue(L"Software\\Vendor\\\u0394\u03b5\u03bb\u03c4\u03b1", winreg::RegValue(L"\u00c9t\u00e9", REG_SZ));
+	for (int i = 0; i < 1500; i++)
+	{
+		winreg::RegValue dw(L"Index", REG_DWORD);
+		dw.Dword() = i;
+		builder.SetValue(L"Software\\Many\\Item" + std::to_wstring(i), dw);
+	}
+	vector<uint8_t> hive = builder.Build();
+
+	// The decoys point at the root, as a parent would
+	const winreg::HiveView view(hive.data(), hive.size());
+	uint32_t vendor = 0;
+	uint32_t found = 0;
+	uint32_t size = 0;
+	view.FindKey(L"Software\\Vendor", vendor);
+	winreg::HiveKey(view, vendor).FindValue(L"LooksLikeAKey", found);
+	const uint32_t fakeCell = hd::Get32(view.Cell(found, size) + hd::VkDataOffset);
+	hd::Put32(hive.data() + hd::BaseBlockSize + fakeCell + 4 + hd::NkParent, view.RootCell());
+
+	winreg::HiveScanOptions options;
+	options.chunkSize = hd::BinAlignment;
+	winreg::HiveScan scan = winreg::ScanHive(view, options);
+	Check(scan.keys.size() == 1 + 1 + 2 + 1 + 1500 && scan.values.size() == 2 + 1 + 1500
+		&& scan.droppedKeys == 1 && scan.droppedValues == 1 && scan.badBins == 0, L"decoy cells dropped");
+	Check(same(view, scan), L"scan finds the keys and values of the tree walk");
+	options.threads = 1;
+	Check(same(view, winreg::ScanHive(view, options)), L"scan on a single thread");
+
+	const size_t delta = std::find_if(scan.keys.begin(), scan.keys.end(), [&](const winreg::ScannedKey& key)
+	{
+		return scan.Name(key) == L"\u0394\u03b5\u03bb\u03c4\u03b1";
+	}) - scan.keys.begin();
+	Check(delta < scan.keys.size() && scan.KeyPath(delta) == L"Software\\Vendor\\\u0394\u03b5\u03bb\u03c4\u03b1",
+		L"Unicode key path rebuilt");
+
+	// Deleted keys are free cells
+	{
+		winreg::HiveEditor editor(hive);
+		editor.DeleteTree(L"Software\\Many");
+		editor.CreateKey(L"Software\\Added");
+		editor.SetValue(L"Software\\Added", winreg::RegValue(L"New", REG_SZ));
+	}
+	const winreg::HiveView edited(hive.data(), hive.size());
+	scan = winreg::ScanHive(edited);
+	Check(scan.keys.size() == 1 + 1 + 2 + 1 && scan.values.size() == 2 + 1 + 1 && same(edited, scan),
+		L"scan after deleting a tree");
+
+	// Throughput against the tree walk, on a larger hive
+	winreg::HiveBuilder large(L"Large");
+	winreg::RegValue state(L"State", REG_BINARY);
+	state.Binary().assign(1024, 0x3C);
+	winreg::RegValue location(L"InstallLocation", REG_SZ);
+	location.String() = L"C:\\Program Files\\Vendor\\Product";
+	for (int i = 0; i < 100; i++)
+	{
+		for (int j = 0; j < 200; j++)
+		{
+			const wstring path = L"Component" + std::to_wstring(i) + L"\\Instance" + std::to_wstring(j);
+			large.SetValue(path, state);
+			large.SetValue(path, location);
+		}
+	}
+	const vector<uint8_t> largeHive = large.Build();
+	const winreg::HiveView largeView(largeHive.data(), largeHive.size());
+
+	// Both keep the same records: the keys with their parents, the values with
+	// their keys, and the names; paths are left out
+	winreg::HiveScan walked;
+	std::function<void(const winreg::HiveKey&, size_t)> visitLarge;
+	visitLarge = [&](const winreg::HiveKey& key, size_t parent)
+	{
+		const size_t index = walked.keys.size();
+		const wstring name = key.Name();
+		walked.keys.push_back(winreg::ScannedKey{ key.CellOffset(), parent, static_cast<uint32_t>(walked.names.size()),
+			static_cast<uint32_t>(name.size()), key.LastWriteTime(), key.SubKeyCount(), key.ValueCount() });
+		walked.names += name;
+		key.ForEachValue([&](const winreg::HiveValue& value)
+		{
+			const wstring valueName = value.Name();
+			walked.values.push_back(winreg::ScannedValue{ value.CellOffset(), index, static_cast<uint32_t>(walked.names.size()),
+				static_cast<uint32_t>(valueName.size()), value.Type(), value.DataSize() });
+			walked.names += valueName;
+		});
+		key.ForEachSubKey([&](const winreg::HiveKey& subKey) { visitLarge(subKey, index); });
+	};
+	const auto start = std::chrono::steady_clock::now();
+	visitLarge(largeView.Root(), winreg::ScannedKey::NoParent);
+	const double walkSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double seconds[2] = {};
+	size_t counts[2] = {};
+	const size_t threads[2] = { 1, 4 };
+	for (int t = 0; t < 2; t++)
+	{
+		options = winreg::HiveScanOptions();
+		options.threads = threads[t];
+		const winreg::HiveScan timed = winreg::ScanHive(largeView, options);
+		seconds[t] = timed.seconds;
+		counts[t] = timed.keys.size() + timed.values.size();
+	}
+
+	wchar_t what[200];
+	swprintf(what, 200, L"scanned %zu keys and values, %.1f MB: tree walk %.1f ms, scan %.1f ms on 1 thread, %.1f ms on 4",
+		counts[1], largeHive.size() / 1e6, walkSeconds * 1e3, seconds[0] * 1e3, seconds[1] * 1e3);
+	Check(counts[0] == walked.keys.size() + walked.values.size() && counts[1] == counts[0], what);
+}
+
+void test_columnar_export(const std::wstring & testKeyName)
+{
+	wcout << L"\nExporting key trees to columnar files...\n";
+
+	const std::filesystem::path fileName = std::filesystem::temp_directory_path() / L"winreg_test_export.wrc";
+
+	winreg::RegKey source = winreg::RegKey::CreateKey(HKEY_CURRENT_USER, testKeyName + L"\\Columnar");
+	for (int i = 0; i < 10; i++)
+	{
+		for (int j = 0; j < 10; j++)
+		{
+			const wstring path = L"App" + std::to_wstring(i) + L"\\Module" + std::to_wstring(j);
+			winreg::RegKey key = winreg::RegKey::CreateKey(source.Handle(), path);
+			key.SetDwordValue(L"Index", i * 10 + j);
+			key.SetStringValue(L"Path", L"C:\\" + path);
+			const vector<BYTE> blob(static_cast<size_t>(i * j), static_cast<BYTE>(j));
+			key.SetBinaryValue(L"Blob", blob.data(), blob.size());
+		}
+	}
+	winreg::RegKey::CreateKey(source.Handle(), L"Empty");
+	winreg::RegKey unicode = winreg::RegKey::CreateKey(source.Handle(), L"\u0394\u03b5\u03bb\u03c4\u03b1");
+	unicode.SetMultiStringValue(L"\u00c9t\u00e9 \u4e2d", vector<wstring>{ L"One", L"\u4e8c" });
+	const unsigned long long qword = 0x0123456789ABCDEFULL;
+	::RegSetValueEx(source.Handle(), L"Big number", 0, REG_QWORD, reinterpret_cast<const BYTE*>(&qword),
+		sizeof(qword));
+
+	// The tree, as read by the copy's source
+	std::map<wstring, vector<winreg::RawValue>> expected;
+	{
+		winreg::RegistrySource registry(source.Handle());
+		vector<wstring> pending(1);
+		while (!pending.empty())
+		{
+			winreg::KeyContents contents;
+			contents.path = pending.back();
+			pending.pop_back();
+			registry.ReadKey(contents.path, contents);
+			for (const wstring& name : contents.subKeyNames)
+			{
+				pending.push_back(contents.path.empty() ? name : contents.path + L"\\" + name);
+			}
+			expected[contents.path] = std::move(contents.values);
+		}
+	}
+
+	// Row groups of at most 50 values
+	winreg::ColumnarExportOptions options;
+	options.threads = 2;
+	options.rowGroupValues = 50;
+	const winreg::ColumnarExportStats stats = winreg::ExportRegistryTree(source.Handle(), fileName, options);
+	Check(stats.keys == 1 + 10 + 100 + 2 && stats.values == 300 + 1 + 1 && stats.rowGroups >= 300 / 50
+		&& stats.peakRowGroups <= options.threads + 1 && stats.fileBytes == std::filesystem::file_size(fileName),
+		L"registry tree exported");
+
+	std::map<wstring, vector<winreg::RawValue>> exported;
+	bool projected = true;
+	{
+		winreg::ColumnarReader reader(fileName);
+		winreg::ColumnarRowGroup rows;
+		winreg::ColumnarRowGroup types;
+		for (size_t g = 0; g < reader.RowGroupCount(); g++)
+		{
+			reader.ReadRowGroup(g, winreg::AllColumns, rows);
+			size_t value = 0;
+			for (size_t k = 0; k < rows.keyPaths.size(); k++)
+			{
+				vector<winreg::RawValue>& values = exported[rows.keyPaths[k]];
+				for (uint32_t v = 0; v < rows.valueCounts[k]; v++, value++)
+				{
+					values.push_back(winreg::RawValue{ rows.nameDictionary[rows.names[value]], rows.types[value],
+						vector<BYTE>(rows.data[value].data, rows.data[value].data + rows.data[value].size) });
+				}
+			}
+
+			reader.ReadRowGroup(g, winreg::ColumnBit(winreg::ValueTypeColumn), types);
+			projected = projected && types.types == rows.types && types.keyPaths.empty() && types.names.empty()
+				&& types.nameDictionary.empty() && types.data.empty();
+		}
+		Check(reader.KeyCount() == stats.keys && reader.ValueCount() == stats.values, L"columnar file counts");
+	}
+	bool same = exported.size() == expected.size();
+	for (const auto& key : expected)
+	{
+		const auto found = exported.find(key.first);
+		same = same && found != exported.end() && found->second.size() == key.second.size();
+		for (size_t v = 0; same && v < key.second.size(); v++)
+		{
+			same = found->second[v].name == key.second[v].name && found->second[v].type == key.second[v].type
+				&& found->second[v].data == key.second[v].data;
+		}
+	}
+	Check(same, L"columnar file read back");
+	Check(projected, L"type column read alone");
+
+	// Row counts larger than the columns can hold
+	const std::filesystem::path corruptName = fileName.wstring() + L".corrupt";
+	{
+		std::ifstream in(fileName, std::ios::binary);
+		std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		const uint32_t huge = 0xFFFFFFFF;
+		memcpy(bytes.data() + sizeof(winreg::ColumnarFileHeader) + offsetof(winreg::ColumnarGroupHeader, valueCount),
+			&huge, sizeof(huge));
+		std::ofstream(corruptName, std::ios::binary).write(bytes.data(), bytes.size());
+	}
+	bool countsRejected = false;
+	try
+	{
+		winreg::ColumnarReader reader(corruptName);
+	}
+	catch (const std::runtime_error&)
+	{
+		countsRejected = true;
+	}
+	std::filesystem::remove(corruptName);
+	Check(countsRejected, L"corrupt row counts rejected");
+
+	// A truncated file
+	std::filesystem::resize_file(fileName, std::filesystem::file_size(fileName) - 1);
+	bool rejected = false;
+	try
+	{
+		winreg::ColumnarReader reader(fileName);
+	}
+	catch (const std::runtime_error&)
+	{
+		rejected = true;
+	}
+	Check(rejected, L"truncated columnar file rejected");
+
+	// An offline hive, encoded on 1 thread and on 4
+	winreg::HiveBuilder large(L"Large");
+	winreg::RegValue state(L"State", REG_BINARY);
+	state.Binary().assign(1024, 0x3C);
+	winreg::RegValue location(L"InstallLocation", REG_SZ);
+	location.String() = L"C:\\Program Files\\Vendor\\Product";
+	for (int i = 0; i < 100; i++)
+	{
+		for (int j = 0; j < 200; j++)
+		{
+			const wstring path = L"Component" + std::to_wstring(i) + L"\\Instance" + std::to_wstring(j);
+			large.SetValue(path, state);
+			large.SetValue(path, location);
+		}
+	}
+	const vector<uint8_t> largeHive = large.Build();
+	const winreg::HiveView largeView(largeHive.data(), largeHive.size());
+
+	const std::filesystem::path otherFileName = std::filesystem::temp_directory_path() / L"winreg_test_export4.wrc";
+	options = winreg::ColumnarExportOptions();
+	options.rowGroupBytes = 1024 * 1024;
+	options.threads = 1;
+	const winreg::ColumnarExportStats one = winreg::ExportHive(largeView, fileName, options);
+	options.threads = 4;
+	const winreg::ColumnarExportStats four = winreg::ExportHive(largeView, otherFileName, options);
+	Check(one.keys == 1 + 100 + 100 * 200 && one.values == 2 * 100 * 200 && four.keys == one.keys
+		&& four.values == one.values && four.peakRowGroups <= 4 + 1, L"hive exported");
+
+	std::ifstream first(fileName, std::ios::binary);
+	std::ifstream second(otherFileName, std::ios::binary);
+	Check(std::equal(std::istreambuf_iterator<char>(first), std::istreambuf_iterator<char>(),
+		std::istreambuf_iterator<char>(second), std::istreambuf_iterator<char>()), L"same file on 1 thread and 4");
+	first.close();
+	second.close();
+
+	// Reading one column against all of them
+	double seconds[2] = {};
+	size_t values[2] = {};
+	const uint32_t columns[2] = { winreg::AllColumns, winreg::ColumnBit(winreg::ValueTypeColumn) };
+	{
+		winreg::ColumnarReader reader(fileName);
+		winreg::ColumnarRowGroup rows;
+		for (int c = 0; c < 2; c++)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			for (size_t g = 0; g < reader.RowGroupCount(); g++)
+			{
+				reader.ReadRowGroup(g, columns[c], rows);
+				values[c] += rows.types.size();
+			}
+			seconds[c] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	wchar_t what[300];
+	swprintf(what, 300, L"%zu values, %.1f MB of data in %.1f MB: exported in %.1f ms on 1 thread, %.1f ms on 4; "
+		L"read in %.1f ms, types alone in %.2f ms",
+		one.values, one.dataBytes / 1e6, one.fileBytes / 1e6, one.seconds * 1e3, four.seconds * 1e3,
+		seconds[0] * 1e3, seconds[1] * 1e3);
+	Check(values[0] == one.values && values[1] == one.values, what);
+
+	std::filesystem::remove(fileName);
+	std::filesystem::remove(otherFileName);
+	winreg::DeleteTree(HKEY_CURRENT_USER, testKeyName);
+}
+
+/*
+*/
+int main()
+{
+    wcout << "*** Testing WinReg -- by Giovanni Dicanio & DBJDBJ ***\n\n";
+
+    const wstring testKeyName = 
+		L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\FolderDescriptions\\";
+	try {
+		//
+		// Enum Sub Keys
+		//
+		{
+			wcout << L"\nEnumerating sub keys:\n";
+
+			// KEY_READ is default access req. and this is bad to hide
+			auto key = winreg::RegKey::OpenKey(HKEY_LOCAL_MACHINE, testKeyName);
+
+			const vector<wstring> subNames = winreg::EnumerateSubKeyNames(key.Handle());
+
+			for (const auto& subName : subNames)
+			{
+				winreg::RegKey subKey = winreg::RegKey::OpenKey(key.Handle(), subName);
+				wcout << L"For the key:" << subName << L" Values are \n";
+				enum_values(subKey);
+				wcout << "-----------------------------------------------------------------\n";
+			}
+		}
+
+	}
+	catch ( winreg::RegException & rx ) {
+		std::wcerr << L"winreg exception: " <<  rx.ErrorCode() << L" : " <<  rx.ErrorMessage() << std::endl ;
+	}
+	catch (... ) {
+		std::wcerr << L"Unknown exception: " << std::endl;
+	}
+
+	try {
+		const wstring scratchKeyName = L"SOFTWARE\\WinRegTest";
+
+		test_query_multiple_values(scratchKeyName);
+		test_filtered_enumeration(scratchKeyName);
+		test_key_path_query(scratchKeyName);
+		test_value_index(scratchKeyName);
+		test_allocation_free_writes(scratchKeyName);
+		test_large_binary_values(scratchKeyName);
+		test_large_value_store(scratchKeyName);
+		test_environment_expander();
+		test_copy_tree(scratchKeyName);
+		test_delete_tree(scratchKeyName);
+		test_watch_service(scratchKeyName);
+		test_registry_mirror(scratchKeyName);
+		test_trace_replay(scratchKeyName);
+		test_value_probe_filter(scratchKeyName);
+		test_registry_overlay(scratchKeyName);
+		test_utf8_api(scratchKeyName);
+		test_pmr_allocation(scratchKeyName);
+		test_memory_footprint(scratchKeyName);
+		test_hive_verify();
+		test_hive_edit();
+		test_hive_log_recovery();
+		test_hive_scan();
+		test_columnar_export(scratchKeyName);
+#ifndef _WIN32
+		test_enumerate_concurrent_change(scratchKeyName);
+#endif
+	}
+	catch (winreg::RegException & rx) {
+		std::wcerr << L"winreg exception: " << rx.ErrorCode() << L" : " << rx.ErrorMessage() << std::endl;
+		g_failures++;
+	}
+
+	wcout << L"\n" << g_failures << L" check(s) failed.\n";
+	// eof main
+	return (g_failures == 0) ? 0 : 1;
+}
+
+
+void Check(bool condition, const wchar_t* what)
+{
+	wcout << (condition ? L"[ok]   " : L"[FAIL] ") << what << L'\n';
+	if (!condition)
+	{
+		g_failures++;
 	}
-	// eof main
-	return 0;
 }
 
 
 wstring ToHexString(BYTE b)
 {
     wchar_t buf[10];
-    swprintf_s(buf, L"0x%02X", b);
+    swprintf(buf, 10, L"0x%02X", b);
     return wstring(buf);
 }
 
@@ -161,7 +2828,7 @@ wstring ToHexString(BYTE b)
 wstring ToHexString(DWORD dw)
 {
     wchar_t buf[20];
-    swprintf_s(buf, L"0x%08X", dw);
+    swprintf(buf, 20, L"0x%08X", dw);
     return wstring(buf);
 }
 
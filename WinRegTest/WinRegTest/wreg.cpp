@@ -0,0 +1,16 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg.cpp
+// DESC: Compiles the non-template functions of wreg.h, once for the program.
+//       Empty when WINREG_HEADER_ONLY is defined.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "wreg.h"
+
+#ifndef WINREG_HEADER_ONLY
+#include "wreg_internal.h"
+#include "wreg_inl.h"
+#endif
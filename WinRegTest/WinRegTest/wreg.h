@@ -8,7 +8,8 @@
 // by Giovanni Dicanio <giovanni.dicanio@gmail.com>
 //
 // FILE: WinReg.hpp
-// DESC: Module header, containing public interface and  implementations. 
+// DESC: Module header, containing the public interface and the templates.
+//       The other functions are defined in wreg_inl.h (see the notes below).
 //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -28,17 +29,45 @@
 // Indent 4 spaces (more readable than 2)
 // Aligned matching braces for better grouping and readability.
 //
+//
+// Build modes:
+// ------------
+// By default, the non-template functions are compiled once, in wreg.cpp: link
+// with the winreg library target (see CMakeLists.txt), or add wreg.cpp to the
+// project. Defining WINREG_HEADER_ONLY (in every translation unit) makes them
+// inline functions, defined by this header through wreg_inl.h, as before.
+//
 //==============================================================================
+#ifdef _WIN32
 #include <windows.h>    // Windows Platform SDK
 #include <crtdbg.h>     // _ASSERTE()
+#else
+#include "wreg_emu.h"   // In-memory emulation of the Win32 registry API
+#endif
+#include <algorithm>    // std::min, std::max, std::equal, std::all_of
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <cstdint>      // uint8_t
+#include <exception>    // std::uncaught_exceptions()
 #include <stdexcept>    // std::invalid_argument, std::runtime_error
 #include <string>       // std::wstring
-#include <utility>      // std::swap()
+#include <string_view>  // std::wstring_view
+#include <type_traits>  // std::is_same
+#include <utility>      // std::swap(), std::pair
 #include <vector>       // std::vector
+#include <initializer_list> // std::initializer_list
 // C library
-#include <string.h>     // wcslen()
+#include <string.h>     // wcslen(), memcpy(), memset()
+#include <wctype.h>     // towupper()
 // C++ library
 #include <limits>       // numeric_limits
+#include <numeric>      // std::iota
+
+#ifdef WINREG_HEADER_ONLY
+#define WINREG_INLINE inline
+#else
+#define WINREG_INLINE
+#endif
 
 namespace winreg
 {
@@ -94,6 +123,12 @@ namespace winreg
 	//------------------------------------------------------------------------------
 	class RegKey;
 	class RegValue;
+
+	namespace footprint_detail
+	{
+		struct RegValueAccess;  // wreg_footprint.h
+	}
+
 		/*
 	DBJ: this is obviously a template but no time right now ...
 	*/
@@ -260,6 +295,9 @@ namespace winreg
 		/* DBJ added */
 		std::wstring name_;
 
+		// Measures the memory of all the members, whatever the type
+		friend struct footprint_detail::RegValueAccess;
+
 		// Clear all the data members representing various values (m_dword, m_string, etc.)
 		void ResetValues()
 		{
@@ -275,674 +313,1022 @@ namespace winreg
 
 	};
 
-//------------------------------------------------------------------------------
-//                      Anonumous namespace Private Helper Functions
-//------------------------------------------------------------------------------
-	namespace {
+	//------------------------------------------------------------------------------
+	// Outcome of reading one value in a batch (see QueryMultipleValues()).
+	//
+	// When status is ERROR_SUCCESS, value holds the data read from the registry;
+	// otherwise value is empty (REG_NONE) and status is the Win32 error code for
+	// that name, e.g. ERROR_FILE_NOT_FOUND or ERROR_UNSUPPORTED_TYPE.
+	//------------------------------------------------------------------------------
+	struct RegValueResult
+	{
+		LONG status;
+		RegValue value;
+	};
 
+	//------------------------------------------------------------------------------
+	// Filters for the enumeration functions.
+	//
+	// Value types are selected with a bit mask, e.g.:
+	//
+	//     ValueTypeMask(REG_SZ) | ValueTypeMask(REG_EXPAND_SZ)
+	//
+	// Names are selected with a predicate called as bool(std::wstring_view name),
+	// on the buffer filled by the Win32 API: names that don't match are never copied
+	// into a std::wstring. Any callable will do; NamePrefix and NameGlob are provided.
+	//
+	// Like the registry, the provided matchers ignore case.
+	//------------------------------------------------------------------------------
+	constexpr DWORD ValueTypeMask(DWORD typeId) noexcept
+	{
+		return (typeId < 32) ? (DWORD(1) << typeId) : 0;
+	}
+
+	constexpr DWORD AllValueTypes = 0xFFFFFFFF;
 
-		// MSVC emits a warning in 64-bit builds when assigning size_t to DWORD.
-		// So, only in 64-bit builds, check proper size limits before conversion
-		// and throw std::overflow_error if the size_t value is too big.
-		DWORD SafeSizeToDwordCast(size_t size)
-		{
-#ifdef _WIN64
-			if (size > static_cast<size_t>((std::numeric_limits<DWORD>::max)()))
-			{
-				throw std::overflow_error(
-					"SafeSizeToDwordCast(): Input size_t too long, it doesn't fit in a DWORD.");
-			}
 
-			// This cast is now safe
-			return static_cast<DWORD>(size);
+	//
+	// Upper-cases a name character the way the registry compares names: on Windows,
+	// with the invariant uppercase mapping, for all of Unicode (towupper() only maps
+	// ASCII in the default "C" locale); elsewhere, like the emulation, with towupper().
+	// Hashes of names that must match case-insensitively are computed on these.
+	//
+	inline wchar_t FoldNameChar(wchar_t ch) noexcept
+	{
+		if (ch < 0x80)
+		{
+			return (ch >= L'a' && ch <= L'z') ? static_cast<wchar_t>(ch - L'a' + L'A') : ch;
+		}
+#ifdef _WIN32
+		wchar_t upper = ch;
+		return (::LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, &ch, 1, &upper, 1,
+			nullptr, nullptr, 0) == 1) ? upper : ch;
 #else
-			// Just fine in 32-bit builds
-			return size;
+		return static_cast<wchar_t>(::towupper(ch));
 #endif
-		}
+	}
 
-		//
-		// Helpers called by QueryValue() to read actual data from the registry.
-		//
-		// NOTE: The "valueSize" parameter contains the size of the value to be read in *BYTES*.
-		// This is important for example to helper functions reading strings (REG_SZ, etc.), 
-		// as usually std::wstring methods consider sizes in wchar_ts.
-		//
 
-		// Reads a REG_DWORD value.
-		winreg::RegValue ReadValueDwordInternal(HKEY hKey, const std::wstring& valueName)
-		{
-			_ASSERTE(hKey != nullptr);
+	inline bool NameCharsEqual(wchar_t a, wchar_t b) noexcept
+	{
+		return (a == b) || (FoldNameChar(a) == FoldNameChar(b));
+	}
 
-			DWORD valueData = 0;
-			DWORD valueSize = sizeof(valueData);
 
-			LONG result = ::RegQueryValueEx(
-				hKey,
-				valueName.c_str(),
-				nullptr, // reserved
-				nullptr, // type not required in this helper: we're called as dispatching by QueryValue()
-				reinterpret_cast<BYTE*>(&valueData),   // where data will be read
-				&valueSize
-			);
-			_ASSERTE(valueSize == sizeof(DWORD)); // we read a DWORD
+	// Matches all names
+	struct AnyName
+	{
+		bool operator()(std::wstring_view) const noexcept { return true; }
+	};
 
-			if (result != ERROR_SUCCESS)
-			{
-				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_DWORD value.", result);
-			}
 
-			winreg::RegValue value(valueName, REG_DWORD);
-			value.Dword() = valueData;
-			return value;
-		}
+	// Matches names starting with a given prefix
+	class NamePrefix
+	{
+	public:
 
+		explicit NamePrefix(std::wstring prefix)
+			: m_prefix(std::move(prefix))
+		{}
 
-		// Reads a REG_SZ value.
-		winreg::RegValue ReadValueStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+
+		bool operator()(std::wstring_view name) const noexcept
 		{
-			_ASSERTE(hKey != nullptr);
+			return name.size() >= m_prefix.size()
+				&& std::equal(m_prefix.begin(), m_prefix.end(), name.begin(), NameCharsEqual);
+		}
 
-			// valueSize is in bytes, we need string length in wchar_ts
-			const DWORD stringBufferLenInWchars = valueSize / sizeof(wchar_t);
+	private:
+		std::wstring m_prefix;
+	};
 
-			// Make room for result string
-			std::wstring str;
-			str.resize(stringBufferLenInWchars);
 
-			DWORD sizeInBytes = valueSize;
+	//
+	// Matches names against a glob pattern, compiled once at construction:
+	//
+	//  *       any run of characters (including none)
+	//  ?       any single character
+	//  [abc]   one of the listed characters; ranges like [a-z] are allowed
+	//  [!abc]  any character but the listed ones
+	//
+	// Other characters match themselves. std::invalid_argument is thrown for an
+	// unterminated character class.
+	//
+	class NameGlob
+	{
+	public:
 
-			LONG result = ::RegQueryValueEx(
-				hKey,
-				valueName.c_str(),
-				nullptr, // reserved
-				nullptr, // not interested in type (we know it's REG_SZ)
-				reinterpret_cast<BYTE*>(&str[0]),   // where data will be read
-				&sizeInBytes
-			);
-			if (result != ERROR_SUCCESS)
+		explicit NameGlob(const std::wstring& pattern)
+		{
+			for (size_t i = 0; i < pattern.size(); i++)
 			{
-				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_SZ value.", result);
-			}
+				Token token;
+				switch (pattern[i])
+				{
+				case L'*':
+					// Consecutive stars are the same as one
+					if (!m_tokens.empty() && m_tokens.back().kind == Token::AnyRun)
+					{
+						continue;
+					}
+					token.kind = Token::AnyRun;
+					break;
+
+				case L'?':
+					token.kind = Token::AnyChar;
+					break;
+
+				case L'[':
+				{
+					token.kind = Token::Class;
+					size_t j = i + 1;
+					if (j < pattern.size() && pattern[j] == L'!')
+					{
+						token.negated = true;
+						j++;
+					}
+
+					// A ']' right after '[' or '[!' is a member of the class
+					bool first = true;
+					for (; j < pattern.size() && (first || pattern[j] != L']'); j++, first = false)
+					{
+						wchar_t low = pattern[j];
+						wchar_t high = low;
+						if (j + 2 < pattern.size() && pattern[j + 1] == L'-' && pattern[j + 2] != L']')
+						{
+							high = pattern[j + 2];
+							j += 2;
+						}
+						token.ranges.push_back(std::make_pair(
+							FoldNameChar(low), FoldNameChar(high)));
+					}
+					if (j >= pattern.size())
+					{
+						throw std::invalid_argument("NameGlob: unterminated character class.");
+					}
+					i = j;
+				}
+				break;
 
-			//
-			// In the remarks section of RegQueryValueEx()
-			//
-			// https://msdn.microsoft.com/en-us/library/windows/desktop/ms724911(v=vs.85).aspx
-			//
-			// they specify that we should check if the string is NUL-terminated, and if it isn't,
-			// we must add a NUL-terminator.
-			//
-			if (str[stringBufferLenInWchars - 1] == L'\0')
-			{
-				// Strip off the NUL-terminator written by the API
-				str.resize(stringBufferLenInWchars - 1);
+				default:
+					token.kind = Token::Literal;
+					token.ch = pattern[i];
+					break;
+				}
+				m_tokens.push_back(std::move(token));
 			}
-			// The API didn't write a NUL terminator, at the end of the string, which is just fine,
-			// as wstrings are automatically NUL-terminated.
-
-			winreg::RegValue value(valueName,REG_SZ);
-			value.String() = str;
-			return value;
 		}
 
 
-		// Reads a REG_EXPAND_SZ value.
-		winreg::RegValue ReadValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		bool operator()(std::wstring_view name) const
 		{
-			// Almost copy-and-paste from ReadValueStringInternal()
-			_ASSERTE(hKey != nullptr);
-
-			// valueSize is in bytes, we need string length in wchar_ts
-			const DWORD stringBufferLenInWchars = valueSize / sizeof(wchar_t);
+			// Greedy matching, backtracking to the last '*' on mismatch
+			size_t t = 0;
+			size_t n = 0;
+			size_t starToken = std::wstring::npos;
+			size_t starName = 0;
 
-			// Make room for result string
-			std::wstring str;
-			str.resize(stringBufferLenInWchars);
-			DWORD sizeInBytes = valueSize;
-
-			LONG result = ::RegQueryValueEx(
-				hKey,
-				valueName.c_str(),
-				nullptr, // reserved
-				nullptr, // not interested in type (we know it's REG_EXPAND_SZ)
-				reinterpret_cast<BYTE*>(&str[0]),   // where data will be read
-				&sizeInBytes
-			);
-			if (result != ERROR_SUCCESS)
+			while (n < name.size())
 			{
-				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_EXPAND_SZ value.",
-					result);
+				if (t < m_tokens.size() && m_tokens[t].kind == Token::AnyRun)
+				{
+					starToken = t++;
+					starName = n;
+				}
+				else if (t < m_tokens.size() && m_tokens[t].Matches(name[n]))
+				{
+					t++;
+					n++;
+				}
+				else if (starToken != std::wstring::npos)
+				{
+					t = starToken + 1;
+					n = ++starName;
+				}
+				else
+				{
+					return false;
+				}
 			}
 
-			//
-			// In the remarks section of RegQueryValueEx()
-			//
-			// https://msdn.microsoft.com/en-us/library/windows/desktop/ms724911(v=vs.85).aspx
-			//
-			// they specify that we should check if the string is NUL-terminated, and if it isn't,
-			// we must add a NUL-terminator.
-			//
-			if (str[stringBufferLenInWchars - 1] == L'\0')
+			// Only trailing stars can match the empty rest of the name
+			while (t < m_tokens.size() && m_tokens[t].kind == Token::AnyRun)
 			{
-				// Strip off the NUL-terminator written by the API
-				str.resize(stringBufferLenInWchars - 1);
+				t++;
 			}
-			// The API didn't write a NUL terminator, at the end of the string, which is just fine,
-			// as wstrings are automatically NUL-terminated.
+			return t == m_tokens.size();
+		}
 
-			winreg::RegValue value(valueName, REG_EXPAND_SZ);
-			value.ExpandString() = str;
-			return value;
+
+		// True if the pattern is a plain name, without any wildcard
+		bool IsLiteral() const noexcept
+		{
+			return std::all_of(m_tokens.begin(), m_tokens.end(),
+				[](const Token& token) { return token.kind == Token::Literal; });
 		}
 
+	private:
 
-		// Reads a REG_BINARY value.
-		winreg::RegValue ReadValueBinaryInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		struct Token
 		{
-			_ASSERTE(hKey != nullptr);
+			enum Kind { Literal, AnyChar, AnyRun, Class };
 
-			// Data to be read from the registry
-			std::vector<BYTE> binaryData(valueSize);
-			DWORD sizeInBytes = valueSize;
+			Kind kind = Literal;
+			wchar_t ch = L'\0';
+			bool negated = false;
+			std::vector<std::pair<wchar_t, wchar_t>> ranges;   // upper-cased, inclusive
 
-			LONG result = ::RegQueryValueEx(
-				hKey,
-				valueName.c_str(),
-				nullptr, // reserved
-				nullptr, // not interested in type (we know it's REG_BINARY)
-				binaryData.data(),   // where data will be read
-				&sizeInBytes
-			);
-			if (result != ERROR_SUCCESS)
+			bool Matches(wchar_t c) const
 			{
-				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_BINARY value.", result);
+				switch (kind)
+				{
+				case Literal: return NameCharsEqual(ch, c);
+				case AnyChar: return true;
+				case Class:
+				{
+					const wchar_t upper = FoldNameChar(c);
+					bool found = false;
+					for (const auto& range : ranges)
+					{
+						if (upper >= range.first && upper <= range.second)
+						{
+							found = true;
+							break;
+						}
+					}
+					return found != negated;
+				}
+				default: return false;
+				}
 			}
+		};
 
-			winreg::RegValue value(valueName,REG_BINARY);
-			value.Binary() = binaryData;
-			return value;
-		}
+		std::vector<Token> m_tokens;
+	};
 
+	//------------------------------------------------------------------------------
+	// Tracing of the registry calls made through the wrappers below (see wreg_trace.h
+	// for a recorder and a replay tool).
+	//
+	// Tracing is off until a TraceSink is installed with SetTraceSink(): then the
+	// traced wrappers (opening, creating and closing keys, reading, writing and
+	// deleting values, enumerations, deleting keys) report a TraceEvent each, when
+	// they return or throw. When off, the cost is one atomic load per call.
+	//------------------------------------------------------------------------------
+	enum class TraceOp : uint8_t
+	{
+		OpenKey = 1,
+		CreateKey,
+		CloseKey,
+		QueryValue,
+		SetValue,
+		EnumerateSubKeys,
+		EnumerateValueNames,
+		EnumerateValues,
+		DeleteValue,
+		DeleteKey,
+	};
 
-		// Reads a REG_MULTI_SZ value.
-		winreg::RegValue ReadValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
-		{
-			_ASSERTE(hKey != nullptr);
 
-			// Multi-string parsed into a vector of strings
-			std::vector<std::wstring> multiStrings;
+	struct TraceEvent
+	{
+		TraceOp op;
+		HKEY hKey;                  // the key the call was made on
+		std::wstring_view name;     // sub-key or value name; empty for enumerations and CloseKey
+		HKEY result;                // the key opened or created, or nullptr
+		DWORD type;                 // value type; access rights (or view) for keys
+		size_t size;                // data size in bytes, or number of items enumerated
+		LONG status;                // ERROR_GEN_FAILURE for failures other than Win32 errors
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::duration duration;
+	};
 
-			// Buffer containing the multi-string
-			std::vector<wchar_t> buffer(valueSize);
 
-			DWORD sizeInBytes = valueSize;
-			LONG result = ::RegQueryValueEx(
-				hKey,
-				valueName.c_str(),
-				nullptr, // reserved
-				nullptr, // not interested in type (we know it's REG_MULTI_SZ)
-				reinterpret_cast<BYTE*>(buffer.data()),   // where data will be read
-				&sizeInBytes
-			);
-			if (result != ERROR_SUCCESS)
+	class TraceSink
+	{
+	public:
+		virtual ~TraceSink() = default;
+
+		// Called on the thread making the call, possibly on several threads at once
+		virtual void Record(const TraceEvent& event) noexcept = 0;
+	};
+
+
+	namespace trace_detail
+	{
+		inline std::atomic<TraceSink*>& ActiveSink() noexcept
+		{
+			static std::atomic<TraceSink*> sink{ nullptr };
+			return sink;
+		}
+
+
+		// Reports a wrapper call to the active sink, if any, when it goes out of scope
+		class Scope
+		{
+		public:
+			Scope(TraceOp op, HKEY hKey, std::wstring_view name = std::wstring_view()) noexcept
+				: m_sink(ActiveSink().load(std::memory_order_acquire))
 			{
-				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_MULTI_SZ value.",
-					result);
+				if (m_sink != nullptr)
+				{
+					m_event = TraceEvent{ op, hKey, name, nullptr, REG_NONE, 0, ERROR_SUCCESS,
+						std::chrono::steady_clock::now(), {} };
+					m_exceptions = std::uncaught_exceptions();
+				}
 			}
 
-			// Scan the read multi-string buffer, and parse the single various strings,
-			// adding them to the result vector<wstring>.
-			const wchar_t* pszz = buffer.data();
-			while (*pszz != L'\0')
+			~Scope()
 			{
-				// Get current string length
-				const size_t len = wcslen(pszz);
+				if (m_sink != nullptr)
+				{
+					m_event.duration = std::chrono::steady_clock::now() - m_event.start;
+					if (m_event.status == ERROR_SUCCESS && std::uncaught_exceptions() > m_exceptions)
+					{
+						m_event.status = ERROR_GEN_FAILURE;
+					}
+					m_sink->Record(m_event);
+				}
+			}
 
-				// Add this string to the resulting vector
-				multiStrings.push_back(std::wstring(pszz, len));
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
 
-				// Point to next string (or end: \0)
-				pszz += len + 1;
-			}
+			void Status(LONG status) noexcept { m_event.status = status; }
+			void Result(HKEY hKey) noexcept { m_event.result = hKey; }
+			void Data(DWORD type, size_t size) noexcept { m_event.type = type; m_event.size = size; }
+
+		private:
+			TraceSink* m_sink;
+			TraceEvent m_event = {};
+			int m_exceptions = 0;
+		};
+
+	} // namespace trace_detail
+
+
+	// Installs a sink (or removes it, passing nullptr), returning the previous one.
+	// The sink must stay alive until no traced call started before its removal runs.
+	inline TraceSink* SetTraceSink(TraceSink* sink) noexcept
+	{
+		return trace_detail::ActiveSink().exchange(sink, std::memory_order_acq_rel);
+	}
+
+
+//------------------------------------------------------------------------------
+//                      Non-Member Functions and Private Helpers
+//------------------------------------------------------------------------------
+
+
+	namespace detail
+	{
+		// MSVC emits a warning in 64-bit builds when assigning size_t to DWORD.
+		// So, only in 64-bit builds, check proper size limits before conversion
+		// and throw std::overflow_error if the size_t value is too big.
+		DWORD SafeSizeToDwordCast(size_t size);
+
+
+		bool IsSupportedValueType(DWORD typeId);
 
-			winreg::RegValue value(valueName,REG_MULTI_SZ);
-			value.MultiString() = multiStrings;
-			return value;
-		}
+
+		// Builds a RegValue from raw registry data, as laid out by the Win32 API
+		// (e.g. in the buffer filled by RegQueryMultipleValues()).
+		// The data doesn't need to be aligned for wchar_t, nor to be NUL-terminated.
+		winreg::RegValue MakeRegValue(const std::wstring& valueName, DWORD typeId,
+			const BYTE* data, DWORD dataSize);
 
 
 
 		//
-		// Helpers for SetValue()
+		// Per-thread scratch buffers, reused by the write functions to lay out value data
+		// and NUL-terminate value names: once they have grown to the size of the largest
+		// value written by the thread, writing values doesn't allocate memory any more.
 		//
 
-		void WriteValueBinaryInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
-		{
-			_ASSERTE(hKey != nullptr);
-			_ASSERTE(value.GetType() == REG_BINARY);
+		std::vector<BYTE>& WriteDataScratch();
 
-			const std::vector<BYTE> & data = value.Binary();
-			const DWORD dataSize = SafeSizeToDwordCast(data.size());
-			LONG result = ::RegSetValueEx(
-				hKey,
-				valueName.c_str(),
-				0, // reserved
-				REG_BINARY,
-				&data[0],
-				dataSize);
-			if (result != ERROR_SUCCESS)
+
+		// Returns a NUL-terminated copy of the name, valid until the next call on this thread
+		const wchar_t* TerminatedValueName(std::wstring_view valueName);
+
+
+		// Lays out a double-NUL-terminated multi-string in the data scratch buffer.
+		// The range elements must be convertible to std::wstring_view.
+		template <typename StringRange>
+		const std::vector<BYTE>& LayoutMultiString(const StringRange& strings)
+		{
+			// Get total buffer size, in wchar_ts: +1 for each string's terminating NUL,
+			// and another terminating NUL (double-NUL-termination)
+			size_t totalLen = 1;
+			for (const auto& s : strings)
 			{
-				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_BINARY value.", result);
+				totalLen += std::wstring_view(s).size() + 1;
 			}
-		}
 
+			// An empty multi-string is just two NULs
+			if (totalLen == 1)
+			{
+				totalLen = 2;
+			}
 
-		void WriteValueDwordInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
-		{
-			_ASSERTE(hKey != nullptr);
-			_ASSERTE(value.GetType() == REG_DWORD);
+			std::vector<BYTE>& buffer = WriteDataScratch();
+			buffer.resize(totalLen * sizeof(wchar_t));
 
-			const DWORD data = value.Dword();
-			const DWORD dataSize = sizeof(data);
-			LONG result = ::RegSetValueEx(
-				hKey,
-				valueName.c_str(),
-				0, // reserved
-				REG_DWORD,
-				reinterpret_cast<const BYTE*>(&data),
-				dataSize);
-			if (result != ERROR_SUCCESS)
+			// Copy the single strings in the buffer, each followed by its NUL
+			BYTE* dest = buffer.data();
+			const wchar_t nul = L'\0';
+			for (const auto& s : strings)
 			{
-				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_DWORD value.", result);
+				const std::wstring_view view(s);
+				if (!view.empty())
+				{
+					memcpy(dest, view.data(), view.size() * sizeof(wchar_t));
+				}
+				dest += view.size() * sizeof(wchar_t);
+				memcpy(dest, &nul, sizeof(nul));
+				dest += sizeof(nul);
 			}
+
+			// Fill the rest (final NUL, or the two NULs of an empty multi-string)
+			memset(dest, 0, buffer.data() + buffer.size() - dest);
+			return buffer;
 		}
 
 
-		void WriteValueStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
-		{
-			_ASSERTE(hKey != nullptr);
-			_ASSERTE(value.GetType() == REG_SZ);
+		void WriteRawValueInternal(HKEY hKey, std::wstring_view valueName, DWORD type,
+			const BYTE* data, size_t dataSize, const wchar_t* errorMessage);
 
-			const std::wstring& str = value.String();
 
-			// According to MSDN doc, this size must include the terminating NUL
-			// Note that size is in *BYTES*, so we must scale by wchar_t.
-			const DWORD dataSize = SafeSizeToDwordCast((str.size() + 1) * sizeof(wchar_t));
+		void SetValueInternal(HKEY hKey, const std::wstring& valueName, const RegValue& value);
 
-			LONG result = ::RegSetValueEx(
-				hKey,
-				valueName.c_str(),
-				0, // reserved
-				REG_SZ,
-				reinterpret_cast<const BYTE*>(str.c_str()),
-				dataSize);
-			if (result != ERROR_SUCCESS)
-			{
-				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_SZ value.", result);
-			}
-		}
+	} // namespace detail
 
 
-		void WriteValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
-		{
-			_ASSERTE(hKey != nullptr);
-			_ASSERTE(value.GetType() == REG_EXPAND_SZ);
+	// Longest names allowed by the registry, in wchar_ts (see "Registry Element Size Limits")
+	const DWORD MaxKeyNameLength = 255;
+	const DWORD MaxValueNameLength = 16383;
 
-			const std::wstring & str = value.ExpandString();
 
-			// According to MSDN doc, this size must include the terminating NUL.
-			// Note that size is in *BYTES*, so we must scale by wchar_t.
-			const DWORD dataSize = SafeSizeToDwordCast((str.size() + 1) * sizeof(wchar_t));
+	//
+	// The enumeration functions tolerate keys concurrently modified by other threads or
+	// processes. Instead of trusting the counts and lengths returned by RegQueryInfoKey(),
+	// which can be stale by the time the names are read:
+	//
+	//  - a name longer than expected makes the name buffer grow, and the same index is read again
+	//  - ERROR_NO_MORE_ITEMS ends the enumeration, even if fewer items than expected were found
+	//  - items added meanwhile are picked up as well
+	//
+	// If any of this happened, concurrentChange is set to true: the result is still a valid
+	// list of names, but a name may have been missed or may no longer exist. Callers that need
+	// an exact snapshot can enumerate again.
+	//
 
-			LONG result = ::RegSetValueEx(
-				hKey,
-				valueName.c_str(),
-				0, // reserved
-				REG_EXPAND_SZ,
-				reinterpret_cast<const BYTE*>(str.c_str()),
-				dataSize);
-			if (result != ERROR_SUCCESS)
-			{
-				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_EXPAND_SZ value.", result);
-			}
-		}
+	std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey, bool& concurrentChange);
 
 
-		void WriteValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
-		{
-			_ASSERTE(hKey != nullptr);
-			_ASSERTE(value.GetType() == REG_MULTI_SZ);
+	std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey);
 
-			const std::vector<std::wstring> & multiString = value.MultiString();
 
-			// We need to build a whole array containing the multi-strings, with double-NUL termination
-			std::vector<wchar_t> buffer;
 
-			// Get total buffer size, in wchar_ts
-			size_t totalLen = 0;
-			for (const std::wstring& s : multiString)
-			{
-				// +1 to include the terminating NUL for current string
-				totalLen += (s.size() + 1);
-			}
-			// Consider another terminating NUL (double-NUL-termination)
-			totalLen++;
+	std::vector<std::wstring> EnumerateValueNames(HKEY hKey, bool& concurrentChange);
 
-			// Optimization: reserve room in the multi-string buffer
-			buffer.resize(totalLen);
 
-			// Deep copy the single strings in the buffer
-			if (!multiString.empty())
-			{
-				wchar_t* dest = &buffer[0];
-				for (const std::wstring& s : multiString)
-				{
-					// Copy the whole string to destination buffer, including the terminating NUL
-					wmemcpy(dest, s.c_str(), s.size() + 1);
+	std::vector<std::wstring> EnumerateValueNames(HKEY hKey);
 
-					// Skip to the next string slot
-					dest += s.size() + 1;
-				}
 
-				// Add another NUL terminator
-				*dest = L'\0';
-			}
-			else
-			{
-				// Just write two NULs in the buffer
-				buffer.resize(2);
-				buffer[0] = L'\0';
-				buffer[1] = L'\0';
-			}
+	//
+	// Filtered enumerations.
+	//
+	// The type mask and the name predicate are applied to what RegEnumKeyEx() and
+	// RegEnumValue() return, while enumerating: names (and data) of the items that are
+	// filtered out are never copied into std::wstring or RegValue objects.
+	//
+	// Like the unfiltered versions, these tolerate concurrent changes of the key.
+	//
 
-			// Size is in *BYTES*
-			const DWORD dataSize = SafeSizeToDwordCast(buffer.size() * sizeof(wchar_t));
+	template <typename NamePredicate>
+	std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey, NamePredicate matches)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::EnumerateSubKeys, hKey);
+
+		DWORD maxSubkeyNameLength = 0;
+		LONG result = ::RegQueryInfoKey(
+			hKey,
+			nullptr, nullptr,
+			nullptr,
+			nullptr, &maxSubkeyNameLength,
+			nullptr, nullptr, nullptr,
+			nullptr, nullptr, nullptr);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryInfoKey() failed while trying to get sub-keys info.", result);
+		}
+
+		std::vector<std::wstring> subkeyNames;
+		std::vector<wchar_t> subkeyNameBuffer(maxSubkeyNameLength + 1); // +1 for terminating NUL
 
-			LONG result = ::RegSetValueEx(
+		for (DWORD subkeyIndex = 0; ; )
+		{
+			DWORD subkeyNameLength = detail::SafeSizeToDwordCast(subkeyNameBuffer.size()); // including NUL
+
+			result = ::RegEnumKeyEx(
 				hKey,
-				valueName.c_str(),
-				0, // reserved
-				REG_MULTI_SZ,
-				reinterpret_cast<const BYTE*>(buffer.data()),
-				dataSize);
+				subkeyIndex,
+				&subkeyNameBuffer[0],
+				&subkeyNameLength,
+				nullptr, nullptr, nullptr, nullptr);
+			if (result == ERROR_NO_MORE_ITEMS)
+			{
+				break;
+			}
+			if ((result == ERROR_MORE_DATA) && (subkeyNameBuffer.size() <= MaxKeyNameLength))
+			{
+				subkeyNameBuffer.resize(MaxKeyNameLength + 1);
+				continue;
+			}
 			if (result != ERROR_SUCCESS)
 			{
-				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_MULTI_SZ value.", result);
+				throw RegException(L"RegEnumKeyEx() failed trying to get sub-key name.", result);
+			}
+
+			const std::wstring_view name(subkeyNameBuffer.data(), subkeyNameLength);
+			if (matches(name))
+			{
+				subkeyNames.push_back(std::wstring(name));
 			}
+			subkeyIndex++;
 		}
 
+		trace.Data(REG_NONE, subkeyNames.size());
+		return subkeyNames;
+	}
 
-		/* was here } // namespace */
 
+	template <typename NamePredicate>
+	std::vector<std::wstring> EnumerateValueNames(HKEY hKey, DWORD typeMask, NamePredicate matches)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::EnumerateValueNames, hKey);
+
+		DWORD maxValueNameLength = 0;
+		LONG result = ::RegQueryInfoKey(
+			hKey,
+			nullptr, nullptr,
+			nullptr,
+			nullptr, nullptr,
+			nullptr,
+			nullptr, &maxValueNameLength,
+			nullptr, nullptr, nullptr);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryInfoKey() failed while trying to get value info.", result);
+		}
 
-		std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey)
+		std::vector<std::wstring> valueNames;
+		std::vector<wchar_t> valueNameBuffer(maxValueNameLength + 1); // +1 for including NUL
+
+		for (DWORD valueIndex = 0; ; )
 		{
-			_ASSERTE(hKey != nullptr);
+			DWORD valueNameLength = detail::SafeSizeToDwordCast(valueNameBuffer.size()); // including NUL
+			DWORD valueType = REG_NONE;
 
-			// Get sub-keys count and max sub-key name length
-			DWORD subkeyCount = 0;
-			DWORD maxSubkeyNameLength = 0;
-			LONG result = ::RegQueryInfoKey(
+			// The type comes for free with the name: no need to read the data
+			result = ::RegEnumValue(
 				hKey,
-				nullptr, nullptr,           // not interested in user-defined class of the key 
-				nullptr,                    // reserved
-				&subkeyCount,               // how many sub-keys here? 
-				&maxSubkeyNameLength,       // useful to preallocate a buffer for all keys
-				nullptr, nullptr, nullptr,  // not interested in all this stuff
-				nullptr, nullptr, nullptr   // (see MSDN doc)
+				valueIndex,
+				&valueNameBuffer[0],
+				&valueNameLength,
+				nullptr,    // reserved
+				&valueType,
+				nullptr,    // not interested in data
+				nullptr     // not interested in data size
 			);
+			if (result == ERROR_NO_MORE_ITEMS)
+			{
+				break;
+			}
+			if ((result == ERROR_MORE_DATA) && (valueNameBuffer.size() <= MaxValueNameLength))
+			{
+				valueNameBuffer.resize((std::min)(valueNameBuffer.size() * 2,
+					static_cast<size_t>(MaxValueNameLength) + 1));
+				continue;
+			}
 			if (result != ERROR_SUCCESS)
 			{
-				throw RegException(L"RegQueryInfoKey() failed while trying to get sub-keys info.", result);
+				throw RegException(L"RegEnumValue() failed to get value name.", result);
 			}
 
-			// Result of the function
-			std::vector<std::wstring> subkeyNames;
-
-			// Temporary buffer to read sub-key names into
-			std::vector<wchar_t> subkeyNameBuffer(maxSubkeyNameLength + 1); // +1 for terminating NUL
-
-																			// For each sub-key:
-			for (DWORD subkeyIndex = 0; subkeyIndex < subkeyCount; subkeyIndex++)
+			const std::wstring_view name(valueNameBuffer.data(), valueNameLength);
+			if ((typeMask & ValueTypeMask(valueType)) != 0 && matches(name))
 			{
-				DWORD subkeyNameLength = SafeSizeToDwordCast(subkeyNameBuffer.size()); // including NUL
-
-				result = ::RegEnumKeyEx(
-					hKey,
-					subkeyIndex,
-					&subkeyNameBuffer[0],
-					&subkeyNameLength,
-					nullptr, nullptr, nullptr, nullptr);
-				if (result != ERROR_SUCCESS)
-				{
-					throw RegException(L"RegEnumKeyEx() failed trying to get sub-key name.", result);
-				}
-
-				// When the RegEnumKeyEx() function returns, subkeyNameBufferSize
-				// contains the number of characters read, *NOT* including the terminating NUL
-				subkeyNames.push_back(std::wstring(subkeyNameBuffer.data(), subkeyNameLength));
+				valueNames.push_back(std::wstring(name));
 			}
-
-			return subkeyNames;
+			valueIndex++;
 		}
 
+		trace.Data(REG_NONE, valueNames.size());
+		return valueNames;
+	}
 
 
-		std::vector<std::wstring> EnumerateValueNames(HKEY hKey)
+	namespace detail
+	{
+		// Takes all the values, in ForEachRawValue()
+		struct AnyRawValue
+		{
+			bool operator()(std::wstring_view, DWORD) const noexcept { return true; }
+		};
+
+
+		//
+		// Calls onValue(std::wstring_view name, DWORD type, const BYTE* data, DWORD dataSize)
+		// for each value of a key, of any type, with one RegEnumValue() call per value.
+		// The name and data buffers are reused: they are only valid during the call.
+		//
+		// With a wanted(std::wstring_view name, DWORD type) predicate, each value is first
+		// enumerated without its data, and the data is read (a second call) only for the
+		// values wanted: filtering out large values doesn't copy them.
+		//
+		template <typename OnValue, typename Wanted = AnyRawValue>
+		void ForEachRawValue(HKEY hKey, OnValue onValue, Wanted wanted = Wanted())
 		{
 			_ASSERTE(hKey != nullptr);
 
-			// Get values count and max value name length
-			DWORD valueCount = 0;
+			trace_detail::Scope trace(TraceOp::EnumerateValues, hKey);
+
 			DWORD maxValueNameLength = 0;
+			DWORD maxValueDataSize = 0;
 			LONG result = ::RegQueryInfoKey(
 				hKey,
 				nullptr, nullptr,
 				nullptr,
 				nullptr, nullptr,
 				nullptr,
-				&valueCount, &maxValueNameLength,
-				nullptr, nullptr, nullptr);
+				nullptr, &maxValueNameLength,
+				&maxValueDataSize,
+				nullptr, nullptr);
 			if (result != ERROR_SUCCESS)
 			{
 				throw RegException(L"RegQueryInfoKey() failed while trying to get value info.", result);
 			}
 
-			std::vector<std::wstring> valueNames;
-
-			// Temporary buffer to read value names into
+			// Buffers reused for all the values; filtering, the data buffer grows to the
+			// largest value wanted only
 			std::vector<wchar_t> valueNameBuffer(maxValueNameLength + 1); // +1 for including NUL
+			std::vector<BYTE> dataBuffer(std::is_same<Wanted, AnyRawValue>::value
+				? (std::max)(maxValueDataSize, DWORD(1)) : DWORD(1));
 
-																		  // For each value in this key:
-			for (DWORD valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			for (DWORD valueIndex = 0; ; )
 			{
 				DWORD valueNameLength = SafeSizeToDwordCast(valueNameBuffer.size()); // including NUL
+				DWORD valueType = REG_NONE;
+
+				if constexpr (!std::is_same<Wanted, AnyRawValue>::value)
+				{
+					// Name and type only
+					result = ::RegEnumValue(
+						hKey,
+						valueIndex,
+						&valueNameBuffer[0],
+						&valueNameLength,
+						nullptr,    // reserved
+						&valueType,
+						nullptr,
+						nullptr
+					);
+					if (result == ERROR_NO_MORE_ITEMS)
+					{
+						trace.Data(REG_NONE, valueIndex);
+						break;
+					}
+					if (result == ERROR_MORE_DATA && valueNameBuffer.size() <= MaxValueNameLength)
+					{
+						valueNameBuffer.resize((std::min)(valueNameBuffer.size() * 2,
+							static_cast<size_t>(MaxValueNameLength) + 1));
+						continue;
+					}
+					if (result != ERROR_SUCCESS)
+					{
+						throw RegException(L"RegEnumValue() failed to get value.", result);
+					}
+					if (!wanted(std::wstring_view(valueNameBuffer.data(), valueNameLength), valueType))
+					{
+						valueIndex++;
+						continue;
+					}
+					valueNameLength = SafeSizeToDwordCast(valueNameBuffer.size());
+				}
 
-																					 // We are just interested in the value's name
+				DWORD dataSize = SafeSizeToDwordCast(dataBuffer.size());
 				result = ::RegEnumValue(
 					hKey,
 					valueIndex,
 					&valueNameBuffer[0],
 					&valueNameLength,
 					nullptr,    // reserved
-					nullptr,    // not interested in type
-					nullptr,    // not interested in data
-					nullptr     // not interested in data size
+					&valueType,
+					dataBuffer.data(),
+					&dataSize
 				);
+				if (result == ERROR_NO_MORE_ITEMS)
+				{
+					trace.Data(REG_NONE, valueIndex);
+					break;
+				}
+				if (result == ERROR_MORE_DATA)
+				{
+					// Either the data or the name grew meanwhile
+					if (dataSize > dataBuffer.size())
+					{
+						dataBuffer.resize(dataSize);
+						continue;
+					}
+					if (valueNameBuffer.size() <= MaxValueNameLength)
+					{
+						valueNameBuffer.resize((std::min)(valueNameBuffer.size() * 2,
+							static_cast<size_t>(MaxValueNameLength) + 1));
+						continue;
+					}
+				}
 				if (result != ERROR_SUCCESS)
 				{
-					throw RegException(L"RegEnumValue() failed to get value name.", result);
+					throw RegException(L"RegEnumValue() failed to get value.", result);
 				}
 
-				// When the RegEnumValue() function returns, valueNameLength
-				// contains the number of characters read, not including the terminating NUL
-				valueNames.push_back(std::wstring(valueNameBuffer.data(), valueNameLength));
+				// (Checked again: the value may have changed since the first call)
+				if (wanted(std::wstring_view(valueNameBuffer.data(), valueNameLength), valueType))
+				{
+					onValue(std::wstring_view(valueNameBuffer.data(), valueNameLength), valueType,
+						static_cast<const BYTE*>(dataBuffer.data()), dataSize);
+				}
+				valueIndex++;
 			}
-
-			return valueNames;
 		}
 
+	} // namespace detail
 
-		RegValue QueryValue(HKEY hKey, const std::wstring& valueName)
+
+	//
+	// Reads the values of a key whose type is in typeMask and whose name matches,
+	// with their data: one RegEnumValue() call per value, instead of enumerating the
+	// names first and then calling QueryValue() on each of them.
+	// With a type mask or a name predicate, the values are enumerated without their
+	// data first, and the data read only for the values matching (two calls each).
+	// Values of types not supported by RegValue are skipped.
+	//
+	template <typename NamePredicate = AnyName>
+	std::vector<RegValue> EnumerateValues(HKEY hKey, DWORD typeMask = AllValueTypes,
+		NamePredicate matches = NamePredicate())
+	{
+		std::vector<RegValue> values;
+		auto wanted = [&](std::wstring_view name, DWORD valueType)
 		{
-			_ASSERTE(hKey != nullptr);
+			return (typeMask & ValueTypeMask(valueType)) != 0 && detail::IsSupportedValueType(valueType)
+				&& matches(name);
+		};
+		auto onValue = [&](std::wstring_view name, DWORD valueType, const BYTE* data, DWORD dataSize)
+		{
+			if (wanted(name, valueType))
+			{
+				values.push_back(detail::MakeRegValue(std::wstring(name), valueType, data, dataSize));
+			}
+		};
 
-			DWORD valueType = 0;
+		if (typeMask == AllValueTypes && std::is_same<NamePredicate, AnyName>::value)
+		{
+			detail::ForEachRawValue(hKey, onValue);
+		}
+		else
+		{
+			detail::ForEachRawValue(hKey, onValue, wanted);
+		}
+		return values;
+	}
+
+
+	RegValue QueryValue(HKEY hKey, const std::wstring& valueName);
+
+
+	//
+	// Reading large REG_BINARY values without intermediate copies.
+	//
+	// The registry API returns a value's data only as a whole, so one copy in memory is
+	// the least possible: these functions read the data straight into the caller's buffer,
+	// or into a single buffer that is then handed to a sink in chunks.
+	//
 
-			// According to this MSDN web page:
-			//
-			// "Registry Element Size Limits"
-			//  https://msdn.microsoft.com/en-us/library/windows/desktop/ms724872(v=vs.85).aspx
-			//
-			// "Long values (more than 2,048 bytes) should be stored in a file, 
-			// and the location of the file should be stored in the registry. 
-			// This helps the registry perform efficiently."
-			//
+	// Returns the size, in bytes, of a REG_BINARY value
+	size_t QueryBinaryValueSize(HKEY hKey, std::wstring_view valueName);
 
-			DWORD dataSize = 0;
 
-			// Query the value type and the data size for that value
+	//
+	// Reads a REG_BINARY value into the caller's buffer, and returns the number of bytes read.
+	// If the buffer is too small, throws RegException with ERROR_MORE_DATA:
+	// QueryBinaryValueSize() returns the size needed.
+	//
+	size_t QueryBinaryValue(HKEY hKey, std::wstring_view valueName, BYTE* buffer, size_t bufferSize);
+
+
+	//
+	// Reads a REG_BINARY value into the caller's vector, which is resized to the data size.
+	// The vector's capacity is reused: reading values into the same vector over and over
+	// only allocates when a value is larger than all the previous ones.
+	//
+	template <typename Allocator>
+	void QueryBinaryValue(HKEY hKey, std::wstring_view valueName, std::vector<BYTE, Allocator>& buffer)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		for (;;)
+		{
+			// Check the type and get the size first, so that the caller's buffer is left
+			// untouched if the value isn't REG_BINARY, and is resized only to the data size
+			const size_t dataSize = QueryBinaryValueSize(hKey, valueName);
+			buffer.resize(dataSize);
+			if (dataSize == 0)
+			{
+				return;
+			}
+
+			DWORD valueType = 0;
+			DWORD readSize = static_cast<DWORD>(dataSize);
 			LONG result = ::RegQueryValueEx(
 				hKey,
-				valueName.c_str(),
+				detail::TerminatedValueName(valueName),
 				nullptr,        // reserved
 				&valueType,
-				nullptr,        // not ready to pass buffer to write data into yet
-				&dataSize       // ask this API the total bytes for the data
+				buffer.data(),
+				&readSize
 			);
-			if (result != ERROR_SUCCESS)
+
+			if (result == ERROR_SUCCESS)
 			{
-				throw RegException(L"RegQueryValueEx() failed in returning value info.", result);
+				if (valueType != REG_BINARY)
+				{
+					throw std::invalid_argument("The registry value is not a REG_BINARY value.");
+				}
+				buffer.resize(readSize);
+				return;
 			}
 
-			// Dispatch to internal helper function based on the value's type
-			switch (valueType)
+			// The value grew concurrently between the two calls: try again
+			if (result != ERROR_MORE_DATA)
 			{
-			case REG_BINARY:    return ReadValueBinaryInternal(hKey, valueName, (DWORD)dataSize);
-				break;
-			case REG_DWORD:     return ReadValueDwordInternal(hKey, valueName);
-				break;
-			case REG_SZ:        return ReadValueStringInternal(hKey, valueName, (DWORD)dataSize);
-				break;
-			case REG_EXPAND_SZ: return ReadValueExpandStringInternal(hKey, valueName, (DWORD)dataSize);
-				break;
-			case REG_MULTI_SZ:  return ReadValueMultiStringInternal(hKey, valueName, (DWORD)dataSize);
-				break;
-			default:
-				throw std::invalid_argument("Unsupported Windows Registry value type.");
+				throw RegException(L"RegQueryValueEx() failed in returning REG_BINARY value.", result);
 			}
 		}
+	}
 
 
-		void SetValueInternal(HKEY hKey, const std::wstring& valueName, const RegValue& value)
+	//
+	// Streams a REG_BINARY value to sink(const BYTE* chunk, size_t chunkSize), in chunks of
+	// at most chunkSize bytes. The data is held in memory once, for the duration of the call.
+	// Returns the total size of the value.
+	//
+	template <typename Sink>
+	size_t StreamBinaryValue(HKEY hKey, std::wstring_view valueName, Sink&& sink,
+		size_t chunkSize = 64 * 1024)
+	{
+		_ASSERTE(chunkSize != 0);
+		if (chunkSize == 0)
 		{
-			_ASSERTE(hKey != nullptr);
-
-			switch (value.GetType())
-			{
-			case REG_BINARY:    return WriteValueBinaryInternal(hKey, valueName, value);
-			case REG_DWORD:     return WriteValueDwordInternal(hKey, valueName, value);
-			case REG_SZ:        return WriteValueStringInternal(hKey, valueName, value);
-			case REG_EXPAND_SZ: return WriteValueExpandStringInternal(hKey, valueName, value);
-			case REG_MULTI_SZ:  return WriteValueMultiStringInternal(hKey, valueName, value);
-
-			default:
-				throw std::invalid_argument("Unsupported Windows Registry value type.");
-			}
+			throw std::invalid_argument("StreamBinaryValue() called with a zero chunk size.");
 		}
 
+		std::vector<BYTE> buffer;
+		QueryBinaryValue(hKey, valueName, buffer);
 
-		void DeleteValue(HKEY hKey, const std::wstring& valueName)
+		for (size_t offset = 0; offset < buffer.size(); offset += chunkSize)
 		{
-			_ASSERTE(hKey != nullptr);
-
-			LONG result = ::RegDeleteValue(hKey, valueName.c_str());
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(L"RegDeleteValue() failed.", result);
-			}
+			sink(static_cast<const BYTE*>(buffer.data() + offset),
+				(std::min)(chunkSize, buffer.size() - offset));
 		}
+		return buffer.size();
+	}
 
 
-		void DeleteKey(HKEY hKey, const std::wstring& subKey, REGSAM view = KEY_WOW64_64KEY)
-		{
-			_ASSERTE(hKey != nullptr);
+	//
+	// Reads several values of a key at once: a single RegQueryMultipleValues() call fills
+	// one contiguous buffer, instead of two RegQueryValueEx() calls per value.
+	//
+	// Results are in the same order as valueNames. A value that can't be read doesn't
+	// make the whole batch fail: its status reports the error.
+	//
+	std::vector<RegValueResult> QueryMultipleValues(HKEY hKey,
+		const std::vector<std::wstring>& valueNames);
 
-			LONG result = ::RegDeleteKeyEx(hKey, subKey.c_str(), view, 0);
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(L"RegDeleteKeyEx() failed.", result);
-			}
-		}
 
+	//
+	// Writing values without building a RegValue first: the data is taken from views
+	// on the caller's strings and bytes, and laid out in per-thread scratch buffers.
+	//
 
-		std::wstring ExpandEnvironmentStrings(const std::wstring& source)
-		{
-			DWORD requiredLen = ::ExpandEnvironmentStrings(source.c_str(), nullptr, 0);
-			if (requiredLen == 0)
-			{
-				return std::wstring(); // empty
-			}
+	void SetDwordValue(HKEY hKey, std::wstring_view valueName, DWORD data);
 
-			std::wstring str;
-			str.resize(requiredLen);
-			DWORD len = ::ExpandEnvironmentStrings(source.c_str(), &str[0], requiredLen);
-			if (len == 0)
-			{
-				// Probably error?
-				// ...but just return an empty string if can't expand.
-				return std::wstring();
-			}
 
-			// Size (len) returned by ExpandEnvironmentStrings() includes the terminating NUL,
-			// so subtract - 1 to remove it.
-			str.resize(len - 1);
-			return str;
-		}
+	// Writes a REG_SZ (or, passing typeId, a REG_EXPAND_SZ) value
+	void SetStringValue(HKEY hKey, std::wstring_view valueName, std::wstring_view data,
+		DWORD typeId = REG_SZ);
+
+
+	void SetBinaryValue(HKEY hKey, std::wstring_view valueName, const BYTE* data, size_t dataSize);
+
+
+	// Writes a REG_MULTI_SZ value from any range of strings convertible to std::wstring_view
+	// (e.g. std::vector<std::wstring_view>, std::initializer_list<const wchar_t*>, etc.)
+	template <typename StringRange>
+	void SetMultiStringValue(HKEY hKey, std::wstring_view valueName, const StringRange& strings)
+	{
+		const std::vector<BYTE>& buffer = detail::LayoutMultiString(strings);
+
+		detail::WriteRawValueInternal(hKey, valueName, REG_MULTI_SZ, buffer.data(), buffer.size(),
+			L"RegSetValueEx() failed in writing REG_MULTI_SZ value.");
+	}
+
+
+	void SetMultiStringValue(HKEY hKey, std::wstring_view valueName,
+		std::initializer_list<std::wstring_view> strings);
+
+
+	void DeleteValue(HKEY hKey, const std::wstring& valueName);
+
+
+	void DeleteKey(HKEY hKey, const std::wstring& subKey, REGSAM view = KEY_WOW64_64KEY);
+
+
+	std::wstring ExpandEnvironmentStrings(const std::wstring& source);
+
 
+	std::wstring ValueTypeIdToString(DWORD typeId);
 
-		std::wstring ValueTypeIdToString(DWORD typeId)
+
+	void LoadKey(HKEY hKey, const std::wstring& subKey, const std::wstring& filename);
+
+
+	void SaveKey(HKEY hKey, const std::wstring& filename, LPSECURITY_ATTRIBUTES security = nullptr);
+
+
+
+
+
+
+	//------------------------------------------------------------------------------
+	// Writes a REG_BINARY value produced in chunks, e.g. streamed from a file or a
+	// serializer. The chunks are appended to a single buffer (reserve it up front,
+	// if the total size is known), and written to the registry by Commit(): the
+	// registry API only accepts a value's data as a whole.
+	//
+	// Nothing is written if the writer is destroyed without calling Commit().
+	//------------------------------------------------------------------------------
+	class BinaryValueWriter
+	{
+	public:
+		BinaryValueWriter(HKEY hKey, std::wstring valueName, size_t expectedSize = 0)
+			: m_hKey(hKey), m_valueName(std::move(valueName))
 		{
-			switch (typeId)
-			{
-			case REG_BINARY:    return L"REG_BINARY";       break;
-			case REG_DWORD:     return L"REG_DWORD";        break;
-			case REG_EXPAND_SZ: return L"REG_EXPAND_SZ";    break;
-			case REG_MULTI_SZ:  return L"REG_MULTI_SZ";     break;
-			case REG_SZ:        return L"REG_SZ";           break;
-
-			default:
-				// Should I throw?
-				return L"Unsupported/Unknown registry value type";
-				break;
-			}
+			_ASSERTE(hKey != nullptr);
+			m_data.reserve(expectedSize);
 		}
 
+		BinaryValueWriter(const BinaryValueWriter&) = delete;
+		BinaryValueWriter& operator=(const BinaryValueWriter&) = delete;
 
-		void LoadKey(HKEY hKey, const std::wstring& subKey, const std::wstring& filename)
+		void Write(const BYTE* chunk, size_t chunkSize)
 		{
-			LONG result = ::RegLoadKey(hKey, subKey.c_str(), filename.c_str());
-			if (result != ERROR_SUCCESS)
+			_ASSERTE(chunk != nullptr || chunkSize == 0);
+			if (chunkSize != 0)
 			{
-				throw RegException(L"RegLoadKey failed.", result);
+				m_data.insert(m_data.end(), chunk, chunk + chunkSize);
 			}
 		}
 
-
-		void SaveKey(HKEY hKey, const std::wstring& filename, LPSECURITY_ATTRIBUTES security = nullptr)
+		// Makes the writer usable as a sink for StreamBinaryValue()
+		void operator()(const BYTE* chunk, size_t chunkSize)
 		{
-			LONG result = ::RegSaveKey(hKey, filename.c_str(), security);
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(L"RegSaveKey failed.", result);
-			}
+			Write(chunk, chunkSize);
 		}
 
+		size_t Size() const noexcept
+		{
+			return m_data.size();
+		}
 
+		// Writes the value, and releases the buffer
+		void Commit()
+		{
+			SetBinaryValue(m_hKey, m_valueName, m_data.data(), m_data.size());
+			std::vector<BYTE>().swap(m_data);
+		}
 
+	private:
+		HKEY m_hKey;
+		std::wstring m_valueName;
+		std::vector<BYTE> m_data;
+	};
 
-	} // anon namespace
 
 	  //------------------------------------------------------------------------------
 	  // Convenient C++ wrapper on raw HKEY registry key handle.
@@ -959,43 +1345,10 @@ namespace winreg
 
 	public:
 
-		static RegKey ConnectRegistry(const std::wstring& machineName, HKEY hKey)
-		{
-			HKEY hKeyResult = nullptr;
-			LONG result = ::RegConnectRegistry(machineName.c_str(), hKey, &hKeyResult);
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(L"RegConnectRegistry failed.", result);
-			}
-
-			return RegKey(hKeyResult);
-		}
+		static RegKey ConnectRegistry(const std::wstring& machineName, HKEY hKey);
 
 		/* DBJ: in essence a factory method */
-		static RegKey OpenKey(HKEY hKey, const std::wstring& subKeyName, REGSAM accessRights = KEY_READ)
-		{
-			_ASSERTE(hKey != nullptr);
-
-			HKEY hKeyResult = nullptr;
-			LONG result = ::RegOpenKeyEx(
-				hKey,
-				subKeyName.c_str(),
-				0, // no special option of symbolic link
-				accessRights,
-				&hKeyResult
-			);
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(
-					L"RegOpenKeyEx() failed trying opening a key:{" + subKeyName + L"}",
-					result
-				);
-			}
-
-			_ASSERTE(hKey != NULL); // DBJ added
-
-			return RegKey(hKeyResult);
-		}
+		static RegKey OpenKey(HKEY hKey, const std::wstring& subKeyName, REGSAM accessRights = KEY_READ);
 
 		/* DBJ: also a factory method */
 		static RegKey CreateKey(
@@ -1004,30 +1357,7 @@ namespace winreg
 			DWORD options = 0, 
 			REGSAM accessRights = KEY_WRITE | KEY_READ,
 			LPSECURITY_ATTRIBUTES securityAttributes = nullptr,
-			LPDWORD disposition = nullptr)
-		{
-			_ASSERTE(hKey != nullptr);
-
-			HKEY hKeyResult = nullptr;
-			LONG result = ::RegCreateKeyEx(
-				hKey,
-				subKeyName.c_str(),
-				0,          // reserved
-				nullptr,    // no user defined class
-				options,
-				accessRights,
-				securityAttributes,
-				&hKeyResult,
-				disposition
-			);
-			if (result != ERROR_SUCCESS)
-			{
-				throw RegException(L"RegCreateKeyEx() failed.", result);
-			}
-
-			return RegKey(hKeyResult);
-		}
-
+			LPDWORD disposition = nullptr);
 
 
 		RegKey(HKEY hKey) noexcept
@@ -1097,28 +1427,44 @@ namespace winreg
 
 		void SetValue(const RegValue& rv_) {
 			_ASSERTE(m_hKey != nullptr);
-				SetValueInternal(m_hKey, rv_.name(), rv_);
+				detail::SetValueInternal(m_hKey, rv_.name(), rv_);
+		}
+
+		void SetDwordValue(std::wstring_view valueName, DWORD data) {
+			_ASSERTE(m_hKey != nullptr);
+			winreg::SetDwordValue(m_hKey, valueName, data);
+		}
+
+		void SetStringValue(std::wstring_view valueName, std::wstring_view data, DWORD typeId = REG_SZ) {
+			_ASSERTE(m_hKey != nullptr);
+			winreg::SetStringValue(m_hKey, valueName, data, typeId);
+		}
+
+		void SetBinaryValue(std::wstring_view valueName, const BYTE* data, size_t dataSize) {
+			_ASSERTE(m_hKey != nullptr);
+			winreg::SetBinaryValue(m_hKey, valueName, data, dataSize);
+		}
+
+		template <typename StringRange>
+		void SetMultiStringValue(std::wstring_view valueName, const StringRange& strings) {
+			_ASSERTE(m_hKey != nullptr);
+			winreg::SetMultiStringValue(m_hKey, valueName, strings);
+		}
+
+		void SetMultiStringValue(std::wstring_view valueName, std::initializer_list<std::wstring_view> strings) {
+			_ASSERTE(m_hKey != nullptr);
+			winreg::SetMultiStringValue(m_hKey, valueName, strings);
 		}
 
 	private:
 		// The raw key wrapped handle
 		HKEY m_hKey;
 
-		void Close() noexcept
-		{
-			if (m_hKey != nullptr)
-			{
-				_ASSERTE(::RegCloseKey(m_hKey) == ERROR_SUCCESS);
-			}
-			m_hKey = nullptr;
-		}
+		void Close() noexcept;
 	};
 
 	// Follow STL's swap() pattern
-	void swap(RegKey& lhs, RegKey& rhs) noexcept
-	{
-		lhs.Swap(rhs);
-	}
+	void swap(RegKey& lhs, RegKey& rhs) noexcept;
 
 	/*--------------------------------------------------------------*/
 /*	template<typename V = REG_DWORD>
@@ -1151,4 +1497,6 @@ namespace winreg
 */
 } // namespace winreg
 
-
+#ifdef WINREG_HEADER_ONLY
+#include "wreg_inl.h"
+#endif
@@ -0,0 +1,662 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_blob.h
+// DESC: Side-car, content-addressed file store for oversized registry values.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// MSDN ("Registry Element Size Limits") recommends keeping values larger than
+// 2,048 bytes in a file, storing only the file's location in the registry.
+// LargeValueStore does that transparently:
+//
+//  - SetValue() writes values above a threshold to a file named after the
+//    SHA-256 digest of their data, and stores in the registry a small
+//    REG_BINARY reference (BlobReference) instead. Equal data is stored once.
+//
+//  - QueryValue() returns the original value, resolving references;
+//    OpenValue() returns a view of the data, memory-mapping stored blobs
+//    instead of copying them.
+//
+//  - CollectGarbage() deletes the blobs not referenced by any value below
+//    the given keys. A writer stores (or reuses) the blob first, then writes
+//    the reference: in between, the blob is referenced by nothing. So blobs
+//    written or reused less than a grace period before the collection started
+//    are kept as well. Concurrent writers are safe as long as each one writes
+//    its reference within the grace period of storing the blob.
+//
+// Blob files are laid out as <directory>\<first 2 hex digits>\<64 hex digits>.
+//
+// A REG_BINARY value that happens to have the exact size and signature of a
+// reference is taken as one: don't store such data with the plain API.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include "wreg_file.h"  // MappedFile, OpenFile()
+#include <array>        // std::array
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::seconds, std::chrono::hours
+#include <cstdint>      // uint32_t, uint64_t
+#include <cstdio>       // fwrite(), fclose()
+#include <cstring>      // memcpy(), memcmp()
+#include <filesystem>   // std::filesystem
+#include <memory>       // std::shared_ptr
+#include <random>       // std::random_device
+#include <set>          // std::set
+#include <stdexcept>    // std::runtime_error
+#include <string>       // std::wstring
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	typedef std::array<BYTE, 32> BlobDigest;    // SHA-256
+
+	//------------------------------------------------------------------------------
+	// REG_BINARY value stored in the registry in place of an oversized value
+	//------------------------------------------------------------------------------
+	struct BlobReference
+	{
+		char magic[8];              // "WRBLOB01"
+		uint32_t type;              // type of the original value
+		uint32_t reserved;
+		uint64_t size;              // size of the original data, in bytes
+		BlobDigest digest;          // SHA-256 of the original data
+	};
+
+	static_assert(sizeof(BlobReference) == 56, "BlobReference must have no padding.");
+
+
+	namespace blob_detail
+	{
+		const char ReferenceMagic[8] = { 'W', 'R', 'B', 'L', 'O', 'B', '0', '1' };
+
+
+		// Plain SHA-256 (FIPS 180-4)
+		class Sha256
+		{
+		public:
+
+			void Update(const BYTE* data, size_t size) noexcept
+			{
+				m_totalSize += size;
+				while (size != 0)
+				{
+					const size_t count = (std::min)(size, sizeof(m_block) - m_blockSize);
+					memcpy(m_block + m_blockSize, data, count);
+					m_blockSize += count;
+					data += count;
+					size -= count;
+
+					if (m_blockSize == sizeof(m_block))
+					{
+						Transform(m_block);
+						m_blockSize = 0;
+					}
+				}
+			}
+
+
+			BlobDigest Finish() noexcept
+			{
+				const uint64_t totalBits = m_totalSize * 8;
+
+				// Padding: 0x80, zeros, then the message length in bits (big-endian)
+				const BYTE pad = 0x80;
+				Update(&pad, 1);
+				const BYTE zero = 0;
+				while (m_blockSize != 56)
+				{
+					Update(&zero, 1);
+				}
+				BYTE length[8];
+				for (int i = 0; i < 8; i++)
+				{
+					length[i] = static_cast<BYTE>(totalBits >> (56 - 8 * i));
+				}
+				Update(length, sizeof(length));
+
+				BlobDigest digest;
+				for (int i = 0; i < 8; i++)
+				{
+					for (int j = 0; j < 4; j++)
+					{
+						digest[i * 4 + j] = static_cast<BYTE>(m_state[i] >> (24 - 8 * j));
+					}
+				}
+				return digest;
+			}
+
+		private:
+			uint32_t m_state[8] = {
+				0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+				0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+			};
+			BYTE m_block[64] = {};
+			size_t m_blockSize = 0;
+			uint64_t m_totalSize = 0;
+
+
+			static uint32_t Rotr(uint32_t x, int n) noexcept
+			{
+				return (x >> n) | (x << (32 - n));
+			}
+
+
+			void Transform(const BYTE* block) noexcept
+			{
+				static const uint32_t k[64] = {
+					0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+					0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+					0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+					0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+					0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+					0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+					0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+					0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+				};
+
+				uint32_t w[64];
+				for (int i = 0; i < 16; i++)
+				{
+					w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (static_cast<uint32_t>(block[i * 4 + 1]) << 16)
+						| (static_cast<uint32_t>(block[i * 4 + 2]) << 8) | static_cast<uint32_t>(block[i * 4 + 3]);
+				}
+				for (int i = 16; i < 64; i++)
+				{
+					const uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+					const uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+					w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+				}
+
+				uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+				uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+				for (int i = 0; i < 64; i++)
+				{
+					const uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+					const uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+					h = g;
+					g = f;
+					f = e;
+					e = d + t1;
+					d = c;
+					c = b;
+					b = a;
+					a = t1 + t2;
+				}
+
+				m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+				m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+			}
+		};
+
+
+		inline BlobDigest Digest(const BYTE* data, size_t size) noexcept
+		{
+			Sha256 sha;
+			sha.Update(data, size);
+			return sha.Finish();
+		}
+
+
+		inline std::wstring ToHex(const BlobDigest& digest)
+		{
+			const wchar_t* const digits = L"0123456789abcdef";
+			std::wstring hex;
+			hex.reserve(digest.size() * 2);
+			for (BYTE b : digest)
+			{
+				hex.push_back(digits[b >> 4]);
+				hex.push_back(digits[b & 0x0F]);
+			}
+			return hex;
+		}
+
+
+		// Parses a blob file name; returns false if it isn't one
+		inline bool FromHex(const std::wstring& hex, BlobDigest& digest)
+		{
+			if (hex.size() != digest.size() * 2)
+			{
+				return false;
+			}
+
+			for (size_t i = 0; i < hex.size(); i++)
+			{
+				const wchar_t ch = hex[i];
+				int nibble = 0;
+				if (ch >= L'0' && ch <= L'9')
+				{
+					nibble = ch - L'0';
+				}
+				else if (ch >= L'a' && ch <= L'f')
+				{
+					nibble = ch - L'a' + 10;
+				}
+				else
+				{
+					return false;
+				}
+
+				if ((i % 2) == 0)
+				{
+					digest[i / 2] = static_cast<BYTE>(nibble << 4);
+				}
+				else
+				{
+					digest[i / 2] |= static_cast<BYTE>(nibble);
+				}
+			}
+			return true;
+		}
+
+
+		// Reads a value of any type
+		inline LONG ReadRawValue(HKEY hKey, const std::wstring& valueName, DWORD& type, std::vector<BYTE>& data)
+		{
+			for (;;)
+			{
+				DWORD size = static_cast<DWORD>(data.size());
+				LONG result = ::RegQueryValueEx(hKey, valueName.c_str(), nullptr, &type,
+					data.empty() ? nullptr : data.data(), &size);
+				if (result == ERROR_SUCCESS && (!data.empty() || size == 0))
+				{
+					data.resize(size);
+					return ERROR_SUCCESS;
+				}
+				if (result != ERROR_SUCCESS && result != ERROR_MORE_DATA)
+				{
+					return result;
+				}
+				data.resize(size);
+			}
+		}
+
+	} // namespace blob_detail
+
+
+	//------------------------------------------------------------------------------
+	// Data of a value read through a LargeValueStore: either a memory-mapped blob
+	// file, or a copy of the data stored inline in the registry.
+	// Copies share the same data.
+	//------------------------------------------------------------------------------
+	class BlobView
+	{
+	public:
+
+		const BYTE* Data() const noexcept { return m_data; }
+		size_t Size() const noexcept { return m_size; }
+		DWORD Type() const noexcept { return m_type; }
+
+		// true if the data is mapped from the blob store
+		bool IsExternal() const noexcept { return m_external; }
+
+	private:
+		friend class LargeValueStore;
+
+		std::shared_ptr<const void> m_owner;
+		const BYTE* m_data = nullptr;
+		size_t m_size = 0;
+		DWORD m_type = REG_NONE;
+		bool m_external = false;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Stores registry values above a size threshold in content-addressed files
+	// (see the notes at the top of this file).
+	//------------------------------------------------------------------------------
+	class LargeValueStore
+	{
+	public:
+
+		struct GcStats
+		{
+			size_t referencesFound = 0;     // references to blobs found in the registry
+			size_t blobsKept = 0;
+			size_t blobsRemoved = 0;
+			uint64_t bytesRemoved = 0;
+		};
+
+
+		// Values larger than threshold bytes are stored in the directory, which is
+		// created when the first blob is written.
+		explicit LargeValueStore(std::filesystem::path directory, size_t threshold = 2048)
+			: m_directory(std::move(directory)), m_threshold(threshold)
+		{
+		}
+
+
+		const std::filesystem::path& Directory() const noexcept { return m_directory; }
+		size_t Threshold() const noexcept { return m_threshold; }
+
+
+		//
+		// Writes a value, given its raw data as laid out by the Win32 API (strings
+		// NUL-terminated, multi-strings double-NUL-terminated).
+		//
+		void SetValue(HKEY hKey, std::wstring_view valueName, DWORD type, const BYTE* data, size_t dataSize)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(data != nullptr || dataSize == 0);
+
+			if (dataSize <= m_threshold)
+			{
+				detail::WriteRawValueInternal(hKey, valueName, type, data, dataSize,
+					L"RegSetValueEx() failed in writing a value.");
+				return;
+			}
+
+			BlobReference reference = {};
+			memcpy(reference.magic, blob_detail::ReferenceMagic, sizeof(reference.magic));
+			reference.type = type;
+			reference.size = dataSize;
+			reference.digest = Put(data, dataSize);
+
+			SetBinaryValue(hKey, valueName, reinterpret_cast<const BYTE*>(&reference), sizeof(reference));
+		}
+
+
+		void SetValue(HKEY hKey, const RegValue& value)
+		{
+			switch (value.GetType())
+			{
+			case REG_SZ:
+			case REG_EXPAND_SZ:
+			{
+				const std::wstring& str = (value.GetType() == REG_SZ) ? value.String() : value.ExpandString();
+				SetValue(hKey, value.name(), value.GetType(), reinterpret_cast<const BYTE*>(str.c_str()),
+					(str.size() + 1) * sizeof(wchar_t));
+				break;
+			}
+			case REG_MULTI_SZ:
+			{
+				const std::vector<BYTE>& buffer = detail::LayoutMultiString(value.MultiString());
+				SetValue(hKey, value.name(), REG_MULTI_SZ, buffer.data(), buffer.size());
+				break;
+			}
+			case REG_BINARY:
+				SetValue(hKey, value.name(), REG_BINARY, value.Binary().data(), value.Binary().size());
+				break;
+			default:
+				detail::SetValueInternal(hKey, value.name(), value);
+				break;
+			}
+		}
+
+
+		void SetBinaryValue(HKEY hKey, std::wstring_view valueName, const BYTE* data, size_t dataSize)
+		{
+			SetValue(hKey, valueName, REG_BINARY, data, dataSize);
+		}
+
+
+		//
+		// Reads a value, resolving blob references. Stored blobs are memory-mapped:
+		// the view's data points into the mapping.
+		// Throws RegException if the value can't be read, and std::runtime_error if
+		// the referenced blob is missing or has the wrong size.
+		//
+		BlobView OpenValue(HKEY hKey, const std::wstring& valueName) const
+		{
+			_ASSERTE(hKey != nullptr);
+
+			auto data = std::make_shared<std::vector<BYTE>>();
+			DWORD type = REG_NONE;
+			LONG result = blob_detail::ReadRawValue(hKey, valueName, type, *data);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryValueEx() failed in returning a value.", result);
+			}
+
+			BlobView view;
+			BlobReference reference;
+			if (ParseReference(type, data->data(), data->size(), reference))
+			{
+				auto file = std::make_shared<MappedFile>(BlobPath(reference.digest));
+				if (file->Size() != reference.size)
+				{
+					throw std::runtime_error("LargeValueStore: the blob file has the wrong size.");
+				}
+				view.m_data = reinterpret_cast<const BYTE*>(file->Data());
+				view.m_size = file->Size();
+				view.m_type = reference.type;
+				view.m_external = true;
+				view.m_owner = std::move(file);
+			}
+			else
+			{
+				view.m_data = data->data();
+				view.m_size = data->size();
+				view.m_type = type;
+				view.m_owner = std::move(data);
+			}
+			return view;
+		}
+
+
+		// Reads a value, resolving blob references
+		RegValue QueryValue(HKEY hKey, const std::wstring& valueName) const
+		{
+			const BlobView view = OpenValue(hKey, valueName);
+			if (!detail::IsSupportedValueType(view.Type()))
+			{
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+			return detail::MakeRegValue(valueName, view.Type(), view.Data(), detail::SafeSizeToDwordCast(view.Size()));
+		}
+
+
+		// Checks whether raw registry data is a blob reference, and decodes it
+		static bool ParseReference(DWORD type, const BYTE* data, size_t dataSize, BlobReference& reference) noexcept
+		{
+			if (type != REG_BINARY || dataSize != sizeof(BlobReference))
+			{
+				return false;
+			}
+			memcpy(&reference, data, sizeof(reference));
+			return memcmp(reference.magic, blob_detail::ReferenceMagic, sizeof(reference.magic)) == 0;
+		}
+
+
+		//
+		// Stores data in a blob file (unless a blob with the same digest already exists),
+		// and returns its digest.
+		// Throws std::runtime_error or std::filesystem::filesystem_error on I/O errors.
+		//
+		BlobDigest Put(const BYTE* data, size_t dataSize)
+		{
+			namespace fs = std::filesystem;
+
+			const BlobDigest digest = blob_detail::Digest(data, dataSize);
+			const fs::path path = BlobPath(digest);
+
+			// Deduplication: refresh the time of the existing blob, so that a garbage
+			// collection already running keeps it
+			std::error_code error;
+			if (fs::file_size(path, error) == dataSize && !error)
+			{
+				fs::last_write_time(path, fs::file_time_type::clock::now(), error);
+				return digest;
+			}
+
+			fs::create_directories(path.parent_path());
+
+			// Write a temporary file, then rename it: readers never see partial blobs
+			static std::atomic<uint64_t> counter{ std::random_device()() };
+			fs::path temporary = path;
+			temporary += L".tmp" + std::to_wstring(counter++);
+
+			FILE* f = OpenFile(temporary, "wb");
+			if (f == nullptr)
+			{
+				throw std::runtime_error("LargeValueStore: can't create a blob file.");
+			}
+			const size_t written = fwrite(data, 1, dataSize, f);
+			const bool closed = (fclose(f) == 0);
+			if (written != dataSize || !closed)
+			{
+				fs::remove(temporary, error);
+				throw std::runtime_error("LargeValueStore: can't write a blob file.");
+			}
+
+			fs::rename(temporary, path, error);
+			if (error)
+			{
+				// Another writer may have stored the same blob meanwhile (and on Windows,
+				// a mapped file can't be replaced)
+				fs::remove(temporary, error);
+				if (fs::file_size(path, error) != dataSize || error)
+				{
+					throw std::runtime_error("LargeValueStore: can't store a blob file.");
+				}
+			}
+			return digest;
+		}
+
+
+		std::filesystem::path BlobPath(const BlobDigest& digest) const
+		{
+			const std::wstring hex = blob_detail::ToHex(digest);
+			return m_directory / hex.substr(0, 2) / hex;
+		}
+
+
+		//
+		// Deletes the blobs not referenced by any value in the given key trees (the
+		// keys need KEY_READ access). Blobs stored or reused less than gracePeriod
+		// before the collection started (or after) are kept, since their references
+		// may not be written yet; so are temporary files less than an hour old.
+		// Throws RegException, without deleting anything, if a key can't be read.
+		//
+		GcStats CollectGarbage(const std::vector<HKEY>& roots,
+			std::chrono::seconds gracePeriod = std::chrono::minutes(10))
+		{
+			namespace fs = std::filesystem;
+
+			_ASSERTE(gracePeriod.count() >= 0);
+
+			GcStats stats;
+			const fs::file_time_type start = fs::file_time_type::clock::now();
+
+			std::set<BlobDigest> referenced;
+			for (HKEY root : roots)
+			{
+				_ASSERTE(root != nullptr);
+				Mark(root, referenced, stats);
+			}
+
+			std::error_code error;
+			if (!fs::is_directory(m_directory, error))
+			{
+				return stats;
+			}
+
+			// Collect first, then delete: don't modify the directories while iterating them
+			std::vector<fs::path> garbage;
+			for (fs::recursive_directory_iterator it(m_directory, fs::directory_options::skip_permission_denied,
+				error), end; !error && it != end; it.increment(error))
+			{
+				if (!it->is_regular_file(error))
+				{
+					continue;
+				}
+
+				const fs::path& path = it->path();
+				const fs::file_time_type lastWrite = it->last_write_time(error);
+				if (error)
+				{
+					error.clear();
+					continue;
+				}
+
+				BlobDigest digest;
+				if (blob_detail::FromHex(path.filename().wstring(), digest))
+				{
+					if (referenced.count(digest) != 0 || lastWrite >= start - gracePeriod)
+					{
+						stats.blobsKept++;
+						continue;
+					}
+					garbage.push_back(path);
+				}
+				else if (path.filename().wstring().find(L".tmp") != std::wstring::npos
+					&& lastWrite < start - std::chrono::hours(1))
+				{
+					garbage.push_back(path);
+				}
+			}
+
+			for (const fs::path& path : garbage)
+			{
+				const uintmax_t size = fs::file_size(path, error);
+				if (!error && fs::remove(path, error))
+				{
+					stats.blobsRemoved++;
+					stats.bytesRemoved += size;
+				}
+				error.clear();
+			}
+			return stats;
+		}
+
+	private:
+		std::filesystem::path m_directory;
+		size_t m_threshold;
+
+
+		// Adds the blobs referenced in a key tree
+		void Mark(HKEY hKey, std::set<BlobDigest>& referenced, GcStats& stats) const
+		{
+			try
+			{
+				for (const std::wstring& name : EnumerateValueNames(hKey, ValueTypeMask(REG_BINARY), AnyName()))
+				{
+					BlobReference reference;
+					DWORD type = REG_NONE;
+					DWORD size = sizeof(reference);
+					LONG result = ::RegQueryValueEx(hKey, name.c_str(), nullptr, &type,
+						reinterpret_cast<BYTE*>(&reference), &size);
+					if (result == ERROR_SUCCESS
+						&& ParseReference(type, reinterpret_cast<const BYTE*>(&reference), size, reference))
+					{
+						referenced.insert(reference.digest);
+						stats.referencesFound++;
+					}
+				}
+
+				for (const std::wstring& name : EnumerateSubKeyNames(hKey))
+				{
+					HKEY hSubKey = nullptr;
+					LONG result = ::RegOpenKeyEx(hKey, name.c_str(), 0, KEY_READ, &hSubKey);
+					if (result == ERROR_FILE_NOT_FOUND)
+					{
+						continue;   // deleted meanwhile
+					}
+					if (result != ERROR_SUCCESS)
+					{
+						throw RegException(L"RegOpenKeyEx() failed in collecting blob references.", result);
+					}
+					RegKey subKey(hSubKey);
+					Mark(subKey.Handle(), referenced, stats);
+				}
+			}
+			catch (const RegException& e)
+			{
+				// Keys deleted meanwhile hold no references. Any other error aborts the
+				// collection: the blobs referenced by unreadable keys would be deleted.
+				if (e.ErrorCode() != ERROR_FILE_NOT_FOUND && e.ErrorCode() != ERROR_KEY_DELETED)
+				{
+					throw;
+				}
+			}
+		}
+	};
+
+} // namespace winreg
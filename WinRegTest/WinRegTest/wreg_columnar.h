@@ -0,0 +1,900 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_columnar.h
+// DESC: Export of key trees to a compact columnar file, for analytics, and the
+//       reader of that file.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// ExportTree() writes a key tree (from any TreeSource, see wreg_copy.h: live
+// keys with ExportRegistryTree(), an offline hive with ExportHive()) to a file
+// of row groups. Each row group holds whole keys, and is split in column
+// chunks:
+//
+//  - key paths: for each key, its path (relative to the root of the export),
+//    prefix-compressed against the previous key, and its number of values;
+//  - value names: a dictionary of the names of the row group, in order of
+//    first use, then the index of each value's name in it;
+//  - value types;
+//  - value data: the raw data of each value, length-prefixed.
+//
+// ColumnarReader decodes the columns asked for, and only those: the sizes of
+// the column chunks are in the row group headers, so the others are skipped
+// without being read. The data column is returned as views on the mapped file.
+//
+// The keys go to a ColumnarWriter in the order of a depth-first walk, so that
+// paths share their prefix with the previous one. The writer fills a row group
+// with them; full row groups are encoded by worker threads and written out in
+// order. The row groups in memory are at most options.threads + 1, each of
+// options.rowGroupValues values and about options.rowGroupBytes of data (a
+// single key larger than that makes a row group of its own).
+//
+// ColumnarWriter is also a TreeSink: CopyTree() can feed it, from several
+// reader threads, with keys in the order they're read.
+//
+// Paths and names are stored as UTF-8 (unpaired surrogates are replaced, see
+// wreg_utf8.h); numbers as LEB128 varints.
+//
+// File layout (little-endian):
+//
+//  ColumnarFileHeader
+//  { ColumnarGroupHeader, column chunks in ColumnarColumn order } for each row group
+//
+// Key path column:  { varint shared, varint length, char[length], varint valueCount } per key
+// Value name column: varint entries, { varint length, char[length] } per entry,
+//                    varint index per value
+// Value type column: varint type per value
+// Value data column: { varint size, BYTE[size] } per value
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include "wreg_copy.h"  // TreeSource, TreeSink, RegistrySource, RawValue
+#include "wreg_file.h"  // OpenFile(), MappedFile
+#include "wreg_hive.h"  // HiveView, HiveKey, HiveValue
+#include "wreg_utf8.h"  // utf_detail::WideToUtf8(), Utf8ToWide()
+#include <algorithm>    // std::min, std::max
+#include <chrono>       // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <cstdint>      // uint8_t, uint32_t, uint64_t
+#include <cstdio>       // fwrite(), fclose()
+#include <cstring>      // memcpy(), memcmp()
+#include <deque>        // std::deque
+#include <exception>    // std::exception_ptr
+#include <filesystem>   // std::filesystem::path
+#include <map>          // std::map
+#include <mutex>        // std::mutex
+#include <stdexcept>    // std::runtime_error
+#include <string>       // std::string, std::wstring
+#include <string_view>  // std::string_view, std::wstring_view
+#include <thread>       // std::thread
+#include <unordered_map> // std::unordered_map
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Columns of a row group, in file order
+	//------------------------------------------------------------------------------
+	enum ColumnarColumn : uint32_t
+	{
+		KeyPathColumn,
+		ValueNameColumn,
+		ValueTypeColumn,
+		ValueDataColumn,
+		ColumnarColumnCount
+	};
+
+	// Column masks for ColumnarReader::ReadRowGroup()
+	constexpr uint32_t ColumnBit(ColumnarColumn column) noexcept
+	{
+		return 1u << column;
+	}
+
+	constexpr uint32_t AllColumns = (1u << ColumnarColumnCount) - 1;
+
+
+	//------------------------------------------------------------------------------
+	// On-disk structures of the columnar file
+	//------------------------------------------------------------------------------
+	struct ColumnarFileHeader
+	{
+		char magic[8];              // "WRCOL001"
+		uint64_t reserved;
+	};
+
+	struct ColumnarGroupHeader
+	{
+		uint32_t keyCount;
+		uint32_t valueCount;
+		uint64_t columnSizes[ColumnarColumnCount];  // bytes of each column chunk
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Options of ColumnarWriter and of the exports
+	//------------------------------------------------------------------------------
+	struct ColumnarExportOptions
+	{
+		size_t threads = 4;                         // encoder threads
+		size_t rowGroupValues = 64 * 1024;          // values per row group, at most
+		size_t rowGroupBytes = 16 * 1024 * 1024;    // value data per row group, about
+	};
+
+
+	//------------------------------------------------------------------------------
+	// What an export wrote
+	//------------------------------------------------------------------------------
+	struct ColumnarExportStats
+	{
+		size_t keys = 0;
+		size_t values = 0;
+		size_t rowGroups = 0;
+		size_t peakRowGroups = 0;       // in memory at once
+		uint64_t dataBytes = 0;         // value data, as read
+		uint64_t fileBytes = 0;
+		double seconds = 0;
+	};
+
+
+	namespace columnar_detail
+	{
+		inline void PutVarint(std::vector<uint8_t>& out, uint64_t n)
+		{
+			while (n >= 0x80)
+			{
+				out.push_back(static_cast<uint8_t>(n | 0x80));
+				n >>= 7;
+			}
+			out.push_back(static_cast<uint8_t>(n));
+		}
+
+		inline void PutBytes(std::vector<uint8_t>& out, const void* data, size_t size)
+		{
+			PutVarint(out, size);
+			out.insert(out.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+		}
+
+		[[noreturn]] inline void ThrowCorrupt()
+		{
+			throw std::runtime_error("ColumnarReader: corrupt row group.");
+		}
+
+		inline uint64_t GetVarint(const uint8_t*& p, const uint8_t* end)
+		{
+			uint64_t n = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				if (p == end)
+				{
+					ThrowCorrupt();
+				}
+				const uint8_t byte = *p++;
+				n |= static_cast<uint64_t>(byte & 0x7F) << shift;
+				if (byte < 0x80)
+				{
+					return n;
+				}
+			}
+			ThrowCorrupt();
+		}
+
+		// A varint that counts bytes following it, or items of at least one byte each
+		inline size_t GetSize(const uint8_t*& p, const uint8_t* end)
+		{
+			const uint64_t size = GetVarint(p, end);
+			if (size > static_cast<uint64_t>(end - p))
+			{
+				ThrowCorrupt();
+			}
+			return static_cast<size_t>(size);
+		}
+
+		inline std::string ToUtf8(std::wstring_view text)
+		{
+			std::string utf8(text.size() * utf_detail::MaxUtf8PerWide, '\0');
+			utf8.resize(utf_detail::WideToUtf8(text.data(), text.size(), &utf8[0]));
+			return utf8;
+		}
+
+		inline std::wstring FromUtf8(const char* text, size_t size)
+		{
+			std::wstring wide(size, L'\0');
+			wide.resize(utf_detail::Utf8ToWide(text, size, &wide[0]));
+			return wide;
+		}
+
+
+		// The rows of a row group, as added to the writer
+		struct RowGroup
+		{
+			std::vector<std::string> keyPaths;
+			std::vector<uint32_t> valueCounts;
+			std::vector<std::string> names;     // for each value
+			std::vector<uint32_t> types;
+			std::vector<uint8_t> data;          // of all the values, back to back
+			std::vector<uint32_t> dataSizes;
+
+			bool Empty() const noexcept
+			{
+				return keyPaths.empty();
+			}
+		};
+
+
+		// The header of a row group, followed by its column chunks
+		inline std::vector<uint8_t> EncodeRowGroup(const RowGroup& rows)
+		{
+			std::vector<uint8_t> columns[ColumnarColumnCount];
+
+			std::string_view previous;
+			for (size_t i = 0; i < rows.keyPaths.size(); i++)
+			{
+				const std::string& path = rows.keyPaths[i];
+				size_t shared = 0;
+				const size_t common = (std::min)(previous.size(), path.size());
+				while (shared < common && previous[shared] == path[shared])
+				{
+					shared++;
+				}
+				PutVarint(columns[KeyPathColumn], shared);
+				PutBytes(columns[KeyPathColumn], path.data() + shared, path.size() - shared);
+				PutVarint(columns[KeyPathColumn], rows.valueCounts[i]);
+				previous = path;
+			}
+
+			std::unordered_map<std::string_view, uint32_t> dictionary;
+			std::vector<std::string_view> entries;
+			std::vector<uint32_t> indexes(rows.names.size());
+			for (size_t i = 0; i < rows.names.size(); i++)
+			{
+				const auto inserted = dictionary.emplace(rows.names[i], static_cast<uint32_t>(entries.size()));
+				if (inserted.second)
+				{
+					entries.push_back(rows.names[i]);
+				}
+				indexes[i] = inserted.first->second;
+			}
+			PutVarint(columns[ValueNameColumn], entries.size());
+			for (std::string_view entry : entries)
+			{
+				PutBytes(columns[ValueNameColumn], entry.data(), entry.size());
+			}
+			for (uint32_t index : indexes)
+			{
+				PutVarint(columns[ValueNameColumn], index);
+			}
+
+			for (uint32_t type : rows.types)
+			{
+				PutVarint(columns[ValueTypeColumn], type);
+			}
+
+			columns[ValueDataColumn].reserve(rows.data.size() + 5 * rows.dataSizes.size());
+			size_t offset = 0;
+			for (uint32_t size : rows.dataSizes)
+			{
+				PutBytes(columns[ValueDataColumn], rows.data.data() + offset, size);
+				offset += size;
+			}
+
+			ColumnarGroupHeader header = {};
+			header.keyCount = static_cast<uint32_t>(rows.keyPaths.size());
+			header.valueCount = static_cast<uint32_t>(rows.names.size());
+			size_t size = sizeof(header);
+			for (uint32_t column = 0; column < ColumnarColumnCount; column++)
+			{
+				header.columnSizes[column] = columns[column].size();
+				size += columns[column].size();
+			}
+
+			std::vector<uint8_t> encoded;
+			encoded.reserve(size);
+			encoded.insert(encoded.end(), reinterpret_cast<const uint8_t*>(&header),
+				reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+			for (const std::vector<uint8_t>& column : columns)
+			{
+				encoded.insert(encoded.end(), column.begin(), column.end());
+			}
+			return encoded;
+		}
+
+	} // namespace columnar_detail
+
+
+	//------------------------------------------------------------------------------
+	// Writes keys to a columnar file (see the notes at the top of this file).
+	// AddKey() can be called from several threads at once.
+	//------------------------------------------------------------------------------
+	class ColumnarWriter : public TreeSink
+	{
+	public:
+
+		// Creates the file, and starts the encoder threads.
+		// Throws std::runtime_error if the file can't be created.
+		explicit ColumnarWriter(const std::filesystem::path& fileName, const ColumnarExportOptions& options = {})
+			: m_options(options), m_start(std::chrono::steady_clock::now())
+		{
+			m_options.threads = (std::max)(m_options.threads, size_t(1));
+			m_options.rowGroupValues = (std::max)(m_options.rowGroupValues, size_t(1));
+
+			m_file = OpenFile(fileName, "wb");
+			if (m_file == nullptr)
+			{
+				throw std::runtime_error("ColumnarWriter: can't create the file.");
+			}
+
+			ColumnarFileHeader header = {};
+			memcpy(header.magic, "WRCOL001", 8);
+			if (fwrite(&header, sizeof(header), 1, m_file) != 1)
+			{
+				m_failed = true;
+			}
+			m_stats.fileBytes = sizeof(header);
+
+			for (size_t t = 0; t < m_options.threads; t++)
+			{
+				m_workers.emplace_back([this] { Encode(); });
+			}
+		}
+
+
+		// Closes the file, if Close() wasn't called; errors are ignored
+		~ColumnarWriter() override
+		{
+			try
+			{
+				Close();
+			}
+			catch (...)
+			{
+			}
+		}
+
+
+		ColumnarWriter(const ColumnarWriter&) = delete;
+		ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+
+		// Adds a key, with its path relative to the root of the export ("" for the root).
+		// Waits while the row groups in memory are at their maximum.
+		// Throws std::runtime_error if the file can't be written.
+		void AddKey(std::wstring_view path, const std::vector<RawValue>& values)
+		{
+			using namespace columnar_detail;
+
+			std::string utf8Path = ToUtf8(path);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			ThrowIfFailed();
+			_ASSERTE(!m_closed);
+
+			m_group.keyPaths.push_back(std::move(utf8Path));
+			m_group.valueCounts.push_back(static_cast<uint32_t>(values.size()));
+			for (const RawValue& value : values)
+			{
+				m_group.names.push_back(ToUtf8(value.name));
+				m_group.types.push_back(value.type);
+				m_group.data.insert(m_group.data.end(), value.data.begin(), value.data.end());
+				m_group.dataSizes.push_back(static_cast<uint32_t>(value.data.size()));
+				m_stats.dataBytes += value.data.size();
+			}
+			m_stats.keys++;
+			m_stats.values += values.size();
+
+			if (m_group.names.size() >= m_options.rowGroupValues || m_group.data.size() >= m_options.rowGroupBytes)
+			{
+				Submit(lock);
+			}
+		}
+
+
+		void WriteKey(const KeyContents& contents) override
+		{
+			AddKey(contents.path, contents.values);
+		}
+
+
+		// Writes out the last row group, stops the encoder threads and closes the file.
+		// Throws std::runtime_error if the file can't be written.
+		ColumnarExportStats Close()
+		{
+			std::exception_ptr error;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (m_closed)
+				{
+					return m_stats;
+				}
+				m_closed = true;
+				if (!m_group.Empty())
+				{
+					try
+					{
+						Submit(lock);
+					}
+					catch (...)
+					{
+						error = std::current_exception();
+					}
+				}
+				m_stopping = true;
+			}
+			m_changed.notify_all();
+			for (std::thread& worker : m_workers)
+			{
+				worker.join();
+			}
+			m_workers.clear();
+
+			if (fclose(m_file) != 0)
+			{
+				m_failed = true;
+			}
+			m_file = nullptr;
+			m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+
+			if (error)
+			{
+				std::rethrow_exception(error);
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			ThrowIfFailed();
+			return m_stats;
+		}
+
+	private:
+		ColumnarExportOptions m_options;
+		std::chrono::steady_clock::time_point m_start;
+		FILE* m_file = nullptr;
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_mutex;
+		std::condition_variable m_changed;
+		columnar_detail::RowGroup m_group;
+		std::deque<std::pair<size_t, columnar_detail::RowGroup>> m_queue;
+		std::map<size_t, std::vector<uint8_t>> m_encoded;  // by sequence number, until written
+		size_t m_nextGroup = 0;
+		size_t m_nextWrite = 0;
+		size_t m_inMemory = 0;          // row groups queued, encoding, or waiting to be written
+		bool m_writing = false;
+		bool m_stopping = false;
+		bool m_closed = false;
+		bool m_failed = false;
+		std::exception_ptr m_error;
+		ColumnarExportStats m_stats;
+
+
+		// Called with the mutex held
+		void ThrowIfFailed()
+		{
+			if (m_error)
+			{
+				std::rethrow_exception(m_error);
+			}
+			if (m_failed)
+			{
+				throw std::runtime_error("ColumnarWriter: can't write the file.");
+			}
+		}
+
+		// Queues the current row group for the encoders; called with the mutex held
+		void Submit(std::unique_lock<std::mutex>& lock)
+		{
+			m_changed.wait(lock, [&] { return m_inMemory < m_options.threads || m_error || m_failed; });
+			ThrowIfFailed();
+
+			m_queue.emplace_back(m_nextGroup++, std::move(m_group));
+			m_group = columnar_detail::RowGroup();
+			m_inMemory++;
+			m_stats.rowGroups++;
+			m_stats.peakRowGroups = (std::max)(m_stats.peakRowGroups, m_inMemory + 1);
+			m_changed.notify_all();
+		}
+
+		// Encoder thread: encodes row groups, and writes out those next in order
+		void Encode()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (;;)
+			{
+				m_changed.wait(lock, [&] { return m_stopping || !m_queue.empty(); });
+				if (m_queue.empty())
+				{
+					return;
+				}
+
+				std::pair<size_t, columnar_detail::RowGroup> job = std::move(m_queue.front());
+				m_queue.pop_front();
+				lock.unlock();
+
+				std::vector<uint8_t> encoded;
+				std::exception_ptr error;
+				try
+				{
+					encoded = columnar_detail::EncodeRowGroup(job.second);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+				job.second = columnar_detail::RowGroup();
+
+				lock.lock();
+				if (error && !m_error)
+				{
+					m_error = error;
+				}
+				m_encoded.emplace(job.first, std::move(encoded));
+
+				// One thread at a time writes, the others go on encoding
+				while (!m_writing && !m_encoded.empty() && m_encoded.begin()->first == m_nextWrite)
+				{
+					std::vector<uint8_t> next = std::move(m_encoded.begin()->second);
+					m_encoded.erase(m_encoded.begin());
+					m_writing = true;
+					lock.unlock();
+
+					const bool written = next.empty() || fwrite(next.data(), 1, next.size(), m_file) == next.size();
+
+					lock.lock();
+					m_writing = false;
+					m_failed = m_failed || !written;
+					m_stats.fileBytes += next.size();
+					m_nextWrite++;
+					m_inMemory--;
+				}
+				m_changed.notify_all();
+			}
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Exports the key tree of a source, depth-first, sub-keys in the order of the
+	// source. Throws on failure (RegException for registry errors, std::runtime_error
+	// if the file can't be written).
+	//------------------------------------------------------------------------------
+	inline ColumnarExportStats ExportTree(TreeSource& source, const std::filesystem::path& fileName,
+		const ColumnarExportOptions& options = {})
+	{
+		ColumnarWriter writer(fileName, options);
+		std::vector<std::wstring> pending(1);
+		KeyContents contents;
+		while (!pending.empty())
+		{
+			contents.path = std::move(pending.back());
+			pending.pop_back();
+			contents.values.clear();
+			contents.subKeyNames.clear();
+			source.ReadKey(contents.path, contents);
+			writer.AddKey(contents.path, contents.values);
+
+			for (auto it = contents.subKeyNames.rbegin(); it != contents.subKeyNames.rend(); ++it)
+			{
+				pending.push_back(contents.path.empty() ? *it : contents.path + L'\\' + *it);
+			}
+		}
+		return writer.Close();
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Exports a registry key tree. The root handle needs KEY_READ access.
+	//------------------------------------------------------------------------------
+	inline ColumnarExportStats ExportRegistryTree(HKEY root, const std::filesystem::path& fileName,
+		const ColumnarExportOptions& options = {})
+	{
+		RegistrySource source(root);
+		return ExportTree(source, fileName, options);
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Exports the key tree of an offline hive, walking its cells directly.
+	// Throws RegException with ERROR_BADDB if the hive is corrupt.
+	//------------------------------------------------------------------------------
+	inline ColumnarExportStats ExportHive(const HiveView& hive, const std::filesystem::path& fileName,
+		const ColumnarExportOptions& options = {})
+	{
+		struct Pending
+		{
+			uint32_t cellOffset;
+			size_t depth;
+			std::wstring path;
+		};
+
+		ColumnarWriter writer(fileName, options);
+		std::vector<Pending> pending{ Pending{ hive.RootCell(), 0, std::wstring() } };
+		std::vector<RawValue> values;
+		std::vector<std::pair<uint32_t, std::wstring>> subKeys;
+		while (!pending.empty())
+		{
+			const Pending key = std::move(pending.back());
+			pending.pop_back();
+			if (key.depth > hive_detail::MaxKeyDepth)
+			{
+				hive_detail::ThrowCorrupt(L"ExportHive: key tree too deep, or looping.");
+			}
+
+			const HiveKey hiveKey(hive, key.cellOffset);
+			values.clear();
+			hiveKey.ForEachValue([&](const HiveValue& value)
+			{
+				values.push_back(RawValue{ value.Name(), value.Type(), {} });
+				value.ReadData(values.back().data);
+			});
+			writer.AddKey(key.path, values);
+
+			subKeys.clear();
+			hiveKey.ForEachSubKey([&](const HiveKey& subKey)
+			{
+				subKeys.emplace_back(subKey.CellOffset(), subKey.Name());
+			});
+			for (auto it = subKeys.rbegin(); it != subKeys.rend(); ++it)
+			{
+				pending.push_back(Pending{ it->first, key.depth + 1,
+					key.path.empty() ? it->second : key.path + L'\\' + it->second });
+			}
+		}
+		return writer.Close();
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Exports the key tree of a hive file, mapped in memory.
+	// Throws std::runtime_error if the file can't be mapped.
+	//------------------------------------------------------------------------------
+	inline ColumnarExportStats ExportHiveFile(const std::filesystem::path& hiveFileName,
+		const std::filesystem::path& fileName, const ColumnarExportOptions& options = {})
+	{
+		const MappedFile file(hiveFileName);
+		return ExportHive(HiveView(file.Data(), file.Size()), fileName, options);
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Bytes of the value data column, in the mapped file
+	//------------------------------------------------------------------------------
+	struct ColumnarBytes
+	{
+		const BYTE* data;
+		size_t size;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// The columns of a row group read by ColumnarReader; the columns not asked for
+	// are left empty
+	//------------------------------------------------------------------------------
+	struct ColumnarRowGroup
+	{
+		// KeyPathColumn: for each key, its path and its number of values (the values
+		// are in the order of the keys)
+		std::vector<std::wstring> keyPaths;
+		std::vector<uint32_t> valueCounts;
+
+		// ValueNameColumn: the names used in the row group, and for each value the index
+		// of its name
+		std::vector<std::wstring> nameDictionary;
+		std::vector<uint32_t> names;
+
+		// ValueTypeColumn
+		std::vector<DWORD> types;
+
+		// ValueDataColumn: valid as long as the reader
+		std::vector<ColumnarBytes> data;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Reads a columnar file, column by column (see the notes at the top of this
+	// file). ReadRowGroup() can be called from several threads at once.
+	//------------------------------------------------------------------------------
+	class ColumnarReader
+	{
+	public:
+
+		// Maps the file, and reads the headers of its row groups.
+		// Throws std::runtime_error if the file can't be read, or isn't a columnar file.
+		explicit ColumnarReader(const std::filesystem::path& fileName)
+			: m_file(fileName)
+		{
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(m_file.Data());
+			const size_t size = m_file.Size();
+			if (size < sizeof(ColumnarFileHeader) || memcmp(data, "WRCOL001", 8) != 0)
+			{
+				throw std::runtime_error("ColumnarReader: not a columnar file.");
+			}
+
+			for (size_t offset = sizeof(ColumnarFileHeader); offset < size; )
+			{
+				if (size - offset < sizeof(ColumnarGroupHeader))
+				{
+					throw std::runtime_error("ColumnarReader: truncated file.");
+				}
+				Group group = {};
+				memcpy(&group.header, data + offset, sizeof(group.header));
+				offset += sizeof(group.header);
+				for (uint32_t column = 0; column < ColumnarColumnCount; column++)
+				{
+					if (group.header.columnSizes[column] > size - offset)
+					{
+						throw std::runtime_error("ColumnarReader: truncated file.");
+					}
+					group.columns[column] = offset;
+					offset += static_cast<size_t>(group.header.columnSizes[column]);
+				}
+
+				// Every row takes at least a byte in each column (a key path, three): larger
+				// counts are corrupt, and mustn't make the readers reserve huge buffers
+				const uint64_t* sizes = group.header.columnSizes;
+				if (uint64_t(group.header.keyCount) * 3 > sizes[KeyPathColumn]
+					|| group.header.valueCount > sizes[ValueNameColumn]
+					|| group.header.valueCount > sizes[ValueTypeColumn]
+					|| group.header.valueCount > sizes[ValueDataColumn])
+				{
+					columnar_detail::ThrowCorrupt();
+				}
+				m_keys += group.header.keyCount;
+				m_values += group.header.valueCount;
+				m_groups.push_back(group);
+			}
+		}
+
+
+		size_t RowGroupCount() const noexcept
+		{
+			return m_groups.size();
+		}
+
+		uint64_t KeyCount() const noexcept
+		{
+			return m_keys;
+		}
+
+		uint64_t ValueCount() const noexcept
+		{
+			return m_values;
+		}
+
+		const ColumnarGroupHeader& RowGroupHeader(size_t group) const
+		{
+			_ASSERTE(group < m_groups.size());
+			return m_groups[group].header;
+		}
+
+
+		// Decodes the columns of a row group selected by the mask (see ColumnBit()).
+		// Throws std::runtime_error if the row group is corrupt.
+		void ReadRowGroup(size_t group, uint32_t columns, ColumnarRowGroup& rows) const
+		{
+			using namespace columnar_detail;
+
+			_ASSERTE(group < m_groups.size());
+			const Group& g = m_groups[group];
+			rows = ColumnarRowGroup();
+
+			auto begin = [&](ColumnarColumn column)
+			{
+				return reinterpret_cast<const uint8_t*>(m_file.Data()) + g.columns[column];
+			};
+			auto end = [&](ColumnarColumn column)
+			{
+				return begin(column) + g.header.columnSizes[column];
+			};
+
+			if ((columns & ColumnBit(KeyPathColumn)) != 0)
+			{
+				const uint8_t* p = begin(KeyPathColumn);
+				const uint8_t* const last = end(KeyPathColumn);
+				rows.keyPaths.reserve(g.header.keyCount);
+				rows.valueCounts.reserve(g.header.keyCount);
+				std::string path;
+				uint64_t values = 0;
+				for (uint32_t i = 0; i < g.header.keyCount; i++)
+				{
+					const uint64_t shared = GetVarint(p, last);
+					const size_t length = GetSize(p, last);
+					if (shared > path.size())
+					{
+						ThrowCorrupt();
+					}
+					path.resize(static_cast<size_t>(shared));
+					path.append(reinterpret_cast<const char*>(p), length);
+					p += length;
+					rows.keyPaths.push_back(FromUtf8(path.data(), path.size()));
+					rows.valueCounts.push_back(static_cast<uint32_t>(GetVarint(p, last)));
+					values += rows.valueCounts.back();
+				}
+				if (p != last || values != g.header.valueCount)
+				{
+					ThrowCorrupt();
+				}
+			}
+
+			if ((columns & ColumnBit(ValueNameColumn)) != 0)
+			{
+				const uint8_t* p = begin(ValueNameColumn);
+				const uint8_t* const last = end(ValueNameColumn);
+				const size_t entries = GetSize(p, last);
+				if (entries > static_cast<size_t>(last - p))
+				{
+					ThrowCorrupt();     // each entry takes at least a byte
+				}
+				rows.nameDictionary.reserve(entries);
+				for (size_t i = 0; i < entries; i++)
+				{
+					const size_t length = GetSize(p, last);
+					rows.nameDictionary.push_back(FromUtf8(reinterpret_cast<const char*>(p), length));
+					p += length;
+				}
+				rows.names.reserve(g.header.valueCount);
+				for (uint32_t i = 0; i < g.header.valueCount; i++)
+				{
+					rows.names.push_back(static_cast<uint32_t>(GetVarint(p, last)));
+					if (rows.names.back() >= entries)
+					{
+						ThrowCorrupt();
+					}
+				}
+				if (p != last)
+				{
+					ThrowCorrupt();
+				}
+			}
+
+			if ((columns & ColumnBit(ValueTypeColumn)) != 0)
+			{
+				const uint8_t* p = begin(ValueTypeColumn);
+				const uint8_t* const last = end(ValueTypeColumn);
+				rows.types.reserve(g.header.valueCount);
+				for (uint32_t i = 0; i < g.header.valueCount; i++)
+				{
+					rows.types.push_back(static_cast<DWORD>(GetVarint(p, last)));
+				}
+				if (p != last)
+				{
+					ThrowCorrupt();
+				}
+			}
+
+			if ((columns & ColumnBit(ValueDataColumn)) != 0)
+			{
+				const uint8_t* p = begin(ValueDataColumn);
+				const uint8_t* const last = end(ValueDataColumn);
+				rows.data.reserve(g.header.valueCount);
+				for (uint32_t i = 0; i < g.header.valueCount; i++)
+				{
+					const size_t size = GetSize(p, last);
+					rows.data.push_back(ColumnarBytes{ reinterpret_cast<const BYTE*>(p), size });
+					p += size;
+				}
+				if (p != last)
+				{
+					ThrowCorrupt();
+				}
+			}
+		}
+
+	private:
+		struct Group
+		{
+			ColumnarGroupHeader header;
+			size_t columns[ColumnarColumnCount];    // file offsets of the column chunks
+		};
+
+		MappedFile m_file;
+		std::vector<Group> m_groups;
+		uint64_t m_keys = 0;
+		uint64_t m_values = 0;
+	};
+
+} // namespace winreg
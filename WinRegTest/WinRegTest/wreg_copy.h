@@ -0,0 +1,525 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_copy.h
+// DESC: Parallel, pipelined copy of key trees, between any two backends.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// CopyTree() copies a key tree from a TreeSource to a TreeSink:
+//
+//  - reader threads take key paths from a shared stack, read each key (its
+//    values and sub-key names) and push the sub-keys back on the stack: the
+//    independent subtrees are read in parallel, depth-first;
+//
+//  - the keys read flow to writer threads through a bounded queue: when the
+//    writers fall behind, the readers wait, so memory stays bounded by the
+//    queue capacity (plus the stack of paths still to read);
+//
+//  - writers create each key with its values. Keys can be written in any
+//    order: creating a key creates its missing parents.
+//
+// The source and the sink are interfaces: RegistrySource and RegistrySink copy
+// between live keys, and other backends (e.g. an offline hive, or a file) just
+// implement ReadKey() or WriteKey(). Both must be callable from several
+// threads at once.
+//
+// Values are copied as raw data, so all value types are preserved.
+// Keys and values that fail are reported, and the copy goes on. An exception
+// thrown by a filter instead stops the copy, and CopyTree() rethrows it once
+// all the threads have stopped.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::remove_if, std::max
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <cstdint>      // uint64_t
+#include <deque>        // std::deque
+#include <exception>    // std::exception, std::exception_ptr
+#include <functional>   // std::function
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// A value with its raw data, as laid out by the Win32 API
+	//------------------------------------------------------------------------------
+	struct RawValue
+	{
+		std::wstring name;
+		DWORD type;
+		std::vector<BYTE> data;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key read from a TreeSource: its values, and the names of its sub-keys
+	//------------------------------------------------------------------------------
+	struct KeyContents
+	{
+		std::wstring path;      // relative to the root of the copy ("" for the root)
+		std::vector<RawValue> values;
+		std::vector<std::wstring> subKeyNames;
+	};
+
+
+	class TreeSource
+	{
+	public:
+		virtual ~TreeSource() = default;
+
+		// Reads the key at the given path (relative to the source's root) into contents.
+		// Throws on failure (RegException for registry errors).
+		virtual void ReadKey(const std::wstring& path, KeyContents& contents) = 0;
+	};
+
+
+	class TreeSink
+	{
+	public:
+		virtual ~TreeSink() = default;
+
+		// Creates the key at the given path (relative to the sink's root), and writes its values.
+		// Throws on failure (RegException for registry errors).
+		virtual void WriteKey(const KeyContents& contents) = 0;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Reads a key tree of the registry. The root handle needs KEY_READ access,
+	// and must stay open during the copy.
+	//------------------------------------------------------------------------------
+	class RegistrySource : public TreeSource
+	{
+	public:
+		explicit RegistrySource(HKEY root)
+			: m_root(root)
+		{
+			_ASSERTE(root != nullptr);
+		}
+
+		void ReadKey(const std::wstring& path, KeyContents& contents) override
+		{
+			if (path.empty())
+			{
+				Read(m_root, contents);
+				return;
+			}
+
+			RegKey key = RegKey::OpenKey(m_root, path, KEY_READ);
+			Read(key.Handle(), contents);
+		}
+
+	private:
+		HKEY m_root;
+
+		static void Read(HKEY hKey, KeyContents& contents)
+		{
+			detail::ForEachRawValue(hKey, [&](std::wstring_view name, DWORD type, const BYTE* data, DWORD dataSize)
+			{
+				contents.values.push_back(RawValue{ std::wstring(name), type, std::vector<BYTE>(data, data + dataSize) });
+			});
+			contents.subKeyNames = EnumerateSubKeyNames(hKey);
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Writes a key tree to the registry. The root handle needs KEY_WRITE access,
+	// and must stay open during the copy.
+	//------------------------------------------------------------------------------
+	class RegistrySink : public TreeSink
+	{
+	public:
+		explicit RegistrySink(HKEY root)
+			: m_root(root)
+		{
+			_ASSERTE(root != nullptr);
+		}
+
+		void WriteKey(const KeyContents& contents) override
+		{
+			if (contents.path.empty())
+			{
+				Write(m_root, contents);
+				return;
+			}
+
+			RegKey key = RegKey::CreateKey(m_root, contents.path, 0, KEY_WRITE);
+			Write(key.Handle(), contents);
+		}
+
+	private:
+		HKEY m_root;
+
+		static void Write(HKEY hKey, const KeyContents& contents)
+		{
+			for (const RawValue& value : contents.values)
+			{
+				detail::WriteRawValueInternal(hKey, value.name, value.type, value.data.data(), value.data.size(),
+					L"RegSetValueEx() failed in copying a value.");
+			}
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Options of CopyTree()
+	//------------------------------------------------------------------------------
+	struct CopyTreeOptions
+	{
+		size_t readerThreads = 4;
+		size_t writerThreads = 4;
+		size_t queueCapacity = 256;     // keys read and not yet written
+
+		// Return false to skip a key (path relative to the root) with its whole subtree.
+		// Called from the reader threads; if it throws, the copy stops and CopyTree()
+		// rethrows the exception.
+		std::function<bool(const std::wstring& keyPath)> keyFilter;
+
+		// Return false to skip a value. Called from the writer threads, like keyFilter.
+		std::function<bool(const std::wstring& keyPath, const std::wstring& valueName)> valueFilter;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key that couldn't be copied
+	//------------------------------------------------------------------------------
+	struct CopyFailure
+	{
+		std::wstring keyPath;
+		bool reading;           // failed reading from the source, or writing to the sink
+		LONG errorCode;         // for RegException, or ERROR_GEN_FAILURE
+		std::wstring message;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Results of CopyTree()
+	//------------------------------------------------------------------------------
+	struct CopyTreeStats
+	{
+		size_t keysCopied = 0;
+		size_t valuesCopied = 0;
+		uint64_t bytesCopied = 0;       // value data
+		size_t keysSkipped = 0;         // by the filter
+		size_t valuesSkipped = 0;
+		std::vector<CopyFailure> failures;
+		double seconds = 0;
+
+		double KeysPerSecond() const noexcept
+		{
+			return (seconds > 0) ? keysCopied / seconds : 0;
+		}
+
+		double BytesPerSecond() const noexcept
+		{
+			return (seconds > 0) ? bytesCopied / seconds : 0;
+		}
+	};
+
+
+	namespace copy_detail
+	{
+		// Blocking queue with a capacity: Push() waits while it's full
+		template <typename T>
+		class BoundedQueue
+		{
+		public:
+			explicit BoundedQueue(size_t capacity)
+				: m_capacity((std::max)(capacity, size_t(1)))
+			{
+			}
+
+			void Push(T item)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_notFull.wait(lock, [&] { return m_items.size() < m_capacity; });
+				m_items.push_back(std::move(item));
+				m_notEmpty.notify_one();
+			}
+
+			// Returns false when the queue is closed and empty
+			bool Pop(T& item)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_notEmpty.wait(lock, [&] { return !m_items.empty() || m_closed; });
+				if (m_items.empty())
+				{
+					return false;
+				}
+				item = std::move(m_items.front());
+				m_items.pop_front();
+				m_notFull.notify_one();
+				return true;
+			}
+
+			void Close()
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_closed = true;
+				m_notEmpty.notify_all();
+			}
+
+		private:
+			std::mutex m_mutex;
+			std::condition_variable m_notEmpty;
+			std::condition_variable m_notFull;
+			std::deque<T> m_items;
+			size_t m_capacity;
+			bool m_closed = false;
+		};
+
+
+		inline CopyFailure MakeFailure(const std::wstring& keyPath, bool reading)
+		{
+			try
+			{
+				throw;
+			}
+			catch (const RegException& e)
+			{
+				return CopyFailure{ keyPath, reading, e.ErrorCode(), e.ErrorMessage() };
+			}
+			catch (const std::exception& e)
+			{
+				const std::string what = e.what();
+				return CopyFailure{ keyPath, reading, ERROR_GEN_FAILURE, std::wstring(what.begin(), what.end()) };
+			}
+		}
+
+	} // namespace copy_detail
+
+
+	//------------------------------------------------------------------------------
+	// Copies the tree below the source's root to the sink's root (see the notes at
+	// the top of this file). Existing keys and values in the sink are kept, or
+	// overwritten by the copied ones.
+	//------------------------------------------------------------------------------
+	inline CopyTreeStats CopyTree(TreeSource& source, TreeSink& sink, const CopyTreeOptions& options = CopyTreeOptions())
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		CopyTreeStats stats;
+		std::mutex statsMutex;
+
+		// Paths still to read; pending counts them plus the ones being read
+		std::mutex pathsMutex;
+		std::condition_variable pathsChanged;
+		std::vector<std::wstring> paths{ std::wstring() };
+		size_t pending = 1;
+
+		copy_detail::BoundedQueue<KeyContents> queue(options.queueCapacity);
+
+		// The first exception thrown by a filter (guarded by pathsMutex): it stops the
+		// readers, and the writers just drain the queue so that no reader stays blocked
+		std::exception_ptr filterError;
+		std::atomic<bool> stopped{ false };
+		auto stop = [&]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(pathsMutex);
+				if (!filterError)
+				{
+					filterError = std::current_exception();
+				}
+				stopped = true;
+			}
+			pathsChanged.notify_all();
+		};
+
+		auto reader = [&]()
+		{
+			for (;;)
+			{
+				std::wstring path;
+				{
+					std::unique_lock<std::mutex> lock(pathsMutex);
+					pathsChanged.wait(lock, [&] { return !paths.empty() || pending == 0 || stopped; });
+					if (paths.empty() || stopped)
+					{
+						return;
+					}
+					path = std::move(paths.back());
+					paths.pop_back();
+				}
+
+				KeyContents contents;
+				contents.path = path;
+				bool read = false;
+				try
+				{
+					source.ReadKey(path, contents);
+					read = true;
+				}
+				catch (...)
+				{
+					CopyFailure failure = copy_detail::MakeFailure(path, true);
+					std::lock_guard<std::mutex> lock(statsMutex);
+					stats.failures.push_back(std::move(failure));
+				}
+
+				size_t keysSkipped = 0;
+				std::vector<std::wstring> subKeyPaths;
+				if (read)
+				{
+					try
+					{
+						subKeyPaths.reserve(contents.subKeyNames.size());
+						for (const std::wstring& name : contents.subKeyNames)
+						{
+							std::wstring subKeyPath = path.empty() ? name : path + L"\\" + name;
+							if (options.keyFilter && !options.keyFilter(subKeyPath))
+							{
+								keysSkipped++;
+								continue;
+							}
+							subKeyPaths.push_back(std::move(subKeyPath));
+						}
+					}
+					catch (...)
+					{
+						stop();
+						return;
+					}
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(pathsMutex);
+					pending += subKeyPaths.size();
+					for (std::wstring& subKeyPath : subKeyPaths)
+					{
+						paths.push_back(std::move(subKeyPath));
+					}
+				}
+				pathsChanged.notify_all();
+
+				if (read)
+				{
+					if (keysSkipped != 0)
+					{
+						std::lock_guard<std::mutex> lock(statsMutex);
+						stats.keysSkipped += keysSkipped;
+					}
+					queue.Push(std::move(contents));
+				}
+
+				// Done with this path: when nothing is pending any more, the readers stop
+				{
+					std::lock_guard<std::mutex> lock(pathsMutex);
+					pending--;
+				}
+				pathsChanged.notify_all();
+			}
+		};
+
+		auto writer = [&]()
+		{
+			KeyContents contents;
+			while (queue.Pop(contents))
+			{
+				if (stopped)
+				{
+					continue;
+				}
+
+				size_t valuesSkipped = 0;
+				if (options.valueFilter)
+				{
+					try
+					{
+						auto& values = contents.values;
+						const auto end = std::remove_if(values.begin(), values.end(), [&](const RawValue& value)
+						{
+							return !options.valueFilter(contents.path, value.name);
+						});
+						valuesSkipped = static_cast<size_t>(values.end() - end);
+						values.erase(end, values.end());
+					}
+					catch (...)
+					{
+						stop();
+						continue;
+					}
+				}
+
+				try
+				{
+					sink.WriteKey(contents);
+
+					uint64_t bytes = 0;
+					for (const RawValue& value : contents.values)
+					{
+						bytes += value.data.size();
+					}
+
+					std::lock_guard<std::mutex> lock(statsMutex);
+					stats.keysCopied++;
+					stats.valuesCopied += contents.values.size();
+					stats.bytesCopied += bytes;
+					stats.valuesSkipped += valuesSkipped;
+				}
+				catch (...)
+				{
+					CopyFailure failure = copy_detail::MakeFailure(contents.path, false);
+					std::lock_guard<std::mutex> lock(statsMutex);
+					stats.failures.push_back(std::move(failure));
+				}
+			}
+		};
+
+		std::vector<std::thread> readers;
+		std::vector<std::thread> writers;
+		for (size_t i = 0; i < (std::max)(options.writerThreads, size_t(1)); i++)
+		{
+			writers.emplace_back(writer);
+		}
+		for (size_t i = 0; i < (std::max)(options.readerThreads, size_t(1)); i++)
+		{
+			readers.emplace_back(reader);
+		}
+
+		for (std::thread& thread : readers)
+		{
+			thread.join();
+		}
+		queue.Close();
+		for (std::thread& thread : writers)
+		{
+			thread.join();
+		}
+
+		if (filterError)
+		{
+			std::rethrow_exception(filterError);
+		}
+
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return stats;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Copies a key tree of the registry to another key
+	//------------------------------------------------------------------------------
+	inline CopyTreeStats CopyTree(HKEY sourceRoot, HKEY destinationRoot,
+		const CopyTreeOptions& options = CopyTreeOptions())
+	{
+		RegistrySource source(sourceRoot);
+		RegistrySink sink(destinationRoot);
+		return CopyTree(source, sink, options);
+	}
+
+} // namespace winreg
@@ -0,0 +1,250 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_delete.h
+// DESC: Recursive deletion of key trees, deleting independent keys in parallel.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// RegDeleteKeyEx() (and so winreg::DeleteKey()) only deletes keys without
+// sub-keys. DeleteTree() deletes a whole tree:
+//
+//  1. the tree is walked once, recording each key with its parent and its
+//     number of sub-keys;
+//
+//  2. worker threads delete the leaves, in parallel; when the last sub-key of
+//     a key is gone, the key itself becomes a leaf, and is queued.
+//
+// A key that can't be read or deleted is reported (once), and its ancestors
+// are left in place (they still have a sub-key); all the other keys are
+// deleted anyway.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::min, std::max
+#include <chrono>       // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <exception>    // std::exception_ptr
+#include <functional>   // std::function
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Options of DeleteTree()
+	//------------------------------------------------------------------------------
+	struct DeleteTreeOptions
+	{
+		size_t threads = 4;
+		REGSAM view = KEY_WOW64_64KEY;          // as for DeleteKey()
+
+		// Called with the number of keys deleted so far and the number of keys found,
+		// every progressInterval deleted keys, and at the end. Calls are serialized and
+		// in order (the deletion waits for them). If it throws, the deletion stops, and
+		// DeleteTree() rethrows the exception.
+		std::function<void(size_t keysDeleted, size_t keysFound)> onProgress;
+		size_t progressInterval = 1000;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key that couldn't be read or deleted
+	//------------------------------------------------------------------------------
+	struct DeleteFailure
+	{
+		std::wstring keyPath;       // relative to the key passed to DeleteTree()
+		LONG errorCode;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Results of DeleteTree()
+	//------------------------------------------------------------------------------
+	struct DeleteTreeStats
+	{
+		size_t keysFound = 0;
+		size_t keysDeleted = 0;
+		std::vector<DeleteFailure> failures;
+		double seconds = 0;
+
+		bool Completed() const noexcept
+		{
+			return keysDeleted == keysFound && failures.empty();
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Deletes subKey of hKey, with all its sub-keys (see the notes at the top of
+	// this file). Failures on single keys are reported in the results; throws
+	// RegException only if subKey itself can't be opened.
+	//------------------------------------------------------------------------------
+	inline DeleteTreeStats DeleteTree(HKEY hKey, const std::wstring& subKey,
+		const DeleteTreeOptions& options = DeleteTreeOptions())
+	{
+		_ASSERTE(hKey != nullptr);
+		_ASSERTE(!subKey.empty());
+
+		const auto start = std::chrono::steady_clock::now();
+		const size_t noParent = static_cast<size_t>(-1);
+
+		struct Node
+		{
+			std::wstring path;
+			size_t parent;
+			size_t remainingSubKeys;
+			bool failed;                // already reported in the failures
+		};
+
+		DeleteTreeStats stats;
+		std::vector<Node> nodes;
+		std::vector<size_t> ready;      // keys with no sub-keys left
+
+		// Paths in the results are relative to subKey
+		auto relativePath = [&](const std::wstring& path)
+		{
+			return path.substr((std::min)(path.size(), subKey.size() + 1));
+		};
+
+		// 1. Walk the tree
+		nodes.push_back(Node{ subKey, noParent, 0, false });
+		std::vector<size_t> toVisit{ 0 };
+		while (!toVisit.empty())
+		{
+			const size_t index = toVisit.back();
+			toVisit.pop_back();
+
+			std::vector<std::wstring> names;
+			HKEY hNode = nullptr;
+			LONG result = ::RegOpenKeyEx(hKey, nodes[index].path.c_str(), 0, KEY_READ | options.view, &hNode);
+			if (result != ERROR_SUCCESS && index == 0)
+			{
+				throw RegException(L"RegOpenKeyEx() failed trying opening the key tree to delete.", result);
+			}
+			if (result == ERROR_SUCCESS)
+			{
+				RegKey key(hNode);
+				try
+				{
+					names = EnumerateSubKeyNames(key.Handle());
+				}
+				catch (const RegException& e)
+				{
+					result = e.ErrorCode();
+				}
+			}
+			if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND)
+			{
+				// Still try to delete it: it may have no sub-keys
+				stats.failures.push_back(DeleteFailure{ relativePath(nodes[index].path), result });
+				nodes[index].failed = true;
+			}
+
+			nodes[index].remainingSubKeys = names.size();
+			if (names.empty())
+			{
+				ready.push_back(index);
+			}
+			for (const std::wstring& name : names)
+			{
+				toVisit.push_back(nodes.size());
+				nodes.push_back(Node{ nodes[index].path + L"\\" + name, index, 0, false });
+			}
+		}
+		stats.keysFound = nodes.size();
+
+		// 2. Delete the leaves, in parallel
+		std::mutex mutex;
+		std::condition_variable changed;
+		size_t active = 0;
+		std::exception_ptr progressError;   // thrown by onProgress: stops the workers
+
+		auto worker = [&]()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;)
+			{
+				changed.wait(lock, [&] { return !ready.empty() || active == 0 || progressError; });
+				if (ready.empty() || progressError)
+				{
+					return;     // nothing queued, and nobody can queue more; or stopped
+				}
+
+				const size_t index = ready.back();
+				ready.pop_back();
+				active++;
+				lock.unlock();
+
+				LONG result = ::RegDeleteKeyEx(hKey, nodes[index].path.c_str(), options.view, 0);
+
+				lock.lock();
+				active--;
+				bool reportProgress = false;
+				if (result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND)
+				{
+					stats.keysDeleted++;
+					reportProgress = options.onProgress && options.progressInterval != 0
+						&& (stats.keysDeleted % options.progressInterval) == 0;
+
+					const size_t parent = nodes[index].parent;
+					if (parent != noParent && --nodes[parent].remainingSubKeys == 0)
+					{
+						ready.push_back(parent);
+					}
+				}
+				else if (!nodes[index].failed)
+				{
+					stats.failures.push_back(DeleteFailure{ relativePath(nodes[index].path), result });
+					nodes[index].failed = true;
+				}
+
+				// Reported under the lock, so that the reports can't get out of order
+				if (reportProgress && !progressError)
+				{
+					try
+					{
+						options.onProgress(stats.keysDeleted, stats.keysFound);
+					}
+					catch (...)
+					{
+						progressError = std::current_exception();
+					}
+				}
+				changed.notify_all();
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < (std::max)(options.threads, size_t(1)); i++)
+		{
+			threads.emplace_back(worker);
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		if (progressError)
+		{
+			std::rethrow_exception(progressError);
+		}
+		if (options.onProgress)
+		{
+			options.onProgress(stats.keysDeleted, stats.keysFound);
+		}
+
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return stats;
+	}
+
+} // namespace winreg
@@ -0,0 +1,1366 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_emu.h
+// DESC: In-memory emulation of the subset of the Win32 registry API used by
+//       wreg.h. It is included by wreg.h in place of <windows.h> on
+//       non-Windows platforms, so the library and its tests can be built and
+//       run on e.g. Linux.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// The emulation keeps one process-wide registry tree, guarded by a single mutex.
+// Key names are compared case-insensitively, sub-keys are enumerated in sorted
+// order and values in creation order, like the real registry does.
+//
+// Only what wreg.h needs is provided: the types, constants and functions keep
+// their Win32 names and signatures, so wreg.h code is the same on both platforms.
+// Hives cannot be loaded or saved, and remote registries cannot be connected to.
+//
+// Change notifications are emulated too: RegNotifyChangeKeyValue() registers an
+// event that the writes to the key (or to its sub-tree) signal once, and a few
+// event and wait functions (CreateEvent(), RegisterWaitForSingleObject(), etc.)
+// let the watchers wait for them. Wait callbacks run one at a time on a single
+// emulated wait thread, never with the registry lock held.
+//
+// winreg::emu::Reset() empties the emulated registry (e.g. between tests).
+// winreg::emu::SetEnumHook() injects faults into enumerations: the hook runs before
+// each RegEnumKeyEx()/RegEnumValue() call, and can modify the registry to reproduce
+// races with other processes writing to the key being enumerated.
+//
+//==============================================================================
+#include <algorithm>    // std::max, std::find_if
+#include <cassert>      // assert()
+#include <chrono>       // std::chrono::system_clock
+#include <condition_variable> // std::condition_variable
+#include <cstdint>      // uint32_t, uintptr_t, etc.
+#include <cstdlib>      // getenv()
+#include <cstring>      // memcpy()
+#include <cwctype>      // towupper()
+#include <functional>   // std::function
+#include <map>          // std::map
+#include <memory>       // std::shared_ptr
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+
+//------------------------------------------------------------------------------
+// Win32 types
+//------------------------------------------------------------------------------
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint8_t BYTE;
+typedef int BOOL;
+typedef uint8_t BOOLEAN;
+typedef unsigned long ULONG;
+typedef wchar_t WCHAR;
+typedef DWORD REGSAM;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t DWORD_PTR;
+typedef DWORD * LPDWORD;
+typedef BYTE * LPBYTE;
+typedef wchar_t * LPWSTR;
+typedef const wchar_t * LPCWSTR;
+typedef void * PVOID;
+typedef void * HANDLE;
+typedef HANDLE * PHANDLE;
+typedef struct _SECURITY_ATTRIBUTES * LPSECURITY_ATTRIBUTES;
+
+typedef struct _FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME, *PFILETIME;
+
+struct HKEY__;
+typedef HKEY__ * HKEY;
+typedef HKEY * PHKEY;
+
+typedef struct value_entW
+{
+	LPWSTR ve_valuename;
+	DWORD ve_valuelen;
+	DWORD_PTR ve_valueptr;
+	DWORD ve_type;
+} VALENTW, VALENT, *PVALENTW, *PVALENT;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define _ASSERTE(expr) assert(expr)
+#define CALLBACK
+
+typedef void (CALLBACK * WAITORTIMERCALLBACK)(PVOID lpParameter, BOOLEAN TimerOrWaitFired);
+
+//------------------------------------------------------------------------------
+// Win32 constants
+//------------------------------------------------------------------------------
+#define ERROR_SUCCESS               0L
+#define ERROR_FILE_NOT_FOUND        2L
+#define ERROR_ACCESS_DENIED         5L
+#define ERROR_INVALID_HANDLE        6L
+#define ERROR_NOT_ENOUGH_MEMORY     8L
+#define ERROR_GEN_FAILURE           31L
+#define ERROR_INVALID_PARAMETER     87L
+#define ERROR_CALL_NOT_IMPLEMENTED  120L
+#define ERROR_MORE_DATA             234L
+#define ERROR_NO_MORE_ITEMS         259L
+#define ERROR_BADDB                 1009L
+#define ERROR_BADKEY                1010L
+#define ERROR_CANTREAD              1012L
+#define ERROR_KEY_DELETED           1018L
+#define ERROR_UNSUPPORTED_TYPE      1630L
+
+#define REG_NONE                    0
+#define REG_SZ                      1
+#define REG_EXPAND_SZ               2
+#define REG_BINARY                  3
+#define REG_DWORD                   4
+#define REG_DWORD_BIG_ENDIAN        5
+#define REG_LINK                    6
+#define REG_MULTI_SZ                7
+#define REG_QWORD                   11
+
+#define REG_NOTIFY_CHANGE_NAME      0x00000001L
+#define REG_NOTIFY_CHANGE_ATTRIBUTES 0x00000002L
+#define REG_NOTIFY_CHANGE_LAST_SET  0x00000004L
+#define REG_NOTIFY_CHANGE_SECURITY  0x00000008L
+#define REG_NOTIFY_THREAD_AGNOSTIC  0x10000000L
+
+#define INFINITE                    0xFFFFFFFF
+#define WAIT_OBJECT_0               0x00000000L
+#define WAIT_TIMEOUT                258L
+#define WAIT_FAILED                 0xFFFFFFFF
+#define WT_EXECUTEDEFAULT           0x00000000
+#define WT_EXECUTEONLYONCE          0x00000008
+#define INVALID_HANDLE_VALUE        (reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1)))
+
+#define REG_OPTION_NON_VOLATILE     0x00000000L
+#define REG_OPTION_VOLATILE         0x00000001L
+#define REG_CREATED_NEW_KEY         0x00000001L
+#define REG_OPENED_EXISTING_KEY     0x00000002L
+
+#define KEY_QUERY_VALUE             0x0001
+#define KEY_SET_VALUE               0x0002
+#define KEY_CREATE_SUB_KEY          0x0004
+#define KEY_ENUMERATE_SUB_KEYS      0x0008
+#define KEY_NOTIFY                  0x0010
+#define KEY_CREATE_LINK             0x0020
+#define KEY_WOW64_64KEY             0x0100
+#define KEY_WOW64_32KEY             0x0200
+#define KEY_READ                    0x20019
+#define KEY_WRITE                   0x20006
+#define KEY_ALL_ACCESS              0xF003F
+
+#define HKEY_CLASSES_ROOT           (reinterpret_cast<HKEY>(static_cast<uintptr_t>(0x80000000)))
+#define HKEY_CURRENT_USER           (reinterpret_cast<HKEY>(static_cast<uintptr_t>(0x80000001)))
+#define HKEY_LOCAL_MACHINE          (reinterpret_cast<HKEY>(static_cast<uintptr_t>(0x80000002)))
+#define HKEY_USERS                  (reinterpret_cast<HKEY>(static_cast<uintptr_t>(0x80000003)))
+#define HKEY_CURRENT_CONFIG         (reinterpret_cast<HKEY>(static_cast<uintptr_t>(0x80000005)))
+
+namespace winreg
+{
+	namespace emu
+	{
+		// Orders key names the way the registry does: case-insensitively.
+		struct KeyNameLess
+		{
+			bool operator()(const std::wstring& lhs, const std::wstring& rhs) const
+			{
+				return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+					[](wchar_t a, wchar_t b) { return ::towupper(a) < ::towupper(b); });
+			}
+		};
+
+
+		inline bool NamesEqual(std::wstring_view lhs, std::wstring_view rhs)
+		{
+			return lhs.size() == rhs.size()
+				&& std::equal(lhs.begin(), lhs.end(), rhs.begin(),
+					[](wchar_t a, wchar_t b) { return ::towupper(a) == ::towupper(b); });
+		}
+
+
+		struct Value
+		{
+			std::wstring name;
+			DWORD type;
+			std::vector<BYTE> data;
+		};
+
+
+		// A pending RegNotifyChangeKeyValue() registration
+		struct ChangeWatcher
+		{
+			HKEY handle;                    // the handle it was registered on
+			bool subtree;
+			DWORD filter;                   // REG_NOTIFY_CHANGE_xxx
+			HANDLE event;
+		};
+
+
+		struct Node
+		{
+			std::map<std::wstring, std::shared_ptr<Node>, KeyNameLess> subkeys;
+			std::vector<Value> values;      // in creation order
+			uint64_t lastWriteTime = 0;     // FILETIME units
+			bool deleted = false;
+			std::weak_ptr<Node> parent;     // empty for the predefined keys
+			std::vector<ChangeWatcher> watchers;
+		};
+
+
+		//
+		// Emulated event objects, and the wait thread running the callbacks of
+		// RegisterWaitForSingleObject(). Guarded by their own mutex, which is never
+		// held while taking the registry one: events can be signaled from within
+		// the registry functions.
+		//
+		struct EventObject
+		{
+			bool manualReset;
+			bool signaled;
+		};
+
+
+		struct WaitObject
+		{
+			EventObject* event;
+			WAITORTIMERCALLBACK callback;
+			PVOID context;
+			bool executeOnlyOnce;
+			bool active = true;
+			bool running = false;           // its callback is being called
+			bool unregistered = false;      // while running: to be deleted after the callback
+			HANDLE completionEvent = nullptr;
+		};
+
+
+		struct EventState
+		{
+			std::mutex mutex;
+			std::condition_variable changed;
+			std::vector<WaitObject*> waits;
+			std::thread waitThread;
+			bool stopping = false;
+
+			~EventState()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stopping = true;
+				}
+				changed.notify_all();
+				if (waitThread.joinable())
+				{
+					waitThread.join();
+				}
+			}
+		};
+
+
+		inline EventState& GetEventState()
+		{
+			static EventState state;
+			return state;
+		}
+
+
+		inline void SignalEvent(HANDLE hEvent)
+		{
+			EventState& events = GetEventState();
+			{
+				std::lock_guard<std::mutex> lock(events.mutex);
+				static_cast<EventObject*>(hEvent)->signaled = true;
+			}
+			events.changed.notify_all();
+		}
+
+
+		// Body of the wait thread: calls the callbacks of the waits whose event
+		// is signaled, consuming the signal of auto-reset events.
+		inline void RunWaits(EventState& events)
+		{
+			std::unique_lock<std::mutex> lock(events.mutex);
+			while (!events.stopping)
+			{
+				auto it = std::find_if(events.waits.begin(), events.waits.end(),
+					[](const WaitObject* wait) { return wait->active && wait->event->signaled; });
+				if (it == events.waits.end())
+				{
+					events.changed.wait(lock);
+					continue;
+				}
+
+				// Move it last, so that the other waits get their turn
+				WaitObject* wait = *it;
+				events.waits.erase(it);
+				events.waits.push_back(wait);
+
+				if (!wait->event->manualReset)
+				{
+					wait->event->signaled = false;
+				}
+				if (wait->executeOnlyOnce)
+				{
+					wait->active = false;
+				}
+				wait->running = true;
+
+				lock.unlock();
+				wait->callback(wait->context, FALSE);
+				lock.lock();
+
+				wait->running = false;
+				if (wait->unregistered)
+				{
+					events.waits.erase(std::find(events.waits.begin(), events.waits.end(), wait));
+					if (wait->completionEvent != nullptr)
+					{
+						static_cast<EventObject*>(wait->completionEvent)->signaled = true;
+					}
+					delete wait;
+				}
+				events.changed.notify_all();
+			}
+		}
+
+
+		// Called before each enumeration step with the key handle and the index to be read
+		typedef std::function<void(HKEY hKey, DWORD index)> EnumHook;
+
+
+		struct State
+		{
+			std::mutex mutex;
+			std::map<uintptr_t, std::shared_ptr<Node>> roots;   // predefined keys
+			uint64_t clock = 0;
+			EnumHook enumHook;
+		};
+
+
+		inline State& GetState()
+		{
+			static State state;
+			return state;
+		}
+
+
+		// Empties the emulated registry. Handles still open keep referring to
+		// their (now detached) keys.
+		inline void Reset()
+		{
+			State& state = GetState();
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.roots.clear();
+		}
+
+
+		// Installs (or removes, passing an empty hook) the fault-injection hook
+		// called before each RegEnumKeyEx() and RegEnumValue().
+		inline void SetEnumHook(EnumHook hook)
+		{
+			State& state = GetState();
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.enumHook = std::move(hook);
+		}
+
+
+		// Runs the enumeration hook, if any, outside of the state lock
+		// so that it can call the registry functions.
+		inline void RunEnumHook(HKEY hKey, DWORD index)
+		{
+			State& state = GetState();
+			EnumHook hook;
+			{
+				std::lock_guard<std::mutex> lock(state.mutex);
+				hook = state.enumHook;
+			}
+			if (hook)
+			{
+				hook(hKey, index);
+			}
+		}
+
+
+		// Returns a strictly increasing FILETIME, so that every modification gets
+		// a distinct last-write time even when the system clock is coarse.
+		// Called with the state mutex held.
+		inline uint64_t NextWriteTime(State& state)
+		{
+			// 100-ns intervals between 1601-01-01 and 1970-01-01
+			const uint64_t epochDelta = 116444736000000000ULL;
+			const auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+			const uint64_t now = epochDelta + static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count()) * 10;
+
+			state.clock = (std::max)(now, state.clock + 1);
+			return state.clock;
+		}
+
+
+		inline bool IsPredefinedKey(HKEY hKey)
+		{
+			const uintptr_t id = reinterpret_cast<uintptr_t>(hKey);
+			return id >= 0x80000000 && id <= 0x80000006;
+		}
+
+
+		inline std::vector<std::wstring> SplitKeyPath(const wchar_t* path)
+		{
+			std::vector<std::wstring> parts;
+			if (path == nullptr)
+			{
+				return parts;
+			}
+
+			std::wstring current;
+			for (const wchar_t* p = path; *p != L'\0'; ++p)
+			{
+				if (*p == L'\\')
+				{
+					if (!current.empty())
+					{
+						parts.push_back(current);
+						current.clear();
+					}
+				}
+				else
+				{
+					current.push_back(*p);
+				}
+			}
+			if (!current.empty())
+			{
+				parts.push_back(current);
+			}
+			return parts;
+		}
+
+
+		// Signals (once) the watchers of node interested in the change, and those
+		// of its ancestors watching their sub-tree.
+		// Called with the state mutex held.
+		inline void NotifyChange(const std::shared_ptr<Node>& node, DWORD change)
+		{
+			bool subtree = false;
+			for (std::shared_ptr<Node> current = node; current; current = current->parent.lock())
+			{
+				auto& watchers = current->watchers;
+				for (auto it = watchers.begin(); it != watchers.end(); )
+				{
+					if ((it->filter & change) != 0 && (!subtree || it->subtree))
+					{
+						SignalEvent(it->event);
+						it = watchers.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+				subtree = true;
+			}
+		}
+
+
+		inline std::vector<Value>::iterator FindValue(Node& node, const wchar_t* name)
+		{
+			const std::wstring_view valueName = (name != nullptr) ? name : L"";
+			return std::find_if(node.values.begin(), node.values.end(),
+				[&](const Value& v) { return NamesEqual(v.name, valueName); });
+		}
+
+	} // namespace emu
+} // namespace winreg
+
+
+// An open emulated key
+struct HKEY__
+{
+	std::shared_ptr<winreg::emu::Node> node;
+	REGSAM access;
+};
+
+
+namespace winreg
+{
+	namespace emu
+	{
+		// Resolves a handle to the key node and its access rights.
+		// Called with the state mutex held.
+		inline LONG ResolveKey(State& state, HKEY hKey, std::shared_ptr<Node>& node, REGSAM& access)
+		{
+			if (hKey == nullptr)
+			{
+				return ERROR_INVALID_HANDLE;
+			}
+
+			if (IsPredefinedKey(hKey))
+			{
+				std::shared_ptr<Node>& root = state.roots[reinterpret_cast<uintptr_t>(hKey)];
+				if (!root)
+				{
+					root = std::make_shared<Node>();
+				}
+				node = root;
+				access = KEY_ALL_ACCESS;
+				return ERROR_SUCCESS;
+			}
+
+			node = hKey->node;
+			access = hKey->access;
+			return node->deleted ? ERROR_KEY_DELETED : ERROR_SUCCESS;
+		}
+
+	} // namespace emu
+} // namespace winreg
+
+
+//------------------------------------------------------------------------------
+// Win32 registry functions
+//------------------------------------------------------------------------------
+
+inline LONG RegOpenKeyExW(HKEY hKey, LPCWSTR lpSubKey, DWORD /* ulOptions */, REGSAM samDesired,
+	PHKEY phkResult)
+{
+	using namespace winreg::emu;
+
+	if (phkResult == nullptr)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	for (const std::wstring& part : SplitKeyPath(lpSubKey))
+	{
+		auto it = node->subkeys.find(part);
+		if (it == node->subkeys.end())
+		{
+			return ERROR_FILE_NOT_FOUND;
+		}
+		node = it->second;
+	}
+
+	*phkResult = new HKEY__{ node, samDesired };
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegCreateKeyExW(HKEY hKey, LPCWSTR lpSubKey, DWORD /* Reserved */, LPWSTR /* lpClass */,
+	DWORD /* dwOptions */, REGSAM samDesired, LPSECURITY_ATTRIBUTES /* lpSecurityAttributes */,
+	PHKEY phkResult, LPDWORD lpdwDisposition)
+{
+	using namespace winreg::emu;
+
+	if (phkResult == nullptr)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	const std::vector<std::wstring> parts = SplitKeyPath(lpSubKey);
+	if (!parts.empty() && (access & KEY_CREATE_SUB_KEY) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	DWORD disposition = REG_OPENED_EXISTING_KEY;
+	for (const std::wstring& part : parts)
+	{
+		std::shared_ptr<Node>& child = node->subkeys[part];
+		if (!child)
+		{
+			child = std::make_shared<Node>();
+			child->parent = node;
+			child->lastWriteTime = NextWriteTime(state);
+			node->lastWriteTime = child->lastWriteTime;
+			disposition = REG_CREATED_NEW_KEY;
+			NotifyChange(node, REG_NOTIFY_CHANGE_NAME);
+		}
+		node = child;
+	}
+
+	if (lpdwDisposition != nullptr)
+	{
+		*lpdwDisposition = disposition;
+	}
+
+	*phkResult = new HKEY__{ node, samDesired };
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegCloseKey(HKEY hKey)
+{
+	if (hKey == nullptr)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	if (!winreg::emu::IsPredefinedKey(hKey))
+	{
+		using namespace winreg::emu;
+
+		// Like the real one, closing the handle signals its pending notifications
+		{
+			State& state = GetState();
+			std::lock_guard<std::mutex> lock(state.mutex);
+			auto& watchers = hKey->node->watchers;
+			for (auto it = watchers.begin(); it != watchers.end(); )
+			{
+				if (it->handle == hKey)
+				{
+					SignalEvent(it->event);
+					it = watchers.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+		delete hKey;
+	}
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegConnectRegistryW(LPCWSTR lpMachineName, HKEY hKey, PHKEY phkResult)
+{
+	// Only the local (emulated) registry is available
+	if (lpMachineName != nullptr && *lpMachineName != L'\0')
+	{
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+
+	return RegOpenKeyExW(hKey, nullptr, 0, KEY_ALL_ACCESS, phkResult);
+}
+
+
+inline LONG RegQueryValueExW(HKEY hKey, LPCWSTR lpValueName, LPDWORD /* lpReserved */,
+	LPDWORD lpType, LPBYTE lpData, LPDWORD lpcbData)
+{
+	using namespace winreg::emu;
+
+	if (lpData != nullptr && lpcbData == nullptr)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_QUERY_VALUE) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	auto it = FindValue(*node, lpValueName);
+	if (it == node->values.end())
+	{
+		return ERROR_FILE_NOT_FOUND;
+	}
+
+	if (lpType != nullptr)
+	{
+		*lpType = it->type;
+	}
+
+	if (lpcbData != nullptr)
+	{
+		const DWORD size = static_cast<DWORD>(it->data.size());
+		if (lpData != nullptr)
+		{
+			if (*lpcbData < size)
+			{
+				*lpcbData = size;
+				return ERROR_MORE_DATA;
+			}
+			if (size != 0)
+			{
+				memcpy(lpData, it->data.data(), size);
+			}
+		}
+		*lpcbData = size;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegSetValueExW(HKEY hKey, LPCWSTR lpValueName, DWORD /* Reserved */, DWORD dwType,
+	const BYTE* lpData, DWORD cbData)
+{
+	using namespace winreg::emu;
+
+	if (lpData == nullptr && cbData != 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_SET_VALUE) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	auto it = FindValue(*node, lpValueName);
+	if (it == node->values.end())
+	{
+		node->values.push_back(Value{ (lpValueName != nullptr) ? lpValueName : L"", dwType, {} });
+		it = node->values.end() - 1;
+	}
+
+	it->type = dwType;
+	it->data.assign(lpData, lpData + cbData);
+	node->lastWriteTime = NextWriteTime(state);
+	NotifyChange(node, REG_NOTIFY_CHANGE_LAST_SET);
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegDeleteValueW(HKEY hKey, LPCWSTR lpValueName)
+{
+	using namespace winreg::emu;
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_SET_VALUE) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	auto it = FindValue(*node, lpValueName);
+	if (it == node->values.end())
+	{
+		return ERROR_FILE_NOT_FOUND;
+	}
+
+	node->values.erase(it);
+	node->lastWriteTime = NextWriteTime(state);
+	NotifyChange(node, REG_NOTIFY_CHANGE_LAST_SET);
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegDeleteKeyExW(HKEY hKey, LPCWSTR lpSubKey, REGSAM /* samDesired */, DWORD /* Reserved */)
+{
+	using namespace winreg::emu;
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> parent;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, parent, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	const std::vector<std::wstring> parts = SplitKeyPath(lpSubKey);
+	if (parts.empty())
+	{
+		return ERROR_BADKEY;
+	}
+
+	for (size_t i = 0; i + 1 < parts.size(); ++i)
+	{
+		auto it = parent->subkeys.find(parts[i]);
+		if (it == parent->subkeys.end())
+		{
+			return ERROR_FILE_NOT_FOUND;
+		}
+		parent = it->second;
+	}
+
+	auto it = parent->subkeys.find(parts.back());
+	if (it == parent->subkeys.end())
+	{
+		return ERROR_FILE_NOT_FOUND;
+	}
+
+	// Like the real RegDeleteKeyEx(), only keys without sub-keys can be deleted
+	if (!it->second->subkeys.empty())
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	// The watchers of the deleted key are signaled, whatever they wait for
+	for (const ChangeWatcher& watcher : it->second->watchers)
+	{
+		SignalEvent(watcher.event);
+	}
+	it->second->watchers.clear();
+
+	it->second->deleted = true;
+	parent->subkeys.erase(it);
+	parent->lastWriteTime = NextWriteTime(state);
+	NotifyChange(parent, REG_NOTIFY_CHANGE_NAME);
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegEnumKeyExW(HKEY hKey, DWORD dwIndex, LPWSTR lpName, LPDWORD lpcchName,
+	LPDWORD /* lpReserved */, LPWSTR /* lpClass */, LPDWORD lpcchClass, PFILETIME lpftLastWriteTime)
+{
+	using namespace winreg::emu;
+
+	if (lpName == nullptr || lpcchName == nullptr)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	RunEnumHook(hKey, dwIndex);
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_ENUMERATE_SUB_KEYS) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	if (dwIndex >= node->subkeys.size())
+	{
+		return ERROR_NO_MORE_ITEMS;
+	}
+
+	auto it = node->subkeys.begin();
+	std::advance(it, dwIndex);
+
+	const std::wstring& name = it->first;
+	if (*lpcchName <= name.size())
+	{
+		return ERROR_MORE_DATA;
+	}
+
+	name.copy(lpName, name.size());
+	lpName[name.size()] = L'\0';
+	*lpcchName = static_cast<DWORD>(name.size());
+
+	if (lpcchClass != nullptr)
+	{
+		*lpcchClass = 0;
+	}
+	if (lpftLastWriteTime != nullptr)
+	{
+		lpftLastWriteTime->dwLowDateTime = static_cast<DWORD>(it->second->lastWriteTime);
+		lpftLastWriteTime->dwHighDateTime = static_cast<DWORD>(it->second->lastWriteTime >> 32);
+	}
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegEnumValueW(HKEY hKey, DWORD dwIndex, LPWSTR lpValueName, LPDWORD lpcchValueName,
+	LPDWORD /* lpReserved */, LPDWORD lpType, LPBYTE lpData, LPDWORD lpcbData)
+{
+	using namespace winreg::emu;
+
+	if (lpValueName == nullptr || lpcchValueName == nullptr
+		|| (lpData != nullptr && lpcbData == nullptr))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	RunEnumHook(hKey, dwIndex);
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_QUERY_VALUE) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	if (dwIndex >= node->values.size())
+	{
+		return ERROR_NO_MORE_ITEMS;
+	}
+
+	const Value& value = node->values[dwIndex];
+	if (*lpcchValueName <= value.name.size())
+	{
+		return ERROR_MORE_DATA;
+	}
+
+	const DWORD size = static_cast<DWORD>(value.data.size());
+	if (lpData != nullptr && *lpcbData < size)
+	{
+		*lpcbData = size;
+		return ERROR_MORE_DATA;
+	}
+
+	value.name.copy(lpValueName, value.name.size());
+	lpValueName[value.name.size()] = L'\0';
+	*lpcchValueName = static_cast<DWORD>(value.name.size());
+
+	if (lpType != nullptr)
+	{
+		*lpType = value.type;
+	}
+	if (lpData != nullptr && size != 0)
+	{
+		memcpy(lpData, value.data.data(), size);
+	}
+	if (lpcbData != nullptr)
+	{
+		*lpcbData = size;
+	}
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegQueryInfoKeyW(HKEY hKey, LPWSTR /* lpClass */, LPDWORD lpcchClass,
+	LPDWORD /* lpReserved */, LPDWORD lpcSubKeys, LPDWORD lpcbMaxSubKeyLen, LPDWORD lpcbMaxClassLen,
+	LPDWORD lpcValues, LPDWORD lpcbMaxValueNameLen, LPDWORD lpcbMaxValueLen,
+	LPDWORD lpcbSecurityDescriptor, PFILETIME lpftLastWriteTime)
+{
+	using namespace winreg::emu;
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	DWORD maxSubKeyLen = 0;
+	for (const auto& subkey : node->subkeys)
+	{
+		maxSubKeyLen = (std::max)(maxSubKeyLen, static_cast<DWORD>(subkey.first.size()));
+	}
+
+	DWORD maxValueNameLen = 0;
+	DWORD maxValueLen = 0;
+	for (const Value& value : node->values)
+	{
+		maxValueNameLen = (std::max)(maxValueNameLen, static_cast<DWORD>(value.name.size()));
+		maxValueLen = (std::max)(maxValueLen, static_cast<DWORD>(value.data.size()));
+	}
+
+	if (lpcchClass != nullptr)          *lpcchClass = 0;
+	if (lpcSubKeys != nullptr)          *lpcSubKeys = static_cast<DWORD>(node->subkeys.size());
+	if (lpcbMaxSubKeyLen != nullptr)    *lpcbMaxSubKeyLen = maxSubKeyLen;
+	if (lpcbMaxClassLen != nullptr)     *lpcbMaxClassLen = 0;
+	if (lpcValues != nullptr)           *lpcValues = static_cast<DWORD>(node->values.size());
+	if (lpcbMaxValueNameLen != nullptr) *lpcbMaxValueNameLen = maxValueNameLen;
+	if (lpcbMaxValueLen != nullptr)     *lpcbMaxValueLen = maxValueLen;
+	if (lpcbSecurityDescriptor != nullptr) *lpcbSecurityDescriptor = 0;
+	if (lpftLastWriteTime != nullptr)
+	{
+		lpftLastWriteTime->dwLowDateTime = static_cast<DWORD>(node->lastWriteTime);
+		lpftLastWriteTime->dwHighDateTime = static_cast<DWORD>(node->lastWriteTime >> 32);
+	}
+	return ERROR_SUCCESS;
+}
+
+
+// All the requested values are looked up under a single acquisition of the
+// registry lock, so the batch is read as one consistent snapshot.
+inline LONG RegQueryMultipleValuesW(HKEY hKey, PVALENTW val_list, DWORD num_vals, LPWSTR lpValueBuf,
+	LPDWORD ldwTotsize)
+{
+	using namespace winreg::emu;
+
+	if (ldwTotsize == nullptr || (num_vals != 0 && val_list == nullptr))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_QUERY_VALUE) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	std::vector<const Value*> found(num_vals);
+	DWORD totalSize = 0;
+	for (DWORD i = 0; i < num_vals; ++i)
+	{
+		auto it = FindValue(*node, val_list[i].ve_valuename);
+		if (it == node->values.end())
+		{
+			return ERROR_CANTREAD;
+		}
+		found[i] = &(*it);
+		totalSize += static_cast<DWORD>(it->data.size());
+	}
+
+	// A null buffer is enough for values that are all empty
+	if ((*ldwTotsize < totalSize) || (lpValueBuf == nullptr && totalSize != 0))
+	{
+		*ldwTotsize = totalSize;
+		return ERROR_MORE_DATA;
+	}
+
+	BYTE* dest = reinterpret_cast<BYTE*>(lpValueBuf);
+	for (DWORD i = 0; i < num_vals; ++i)
+	{
+		const std::vector<BYTE>& data = found[i]->data;
+		if (!data.empty())
+		{
+			memcpy(dest, data.data(), data.size());
+		}
+		val_list[i].ve_valuelen = static_cast<DWORD>(data.size());
+		val_list[i].ve_valueptr = reinterpret_cast<DWORD_PTR>(dest);
+		val_list[i].ve_type = found[i]->type;
+		dest += data.size();
+	}
+
+	*ldwTotsize = totalSize;
+	return ERROR_SUCCESS;
+}
+
+
+inline LONG RegLoadKeyW(HKEY /* hKey */, LPCWSTR /* lpSubKey */, LPCWSTR /* lpFile */)
+{
+	return ERROR_CALL_NOT_IMPLEMENTED;
+}
+
+
+inline LONG RegSaveKeyW(HKEY /* hKey */, LPCWSTR /* lpFile */,
+	LPSECURITY_ATTRIBUTES /* lpSecurityAttributes */)
+{
+	return ERROR_CALL_NOT_IMPLEMENTED;
+}
+
+
+// Expands %NAME% references from the process environment. Like the Win32 API,
+// references to undefined variables are left as they are.
+inline DWORD ExpandEnvironmentStringsW(LPCWSTR lpSrc, LPWSTR lpDst, DWORD nSize)
+{
+	std::wstring result;
+	const std::wstring source = (lpSrc != nullptr) ? lpSrc : L"";
+
+	size_t pos = 0;
+	while (pos < source.size())
+	{
+		const size_t open = source.find(L'%', pos);
+		const size_t close = (open == std::wstring::npos) ? open : source.find(L'%', open + 1);
+		if (close == std::wstring::npos)
+		{
+			result.append(source, pos, std::wstring::npos);
+			break;
+		}
+
+		result.append(source, pos, open - pos);
+
+		// Environment variable names are ASCII in practice
+		std::string name;
+		for (size_t i = open + 1; i < close; ++i)
+		{
+			name.push_back(static_cast<char>(source[i]));
+		}
+
+		const char* value = name.empty() ? nullptr : getenv(name.c_str());
+		if (value != nullptr)
+		{
+			for (const char* p = value; *p != '\0'; ++p)
+			{
+				result.push_back(static_cast<unsigned char>(*p));
+			}
+			pos = close + 1;
+		}
+		else
+		{
+			// Keep "%NAME" and restart from the closing '%'
+			result.append(source, open, close - open);
+			pos = close;
+		}
+	}
+
+	const DWORD required = static_cast<DWORD>(result.size() + 1);
+	if (lpDst != nullptr && nSize >= required)
+	{
+		result.copy(lpDst, result.size());
+		lpDst[result.size()] = L'\0';
+	}
+	return required;
+}
+
+
+// Registers hEvent to be signaled once, at the next change of the key (or of
+// its sub-tree) matching dwNotifyFilter. Only the asynchronous form is emulated.
+inline LONG RegNotifyChangeKeyValue(HKEY hKey, BOOL bWatchSubtree, DWORD dwNotifyFilter, HANDLE hEvent,
+	BOOL fAsynchronous)
+{
+	using namespace winreg::emu;
+
+	if (!fAsynchronous)
+	{
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	if (hEvent == nullptr)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	State& state = GetState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	std::shared_ptr<Node> node;
+	REGSAM access = 0;
+	LONG result = ResolveKey(state, hKey, node, access);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+	if ((access & KEY_NOTIFY) == 0)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	node->watchers.push_back(ChangeWatcher{ hKey, bWatchSubtree != FALSE,
+		dwNotifyFilter & ~static_cast<DWORD>(REG_NOTIFY_THREAD_AGNOSTIC), hEvent });
+	return ERROR_SUCCESS;
+}
+
+
+// Events can't be named, nor shared between processes
+inline HANDLE CreateEventW(LPSECURITY_ATTRIBUTES /* lpEventAttributes */, BOOL bManualReset, BOOL bInitialState,
+	LPCWSTR lpName)
+{
+	if (lpName != nullptr)
+	{
+		return nullptr;
+	}
+	return new winreg::emu::EventObject{ bManualReset != FALSE, bInitialState != FALSE };
+}
+
+
+inline BOOL SetEvent(HANDLE hEvent)
+{
+	if (hEvent == nullptr)
+	{
+		return FALSE;
+	}
+	winreg::emu::SignalEvent(hEvent);
+	return TRUE;
+}
+
+
+inline BOOL ResetEvent(HANDLE hEvent)
+{
+	if (hEvent == nullptr)
+	{
+		return FALSE;
+	}
+
+	winreg::emu::EventState& events = winreg::emu::GetEventState();
+	std::lock_guard<std::mutex> lock(events.mutex);
+	static_cast<winreg::emu::EventObject*>(hEvent)->signaled = false;
+	return TRUE;
+}
+
+
+// Only events are emulated; they must not be waited for any more
+inline BOOL CloseHandle(HANDLE hObject)
+{
+	if (hObject == nullptr || hObject == INVALID_HANDLE_VALUE)
+	{
+		return FALSE;
+	}
+	delete static_cast<winreg::emu::EventObject*>(hObject);
+	return TRUE;
+}
+
+
+inline DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+	using namespace winreg::emu;
+
+	if (hHandle == nullptr)
+	{
+		return WAIT_FAILED;
+	}
+
+	EventState& events = GetEventState();
+	EventObject* event = static_cast<EventObject*>(hHandle);
+	std::unique_lock<std::mutex> lock(events.mutex);
+	auto isSignaled = [&] { return event->signaled; };
+	if (dwMilliseconds == INFINITE)
+	{
+		events.changed.wait(lock, isSignaled);
+	}
+	else if (!events.changed.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), isSignaled))
+	{
+		return WAIT_TIMEOUT;
+	}
+
+	if (!event->manualReset)
+	{
+		event->signaled = false;
+	}
+	return WAIT_OBJECT_0;
+}
+
+
+// Calls Callback on the emulated wait thread each time hObject (an event) is
+// signaled, or only the first time with WT_EXECUTEONLYONCE. Time-outs are not
+// emulated: dwMilliseconds must be INFINITE.
+inline BOOL RegisterWaitForSingleObject(PHANDLE phNewWaitObject, HANDLE hObject, WAITORTIMERCALLBACK Callback,
+	PVOID Context, ULONG dwMilliseconds, ULONG dwFlags)
+{
+	using namespace winreg::emu;
+
+	if (phNewWaitObject == nullptr || hObject == nullptr || Callback == nullptr || dwMilliseconds != INFINITE)
+	{
+		return FALSE;
+	}
+
+	EventState& events = GetEventState();
+	WaitObject* wait = new WaitObject{ static_cast<EventObject*>(hObject), Callback, Context,
+		(dwFlags & WT_EXECUTEONLYONCE) != 0 };
+	{
+		std::lock_guard<std::mutex> lock(events.mutex);
+		if (!events.waitThread.joinable())
+		{
+			events.waitThread = std::thread(RunWaits, std::ref(events));
+		}
+		events.waits.push_back(wait);
+	}
+	events.changed.notify_all();
+
+	*phNewWaitObject = wait;
+	return TRUE;
+}
+
+
+// With CompletionEvent set to INVALID_HANDLE_VALUE, waits for the callback
+// running (if any) to return, unless called from the callback itself.
+inline BOOL UnregisterWaitEx(HANDLE WaitHandle, HANDLE CompletionEvent)
+{
+	using namespace winreg::emu;
+
+	if (WaitHandle == nullptr)
+	{
+		return FALSE;
+	}
+
+	EventState& events = GetEventState();
+	WaitObject* wait = static_cast<WaitObject*>(WaitHandle);
+	{
+		std::unique_lock<std::mutex> lock(events.mutex);
+		wait->active = false;
+		if (CompletionEvent == INVALID_HANDLE_VALUE && std::this_thread::get_id() != events.waitThread.get_id())
+		{
+			events.changed.wait(lock, [&] { return !wait->running; });
+		}
+		else if (wait->running)
+		{
+			// The wait thread deletes it when the callback returns
+			wait->unregistered = true;
+			wait->completionEvent = (CompletionEvent != INVALID_HANDLE_VALUE) ? CompletionEvent : nullptr;
+			return TRUE;
+		}
+		events.waits.erase(std::find(events.waits.begin(), events.waits.end(), wait));
+	}
+	delete wait;
+
+	if (CompletionEvent != nullptr && CompletionEvent != INVALID_HANDLE_VALUE)
+	{
+		SetEvent(CompletionEvent);
+	}
+	return TRUE;
+}
+
+
+#define RegOpenKeyEx                RegOpenKeyExW
+#define RegCreateKeyEx              RegCreateKeyExW
+#define RegConnectRegistry          RegConnectRegistryW
+#define RegQueryValueEx             RegQueryValueExW
+#define RegSetValueEx               RegSetValueExW
+#define RegDeleteValue              RegDeleteValueW
+#define RegDeleteKeyEx              RegDeleteKeyExW
+#define RegEnumKeyEx                RegEnumKeyExW
+#define RegEnumValue                RegEnumValueW
+#define RegQueryInfoKey             RegQueryInfoKeyW
+#define RegQueryMultipleValues      RegQueryMultipleValuesW
+#define RegLoadKey                  RegLoadKeyW
+#define RegSaveKey                  RegSaveKeyW
+#define ExpandEnvironmentStrings    ExpandEnvironmentStringsW
+#define CreateEvent                 CreateEventW
@@ -0,0 +1,397 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_env.h
+// DESC: Cached expansion of environment variables in REG_EXPAND_SZ values.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// winreg::ExpandEnvironmentStrings() calls the Win32 API twice per string
+// (size, then expansion), reading the live process environment every time.
+// EnvironmentExpander instead:
+//
+//  - takes a snapshot of the environment once, from a pluggable provider
+//    (the process environment by default, or e.g. a fixed map in tests),
+//  - scans the strings for '%' delimiters 8 (or 4) characters at a time with
+//    SSE2, where available,
+//  - memoizes the expanded strings: configurations tend to expand the same
+//    few paths over and over.
+//
+// Refresh() takes a new snapshot and drops the memoized expansions.
+//
+// Expansion follows ExpandEnvironmentStrings(): "%NAME%" is replaced by the
+// variable's value; an unknown (or empty) name leaves "%NAME" as is, and the
+// search for the next variable restarts from its closing '%'. Names are
+// case-insensitive on Windows, and case-sensitive elsewhere (as getenv()).
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::equal
+#include <deque>        // std::deque
+#include <functional>   // std::hash
+#include <memory>       // std::shared_ptr
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <unordered_map>// std::unordered_map
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+#include <string.h>     // strchr(), wcslen()
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>  // SSE2
+#define WINREG_ENV_SSE2 1
+#endif
+#ifndef _WIN32
+extern char** environ;
+#endif
+
+namespace winreg
+{
+	// Environment variables, as (name, value) pairs
+	typedef std::vector<std::pair<std::wstring, std::wstring>> EnvironmentBlock;
+
+
+	//------------------------------------------------------------------------------
+	// Source of the environment variables used by EnvironmentExpander
+	//------------------------------------------------------------------------------
+	class EnvironmentProvider
+	{
+	public:
+		virtual ~EnvironmentProvider() = default;
+
+		// Returns the current variables
+		virtual EnvironmentBlock Read() const = 0;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// The environment of the current process
+	//------------------------------------------------------------------------------
+	class ProcessEnvironment : public EnvironmentProvider
+	{
+	public:
+		EnvironmentBlock Read() const override
+		{
+			EnvironmentBlock block;
+#ifdef _WIN32
+			wchar_t* strings = ::GetEnvironmentStringsW();
+			if (strings == nullptr)
+			{
+				return block;
+			}
+
+			// "NAME=VALUE\0NAME=VALUE\0...\0\0"; names of hidden variables start with '='
+			for (const wchar_t* p = strings; *p != L'\0'; p += wcslen(p) + 1)
+			{
+				const std::wstring_view entry(p);
+				const size_t equal = entry.find(L'=', 1);
+				if (equal != std::wstring_view::npos)
+				{
+					block.emplace_back(std::wstring(entry.substr(0, equal)), std::wstring(entry.substr(equal + 1)));
+				}
+			}
+			::FreeEnvironmentStringsW(strings);
+#else
+			// Taken byte by byte, as the emulated ExpandEnvironmentStringsW() does
+			for (char** p = environ; p != nullptr && *p != nullptr; ++p)
+			{
+				const char* entry = *p;
+				const char* equal = strchr(entry, '=');
+				if (equal != nullptr && equal != entry)
+				{
+					std::wstring name, value;
+					for (const char* c = entry; c != equal; ++c)
+					{
+						name.push_back(static_cast<unsigned char>(*c));
+					}
+					for (const char* c = equal + 1; *c != '\0'; ++c)
+					{
+						value.push_back(static_cast<unsigned char>(*c));
+					}
+					block.emplace_back(std::move(name), std::move(value));
+				}
+			}
+#endif
+			return block;
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A fixed set of variables
+	//------------------------------------------------------------------------------
+	class FixedEnvironment : public EnvironmentProvider
+	{
+	public:
+		explicit FixedEnvironment(EnvironmentBlock variables)
+			: m_variables(std::move(variables))
+		{
+		}
+
+		EnvironmentBlock Read() const override
+		{
+			return m_variables;
+		}
+
+	private:
+		EnvironmentBlock m_variables;
+	};
+
+
+	namespace env_detail
+	{
+#ifdef _WIN32
+		const bool IgnoreNameCase = true;
+#else
+		const bool IgnoreNameCase = false;
+#endif
+
+		struct NameHash
+		{
+			size_t operator()(std::wstring_view name) const noexcept
+			{
+				// FNV-1a
+				size_t hash = static_cast<size_t>(14695981039346656037ULL);
+				for (wchar_t ch : name)
+				{
+					hash ^= static_cast<size_t>(IgnoreNameCase ? FoldNameChar(ch) : ch);
+					hash *= static_cast<size_t>(1099511628211ULL);
+				}
+				return hash;
+			}
+		};
+
+		struct NameEqual
+		{
+			bool operator()(std::wstring_view lhs, std::wstring_view rhs) const noexcept
+			{
+				if (!IgnoreNameCase)
+				{
+					return lhs == rhs;
+				}
+				return lhs.size() == rhs.size()
+					&& std::equal(lhs.begin(), lhs.end(), rhs.begin(), NameCharsEqual);
+			}
+		};
+
+
+		// Returns the position of the first '%' at or after pos, or npos
+		inline size_t FindPercent(std::wstring_view str, size_t pos) noexcept
+		{
+			const wchar_t* const data = str.data();
+			const size_t size = str.size();
+
+#ifdef WINREG_ENV_SSE2
+			const size_t lanes = 16 / sizeof(wchar_t);
+			const __m128i percent = (sizeof(wchar_t) == 2) ? _mm_set1_epi16(L'%') : _mm_set1_epi32(L'%');
+			for (; pos + lanes <= size; pos += lanes)
+			{
+				const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+				const __m128i equal = (sizeof(wchar_t) == 2)
+					? _mm_cmpeq_epi16(chars, percent) : _mm_cmpeq_epi32(chars, percent);
+				const int mask = _mm_movemask_epi8(equal);
+				if (mask != 0)
+				{
+					// Each character sets sizeof(wchar_t) bits: find the first one set
+					int bit = 0;
+					while (((mask >> bit) & 1) == 0)
+					{
+						bit++;
+					}
+					return pos + bit / sizeof(wchar_t);
+				}
+			}
+#endif
+			for (; pos < size; pos++)
+			{
+				if (data[pos] == L'%')
+				{
+					return pos;
+				}
+			}
+			return std::wstring_view::npos;
+		}
+
+
+		// Variables from a provider, indexed by name
+		class EnvironmentSnapshot
+		{
+		public:
+			explicit EnvironmentSnapshot(EnvironmentBlock variables)
+				: m_variables(std::move(variables))
+			{
+				// The views point into m_variables, which doesn't change any more.
+				// As in the Win32 environment block, the first definition of a name wins.
+				m_index.reserve(m_variables.size());
+				for (const auto& variable : m_variables)
+				{
+					m_index.emplace(variable.first, variable.second);
+				}
+			}
+
+			const std::wstring_view* Find(std::wstring_view name) const
+			{
+				auto it = m_index.find(name);
+				return (it != m_index.end()) ? &it->second : nullptr;
+			}
+
+		private:
+			EnvironmentBlock m_variables;
+			std::unordered_map<std::wstring_view, std::wstring_view, NameHash, NameEqual> m_index;
+		};
+
+	} // namespace env_detail
+
+
+	//------------------------------------------------------------------------------
+	// Expands environment variables in strings, using a snapshot of the environment
+	// and memoizing the results (see the notes at the top of this file).
+	// Thread-safe.
+	//------------------------------------------------------------------------------
+	class EnvironmentExpander
+	{
+	public:
+
+		// Memoizes up to cacheCapacity expanded strings (0 disables memoization)
+		explicit EnvironmentExpander(
+			std::shared_ptr<const EnvironmentProvider> provider = std::make_shared<ProcessEnvironment>(),
+			size_t cacheCapacity = 4096)
+			: m_provider(std::move(provider)), m_cacheCapacity(cacheCapacity)
+		{
+			_ASSERTE(m_provider != nullptr);
+			Refresh();
+		}
+
+
+		EnvironmentExpander(const EnvironmentExpander&) = delete;
+		EnvironmentExpander& operator=(const EnvironmentExpander&) = delete;
+
+
+		// Takes a new snapshot of the environment, and drops the memoized expansions
+		void Refresh()
+		{
+			auto snapshot = std::make_shared<const env_detail::EnvironmentSnapshot>(m_provider->Read());
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_snapshot = std::move(snapshot);
+			m_cacheIndex.clear();
+			m_cache.clear();
+		}
+
+
+		std::wstring Expand(std::wstring_view source)
+		{
+			// Nothing to expand, nothing to memoize
+			if (env_detail::FindPercent(source, 0) == std::wstring_view::npos)
+			{
+				return std::wstring(source);
+			}
+
+			std::shared_ptr<const env_detail::EnvironmentSnapshot> snapshot;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_cacheIndex.find(source);
+				if (it != m_cacheIndex.end())
+				{
+					m_hits++;
+					return std::wstring(it->second);
+				}
+				snapshot = m_snapshot;
+			}
+
+			std::wstring result;
+			ExpandWith(*snapshot, source, result);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_cacheCapacity != 0 && snapshot == m_snapshot && m_cacheIndex.find(source) == m_cacheIndex.end())
+			{
+				// When full, start over: the working set of a configuration is small
+				if (m_cache.size() >= m_cacheCapacity)
+				{
+					m_cacheIndex.clear();
+					m_cache.clear();
+				}
+				m_cache.emplace_back(source, result);
+				m_cacheIndex.emplace(m_cache.back().first, m_cache.back().second);
+			}
+			m_misses++;
+			return result;
+		}
+
+
+		// Expands the string of a REG_EXPAND_SZ value
+		std::wstring Expand(const RegValue& value)
+		{
+			return Expand(value.ExpandString());
+		}
+
+
+		// Number of Expand() calls answered from, and added to, the memoized expansions
+		size_t CacheHits() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_hits;
+		}
+
+		size_t CacheMisses() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_misses;
+		}
+
+	private:
+		std::shared_ptr<const EnvironmentProvider> m_provider;
+		size_t m_cacheCapacity;
+
+		mutable std::mutex m_mutex;
+		std::shared_ptr<const env_detail::EnvironmentSnapshot> m_snapshot;
+		std::deque<std::pair<std::wstring, std::wstring>> m_cache;     // (source, expansion)
+		std::unordered_map<std::wstring_view, std::wstring_view> m_cacheIndex;
+		size_t m_hits = 0;
+		size_t m_misses = 0;
+
+
+		static void ExpandWith(const env_detail::EnvironmentSnapshot& snapshot, std::wstring_view source,
+			std::wstring& result)
+		{
+			using env_detail::FindPercent;
+
+			result.reserve(source.size());
+			size_t pos = 0;
+			while (pos < source.size())
+			{
+				const size_t open = FindPercent(source, pos);
+				const size_t close = (open == std::wstring_view::npos) ? open : FindPercent(source, open + 1);
+				if (close == std::wstring_view::npos)
+				{
+					result.append(source.substr(pos));
+					break;
+				}
+
+				result.append(source.substr(pos, open - pos));
+
+				const std::wstring_view name = source.substr(open + 1, close - open - 1);
+				const std::wstring_view* value = name.empty() ? nullptr : snapshot.Find(name);
+				if (value != nullptr)
+				{
+					result.append(*value);
+					pos = close + 1;
+				}
+				else
+				{
+					// Keep "%NAME" and restart from the closing '%'
+					result.append(source.substr(open, close - open));
+					pos = close;
+				}
+			}
+		}
+	};
+
+} // namespace winreg
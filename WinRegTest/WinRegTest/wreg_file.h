@@ -0,0 +1,280 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_file.h
+// DESC: Small file helpers shared by the WinReg extensions (index, blob store,
+//       hive files).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "wreg.h"       // WinReg public header
+#include <cstdio>       // FILE, fopen(), fclose()
+#include <filesystem>   // std::filesystem::path
+#include <stdexcept>    // std::runtime_error
+#ifndef _WIN32
+#include <fcntl.h>      // open()
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>   // fstat()
+#include <unistd.h>     // close(), ftruncate(), sysconf()
+#endif
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Opens a file with fopen() semantics, taking the name as a path (wide names
+	// on Windows). Returns nullptr on failure.
+	//------------------------------------------------------------------------------
+	inline FILE* OpenFile(const std::filesystem::path& fileName, const char* mode)
+	{
+#ifdef _WIN32
+		const std::wstring wideMode(mode, mode + strlen(mode));
+		FILE* f = nullptr;
+		if (_wfopen_s(&f, fileName.c_str(), wideMode.c_str()) != 0)
+		{
+			f = nullptr;
+		}
+		return f;
+#else
+		return fopen(fileName.c_str(), mode);
+#endif
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Read-only memory mapping of a whole, non-empty file.
+	// Throws std::runtime_error if the file can't be opened or mapped.
+	//------------------------------------------------------------------------------
+	class MappedFile
+	{
+	public:
+
+		explicit MappedFile(const std::filesystem::path& fileName)
+		{
+#ifdef _WIN32
+			HANDLE file = ::CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+				nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+			{
+				throw std::runtime_error("MappedFile: can't open the file.");
+			}
+
+			LARGE_INTEGER size = {};
+			::GetFileSizeEx(file, &size);
+			m_size = static_cast<size_t>(size.QuadPart);
+
+			HANDLE mapping = (m_size != 0)
+				? ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+				: nullptr;
+			::CloseHandle(file);
+			if (mapping != nullptr)
+			{
+				m_data = static_cast<const char*>(::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				::CloseHandle(mapping);
+			}
+#else
+			const int fd = ::open(fileName.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				throw std::runtime_error("MappedFile: can't open the file.");
+			}
+
+			struct stat st = {};
+			::fstat(fd, &st);
+			m_size = static_cast<size_t>(st.st_size);
+
+			if (m_size != 0)
+			{
+				void* p = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+				m_data = (p != MAP_FAILED) ? static_cast<const char*>(p) : nullptr;
+			}
+			::close(fd);
+#endif
+			if (m_data == nullptr)
+			{
+				throw std::runtime_error("MappedFile: can't map the file in memory.");
+			}
+		}
+
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			::UnmapViewOfFile(m_data);
+#else
+			::munmap(const_cast<char*>(m_data), m_size);
+#endif
+		}
+
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const char* Data() const noexcept { return m_data; }
+		size_t Size() const noexcept { return m_size; }
+
+	private:
+		const char* m_data = nullptr;
+		size_t m_size = 0;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Read-write, shared memory mapping of a whole, non-empty file, which can be
+	// grown. Changes reach the file as the system writes the pages back, or on
+	// Flush(). Throws std::runtime_error on failure.
+	//------------------------------------------------------------------------------
+	class WritableMappedFile
+	{
+	public:
+
+		explicit WritableMappedFile(const std::filesystem::path& fileName)
+		{
+#ifdef _WIN32
+			m_file = ::CreateFileW(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+				nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE)
+			{
+				throw std::runtime_error("WritableMappedFile: can't open the file.");
+			}
+
+			LARGE_INTEGER size = {};
+			::GetFileSizeEx(m_file, &size);
+			m_size = static_cast<size_t>(size.QuadPart);
+#else
+			m_fd = ::open(fileName.c_str(), O_RDWR);
+			if (m_fd < 0)
+			{
+				throw std::runtime_error("WritableMappedFile: can't open the file.");
+			}
+
+			struct stat st = {};
+			::fstat(m_fd, &st);
+			m_size = static_cast<size_t>(st.st_size);
+#endif
+			try
+			{
+				Map();
+			}
+			catch (...)
+			{
+				CloseFile();
+				throw;
+			}
+		}
+
+
+		~WritableMappedFile()
+		{
+			Unmap();
+			CloseFile();
+		}
+
+
+		WritableMappedFile(const WritableMappedFile&) = delete;
+		WritableMappedFile& operator=(const WritableMappedFile&) = delete;
+
+		char* Data() const noexcept { return m_data; }
+		size_t Size() const noexcept { return m_size; }
+
+
+		// Grows the file, zero-filled, and maps it again: pointers to the old data
+		// are no longer valid
+		void Resize(size_t newSize)
+		{
+			Unmap();
+#ifdef _WIN32
+			LARGE_INTEGER size = {};
+			size.QuadPart = static_cast<LONGLONG>(newSize);
+			const bool resized = ::SetFilePointerEx(m_file, size, nullptr, FILE_BEGIN) && ::SetEndOfFile(m_file);
+#else
+			const bool resized = ::ftruncate(m_fd, static_cast<off_t>(newSize)) == 0;
+#endif
+			if (resized)
+			{
+				m_size = newSize;
+			}
+			Map();
+			if (!resized)
+			{
+				throw std::runtime_error("WritableMappedFile: can't resize the file.");
+			}
+		}
+
+
+		// Writes the changed pages of a range to the file, and waits for them
+		void Flush(size_t offset, size_t size)
+		{
+			_ASSERTE(offset + size <= m_size);
+#ifdef _WIN32
+			const bool flushed = ::FlushViewOfFile(m_data + offset, size) && ::FlushFileBuffers(m_file);
+#else
+			const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+			const size_t start = offset - offset % pageSize;
+			const bool flushed = ::msync(m_data + start, offset + size - start, MS_SYNC) == 0;
+#endif
+			if (!flushed)
+			{
+				throw std::runtime_error("WritableMappedFile: can't write the changes to the file.");
+			}
+		}
+
+	private:
+		char* m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+#else
+		int m_fd = -1;
+#endif
+
+		void Map()
+		{
+#ifdef _WIN32
+			HANDLE mapping = (m_size != 0)
+				? ::CreateFileMappingW(m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr)
+				: nullptr;
+			if (mapping != nullptr)
+			{
+				m_data = static_cast<char*>(::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+				::CloseHandle(mapping);
+			}
+#else
+			if (m_size != 0)
+			{
+				void* p = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+				m_data = (p != MAP_FAILED) ? static_cast<char*>(p) : nullptr;
+			}
+#endif
+			if (m_data == nullptr)
+			{
+				throw std::runtime_error("WritableMappedFile: can't map the file in memory.");
+			}
+		}
+
+		void Unmap() noexcept
+		{
+			if (m_data != nullptr)
+			{
+#ifdef _WIN32
+				::UnmapViewOfFile(m_data);
+#else
+				::munmap(m_data, m_size);
+#endif
+				m_data = nullptr;
+			}
+		}
+
+		void CloseFile() noexcept
+		{
+#ifdef _WIN32
+			::CloseHandle(m_file);
+#else
+			::close(m_fd);
+#endif
+		}
+	};
+
+} // namespace winreg
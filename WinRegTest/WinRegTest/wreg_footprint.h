@@ -0,0 +1,350 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_footprint.h
+// DESC: Heap memory used by values and loaded key trees, and loading a tree
+//       within a memory budget.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// Footprint() returns the heap bytes owned by a RegValue, a string, a vector of
+// names or values, or a loaded tree, split into:
+//
+//  - name bytes: the characters (and NUL) of value names, key paths and sub-key
+//    names;
+//  - payload bytes: the data of the values (DWORDs are stored inline);
+//  - overhead bytes: the objects stored in heap arrays, e.g. the std::wstring
+//    objects of a multi-string, or the RegValue objects of a vector of values;
+//  - slack bytes: capacity allocated and not used.
+//
+// The sum is what the containers asked the allocator for: a std::vector holds
+// capacity() elements, a std::wstring holds capacity() + 1 wchar_ts, unless
+// the string fits in the object itself (the small string optimization, when
+// capacity() is that of an empty string). The bookkeeping of the heap itself
+// (a few bytes per block) is left out: allocations counts the blocks.
+// Objects not on the heap (e.g. a RegValue on the stack) aren't counted either.
+//
+// ReportFootprint() breaks the footprint of a loaded tree down by key, and by
+// value type.
+//
+// LoadTree() reads a key tree, breadth-first, and stops before the footprint
+// of what it loaded would go over a budget. With a spill function, the keys
+// that don't fit are passed to it instead, and the load goes on: the caller
+// can write them elsewhere, and the loaded part stays within the budget.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <cstdint>      // SIZE_MAX
+#include <deque>        // std::deque
+#include <functional>   // std::function
+#include <map>          // std::map
+#include <string>       // std::wstring
+#include <utility>      // std::move
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Heap bytes (see the notes at the top of this file)
+	//------------------------------------------------------------------------------
+	struct MemoryFootprint
+	{
+		size_t nameBytes = 0;
+		size_t payloadBytes = 0;
+		size_t overheadBytes = 0;
+		size_t slackBytes = 0;
+		size_t allocations = 0;     // heap blocks
+
+		size_t HeapBytes() const noexcept
+		{
+			return nameBytes + payloadBytes + overheadBytes + slackBytes;
+		}
+
+		MemoryFootprint& operator+=(const MemoryFootprint& other) noexcept
+		{
+			nameBytes += other.nameBytes;
+			payloadBytes += other.payloadBytes;
+			overheadBytes += other.overheadBytes;
+			slackBytes += other.slackBytes;
+			allocations += other.allocations;
+			return *this;
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key read by LoadTree()
+	//------------------------------------------------------------------------------
+	struct LoadedKey
+	{
+		std::wstring path;      // relative to the root of the tree ("" for the root)
+		std::vector<RegValue> values;
+		std::vector<std::wstring> subKeyNames;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key tree read by LoadTree(), parents before their sub-keys
+	//------------------------------------------------------------------------------
+	struct LoadedTree
+	{
+		std::vector<LoadedKey> keys;
+		bool complete = true;       // false if the load stopped at the budget
+		size_t spilledKeys = 0;     // passed to the spill function
+	};
+
+
+	namespace footprint_detail
+	{
+		// Where the bytes of a string go
+		enum class StringKind { Name, Payload };
+
+
+		inline MemoryFootprint StringFootprint(const std::wstring& str, StringKind kind)
+		{
+			static const size_t inlineCapacity = std::wstring().capacity();
+
+			MemoryFootprint footprint;
+			if (str.capacity() > inlineCapacity)
+			{
+				const size_t used = (str.size() + 1) * sizeof(wchar_t);
+				(kind == StringKind::Name ? footprint.nameBytes : footprint.payloadBytes) = used;
+				footprint.slackBytes = (str.capacity() - str.size()) * sizeof(wchar_t);
+				footprint.allocations = 1;
+			}
+			return footprint;
+		}
+
+
+		// The heap array of a vector: its elements are overhead, its unused capacity slack
+		template <typename T>
+		MemoryFootprint ArrayFootprint(const std::vector<T>& items)
+		{
+			MemoryFootprint footprint;
+			if (items.capacity() != 0)
+			{
+				footprint.overheadBytes = items.size() * sizeof(T);
+				footprint.slackBytes = (items.capacity() - items.size()) * sizeof(T);
+				footprint.allocations = 1;
+			}
+			return footprint;
+		}
+
+
+		inline MemoryFootprint StringsFootprint(const std::vector<std::wstring>& strings, StringKind kind)
+		{
+			MemoryFootprint footprint = ArrayFootprint(strings);
+			for (const std::wstring& str : strings)
+			{
+				footprint += StringFootprint(str, kind);
+			}
+			return footprint;
+		}
+
+
+		struct RegValueAccess
+		{
+			static MemoryFootprint Footprint(const RegValue& value)
+			{
+				MemoryFootprint footprint = StringFootprint(value.name_, StringKind::Name);
+				footprint += StringFootprint(value.m_string, StringKind::Payload);
+				footprint += StringFootprint(value.m_expandString, StringKind::Payload);
+				footprint += StringsFootprint(value.m_multiString, StringKind::Payload);
+				if (value.m_binary.capacity() != 0)
+				{
+					footprint.payloadBytes += value.m_binary.size();
+					footprint.slackBytes += value.m_binary.capacity() - value.m_binary.size();
+					footprint.allocations++;
+				}
+				return footprint;
+			}
+		};
+
+	} // namespace footprint_detail
+
+
+	//------------------------------------------------------------------------------
+	// Heap bytes owned by an object, not including the object itself
+	//------------------------------------------------------------------------------
+
+	inline MemoryFootprint Footprint(const RegValue& value)
+	{
+		return footprint_detail::RegValueAccess::Footprint(value);
+	}
+
+
+	// Of a name
+	inline MemoryFootprint Footprint(const std::wstring& name)
+	{
+		return footprint_detail::StringFootprint(name, footprint_detail::StringKind::Name);
+	}
+
+
+	// Of a list of names (e.g. from EnumerateSubKeyNames())
+	inline MemoryFootprint Footprint(const std::vector<std::wstring>& names)
+	{
+		return footprint_detail::StringsFootprint(names, footprint_detail::StringKind::Name);
+	}
+
+
+	inline MemoryFootprint Footprint(const std::vector<RegValue>& values)
+	{
+		MemoryFootprint footprint = footprint_detail::ArrayFootprint(values);
+		for (const RegValue& value : values)
+		{
+			footprint += Footprint(value);
+		}
+		return footprint;
+	}
+
+
+	inline MemoryFootprint Footprint(const LoadedKey& key)
+	{
+		MemoryFootprint footprint = Footprint(key.path);
+		footprint += Footprint(key.values);
+		footprint += Footprint(key.subKeyNames);
+		return footprint;
+	}
+
+
+	inline MemoryFootprint Footprint(const LoadedTree& tree)
+	{
+		MemoryFootprint footprint = footprint_detail::ArrayFootprint(tree.keys);
+		for (const LoadedKey& key : tree.keys)
+		{
+			footprint += Footprint(key);
+		}
+		return footprint;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Footprint of a loaded tree, by key and by value type.
+	// The totals include the array of keys of the tree.
+	//------------------------------------------------------------------------------
+	struct FootprintReport
+	{
+		MemoryFootprint total;
+		std::map<DWORD, MemoryFootprint> byType;        // values, by type: names and data
+		std::vector<std::pair<std::wstring, MemoryFootprint>> byKey;    // in the order of the tree
+	};
+
+
+	inline FootprintReport ReportFootprint(const LoadedTree& tree)
+	{
+		FootprintReport report;
+		report.total = footprint_detail::ArrayFootprint(tree.keys);
+		report.byKey.reserve(tree.keys.size());
+		for (const LoadedKey& key : tree.keys)
+		{
+			const MemoryFootprint keyFootprint = Footprint(key);
+			report.byKey.emplace_back(key.path, keyFootprint);
+			report.total += keyFootprint;
+
+			for (const RegValue& value : key.values)
+			{
+				report.byType[value.GetType()] += Footprint(value);
+			}
+		}
+		return report;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Options of LoadTree()
+	//------------------------------------------------------------------------------
+	struct TreeLoadBudget
+	{
+		// Most heap bytes of the loaded tree (Footprint(LoadedTree))
+		size_t maxHeapBytes = SIZE_MAX;
+
+		// If set, called with the keys that don't fit, and the load goes on;
+		// otherwise, the load stops at the first key that doesn't fit
+		std::function<void(LoadedKey&&)> spill;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Reads the tree below subKey of hKey, breadth-first, keeping its footprint
+	// within the budget (see the notes at the top of this file).
+	// Sub-keys deleted meanwhile are skipped. Throws RegException if subKey can't
+	// be opened, or on errors reading a key.
+	//------------------------------------------------------------------------------
+	inline LoadedTree LoadTree(HKEY hKey, const std::wstring& subKey, const TreeLoadBudget& budget = {})
+	{
+		_ASSERTE(hKey != nullptr);
+
+		RegKey root = RegKey::OpenKey(hKey, subKey, KEY_READ);
+
+		LoadedTree tree;
+		size_t heapBytes = 0;       // of the keys, not of the array holding them
+
+		std::deque<std::wstring> pending{ std::wstring() };
+		while (!pending.empty())
+		{
+			LoadedKey key;
+			key.path = std::move(pending.front());
+			pending.pop_front();
+
+			HKEY hSubKey = nullptr;
+			if (key.path.empty())
+			{
+				key.values = EnumerateValues(root.Handle());
+				key.subKeyNames = EnumerateSubKeyNames(root.Handle());
+			}
+			else
+			{
+				LONG result = ::RegOpenKeyEx(root.Handle(), key.path.c_str(), 0, KEY_READ, &hSubKey);
+				if (result == ERROR_FILE_NOT_FOUND)
+				{
+					continue;       // deleted since its parent was read
+				}
+				if (result != ERROR_SUCCESS)
+				{
+					throw RegException(L"RegOpenKeyEx() failed trying opening a key:{" + key.path + L"}", result);
+				}
+
+				RegKey keyHandle(hSubKey);
+				key.values = EnumerateValues(keyHandle.Handle());
+				key.subKeyNames = EnumerateSubKeyNames(keyHandle.Handle());
+			}
+
+			for (const std::wstring& name : key.subKeyNames)
+			{
+				pending.push_back(key.path.empty() ? name : key.path + L"\\" + name);
+			}
+
+			// The array of keys grows by doubling, under our control, to know its size beforehand
+			const size_t keyBytes = Footprint(key).HeapBytes();
+			size_t capacity = tree.keys.capacity();
+			if (tree.keys.size() == capacity)
+			{
+				capacity = (capacity == 0) ? 16 : capacity * 2;
+			}
+			if (heapBytes + keyBytes + capacity * sizeof(LoadedKey) > budget.maxHeapBytes)
+			{
+				if (!budget.spill)
+				{
+					tree.complete = false;
+					break;
+				}
+				budget.spill(std::move(key));
+				tree.spilledKeys++;
+				continue;
+			}
+
+			tree.keys.reserve(capacity);
+			tree.keys.push_back(std::move(key));
+			heapBytes += keyBytes;
+		}
+		return tree;
+	}
+
+} // namespace winreg
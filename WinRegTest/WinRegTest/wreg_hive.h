@@ -0,0 +1,1305 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_hive.h
+// DESC: Offline hive files (REGF): layout, read-only view, and builder.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// A hive file, as written by RegSaveKey() (format version 1.5), is:
+//
+//  - a 4 KB base block: "regf", the sequence numbers, the offset of the root
+//    key, the size of the hive bins data, and an XOR-32 checksum of its first
+//    508 bytes;
+//
+//  - the hive bins: "hbin" blocks, multiples of 4 KB, each holding cells.
+//    A cell starts with its size, a multiple of 8 including the size field:
+//    negative for an allocated cell, positive for a free one. Cells are
+//    referenced by offsets relative to the first bin (the "cell index").
+//
+// The cells of a key tree are:
+//
+//  - "nk" key nodes: name, parent, and the offsets of the sub-key list, of the
+//    value list, and of the security ("sk") cell;
+//  - sub-key lists, sorted by upper-case name: "lh" (offset and name hash),
+//    "lf" (offset and first 4 characters), "li" (offsets), and "ri", a list of
+//    those lists, for large keys;
+//  - value lists (an array of offsets, with no signature), and "vk" values,
+//    whose data is stored in the offset field up to 4 bytes, in a data cell,
+//    or in "db" big data segments of up to 16344 bytes.
+//
+// Names are stored as Latin-1 when they can be ("compressed" names), in
+// UTF-16LE otherwise. String data is UTF-16LE: where wchar_t is 32-bit, it's
+// transcoded. The layout is little-endian, as are the processors Windows runs on.
+//
+// HiveView reads a hive in memory (e.g. a MappedFile) without copying it:
+// HiveKey and HiveValue are small handles to its cells. Malformed cells make
+// them throw RegException(ERROR_BADDB), without reading out of bounds; use
+// the verifier of wreg_hive_verify.h to check a whole hive first.
+//
+// HiveBuilder lays out a key tree as a hive, e.g. to export a tree on
+// platforms without RegSaveKey(), or to produce hives for tests.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include "wreg_file.h"  // OpenFile()
+#include "wreg_utf8.h"  // utf_detail::Utf16ToWide(), WideToUtf16()
+#include <algorithm>    // std::all_of, std::lower_bound, std::min, std::max
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::system_clock
+#include <cstdint>      // uint8_t, uint16_t, uint32_t, uint64_t
+#include <filesystem>   // std::filesystem::path
+#include <iterator>     // std::begin, std::end
+#include <map>          // std::map
+#include <memory>       // std::unique_ptr
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+#include <string.h>     // memcpy(), memcmp()
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define WINREG_HIVE_SSE2 1
+#include <emmintrin.h>  // SSE2 intrinsics
+#endif
+
+namespace winreg
+{
+	namespace hive_detail
+	{
+		constexpr uint32_t BaseBlockSize = 4096;
+		constexpr uint32_t BinAlignment = 4096;
+		constexpr uint32_t BinHeaderSize = 32;
+		constexpr uint32_t InvalidOffset = 0xFFFFFFFF;
+		constexpr uint32_t MaxSegmentSize = 16344;      // of big data
+		constexpr uint32_t ResidentData = 0x80000000;   // in vk data sizes: data in the offset field
+		constexpr uint32_t MaxKeyDepth = 512;
+
+		// Base block fields
+		enum : uint32_t
+		{
+			RegfSignature = 0, RegfPrimarySequence = 4, RegfSecondarySequence = 8, RegfLastWrite = 12,
+			RegfMajorVersion = 20, RegfMinorVersion = 24, RegfFileType = 28, RegfFileFormat = 32,
+			RegfRootCell = 36, RegfBinsSize = 40, RegfClustering = 44, RegfFileName = 48,
+			RegfChecksum = 508
+		};
+
+		// Bin header fields
+		enum : uint32_t
+		{
+			BinSignature = 0, BinOffset = 4, BinSize = 8, BinTimestamp = 20
+		};
+
+		// Key node fields, from the start of the cell data (after the size)
+		enum : uint32_t
+		{
+			NkFlags = 2, NkLastWrite = 4, NkParent = 16, NkSubKeyCount = 20, NkVolatileSubKeyCount = 24,
+			NkSubKeyList = 28, NkVolatileSubKeyList = 32, NkValueCount = 36, NkValueList = 40,
+			NkSecurity = 44, NkClass = 48, NkMaxNameLength = 52, NkMaxClassLength = 56,
+			NkMaxValueNameLength = 60, NkMaxValueDataSize = 64, NkNameLength = 72, NkClassLength = 74,
+			NkName = 76
+		};
+
+		// Value fields
+		enum : uint32_t
+		{
+			VkNameLength = 2, VkDataSize = 4, VkDataOffset = 8, VkType = 12, VkFlags = 16, VkName = 20
+		};
+
+		// Security fields
+		enum : uint32_t
+		{
+			SkFlink = 4, SkBlink = 8, SkRefCount = 12, SkDescriptorSize = 16, SkDescriptor = 20
+		};
+
+		// Big data fields
+		enum : uint32_t
+		{
+			DbCount = 2, DbSegmentList = 4, DbSize = 8
+		};
+
+		// Key node flags
+		constexpr uint16_t KeyHiveEntry = 0x0004;
+		constexpr uint16_t KeyNoDelete = 0x0008;
+		constexpr uint16_t KeyCompressedName = 0x0020;
+
+		// Value flags
+		constexpr uint16_t ValueCompressedName = 0x0001;
+
+
+		inline uint16_t Get16(const uint8_t* p) noexcept
+		{
+			uint16_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		inline uint32_t Get32(const uint8_t* p) noexcept
+		{
+			uint32_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		inline uint64_t Get64(const uint8_t* p) noexcept
+		{
+			uint64_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		inline void Put16(uint8_t* p, uint16_t value) noexcept
+		{
+			memcpy(p, &value, sizeof(value));
+		}
+
+		inline void Put32(uint8_t* p, uint32_t value) noexcept
+		{
+			memcpy(p, &value, sizeof(value));
+		}
+
+		inline void Put64(uint8_t* p, uint64_t value) noexcept
+		{
+			memcpy(p, &value, sizeof(value));
+		}
+
+
+		inline bool HasSignature(const uint8_t* p, const char (&signature)[3]) noexcept
+		{
+			return p[0] == static_cast<uint8_t>(signature[0]) && p[1] == static_cast<uint8_t>(signature[1]);
+		}
+
+
+		//
+		// XOR-32 of the first 508 bytes of the base block; 0 and -1 are stored
+		// as 1 and -2. Vectorized with SSE2: 31 blocks of 16 bytes, then 3 DWORDs.
+		//
+		inline uint32_t BaseBlockChecksum(const uint8_t* baseBlock) noexcept
+		{
+			uint32_t sum = 0;
+			size_t i = 0;
+#ifdef WINREG_HIVE_SSE2
+			__m128i acc = _mm_setzero_si128();
+			for (; i + 16 <= RegfChecksum; i += 16)
+			{
+				acc = _mm_xor_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(baseBlock + i)));
+			}
+			acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+			acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+			sum = static_cast<uint32_t>(_mm_cvtsi128_si32(acc));
+#endif
+			for (; i < RegfChecksum; i += 4)
+			{
+				sum ^= Get32(baseBlock + i);
+			}
+
+			if (sum == 0xFFFFFFFF)
+			{
+				return 0xFFFFFFFE;
+			}
+			return (sum == 0) ? 1 : sum;
+		}
+
+
+		// Upper-case mapping of UTF-16 units, as RtlUpcaseUnicodeChar(): the units from first
+		// to last, every step units, map to unit + delta (modulo 2^16). These are the simple
+		// upper-case mappings of Unicode, but for the dotless i and the long s, not mapped to
+		// ASCII. Unlike towupper(), this doesn't depend on the locale: the hashes and the order
+		// of the names in a hive are the ones Windows computes.
+		struct UpcaseRange
+		{
+			uint16_t first;
+			uint16_t last;
+			uint16_t delta;
+			uint16_t step;
+		};
+
+		inline constexpr UpcaseRange UpcaseRanges[] =
+		{
+			{ 0x00B5, 0x00B5, 0x02E7, 1 }, { 0x00E0, 0x00F6, 0xFFE0, 1 }, { 0x00F8, 0x00FE, 0xFFE0, 1 }, { 0x00FF, 0x00FF, 0x0079, 1 },
+			{ 0x0101, 0x012F, 0xFFFF, 2 }, { 0x0133, 0x0137, 0xFFFF, 2 }, { 0x013A, 0x0148, 0xFFFF, 2 }, { 0x014B, 0x0177, 0xFFFF, 2 },
+			{ 0x017A, 0x017E, 0xFFFF, 2 }, { 0x0180, 0x0180, 0x00C3, 1 }, { 0x0183, 0x0185, 0xFFFF, 2 }, { 0x0188, 0x0188, 0xFFFF, 1 },
+			{ 0x018C, 0x018C, 0xFFFF, 1 }, { 0x0192, 0x0192, 0xFFFF, 1 }, { 0x0195, 0x0195, 0x0061, 1 }, { 0x0199, 0x0199, 0xFFFF, 1 },
+			{ 0x019A, 0x019A, 0x00A3, 1 }, { 0x019E, 0x019E, 0x0082, 1 }, { 0x01A1, 0x01A5, 0xFFFF, 2 }, { 0x01A8, 0x01A8, 0xFFFF, 1 },
+			{ 0x01AD, 0x01AD, 0xFFFF, 1 }, { 0x01B0, 0x01B0, 0xFFFF, 1 }, { 0x01B4, 0x01B6, 0xFFFF, 2 }, { 0x01B9, 0x01B9, 0xFFFF, 1 },
+			{ 0x01BD, 0x01BD, 0xFFFF, 1 }, { 0x01BF, 0x01BF, 0x0038, 1 }, { 0x01C5, 0x01C5, 0xFFFF, 1 }, { 0x01C6, 0x01C6, 0xFFFE, 1 },
+			{ 0x01C8, 0x01C8, 0xFFFF, 1 }, { 0x01C9, 0x01C9, 0xFFFE, 1 }, { 0x01CB, 0x01CB, 0xFFFF, 1 }, { 0x01CC, 0x01CC, 0xFFFE, 1 },
+			{ 0x01CE, 0x01DC, 0xFFFF, 2 }, { 0x01DD, 0x01DD, 0xFFB1, 1 }, { 0x01DF, 0x01EF, 0xFFFF, 2 }, { 0x01F2, 0x01F2, 0xFFFF, 1 },
+			{ 0x01F3, 0x01F3, 0xFFFE, 1 }, { 0x01F5, 0x01F5, 0xFFFF, 1 }, { 0x01F9, 0x021F, 0xFFFF, 2 }, { 0x0223, 0x0233, 0xFFFF, 2 },
+			{ 0x023C, 0x023C, 0xFFFF, 1 }, { 0x023F, 0x0240, 0x2A3F, 1 }, { 0x0242, 0x0242, 0xFFFF, 1 }, { 0x0247, 0x024F, 0xFFFF, 2 },
+			{ 0x0250, 0x0250, 0x2A1F, 1 }, { 0x0251, 0x0251, 0x2A1C, 1 }, { 0x0252, 0x0252, 0x2A1E, 1 }, { 0x0253, 0x0253, 0xFF2E, 1 },
+			{ 0x0254, 0x0254, 0xFF32, 1 }, { 0x0256, 0x0257, 0xFF33, 1 }, { 0x0259, 0x0259, 0xFF36, 1 }, { 0x025B, 0x025B, 0xFF35, 1 },
+			{ 0x025C, 0x025C, 0xA54F, 1 }, { 0x0260, 0x0260, 0xFF33, 1 }, { 0x0261, 0x0261, 0xA54B, 1 }, { 0x0263, 0x0263, 0xFF31, 1 },
+			{ 0x0265, 0x0265, 0xA528, 1 }, { 0x0266, 0x0266, 0xA544, 1 }, { 0x0268, 0x0268, 0xFF2F, 1 }, { 0x0269, 0x0269, 0xFF2D, 1 },
+			{ 0x026A, 0x026A, 0xA544, 1 }, { 0x026B, 0x026B, 0x29F7, 1 }, { 0x026C, 0x026C, 0xA541, 1 }, { 0x026F, 0x026F, 0xFF2D, 1 },
+			{ 0x0271, 0x0271, 0x29FD, 1 }, { 0x0272, 0x0272, 0xFF2B, 1 }, { 0x0275, 0x0275, 0xFF2A, 1 }, { 0x027D, 0x027D, 0x29E7, 1 },
+			{ 0x0280, 0x0280, 0xFF26, 1 }, { 0x0282, 0x0282, 0xA543, 1 }, { 0x0283, 0x0283, 0xFF26, 1 }, { 0x0287, 0x0287, 0xA52A, 1 },
+			{ 0x0288, 0x0288, 0xFF26, 1 }, { 0x0289, 0x0289, 0xFFBB, 1 }, { 0x028A, 0x028B, 0xFF27, 1 }, { 0x028C, 0x028C, 0xFFB9, 1 },
+			{ 0x0292, 0x0292, 0xFF25, 1 }, { 0x029D, 0x029D, 0xA515, 1 }, { 0x029E, 0x029E, 0xA512, 1 }, { 0x0345, 0x0345, 0x0054, 1 },
+			{ 0x0371, 0x0373, 0xFFFF, 2 }, { 0x0377, 0x0377, 0xFFFF, 1 }, { 0x037B, 0x037D, 0x0082, 1 }, { 0x03AC, 0x03AC, 0xFFDA, 1 },
+			{ 0x03AD, 0x03AF, 0xFFDB, 1 }, { 0x03B1, 0x03C1, 0xFFE0, 1 }, { 0x03C2, 0x03C2, 0xFFE1, 1 }, { 0x03C3, 0x03CB, 0xFFE0, 1 },
+			{ 0x03CC, 0x03CC, 0xFFC0, 1 }, { 0x03CD, 0x03CE, 0xFFC1, 1 }, { 0x03D0, 0x03D0, 0xFFC2, 1 }, { 0x03D1, 0x03D1, 0xFFC7, 1 },
+			{ 0x03D5, 0x03D5, 0xFFD1, 1 }, { 0x03D6, 0x03D6, 0xFFCA, 1 }, { 0x03D7, 0x03D7, 0xFFF8, 1 }, { 0x03D9, 0x03EF, 0xFFFF, 2 },
+			{ 0x03F0, 0x03F0, 0xFFAA, 1 }, { 0x03F1, 0x03F1, 0xFFB0, 1 }, { 0x03F2, 0x03F2, 0x0007, 1 }, { 0x03F3, 0x03F3, 0xFF8C, 1 },
+			{ 0x03F5, 0x03F5, 0xFFA0, 1 }, { 0x03F8, 0x03F8, 0xFFFF, 1 }, { 0x03FB, 0x03FB, 0xFFFF, 1 }, { 0x0430, 0x044F, 0xFFE0, 1 },
+			{ 0x0450, 0x045F, 0xFFB0, 1 }, { 0x0461, 0x0481, 0xFFFF, 2 }, { 0x048B, 0x04BF, 0xFFFF, 2 }, { 0x04C2, 0x04CE, 0xFFFF, 2 },
+			{ 0x04CF, 0x04CF, 0xFFF1, 1 }, { 0x04D1, 0x052F, 0xFFFF, 2 }, { 0x0561, 0x0586, 0xFFD0, 1 }, { 0x10D0, 0x10FA, 0x0BC0, 1 },
+			{ 0x10FD, 0x10FF, 0x0BC0, 1 }, { 0x13F8, 0x13FD, 0xFFF8, 1 }, { 0x1C80, 0x1C80, 0xE792, 1 }, { 0x1C81, 0x1C81, 0xE793, 1 },
+			{ 0x1C82, 0x1C82, 0xE79C, 1 }, { 0x1C83, 0x1C84, 0xE79E, 1 }, { 0x1C85, 0x1C85, 0xE79D, 1 }, { 0x1C86, 0x1C86, 0xE7A4, 1 },
+			{ 0x1C87, 0x1C87, 0xE7DB, 1 }, { 0x1C88, 0x1C88, 0x89C2, 1 }, { 0x1D79, 0x1D79, 0x8A04, 1 }, { 0x1D7D, 0x1D7D, 0x0EE6, 1 },
+			{ 0x1D8E, 0x1D8E, 0x8A38, 1 }, { 0x1E01, 0x1E95, 0xFFFF, 2 }, { 0x1E9B, 0x1E9B, 0xFFC5, 1 }, { 0x1EA1, 0x1EFF, 0xFFFF, 2 },
+			{ 0x1F00, 0x1F07, 0x0008, 1 }, { 0x1F10, 0x1F15, 0x0008, 1 }, { 0x1F20, 0x1F27, 0x0008, 1 }, { 0x1F30, 0x1F37, 0x0008, 1 },
+			{ 0x1F40, 0x1F45, 0x0008, 1 }, { 0x1F51, 0x1F57, 0x0008, 2 }, { 0x1F60, 0x1F67, 0x0008, 1 }, { 0x1F70, 0x1F71, 0x004A, 1 },
+			{ 0x1F72, 0x1F75, 0x0056, 1 }, { 0x1F76, 0x1F77, 0x0064, 1 }, { 0x1F78, 0x1F79, 0x0080, 1 }, { 0x1F7A, 0x1F7B, 0x0070, 1 },
+			{ 0x1F7C, 0x1F7D, 0x007E, 1 }, { 0x1F80, 0x1F87, 0x0008, 1 }, { 0x1F90, 0x1F97, 0x0008, 1 }, { 0x1FA0, 0x1FA7, 0x0008, 1 },
+			{ 0x1FB0, 0x1FB1, 0x0008, 1 }, { 0x1FB3, 0x1FB3, 0x0009, 1 }, { 0x1FBE, 0x1FBE, 0xE3DB, 1 }, { 0x1FC3, 0x1FC3, 0x0009, 1 },
+			{ 0x1FD0, 0x1FD1, 0x0008, 1 }, { 0x1FE0, 0x1FE1, 0x0008, 1 }, { 0x1FE5, 0x1FE5, 0x0007, 1 }, { 0x1FF3, 0x1FF3, 0x0009, 1 },
+			{ 0x214E, 0x214E, 0xFFE4, 1 }, { 0x2170, 0x217F, 0xFFF0, 1 }, { 0x2184, 0x2184, 0xFFFF, 1 }, { 0x24D0, 0x24E9, 0xFFE6, 1 },
+			{ 0x2C30, 0x2C5F, 0xFFD0, 1 }, { 0x2C61, 0x2C61, 0xFFFF, 1 }, { 0x2C65, 0x2C65, 0xD5D5, 1 }, { 0x2C66, 0x2C66, 0xD5D8, 1 },
+			{ 0x2C68, 0x2C6C, 0xFFFF, 2 }, { 0x2C73, 0x2C73, 0xFFFF, 1 }, { 0x2C76, 0x2C76, 0xFFFF, 1 }, { 0x2C81, 0x2CE3, 0xFFFF, 2 },
+			{ 0x2CEC, 0x2CEE, 0xFFFF, 2 }, { 0x2CF3, 0x2CF3, 0xFFFF, 1 }, { 0x2D00, 0x2D25, 0xE3A0, 1 }, { 0x2D27, 0x2D27, 0xE3A0, 1 },
+			{ 0x2D2D, 0x2D2D, 0xE3A0, 1 }, { 0xA641, 0xA66D, 0xFFFF, 2 }, { 0xA681, 0xA69B, 0xFFFF, 2 }, { 0xA723, 0xA72F, 0xFFFF, 2 },
+			{ 0xA733, 0xA76F, 0xFFFF, 2 }, { 0xA77A, 0xA77C, 0xFFFF, 2 }, { 0xA77F, 0xA787, 0xFFFF, 2 }, { 0xA78C, 0xA78C, 0xFFFF, 1 },
+			{ 0xA791, 0xA793, 0xFFFF, 2 }, { 0xA794, 0xA794, 0x0030, 1 }, { 0xA797, 0xA7A9, 0xFFFF, 2 }, { 0xA7B5, 0xA7C3, 0xFFFF, 2 },
+			{ 0xA7C8, 0xA7CA, 0xFFFF, 2 }, { 0xA7D1, 0xA7D1, 0xFFFF, 1 }, { 0xA7D7, 0xA7D9, 0xFFFF, 2 }, { 0xA7F6, 0xA7F6, 0xFFFF, 1 },
+			{ 0xAB53, 0xAB53, 0xFC60, 1 }, { 0xAB70, 0xABBF, 0x6830, 1 }, { 0xFF41, 0xFF5A, 0xFFE0, 1 },
+		};
+
+
+		inline uint16_t UpcaseUnit(uint16_t unit) noexcept
+		{
+			if (unit < 0x80)
+			{
+				return (unit >= 'a' && unit <= 'z') ? static_cast<uint16_t>(unit - 'a' + 'A') : unit;
+			}
+
+			// The first range ending at or after the unit
+			const UpcaseRange* range = std::lower_bound(std::begin(UpcaseRanges), std::end(UpcaseRanges), unit,
+				[](const UpcaseRange& r, uint16_t u) { return r.last < u; });
+			if (range == std::end(UpcaseRanges) || unit < range->first || (unit - range->first) % range->step != 0)
+			{
+				return unit;
+			}
+			return static_cast<uint16_t>(unit + range->delta);
+		}
+
+
+		// Upper-case UTF-16 units of a character, the first one in the high half: the low
+		// half is the low surrogate of a character beyond the BMP (left as it is), or 0
+		inline uint32_t UpcaseUnits(wchar_t ch) noexcept
+		{
+			const uint32_t cp = static_cast<uint32_t>(ch);
+			if (cp > 0xFFFF)
+			{
+				return ((0xD800 + ((cp - 0x10000) >> 10)) << 16) | (0xDC00 + ((cp - 0x10000) & 0x3FF));
+			}
+			return static_cast<uint32_t>(UpcaseUnit(static_cast<uint16_t>(cp))) << 16;
+		}
+
+
+		// Hash of a name in "lh" lists
+		inline uint32_t NameHash(std::wstring_view name) noexcept
+		{
+			uint32_t hash = 0;
+			for (wchar_t ch : name)
+			{
+				const uint32_t units = UpcaseUnits(ch);
+				hash = hash * 37 + (units >> 16);
+				if ((units & 0xFFFF) != 0)
+				{
+					hash = hash * 37 + (units & 0xFFFF);
+				}
+			}
+			return hash;
+		}
+
+
+		// Sub-key lists are sorted by upper-case name, unit by unit
+		inline int CompareNames(std::wstring_view lhs, std::wstring_view rhs) noexcept
+		{
+			const size_t length = (std::min)(lhs.size(), rhs.size());
+			for (size_t i = 0; i < length; i++)
+			{
+				const uint32_t a = UpcaseUnits(lhs[i]);
+				const uint32_t b = UpcaseUnits(rhs[i]);
+				if (a != b)
+				{
+					return (a < b) ? -1 : 1;
+				}
+			}
+			return (lhs.size() == rhs.size()) ? 0 : (lhs.size() < rhs.size()) ? -1 : 1;
+		}
+
+
+		struct NameLess
+		{
+			bool operator()(const std::wstring& lhs, const std::wstring& rhs) const noexcept
+			{
+				return CompareNames(lhs, rhs) < 0;
+			}
+		};
+
+
+		// Decodes a name stored as Latin-1 (compressed) or UTF-16LE
+		inline std::wstring DecodeName(const uint8_t* p, size_t byteLength, bool compressed)
+		{
+			if (compressed)
+			{
+				return std::wstring(p, p + byteLength);
+			}
+			std::vector<char16_t> units(byteLength / 2);
+			if (!units.empty())
+			{
+				memcpy(units.data(), p, units.size() * sizeof(char16_t));
+			}
+			std::wstring name(units.size(), L'\0');
+			name.resize(utf_detail::Utf16ToWide(units.data(), units.size(), &name[0]));
+			return name;
+		}
+
+
+		// Encodes a name as stored in a cell; compressed if all its characters are Latin-1
+		inline std::vector<uint8_t> EncodeName(std::wstring_view name, bool& compressed)
+		{
+			compressed = std::all_of(name.begin(), name.end(),
+				[](wchar_t ch) { return static_cast<uint32_t>(ch) < 0x100; });
+			if (compressed)
+			{
+				return std::vector<uint8_t>(name.begin(), name.end());
+			}
+			std::vector<char16_t> units(name.size() * utf_detail::MaxUtf16PerWide);
+			units.resize(utf_detail::WideToUtf16(name.data(), name.size(), units.data()));
+			std::vector<uint8_t> bytes(units.size() * sizeof(char16_t));
+			if (!bytes.empty())
+			{
+				memcpy(bytes.data(), units.data(), bytes.size());
+			}
+			return bytes;
+		}
+
+
+		// Value data as stored in a hive (UTF-16LE strings), from a RegValue
+		inline std::vector<uint8_t> EncodeValueData(const RegValue& value)
+		{
+			std::vector<char16_t> units;
+			auto append = [&](const std::wstring& str)
+			{
+				const size_t start = units.size();
+				units.resize(start + str.size() * utf_detail::MaxUtf16PerWide);
+				units.resize(start + utf_detail::WideToUtf16(str.data(), str.size(), units.data() + start));
+				units.push_back(u'\0');
+			};
+
+			std::vector<uint8_t> data;
+			switch (value.GetType())
+			{
+			case REG_DWORD:
+				data.resize(sizeof(DWORD));
+				Put32(data.data(), value.Dword());
+				return data;
+			case REG_BINARY:
+				return std::vector<uint8_t>(value.Binary().begin(), value.Binary().end());
+			case REG_SZ:
+				append(value.String());
+				break;
+			case REG_EXPAND_SZ:
+				append(value.ExpandString());
+				break;
+			case REG_MULTI_SZ:
+				for (const std::wstring& str : value.MultiString())
+				{
+					append(str);
+				}
+				units.push_back(u'\0');
+				break;
+			default:
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+
+			data.resize(units.size() * sizeof(char16_t));
+			if (!data.empty())
+			{
+				memcpy(data.data(), units.data(), data.size());
+			}
+			return data;
+		}
+
+
+		// RegValue from value data as stored in a hive
+		inline RegValue DecodeValueData(const std::wstring& name, DWORD type, const uint8_t* data, size_t size)
+		{
+			if (type != REG_SZ && type != REG_EXPAND_SZ && type != REG_MULTI_SZ)
+			{
+				return detail::MakeRegValue(name, type, data, detail::SafeSizeToDwordCast(size));
+			}
+
+			// Transcoded to wchar_t data, as returned by the registry API
+			std::vector<char16_t> units(size / sizeof(char16_t));
+			if (!units.empty())
+			{
+				memcpy(units.data(), data, units.size() * sizeof(char16_t));
+			}
+			std::vector<wchar_t> wide(units.size());
+			wide.resize(utf_detail::Utf16ToWide(units.data(), units.size(), wide.data()));
+			return detail::MakeRegValue(name, type, reinterpret_cast<const BYTE*>(wide.data()),
+				detail::SafeSizeToDwordCast(wide.size() * sizeof(wchar_t)));
+		}
+
+
+		inline uint64_t FileTimeNow() noexcept
+		{
+			// 100 ns intervals since 1601-01-01
+			const auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count())
+				* 10 + 116444736000000000ULL;
+		}
+
+
+		inline void ThrowCorrupt(const wchar_t* message)
+		{
+			throw RegException(message, ERROR_BADDB);
+		}
+
+
+		// Calls work(index, thread) for each index in [0, count), on up to threads
+		// threads; the indexes are handed out one at a time, in order
+		template <typename Work>
+		void ParallelFor(size_t threads, size_t count, Work work)
+		{
+			threads = (std::max)(size_t(1), (std::min)(threads, count));
+			if (threads == 1)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					work(i, size_t(0));
+				}
+				return;
+			}
+
+			std::atomic<size_t> next{ 0 };
+			auto worker = [&](size_t thread)
+			{
+				for (size_t i = next++; i < count; i = next++)
+				{
+					work(i, thread);
+				}
+			};
+
+			std::vector<std::thread> workers;
+			for (size_t t = 1; t < threads; t++)
+			{
+				workers.emplace_back(worker, t);
+			}
+			worker(0);
+			for (std::thread& thread : workers)
+			{
+				thread.join();
+			}
+		}
+
+	} // namespace hive_detail
+
+
+	class HiveView;
+
+
+	//------------------------------------------------------------------------------
+	// A value of a hive: a handle to its "vk" cell
+	//------------------------------------------------------------------------------
+	class HiveValue
+	{
+	public:
+		HiveValue(const HiveView& hive, uint32_t cellOffset);
+
+		uint32_t CellOffset() const noexcept { return m_offset; }
+		std::wstring Name() const;
+		DWORD Type() const noexcept { return hive_detail::Get32(m_cell + hive_detail::VkType); }
+		uint32_t DataSize() const noexcept;
+
+		// Reads the data as stored in the hive (UTF-16LE strings), joining big data segments
+		void ReadData(std::vector<uint8_t>& data) const;
+
+		// Reads the value as a RegValue; throws std::invalid_argument for unsupported types
+		RegValue ToRegValue() const;
+
+	private:
+		const HiveView* m_hive;
+		uint32_t m_offset;
+		const uint8_t* m_cell;
+		uint32_t m_cellSize;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key of a hive: a handle to its "nk" cell
+	//------------------------------------------------------------------------------
+	class HiveKey
+	{
+	public:
+		HiveKey(const HiveView& hive, uint32_t cellOffset);
+
+		uint32_t CellOffset() const noexcept { return m_offset; }
+		std::wstring Name() const;
+		uint64_t LastWriteTime() const noexcept { return hive_detail::Get64(m_cell + hive_detail::NkLastWrite); }
+		uint32_t SubKeyCount() const noexcept { return hive_detail::Get32(m_cell + hive_detail::NkSubKeyCount); }
+		uint32_t ValueCount() const noexcept { return hive_detail::Get32(m_cell + hive_detail::NkValueCount); }
+		uint32_t ParentOffset() const noexcept { return hive_detail::Get32(m_cell + hive_detail::NkParent); }
+
+		// Calls onSubKey(const HiveKey&) for each sub-key, in the order of the list (by name)
+		template <typename OnSubKey>
+		void ForEachSubKey(OnSubKey onSubKey) const;
+
+		// Calls onValue(const HiveValue&) for each value
+		template <typename OnValue>
+		void ForEachValue(OnValue onValue) const;
+
+		// Finds a sub-key by name, ignoring case; returns false if there isn't one
+		bool FindSubKey(std::wstring_view name, uint32_t& cellOffset) const;
+
+		// Finds a value by name, ignoring case; returns false if there isn't one
+		bool FindValue(std::wstring_view name, uint32_t& cellOffset) const;
+
+	private:
+		const HiveView* m_hive;
+		uint32_t m_offset;
+		const uint8_t* m_cell;
+		uint32_t m_cellSize;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Read-only view of a hive in memory (see the notes at the top of this file).
+	// The memory must stay valid while the view, its keys and values are used.
+	//------------------------------------------------------------------------------
+	class HiveView
+	{
+	public:
+
+		// Checks the base block: throws RegException(ERROR_BADDB) if it isn't a
+		// primary hive file, or if the file is shorter than its hive bins
+		HiveView(const void* data, size_t size)
+			: m_data(static_cast<const uint8_t*>(data)), m_size(size)
+		{
+			using namespace hive_detail;
+
+			if (m_size < BaseBlockSize || memcmp(m_data, "regf", 4) != 0)
+			{
+				ThrowCorrupt(L"Not a hive file: no \"regf\" base block.");
+			}
+			m_binsSize = Get32(m_data + RegfBinsSize);
+			if (m_binsSize % BinAlignment != 0 || m_binsSize > m_size - BaseBlockSize)
+			{
+				ThrowCorrupt(L"Hive file truncated, or with an invalid hive bins size.");
+			}
+			m_rootCell = Get32(m_data + RegfRootCell);
+		}
+
+
+		const uint8_t* Data() const noexcept { return m_data; }
+		size_t Size() const noexcept { return m_size; }
+
+		// The hive bins data, where cell offsets start
+		const uint8_t* Bins() const noexcept { return m_data + hive_detail::BaseBlockSize; }
+		uint32_t BinsSize() const noexcept { return m_binsSize; }
+
+		uint32_t RootCell() const noexcept { return m_rootCell; }
+		HiveKey Root() const { return HiveKey(*this, m_rootCell); }
+
+		// Whether the log files must be applied to get the latest data
+		bool IsDirty() const noexcept
+		{
+			return hive_detail::Get32(m_data + hive_detail::RegfPrimarySequence)
+				!= hive_detail::Get32(m_data + hive_detail::RegfSecondarySequence);
+		}
+
+
+		// Returns the data of the allocated cell at offset, and its size (without the
+		// size field). Throws RegException(ERROR_BADDB) if there's no such cell.
+		const uint8_t* Cell(uint32_t offset, uint32_t& dataSize) const
+		{
+			using namespace hive_detail;
+
+			if (offset % 8 != 0 || offset >= m_binsSize || m_binsSize - offset < 8)
+			{
+				ThrowCorrupt(L"Cell offset out of the hive bins.");
+			}
+			const int32_t size = static_cast<int32_t>(Get32(Bins() + offset));
+			if (size >= 0 || size == INT32_MIN || static_cast<uint32_t>(-size) > m_binsSize - offset
+				|| -size < 8)
+			{
+				ThrowCorrupt(L"Cell not allocated, or with an invalid size.");
+			}
+			dataSize = static_cast<uint32_t>(-size) - 4;
+			return Bins() + offset + 4;
+		}
+
+
+		// The path of the key from the root of the hive ("" for the root)
+		std::wstring KeyPath(uint32_t keyOffset) const
+		{
+			std::vector<std::wstring> names;
+			for (uint32_t offset = keyOffset; offset != m_rootCell; )
+			{
+				if (names.size() >= hive_detail::MaxKeyDepth)
+				{
+					hive_detail::ThrowCorrupt(L"Loop in the parents of a key.");
+				}
+				const HiveKey key(*this, offset);
+				names.push_back(key.Name());
+				offset = key.ParentOffset();
+			}
+
+			std::wstring path;
+			for (auto it = names.rbegin(); it != names.rend(); ++it)
+			{
+				if (!path.empty())
+				{
+					path += L'\\';
+				}
+				path += *it;
+			}
+			return path;
+		}
+
+
+		// Opens a key by path from the root, ignoring case; returns false if it doesn't exist
+		bool FindKey(std::wstring_view path, uint32_t& cellOffset) const
+		{
+			uint32_t offset = m_rootCell;
+			while (!path.empty())
+			{
+				const size_t separator = path.find(L'\\');
+				const std::wstring_view name = path.substr(0, separator);
+				path = (separator == std::wstring_view::npos) ? std::wstring_view() : path.substr(separator + 1);
+				if (!name.empty() && !HiveKey(*this, offset).FindSubKey(name, offset))
+				{
+					return false;
+				}
+			}
+			cellOffset = offset;
+			return true;
+		}
+
+	private:
+		const uint8_t* m_data;
+		size_t m_size;
+		uint32_t m_binsSize = 0;
+		uint32_t m_rootCell = 0;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// HiveKey and HiveValue
+	//------------------------------------------------------------------------------
+
+	inline HiveKey::HiveKey(const HiveView& hive, uint32_t cellOffset)
+		: m_hive(&hive), m_offset(cellOffset)
+	{
+		using namespace hive_detail;
+
+		m_cell = hive.Cell(cellOffset, m_cellSize);
+		if (m_cellSize < NkName || !HasSignature(m_cell, "nk")
+			|| Get16(m_cell + NkNameLength) > m_cellSize - NkName)
+		{
+			ThrowCorrupt(L"Invalid key node cell.");
+		}
+	}
+
+
+	inline std::wstring HiveKey::Name() const
+	{
+		using namespace hive_detail;
+		return DecodeName(m_cell + NkName, Get16(m_cell + NkNameLength),
+			(Get16(m_cell + NkFlags) & KeyCompressedName) != 0);
+	}
+
+
+	template <typename OnSubKey>
+	void HiveKey::ForEachSubKey(OnSubKey onSubKey) const
+	{
+		using namespace hive_detail;
+
+		if (SubKeyCount() == 0)
+		{
+			return;
+		}
+
+		// Leaf lists ("li", "lf", "lh"), or an index of them ("ri")
+		auto forEachInLeaf = [&](uint32_t listOffset)
+		{
+			uint32_t listSize = 0;
+			const uint8_t* list = m_hive->Cell(listOffset, listSize);
+			const uint32_t count = (listSize >= 4) ? Get16(list + 2) : 0;
+			const uint32_t entrySize = HasSignature(list, "li") ? 4
+				: (HasSignature(list, "lf") || HasSignature(list, "lh")) ? 8 : 0;
+			if (entrySize == 0 || listSize < 4 || count > (listSize - 4) / entrySize)
+			{
+				ThrowCorrupt(L"Invalid sub-key list cell.");
+			}
+			for (uint32_t i = 0; i < count; i++)
+			{
+				onSubKey(HiveKey(*m_hive, Get32(list + 4 + i * entrySize)));
+			}
+		};
+
+		const uint32_t listOffset = Get32(m_cell + NkSubKeyList);
+		uint32_t listSize = 0;
+		const uint8_t* list = m_hive->Cell(listOffset, listSize);
+		if (listSize >= 4 && HasSignature(list, "ri"))
+		{
+			const uint32_t count = Get16(list + 2);
+			if (count > (listSize - 4) / 4)
+			{
+				ThrowCorrupt(L"Invalid sub-key index cell.");
+			}
+			for (uint32_t i = 0; i < count; i++)
+			{
+				forEachInLeaf(Get32(list + 4 + i * 4));
+			}
+			return;
+		}
+		forEachInLeaf(listOffset);
+	}
+
+
+	template <typename OnValue>
+	void HiveKey::ForEachValue(OnValue onValue) const
+	{
+		using namespace hive_detail;
+
+		const uint32_t count = ValueCount();
+		if (count == 0)
+		{
+			return;
+		}
+		uint32_t listSize = 0;
+		const uint8_t* list = m_hive->Cell(Get32(m_cell + NkValueList), listSize);
+		if (count > listSize / 4)
+		{
+			ThrowCorrupt(L"Invalid value list cell.");
+		}
+		for (uint32_t i = 0; i < count; i++)
+		{
+			onValue(HiveValue(*m_hive, Get32(list + i * 4)));
+		}
+	}
+
+
+	inline bool HiveKey::FindSubKey(std::wstring_view name, uint32_t& cellOffset) const
+	{
+		bool found = false;
+		ForEachSubKey([&](const HiveKey& subKey)
+		{
+			if (!found && hive_detail::CompareNames(subKey.Name(), name) == 0)
+			{
+				cellOffset = subKey.CellOffset();
+				found = true;
+			}
+		});
+		return found;
+	}
+
+
+	inline bool HiveKey::FindValue(std::wstring_view name, uint32_t& cellOffset) const
+	{
+		bool found = false;
+		ForEachValue([&](const HiveValue& value)
+		{
+			if (!found && hive_detail::CompareNames(value.Name(), name) == 0)
+			{
+				cellOffset = value.CellOffset();
+				found = true;
+			}
+		});
+		return found;
+	}
+
+
+	inline HiveValue::HiveValue(const HiveView& hive, uint32_t cellOffset)
+		: m_hive(&hive), m_offset(cellOffset)
+	{
+		using namespace hive_detail;
+
+		m_cell = hive.Cell(cellOffset, m_cellSize);
+		if (m_cellSize < VkName || !HasSignature(m_cell, "vk")
+			|| Get16(m_cell + VkNameLength) > m_cellSize - VkName)
+		{
+			ThrowCorrupt(L"Invalid value cell.");
+		}
+	}
+
+
+	inline std::wstring HiveValue::Name() const
+	{
+		using namespace hive_detail;
+		return DecodeName(m_cell + VkName, Get16(m_cell + VkNameLength),
+			(Get16(m_cell + VkFlags) & ValueCompressedName) != 0);
+	}
+
+
+	inline uint32_t HiveValue::DataSize() const noexcept
+	{
+		return hive_detail::Get32(m_cell + hive_detail::VkDataSize) & ~hive_detail::ResidentData;
+	}
+
+
+	inline void HiveValue::ReadData(std::vector<uint8_t>& data) const
+	{
+		using namespace hive_detail;
+
+		const uint32_t rawSize = Get32(m_cell + VkDataSize);
+		const uint32_t size = rawSize & ~ResidentData;
+		if ((rawSize & ResidentData) != 0)
+		{
+			if (size > 4)
+			{
+				ThrowCorrupt(L"Invalid size of resident value data.");
+			}
+			data.assign(m_cell + VkDataOffset, m_cell + VkDataOffset + size);
+			return;
+		}
+		if (size == 0)
+		{
+			data.clear();
+			return;
+		}
+
+		uint32_t cellSize = 0;
+		const uint8_t* cell = m_hive->Cell(Get32(m_cell + VkDataOffset), cellSize);
+		if (size > MaxSegmentSize && cellSize >= DbSize && HasSignature(cell, "db"))
+		{
+			// Big data: a list of segments
+			const uint32_t count = Get16(cell + DbCount);
+			uint32_t listSize = 0;
+			const uint8_t* list = m_hive->Cell(Get32(cell + DbSegmentList), listSize);
+			if (count > listSize / 4)
+			{
+				ThrowCorrupt(L"Invalid big data segment list.");
+			}
+
+			data.resize(size);
+			uint32_t copied = 0;
+			for (uint32_t i = 0; i < count && copied < size; i++)
+			{
+				uint32_t segmentSize = 0;
+				const uint8_t* segment = m_hive->Cell(Get32(list + i * 4), segmentSize);
+				const uint32_t chunk = (std::min)((std::min)(segmentSize, MaxSegmentSize), size - copied);
+				memcpy(data.data() + copied, segment, chunk);
+				copied += chunk;
+			}
+			if (copied != size)
+			{
+				ThrowCorrupt(L"Big data segments shorter than the value data.");
+			}
+			return;
+		}
+
+		if (cellSize < size)
+		{
+			ThrowCorrupt(L"Value data cell shorter than the value data.");
+		}
+		data.assign(cell, cell + size);
+	}
+
+
+	inline RegValue HiveValue::ToRegValue() const
+	{
+		std::vector<uint8_t> data;
+		ReadData(data);
+		return hive_detail::DecodeValueData(Name(), Type(), data.data(), data.size());
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Lays out a key tree as a hive file (see the notes at the top of this file)
+	//------------------------------------------------------------------------------
+	class HiveBuilder
+	{
+	public:
+
+		explicit HiveBuilder(std::wstring rootName = L"ROOT")
+			: m_root(std::make_unique<Node>())
+		{
+			m_root->name = std::move(rootName);
+		}
+
+
+		// Creates a key and its missing parents; "" is the root
+		void CreateKey(std::wstring_view path)
+		{
+			FindOrCreate(path);
+		}
+
+
+		// Sets a value with its data as stored in a hive (UTF-16LE strings),
+		// creating the key if needed
+		void SetRawValue(std::wstring_view keyPath, std::wstring_view name, DWORD type,
+			const void* data, size_t dataSize)
+		{
+			Node& node = FindOrCreate(keyPath);
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			for (Value& value : node.values)
+			{
+				if (hive_detail::CompareNames(value.name, name) == 0)
+				{
+					value.type = type;
+					value.data.assign(bytes, bytes + dataSize);
+					return;
+				}
+			}
+			node.values.push_back(Value{ std::wstring(name), type, std::vector<uint8_t>(bytes, bytes + dataSize) });
+		}
+
+
+		void SetValue(std::wstring_view keyPath, const RegValue& value)
+		{
+			const std::vector<uint8_t> data = hive_detail::EncodeValueData(value);
+			SetRawValue(keyPath, value.name(), value.GetType(), data.data(), data.size());
+		}
+
+
+		// Lays out the hive: the base block, then the bins
+		std::vector<uint8_t> Build() const
+		{
+			using namespace hive_detail;
+
+			Layout layout;
+			layout.timestamp = FileTimeNow();
+			layout.file.assign(BaseBlockSize, 0);
+			layout.keyCount = CountKeys(*m_root);
+
+			const uint32_t rootCell = WriteKey(layout, *m_root, InvalidOffset);
+			layout.CloseBin();
+
+			uint8_t* base = layout.file.data();
+			memcpy(base, "regf", 4);
+			Put32(base + RegfPrimarySequence, 1);
+			Put32(base + RegfSecondarySequence, 1);
+			Put64(base + RegfLastWrite, layout.timestamp);
+			Put32(base + RegfMajorVersion, 1);
+			Put32(base + RegfMinorVersion, 5);
+			Put32(base + RegfFileType, 0);
+			Put32(base + RegfFileFormat, 1);
+			Put32(base + RegfRootCell, rootCell);
+			Put32(base + RegfBinsSize, static_cast<uint32_t>(layout.file.size() - BaseBlockSize));
+			Put32(base + RegfClustering, 1);
+			for (size_t i = 0; i < m_root->name.size() && i < 31; i++)
+			{
+				Put16(base + RegfFileName + i * 2, static_cast<uint16_t>(m_root->name[i]));
+			}
+			Put32(base + RegfChecksum, BaseBlockChecksum(base));
+			return std::move(layout.file);
+		}
+
+
+		// Writes the hive to a file. Throws std::runtime_error on failure.
+		void Save(const std::filesystem::path& fileName) const
+		{
+			const std::vector<uint8_t> hive = Build();
+			FILE* f = OpenFile(fileName, "wb");
+			if (f == nullptr)
+			{
+				throw std::runtime_error("HiveBuilder: can't create the hive file.");
+			}
+			const bool written = fwrite(hive.data(), 1, hive.size(), f) == hive.size();
+			if (fclose(f) != 0 || !written)
+			{
+				throw std::runtime_error("HiveBuilder: can't write the hive file.");
+			}
+		}
+
+	private:
+
+		struct Value
+		{
+			std::wstring name;
+			DWORD type;
+			std::vector<uint8_t> data;
+		};
+
+		struct Node
+		{
+			std::wstring name;
+			std::vector<Value> values;
+			std::map<std::wstring, std::unique_ptr<Node>, hive_detail::NameLess> subKeys;
+		};
+
+		// Largest "lh" list; larger keys get an "ri" index of lists
+		static constexpr size_t MaxLeafEntries = 512;
+
+		std::unique_ptr<Node> m_root;
+
+
+		// The file being laid out, cell by cell
+		struct Layout
+		{
+			std::vector<uint8_t> file;
+			size_t binStart = 0;        // file offset of the current bin (0: none)
+			uint64_t timestamp = 0;
+			uint32_t securityCell = hive_detail::InvalidOffset;
+			size_t keyCount = 0;
+
+			// Allocates a cell for dataSize bytes; returns its offset (from the first bin)
+			uint32_t Allocate(size_t dataSize)
+			{
+				using namespace hive_detail;
+
+				const size_t cellSize = (dataSize + 4 + 7) & ~size_t(7);
+				if (binStart == 0 || file.size() + cellSize > binStart + Get32(file.data() + binStart + BinSize))
+				{
+					CloseBin();
+					binStart = file.size();
+					const size_t binSize = (cellSize + BinHeaderSize + BinAlignment - 1) & ~size_t(BinAlignment - 1);
+					file.resize(file.size() + BinHeaderSize, 0);
+					uint8_t* bin = file.data() + binStart;
+					memcpy(bin, "hbin", 4);
+					Put32(bin + BinOffset, static_cast<uint32_t>(binStart - BaseBlockSize));
+					Put32(bin + BinSize, static_cast<uint32_t>(binSize));
+					Put64(bin + BinTimestamp, timestamp);
+				}
+
+				const size_t cellStart = file.size();
+				file.resize(cellStart + cellSize, 0);
+				Put32(file.data() + cellStart, static_cast<uint32_t>(-static_cast<int32_t>(cellSize)));
+				return static_cast<uint32_t>(cellStart - BaseBlockSize);
+			}
+
+			uint8_t* CellData(uint32_t offset)
+			{
+				return file.data() + hive_detail::BaseBlockSize + offset + 4;
+			}
+
+			// Ends the current bin with a free cell, if there's room left
+			void CloseBin()
+			{
+				using namespace hive_detail;
+
+				if (binStart == 0)
+				{
+					return;
+				}
+				const size_t binEnd = binStart + Get32(file.data() + binStart + BinSize);
+				if (file.size() < binEnd)
+				{
+					const size_t freeStart = file.size();
+					file.resize(binEnd, 0);
+					Put32(file.data() + freeStart, static_cast<uint32_t>(binEnd - freeStart));
+				}
+				binStart = 0;
+			}
+		};
+
+
+		Node& FindOrCreate(std::wstring_view path)
+		{
+			Node* node = m_root.get();
+			while (!path.empty())
+			{
+				const size_t separator = path.find(L'\\');
+				const std::wstring name(path.substr(0, separator));
+				path = (separator == std::wstring_view::npos) ? std::wstring_view() : path.substr(separator + 1);
+				if (name.empty())
+				{
+					continue;
+				}
+				std::unique_ptr<Node>& subKey = node->subKeys[name];
+				if (subKey == nullptr)
+				{
+					subKey = std::make_unique<Node>();
+					subKey->name = name;
+				}
+				node = subKey.get();
+			}
+			return *node;
+		}
+
+
+		static size_t CountKeys(const Node& node)
+		{
+			size_t count = 1;
+			for (const auto& subKey : node.subKeys)
+			{
+				count += CountKeys(*subKey.second);
+			}
+			return count;
+		}
+
+
+		// Writes a key and its sub-tree; returns the offset of its "nk" cell
+		static uint32_t WriteKey(Layout& layout, const Node& node, uint32_t parent)
+		{
+			using namespace hive_detail;
+
+			bool compressed = false;
+			const std::vector<uint8_t> name = EncodeName(node.name, compressed);
+			const uint32_t cell = layout.Allocate(NkName + name.size());
+
+			// One security cell, shared by all the keys, after the root key
+			if (layout.securityCell == InvalidOffset)
+			{
+				// Self-relative descriptor, with a NULL DACL: full access for everyone
+				const uint8_t descriptor[20] = { 1, 0, 0x04, 0x80 };
+				layout.securityCell = layout.Allocate(SkDescriptor + sizeof(descriptor));
+				uint8_t* sk = layout.CellData(layout.securityCell);
+				memcpy(sk, "sk", 2);
+				Put32(sk + SkFlink, layout.securityCell);
+				Put32(sk + SkBlink, layout.securityCell);
+				Put32(sk + SkRefCount, static_cast<uint32_t>(layout.keyCount));
+				Put32(sk + SkDescriptorSize, sizeof(descriptor));
+				memcpy(sk + SkDescriptor, descriptor, sizeof(descriptor));
+			}
+
+			// Values: the "vk" cells and their data, then the list
+			uint32_t valueList = InvalidOffset;
+			uint32_t maxValueNameLength = 0;
+			uint32_t maxValueDataSize = 0;
+			if (!node.values.empty())
+			{
+				std::vector<uint32_t> valueCells;
+				valueCells.reserve(node.values.size());
+				for (const Value& value : node.values)
+				{
+					valueCells.push_back(WriteValue(layout, value));
+					maxValueNameLength = (std::max)(maxValueNameLength, static_cast<uint32_t>(value.name.size() * 2));
+					maxValueDataSize = (std::max)(maxValueDataSize, static_cast<uint32_t>(value.data.size()));
+				}
+				valueList = layout.Allocate(valueCells.size() * 4);
+				memcpy(layout.CellData(valueList), valueCells.data(), valueCells.size() * 4);
+			}
+
+			// Sub-keys, then their list
+			std::vector<std::pair<uint32_t, uint32_t>> subKeyCells;     // offset, name hash
+			uint32_t maxNameLength = 0;
+			subKeyCells.reserve(node.subKeys.size());
+			for (const auto& subKey : node.subKeys)
+			{
+				subKeyCells.emplace_back(WriteKey(layout, *subKey.second, cell), NameHash(subKey.first));
+				maxNameLength = (std::max)(maxNameLength, static_cast<uint32_t>(subKey.first.size() * 2));
+			}
+			const uint32_t subKeyList = subKeyCells.empty() ? InvalidOffset : WriteSubKeyList(layout, subKeyCells);
+
+			uint8_t* nk = layout.CellData(cell);
+			memcpy(nk, "nk", 2);
+			Put16(nk + NkFlags, static_cast<uint16_t>((compressed ? KeyCompressedName : 0)
+				| ((parent == InvalidOffset) ? (KeyHiveEntry | KeyNoDelete) : 0)));
+			Put64(nk + NkLastWrite, layout.timestamp);
+			Put32(nk + NkParent, parent);
+			Put32(nk + NkSubKeyCount, static_cast<uint32_t>(subKeyCells.size()));
+			Put32(nk + NkSubKeyList, subKeyList);
+			Put32(nk + NkVolatileSubKeyList, InvalidOffset);
+			Put32(nk + NkValueCount, static_cast<uint32_t>(node.values.size()));
+			Put32(nk + NkValueList, valueList);
+			Put32(nk + NkSecurity, layout.securityCell);
+			Put32(nk + NkClass, InvalidOffset);
+			Put32(nk + NkMaxNameLength, maxNameLength);
+			Put32(nk + NkMaxValueNameLength, maxValueNameLength);
+			Put32(nk + NkMaxValueDataSize, maxValueDataSize);
+			Put16(nk + NkNameLength, static_cast<uint16_t>(name.size()));
+			memcpy(nk + NkName, name.data(), name.size());
+			return cell;
+		}
+
+
+		static uint32_t WriteValue(Layout& layout, const Value& value)
+		{
+			using namespace hive_detail;
+
+			bool compressed = false;
+			const std::vector<uint8_t> name = EncodeName(value.name, compressed);
+			const uint32_t cell = layout.Allocate(VkName + name.size());
+			const uint32_t size = static_cast<uint32_t>(value.data.size());
+
+			uint32_t dataSize = size;
+			uint32_t dataOffset = 0;
+			if (size <= 4)
+			{
+				dataSize |= ResidentData;
+				if (size != 0)
+				{
+					memcpy(&dataOffset, value.data.data(), size);
+				}
+			}
+			else if (size <= MaxSegmentSize)
+			{
+				dataOffset = layout.Allocate(size);
+				memcpy(layout.CellData(dataOffset), value.data.data(), size);
+			}
+			else
+			{
+				// Big data: segments, their list, and the "db" cell
+				std::vector<uint32_t> segments;
+				for (uint32_t copied = 0; copied < size; copied += MaxSegmentSize)
+				{
+					const uint32_t chunk = (std::min)(MaxSegmentSize, size - copied);
+					const uint32_t segment = layout.Allocate(chunk);
+					memcpy(layout.CellData(segment), value.data.data() + copied, chunk);
+					segments.push_back(segment);
+				}
+				const uint32_t list = layout.Allocate(segments.size() * 4);
+				memcpy(layout.CellData(list), segments.data(), segments.size() * 4);
+
+				dataOffset = layout.Allocate(DbSize);
+				uint8_t* db = layout.CellData(dataOffset);
+				memcpy(db, "db", 2);
+				Put16(db + DbCount, static_cast<uint16_t>(segments.size()));
+				Put32(db + DbSegmentList, list);
+			}
+
+			uint8_t* vk = layout.CellData(cell);
+			memcpy(vk, "vk", 2);
+			Put16(vk + VkNameLength, static_cast<uint16_t>(name.size()));
+			Put32(vk + VkDataSize, dataSize);
+			Put32(vk + VkDataOffset, dataOffset);
+			Put32(vk + VkType, value.type);
+			Put16(vk + VkFlags, compressed ? ValueCompressedName : 0);
+			memcpy(vk + VkName, name.data(), name.size());
+			return cell;
+		}
+
+
+		// "lh" list, or an "ri" index of "lh" lists for large keys
+		static uint32_t WriteSubKeyList(Layout& layout, const std::vector<std::pair<uint32_t, uint32_t>>& subKeys)
+		{
+			using namespace hive_detail;
+
+			auto writeLeaf = [&](size_t first, size_t count)
+			{
+				const uint32_t list = layout.Allocate(4 + count * 8);
+				uint8_t* lh = layout.CellData(list);
+				memcpy(lh, "lh", 2);
+				Put16(lh + 2, static_cast<uint16_t>(count));
+				for (size_t i = 0; i < count; i++)
+				{
+					Put32(lh + 4 + i * 8, subKeys[first + i].first);
+					Put32(lh + 8 + i * 8, subKeys[first + i].second);
+				}
+				return list;
+			};
+
+			if (subKeys.size() <= MaxLeafEntries)
+			{
+				return writeLeaf(0, subKeys.size());
+			}
+
+			std::vector<uint32_t> leaves;
+			for (size_t first = 0; first < subKeys.size(); first += MaxLeafEntries)
+			{
+				leaves.push_back(writeLeaf(first, (std::min)(MaxLeafEntries, subKeys.size() - first)));
+			}
+			const uint32_t index = layout.Allocate(4 + leaves.size() * 4);
+			uint8_t* ri = layout.CellData(index);
+			memcpy(ri, "ri", 2);
+			Put16(ri + 2, static_cast<uint16_t>(leaves.size()));
+			memcpy(ri + 4, leaves.data(), leaves.size() * 4);
+			return index;
+		}
+	};
+
+} // namespace winreg
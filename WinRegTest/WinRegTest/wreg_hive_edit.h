@@ -0,0 +1,1191 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_hive_edit.h
+// DESC: In-place editing of offline hive files, reusing free cells.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// HiveEditor changes a hive file (see wreg_hive.h) where it is, without
+// loading it in a registry and saving it again: the file is mapped in memory
+// and only the cells being changed are written, so changing a few values of a
+// large hive writes a few pages. It runs wherever the file can be mapped.
+//
+// New cells are allocated from the free cells of the hive, best fit, found by
+// scanning the bins lazily, as far as needed. A new bin is appended to the
+// file only when no free cell is large enough. Freed cells are merged with the
+// free cell that follows them in the same bin, if any.
+//
+// The structures stay consistent as a registry would keep them: the sub-key
+// lists stay sorted, with their hashes ("lh") or name hints ("lf"); a list
+// that grows past 512 sub-keys is split, under an "ri" index; the security
+// cells are reference counted; the key counts and the largest name and data
+// sizes of the keys are updated.
+//
+// On the first change, the primary sequence number of the base block is
+// incremented: until Flush() has written the changes and matched the secondary
+// sequence number, the hive reads as "dirty", as after an interrupted write.
+// The destructor flushes the changes too, ignoring errors.
+//
+// A hive that's already dirty must be recovered from its log files first.
+// The pointers returned by View() are invalidated by a change that grows the
+// file.
+//
+//==============================================================================
+#include "wreg_hive.h"  // HiveView, HiveKey, hive_detail
+#include "wreg_file.h"  // WritableMappedFile
+#include <algorithm>    // std::min, std::max
+#include <filesystem>   // std::filesystem::path
+#include <map>          // std::map
+#include <memory>       // std::unique_ptr
+#include <set>          // std::set
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// What a HiveEditor changed so far
+	//------------------------------------------------------------------------------
+	struct HiveEditStats
+	{
+		size_t pagesWritten = 0;        // 4 KB pages of the file with changed bytes
+		size_t cellsAllocated = 0;
+		size_t cellsFreed = 0;
+		size_t binsAppended = 0;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Edits a hive file in place (see the notes at the top of this file).
+	// Errors throw RegException: ERROR_FILE_NOT_FOUND for a missing key,
+	// ERROR_ACCESS_DENIED for deleting the root or a key with sub-keys, and
+	// ERROR_BADDB for a dirty or malformed hive.
+	//------------------------------------------------------------------------------
+	class HiveEditor
+	{
+	public:
+
+		// Edits a hive file, mapped in memory.
+		// Throws std::runtime_error if the file can't be mapped.
+		explicit HiveEditor(const std::filesystem::path& fileName)
+			: m_file(std::make_unique<WritableMappedFile>(fileName))
+		{
+			Attach();
+		}
+
+
+		// Edits a hive in memory: the vector grows when bins are appended
+		explicit HiveEditor(std::vector<uint8_t>& image)
+			: m_image(&image)
+		{
+			Attach();
+		}
+
+
+		~HiveEditor()
+		{
+			try
+			{
+				Flush();
+			}
+			catch (...)
+			{
+				// The hive stays marked as dirty
+			}
+		}
+
+
+		HiveEditor(const HiveEditor&) = delete;
+		HiveEditor& operator=(const HiveEditor&) = delete;
+
+
+		// A view of the hive as edited so far
+		HiveView View() const
+		{
+			return HiveView(m_data, m_size);
+		}
+
+
+		const HiveEditStats& Stats() const noexcept
+		{
+			return m_stats;
+		}
+
+
+		// Creates a key and its missing parents; returns the offset of its cell
+		uint32_t CreateKey(std::wstring_view path)
+		{
+			uint32_t key = View().RootCell();
+			while (!path.empty())
+			{
+				const size_t separator = path.find(L'\\');
+				const std::wstring_view name = path.substr(0, separator);
+				path = (separator == std::wstring_view::npos) ? std::wstring_view() : path.substr(separator + 1);
+				uint32_t subKey = 0;
+				if (name.empty())
+				{
+					continue;
+				}
+				if (HiveKey(View(), key).FindSubKey(name, subKey))
+				{
+					key = subKey;
+				}
+				else
+				{
+					key = NewKey(key, name);
+				}
+			}
+			return key;
+		}
+
+
+		// Deletes a key without sub-keys, and its values.
+		// Returns false if the key doesn't exist.
+		bool DeleteKey(std::wstring_view path)
+		{
+			uint32_t key = 0;
+			if (!View().FindKey(path, key))
+			{
+				return false;
+			}
+			RemoveKey(key);
+			return true;
+		}
+
+
+		// Deletes a key with its sub-keys. Returns false if the key doesn't exist.
+		bool DeleteTree(std::wstring_view path)
+		{
+			uint32_t key = 0;
+			if (!View().FindKey(path, key))
+			{
+				return false;
+			}
+			if (key == View().RootCell())
+			{
+				throw RegException(L"HiveEditor: the root key can't be deleted.", ERROR_ACCESS_DENIED);
+			}
+
+			// Post-order: the sub-keys first. The whole tree is walked before anything is
+			// deleted, so that a malformed one (a key listed twice, or nested in itself) is
+			// reported with the hive unchanged.
+			struct Pending
+			{
+				uint32_t key;
+				uint32_t depth;
+				bool listed;
+			};
+			std::vector<Pending> pending{ { key, 0, false } };
+			std::set<uint32_t> visited{ key };
+			std::vector<uint32_t> order;
+			while (!pending.empty())
+			{
+				const Pending top = pending.back();
+				if (top.listed)
+				{
+					pending.pop_back();
+					order.push_back(top.key);
+					continue;
+				}
+				pending.back().listed = true;
+				HiveKey(View(), top.key).ForEachSubKey([&](const HiveKey& subKey)
+				{
+					if (top.depth + 1 >= hive_detail::MaxKeyDepth)
+					{
+						hive_detail::ThrowCorrupt(L"HiveEditor: keys nested too deep.");
+					}
+					if (!visited.insert(subKey.CellOffset()).second)
+					{
+						hive_detail::ThrowCorrupt(L"HiveEditor: key listed more than once.");
+					}
+					pending.push_back(Pending{ subKey.CellOffset(), top.depth + 1, false });
+				});
+			}
+
+			for (uint32_t removed : order)
+			{
+				RemoveKey(removed);
+			}
+			return true;
+		}
+
+
+		// Sets a value, with its data as stored in a hive (UTF-16LE strings)
+		void SetRawValue(std::wstring_view keyPath, std::wstring_view name, DWORD type,
+			const void* data, size_t dataSize)
+		{
+			using namespace hive_detail;
+
+			if (dataSize > 0x7FFFFFFF)
+			{
+				throw std::invalid_argument("HiveEditor: value data too large.");
+			}
+			const uint32_t key = FindExistingKey(keyPath);
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			const uint32_t size = static_cast<uint32_t>(dataSize);
+
+			uint32_t value = 0;
+			if (HiveKey(View(), key).FindValue(name, value))
+			{
+				const uint32_t oldSize = Field32(value, VkDataSize);
+				const uint32_t oldOffset = Field32(value, VkDataOffset);
+
+				// Data that fits in its cell is overwritten in place
+				bool inPlace = (oldSize & ResidentData) == 0 && oldSize != 0 && oldSize <= MaxSegmentSize
+					&& size > 4 && size <= MaxSegmentSize;
+				if (inPlace)
+				{
+					uint32_t cellSize = 0;
+					CellData(oldOffset, cellSize);
+					inPlace = cellSize >= size;
+				}
+				if (inPlace)
+				{
+					Write(CellStart(oldOffset), bytes, size);
+					WriteField32(value, VkDataSize, size);
+				}
+				else
+				{
+					uint32_t sizeField = 0;
+					uint32_t offsetField = 0;
+					StoreData(bytes, size, sizeField, offsetField);
+					WriteField32(value, VkDataSize, sizeField);
+					WriteField32(value, VkDataOffset, offsetField);
+					FreeData(oldSize, oldOffset);
+				}
+				WriteField32(value, VkType, type);
+			}
+			else
+			{
+				bool compressed = false;
+				const std::vector<uint8_t> encodedName = EncodeName(name, compressed);
+				uint32_t sizeField = 0;
+				uint32_t offsetField = 0;
+				StoreData(bytes, size, sizeField, offsetField);
+
+				value = Allocate(VkName + encodedName.size());
+				std::vector<uint8_t> vk(VkName + encodedName.size(), 0);
+				memcpy(vk.data(), "vk", 2);
+				Put16(vk.data() + VkNameLength, static_cast<uint16_t>(encodedName.size()));
+				Put32(vk.data() + VkDataSize, sizeField);
+				Put32(vk.data() + VkDataOffset, offsetField);
+				Put32(vk.data() + VkType, type);
+				Put16(vk.data() + VkFlags, compressed ? ValueCompressedName : 0);
+				memcpy(vk.data() + VkName, encodedName.data(), encodedName.size());
+				Write(CellStart(value), vk.data(), vk.size());
+
+				// Appended to the value list
+				const uint32_t count = Field32(key, NkValueCount);
+				std::vector<uint8_t> list((count + 1) * 4);
+				if (count != 0)
+				{
+					uint32_t listSize = 0;
+					memcpy(list.data(), CellData(Field32(key, NkValueList), listSize), count * 4);
+				}
+				Put32(list.data() + count * 4, value);
+				WriteField32(key, NkValueList, Rewrite(Field32(key, NkValueList), count != 0, list, (count / 2 + 1) * 4));
+				WriteField32(key, NkValueCount, count + 1);
+				WriteField32(key, NkMaxValueNameLength, (std::max)(Field32(key, NkMaxValueNameLength),
+					static_cast<uint32_t>(name.size() * 2)));
+			}
+
+			WriteField32(key, NkMaxValueDataSize, (std::max)(Field32(key, NkMaxValueDataSize), size));
+			WriteField64(key, NkLastWrite, FileTimeNow());
+		}
+
+
+		void SetValue(std::wstring_view keyPath, const RegValue& value)
+		{
+			const std::vector<uint8_t> data = hive_detail::EncodeValueData(value);
+			SetRawValue(keyPath, value.name(), value.GetType(), data.data(), data.size());
+		}
+
+
+		// Deletes a value; returns false if it doesn't exist
+		bool DeleteValue(std::wstring_view keyPath, std::wstring_view name)
+		{
+			using namespace hive_detail;
+
+			const uint32_t key = FindExistingKey(keyPath);
+			uint32_t value = 0;
+			if (!HiveKey(View(), key).FindValue(name, value))
+			{
+				return false;
+			}
+
+			const uint32_t count = Field32(key, NkValueCount);
+			const uint32_t listOffset = Field32(key, NkValueList);
+			uint32_t listSize = 0;
+			const uint8_t* listData = CellData(listOffset, listSize);
+			std::vector<uint8_t> list;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (Get32(listData + i * 4) != value)
+				{
+					list.insert(list.end(), listData + i * 4, listData + i * 4 + 4);
+				}
+			}
+
+			if (list.empty())
+			{
+				Free(listOffset);
+				WriteField32(key, NkValueList, InvalidOffset);
+			}
+			else
+			{
+				Rewrite(listOffset, true, list, 0);
+			}
+			WriteField32(key, NkValueCount, count - 1);
+			FreeValue(value);
+			WriteField64(key, NkLastWrite, FileTimeNow());
+			return true;
+		}
+
+
+		// Writes the changes to the file, then marks the hive as clean
+		void Flush()
+		{
+			using namespace hive_detail;
+
+			if (!m_changing)
+			{
+				return;
+			}
+			if (m_file)
+			{
+				m_file->Flush(0, m_size);
+			}
+
+			std::vector<uint8_t> base(m_data, m_data + BaseBlockSize);
+			Put32(base.data() + RegfSecondarySequence, Get32(base.data() + RegfPrimarySequence));
+			Put64(base.data() + RegfLastWrite, FileTimeNow());
+			Put32(base.data() + RegfChecksum, BaseBlockChecksum(base.data()));
+			Write(0, base.data(), base.size());
+			if (m_file)
+			{
+				m_file->Flush(0, BaseBlockSize);
+			}
+			m_changing = false;
+		}
+
+	private:
+
+		// Sub-key lists larger than this are split, under an "ri" index
+		static constexpr size_t MaxLeafEntries = 512;
+
+		std::unique_ptr<WritableMappedFile> m_file;
+		std::vector<uint8_t>* m_image = nullptr;
+		uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+
+		uint32_t m_binsSize = 0;
+		uint32_t m_scanned = 0;                                 // bins scanned for free cells
+		std::map<uint32_t, uint32_t> m_freeByOffset;            // offset -> size
+		std::set<std::pair<uint32_t, uint32_t>> m_freeBySize;   // size, offset
+
+		bool m_changing = false;
+		std::set<size_t> m_pagesWritten;
+		HiveEditStats m_stats;
+
+
+		void Attach()
+		{
+			Remap();
+			const HiveView view = View();
+			if (view.IsDirty())
+			{
+				hive_detail::ThrowCorrupt(L"HiveEditor: the hive has changes in its log files to recover first.");
+			}
+			const HiveKey root(view, view.RootCell());     // throws if not a key
+			m_binsSize = view.BinsSize();
+		}
+
+
+		void Remap() noexcept
+		{
+			if (m_file)
+			{
+				m_data = reinterpret_cast<uint8_t*>(m_file->Data());
+				m_size = m_file->Size();
+			}
+			else
+			{
+				m_data = m_image->data();
+				m_size = m_image->size();
+			}
+		}
+
+
+		void Grow(size_t newSize)
+		{
+			if (m_file)
+			{
+				m_file->Resize(newSize);
+			}
+			else
+			{
+				m_image->resize(newSize, 0);
+			}
+			Remap();
+		}
+
+
+		//
+		// Reading and writing
+		//
+
+		static size_t CellStart(uint32_t cell) noexcept
+		{
+			return size_t(hive_detail::BaseBlockSize) + cell + 4;
+		}
+
+		const uint8_t* CellData(uint32_t cell, uint32_t& dataSize) const
+		{
+			return View().Cell(cell, dataSize);
+		}
+
+		uint32_t Field32(uint32_t cell, uint32_t field) const
+		{
+			uint32_t dataSize = 0;
+			const uint8_t* data = CellData(cell, dataSize);
+			if (field + 4 > dataSize)
+			{
+				hive_detail::ThrowCorrupt(L"HiveEditor: cell too small.");
+			}
+			return hive_detail::Get32(data + field);
+		}
+
+
+		// Writes the bytes that differ, and records the pages written
+		void Write(size_t fileOffset, const void* bytes, size_t size)
+		{
+			_ASSERTE(fileOffset + size <= m_size);
+			const uint8_t* source = static_cast<const uint8_t*>(bytes);
+			uint8_t* target = m_data + fileOffset;
+
+			size_t first = 0;
+			while (first < size && source[first] == target[first])
+			{
+				first++;
+			}
+			if (first == size)
+			{
+				return;
+			}
+			size_t last = size;
+			while (source[last - 1] == target[last - 1])
+			{
+				last--;
+			}
+
+			BeginChanges();
+			memcpy(target + first, source + first, last - first);
+			for (size_t page = (fileOffset + first) / 4096; page <= (fileOffset + last - 1) / 4096; page++)
+			{
+				m_pagesWritten.insert(page);
+			}
+			m_stats.pagesWritten = m_pagesWritten.size();
+		}
+
+		void WriteField32(uint32_t cell, uint32_t field, uint32_t value)
+		{
+			uint8_t bytes[4];
+			hive_detail::Put32(bytes, value);
+			Write(CellStart(cell) + field, bytes, sizeof(bytes));
+		}
+
+		void WriteField64(uint32_t cell, uint32_t field, uint64_t value)
+		{
+			uint8_t bytes[8];
+			hive_detail::Put64(bytes, value);
+			Write(CellStart(cell) + field, bytes, sizeof(bytes));
+		}
+
+		void WriteCellSize(uint32_t cell, int32_t size)
+		{
+			uint8_t bytes[4];
+			hive_detail::Put32(bytes, static_cast<uint32_t>(size));
+			Write(size_t(hive_detail::BaseBlockSize) + cell, bytes, sizeof(bytes));
+		}
+
+
+		// Marks the hive as being written: the sequence numbers differ until Flush()
+		void BeginChanges()
+		{
+			using namespace hive_detail;
+
+			if (m_changing)
+			{
+				return;
+			}
+			m_changing = true;
+			Put32(m_data + RegfPrimarySequence, Get32(m_data + RegfPrimarySequence) + 1);
+			Put32(m_data + RegfChecksum, BaseBlockChecksum(m_data));
+			m_pagesWritten.insert(0);
+			if (m_file)
+			{
+				m_file->Flush(0, BaseBlockSize);
+			}
+		}
+
+
+		//
+		// Cell allocation
+		//
+
+		void AddFree(uint32_t cell, uint32_t size)
+		{
+			m_freeByOffset[cell] = size;
+			m_freeBySize.emplace(size, cell);
+		}
+
+		void RemoveFree(uint32_t cell)
+		{
+			const auto it = m_freeByOffset.find(cell);
+			m_freeBySize.erase({ it->second, cell });
+			m_freeByOffset.erase(it);
+		}
+
+
+		// Indexes the free cells of the next bin; returns false past the last one
+		bool ScanNextBin()
+		{
+			using namespace hive_detail;
+
+			if (m_scanned >= m_binsSize)
+			{
+				return false;
+			}
+			const uint8_t* bin = m_data + BaseBlockSize + m_scanned;
+			const uint32_t binSize = Get32(bin + BinSize);
+			if (memcmp(bin, "hbin", 4) != 0 || binSize == 0 || binSize % BinAlignment != 0
+				|| binSize > m_binsSize - m_scanned)
+			{
+				ThrowCorrupt(L"HiveEditor: invalid bin header.");
+			}
+
+			// Consecutive free cells are indexed as one
+			const uint32_t end = m_scanned + binSize;
+			uint32_t freeStart = 0;
+			uint32_t freeSize = 0;
+			for (uint32_t cell = m_scanned + BinHeaderSize; cell < end; )
+			{
+				const int32_t size = static_cast<int32_t>(Get32(m_data + BaseBlockSize + cell));
+				const uint32_t length = (size < 0) ? 0u - static_cast<uint32_t>(size) : static_cast<uint32_t>(size);
+				if (length < 8 || length % 8 != 0 || length > end - cell)
+				{
+					ThrowCorrupt(L"HiveEditor: invalid cell size.");
+				}
+				if (size > 0)
+				{
+					if (freeSize == 0)
+					{
+						freeStart = cell;
+					}
+					freeSize += length;
+				}
+				else if (freeSize != 0)
+				{
+					AddFree(freeStart, freeSize);
+					freeSize = 0;
+				}
+				cell += length;
+			}
+			if (freeSize != 0)
+			{
+				AddFree(freeStart, freeSize);
+			}
+			m_scanned = end;
+			return true;
+		}
+
+
+		// Appends a bin with room for a cell of cellSize bytes, as a free cell
+		void AppendBin(uint32_t cellSize)
+		{
+			using namespace hive_detail;
+
+			const uint32_t binSize = (cellSize + BinHeaderSize + BinAlignment - 1) & ~(BinAlignment - 1);
+			const uint32_t binOffset = m_binsSize;
+			const size_t fileSize = size_t(BaseBlockSize) + binOffset + binSize;
+			if (fileSize > m_size)
+			{
+				Grow(fileSize);
+			}
+
+			uint8_t header[BinHeaderSize + 4] = {};
+			memcpy(header, "hbin", 4);
+			Put32(header + BinOffset, binOffset);
+			Put32(header + BinSize, binSize);
+			Put64(header + BinTimestamp, FileTimeNow());
+			Put32(header + BinHeaderSize, binSize - BinHeaderSize);
+			Write(size_t(BaseBlockSize) + binOffset, header, sizeof(header));
+
+			m_binsSize += binSize;
+			uint8_t binsSize[4];
+			Put32(binsSize, m_binsSize);
+			Write(RegfBinsSize, binsSize, sizeof(binsSize));
+
+			AddFree(binOffset + BinHeaderSize, binSize - BinHeaderSize);
+			m_scanned = m_binsSize;
+			m_stats.binsAppended++;
+		}
+
+
+		// Allocates a cell for dataSize bytes, zero-filled; returns its offset
+		uint32_t Allocate(size_t dataSize)
+		{
+			using namespace hive_detail;
+
+			const uint32_t size = static_cast<uint32_t>((dataSize + 4 + 7) & ~size_t(7));
+			auto fit = m_freeBySize.lower_bound({ size, 0 });
+			while (fit == m_freeBySize.end())
+			{
+				if (!ScanNextBin())
+				{
+					AppendBin(size);
+				}
+				fit = m_freeBySize.lower_bound({ size, 0 });
+			}
+
+			const uint32_t cell = fit->second;
+			uint32_t cellSize = fit->first;
+			RemoveFree(cell);
+			if (cellSize - size >= 16)
+			{
+				WriteCellSize(cell + size, static_cast<int32_t>(cellSize - size));
+				AddFree(cell + size, cellSize - size);
+				cellSize = size;
+			}
+			WriteCellSize(cell, -static_cast<int32_t>(cellSize));
+			const std::vector<uint8_t> zeros(cellSize - 4, 0);
+			Write(CellStart(cell), zeros.data(), zeros.size());
+			m_stats.cellsAllocated++;
+			return cell;
+		}
+
+
+		void Free(uint32_t cell)
+		{
+			using namespace hive_detail;
+
+			uint32_t dataSize = 0;
+			CellData(cell, dataSize);
+			uint32_t size = dataSize + 4;
+
+			// Merged with the next cell of the bin, if free; bins already scanned
+			// are in the index, the others are indexed when scanned
+			const bool indexed = cell < m_scanned;
+			const uint32_t next = cell + size;
+			if (indexed && next < m_binsSize
+				&& !(next % BinAlignment == 0 && memcmp(m_data + BaseBlockSize + next, "hbin", 4) == 0))
+			{
+				const auto it = m_freeByOffset.find(next);
+				if (it != m_freeByOffset.end())
+				{
+					size += it->second;
+					RemoveFree(next);
+				}
+			}
+			WriteCellSize(cell, static_cast<int32_t>(size));
+			if (indexed)
+			{
+				AddFree(cell, size);
+			}
+			m_stats.cellsFreed++;
+		}
+
+
+		// Writes contents to a cell if it fits, or to a new cell, with room for
+		// headroom more bytes, freeing the old one; returns the cell written
+		uint32_t Rewrite(uint32_t cell, bool exists, const std::vector<uint8_t>& contents, size_t headroom)
+		{
+			uint32_t dataSize = 0;
+			if (exists)
+			{
+				CellData(cell, dataSize);
+			}
+			if (exists && dataSize >= contents.size())
+			{
+				Write(CellStart(cell), contents.data(), contents.size());
+				return cell;
+			}
+			const uint32_t newCell = Allocate(contents.size() + headroom);
+			Write(CellStart(newCell), contents.data(), contents.size());
+			if (exists)
+			{
+				Free(cell);
+			}
+			return newCell;
+		}
+
+
+		//
+		// Values
+		//
+
+		// Stores value data; returns the size and offset fields of the value
+		void StoreData(const uint8_t* data, uint32_t size, uint32_t& sizeField, uint32_t& offsetField)
+		{
+			using namespace hive_detail;
+
+			sizeField = size;
+			offsetField = 0;
+			if (size <= 4)
+			{
+				sizeField |= ResidentData;
+				if (size != 0)
+				{
+					memcpy(&offsetField, data, size);
+				}
+				return;
+			}
+			if (size <= MaxSegmentSize)
+			{
+				offsetField = Allocate(size);
+				Write(CellStart(offsetField), data, size);
+				return;
+			}
+
+			std::vector<uint8_t> segments;
+			for (uint32_t copied = 0; copied < size; copied += MaxSegmentSize)
+			{
+				const uint32_t chunk = (std::min)(MaxSegmentSize, size - copied);
+				const uint32_t segment = Allocate(chunk);
+				Write(CellStart(segment), data + copied, chunk);
+				segments.resize(segments.size() + 4);
+				Put32(segments.data() + segments.size() - 4, segment);
+			}
+			const uint32_t list = Allocate(segments.size());
+			Write(CellStart(list), segments.data(), segments.size());
+
+			uint8_t db[DbSize] = { 'd', 'b' };
+			Put16(db + DbCount, static_cast<uint16_t>(segments.size() / 4));
+			Put32(db + DbSegmentList, list);
+			offsetField = Allocate(sizeof(db));
+			Write(CellStart(offsetField), db, sizeof(db));
+		}
+
+
+		void FreeData(uint32_t sizeField, uint32_t offsetField)
+		{
+			using namespace hive_detail;
+
+			const uint32_t size = sizeField & ~ResidentData;
+			if ((sizeField & ResidentData) != 0 || size == 0)
+			{
+				return;
+			}
+			uint32_t cellSize = 0;
+			const uint8_t* cell = CellData(offsetField, cellSize);
+			if (size > MaxSegmentSize && cellSize >= DbSize && HasSignature(cell, "db"))
+			{
+				const uint32_t count = Get16(cell + DbCount);
+				const uint32_t list = Get32(cell + DbSegmentList);
+				uint32_t listSize = 0;
+				const uint8_t* segments = CellData(list, listSize);
+				std::vector<uint32_t> toFree;
+				for (uint32_t i = 0; i < count && i < listSize / 4; i++)
+				{
+					toFree.push_back(Get32(segments + i * 4));
+				}
+				for (uint32_t segment : toFree)
+				{
+					Free(segment);
+				}
+				Free(list);
+			}
+			Free(offsetField);
+		}
+
+
+		void FreeValue(uint32_t value)
+		{
+			FreeData(Field32(value, hive_detail::VkDataSize), Field32(value, hive_detail::VkDataOffset));
+			Free(value);
+		}
+
+
+		//
+		// Keys
+		//
+
+		uint32_t FindExistingKey(std::wstring_view path) const
+		{
+			uint32_t key = 0;
+			if (!View().FindKey(path, key))
+			{
+				throw RegException(L"HiveEditor: key not found:{" + std::wstring(path) + L"}", ERROR_FILE_NOT_FOUND);
+			}
+			return key;
+		}
+
+
+		uint32_t NewKey(uint32_t parent, std::wstring_view name)
+		{
+			using namespace hive_detail;
+
+			// Same security as the parent, one more reference
+			const uint32_t security = Field32(parent, NkSecurity);
+			WriteField32(security, SkRefCount, Field32(security, SkRefCount) + 1);
+
+			bool compressed = false;
+			const std::vector<uint8_t> encodedName = EncodeName(name, compressed);
+			const uint32_t key = Allocate(NkName + encodedName.size());
+			std::vector<uint8_t> nk(NkName + encodedName.size(), 0);
+			memcpy(nk.data(), "nk", 2);
+			Put16(nk.data() + NkFlags, compressed ? KeyCompressedName : 0);
+			Put64(nk.data() + NkLastWrite, FileTimeNow());
+			Put32(nk.data() + NkParent, parent);
+			Put32(nk.data() + NkSubKeyList, InvalidOffset);
+			Put32(nk.data() + NkVolatileSubKeyList, InvalidOffset);
+			Put32(nk.data() + NkValueList, InvalidOffset);
+			Put32(nk.data() + NkSecurity, security);
+			Put32(nk.data() + NkClass, InvalidOffset);
+			Put16(nk.data() + NkNameLength, static_cast<uint16_t>(encodedName.size()));
+			memcpy(nk.data() + NkName, encodedName.data(), encodedName.size());
+			Write(CellStart(key), nk.data(), nk.size());
+
+			InsertSubKey(parent, key, std::wstring(name));
+			WriteField32(parent, NkMaxNameLength, (std::max)(Field32(parent, NkMaxNameLength),
+				static_cast<uint32_t>(name.size() * 2)));
+			WriteField64(parent, NkLastWrite, FileTimeNow());
+			return key;
+		}
+
+
+		// Deletes a key without sub-keys
+		void RemoveKey(uint32_t key)
+		{
+			using namespace hive_detail;
+
+			if (key == View().RootCell())
+			{
+				throw RegException(L"HiveEditor: the root key can't be deleted.", ERROR_ACCESS_DENIED);
+			}
+			if (Field32(key, NkSubKeyCount) != 0)
+			{
+				throw RegException(L"HiveEditor: can't delete a key with sub-keys.", ERROR_ACCESS_DENIED);
+			}
+
+			const uint32_t valueCount = Field32(key, NkValueCount);
+			if (valueCount != 0)
+			{
+				const uint32_t listOffset = Field32(key, NkValueList);
+				uint32_t listSize = 0;
+				const uint8_t* list = CellData(listOffset, listSize);
+				std::vector<uint32_t> values;
+				for (uint32_t i = 0; i < valueCount && i < listSize / 4; i++)
+				{
+					values.push_back(Get32(list + i * 4));
+				}
+				for (uint32_t value : values)
+				{
+					FreeValue(value);
+				}
+				Free(listOffset);
+			}
+
+			uint32_t dataSize = 0;
+			if (Get16(CellData(key, dataSize) + NkClassLength) != 0)
+			{
+				Free(Field32(key, NkClass));
+			}
+			ReleaseSecurity(Field32(key, NkSecurity));
+
+			const uint32_t parent = Field32(key, NkParent);
+			RemoveSubKey(parent, key);
+			WriteField64(parent, NkLastWrite, FileTimeNow());
+			Free(key);
+		}
+
+
+		// Drops a reference to a security cell; the last one unlinks and frees it
+		void ReleaseSecurity(uint32_t security)
+		{
+			using namespace hive_detail;
+
+			const uint32_t references = Field32(security, SkRefCount);
+			if (references > 1)
+			{
+				WriteField32(security, SkRefCount, references - 1);
+				return;
+			}
+			const uint32_t next = Field32(security, SkFlink);
+			const uint32_t previous = Field32(security, SkBlink);
+			if (next != security)
+			{
+				WriteField32(previous, SkFlink, next);
+				WriteField32(next, SkBlink, previous);
+			}
+			Free(security);
+		}
+
+
+		//
+		// Sub-key lists
+		//
+
+		struct ListEntry
+		{
+			uint32_t key;
+			uint32_t hint;      // "lh" hash, or "lf" name hint
+		};
+
+		struct Leaf
+		{
+			uint32_t cell;
+			char signature[2];
+			std::vector<ListEntry> entries;
+		};
+
+
+		Leaf ReadLeaf(uint32_t cell) const
+		{
+			using namespace hive_detail;
+
+			uint32_t size = 0;
+			const uint8_t* list = CellData(cell, size);
+			const uint32_t entrySize = (size < 4) ? 0 : HasSignature(list, "li") ? 4
+				: (HasSignature(list, "lf") || HasSignature(list, "lh")) ? 8 : 0;
+			const uint32_t count = (size < 4) ? 0 : Get16(list + 2);
+			if (entrySize == 0 || count > (size - 4) / entrySize)
+			{
+				ThrowCorrupt(L"HiveEditor: invalid sub-key list cell.");
+			}
+
+			Leaf leaf{ cell, { static_cast<char>(list[0]), static_cast<char>(list[1]) }, {} };
+			leaf.entries.reserve(count + 1);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				const uint8_t* entry = list + 4 + i * entrySize;
+				leaf.entries.push_back(ListEntry{ Get32(entry), (entrySize == 8) ? Get32(entry + 4) : 0 });
+			}
+			return leaf;
+		}
+
+
+		// The leaves of a sub-key list: the list itself, or those of its "ri" index
+		std::vector<uint32_t> LeafCells(uint32_t list, bool& indexed) const
+		{
+			uint32_t size = 0;
+			const uint8_t* data = CellData(list, size);
+			indexed = size >= 4 && hive_detail::HasSignature(data, "ri");
+			if (!indexed)
+			{
+				return { list };
+			}
+			const uint32_t count = hive_detail::Get16(data + 2);
+			if (count > (size - 4) / 4)
+			{
+				hive_detail::ThrowCorrupt(L"HiveEditor: invalid sub-key index cell.");
+			}
+			std::vector<uint32_t> leaves(count);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				leaves[i] = hive_detail::Get32(data + 4 + i * 4);
+			}
+			return leaves;
+		}
+
+
+		// Writes a leaf, in place if it fits; returns its cell
+		uint32_t WriteLeaf(const Leaf& leaf, bool exists)
+		{
+			using namespace hive_detail;
+
+			const uint32_t entrySize = (leaf.signature[1] == 'i') ? 4 : 8;
+			std::vector<uint8_t> contents(4 + leaf.entries.size() * entrySize);
+			contents[0] = static_cast<uint8_t>(leaf.signature[0]);
+			contents[1] = static_cast<uint8_t>(leaf.signature[1]);
+			Put16(contents.data() + 2, static_cast<uint16_t>(leaf.entries.size()));
+			for (size_t i = 0; i < leaf.entries.size(); i++)
+			{
+				Put32(contents.data() + 4 + i * entrySize, leaf.entries[i].key);
+				if (entrySize == 8)
+				{
+					Put32(contents.data() + 8 + i * entrySize, leaf.entries[i].hint);
+				}
+			}
+			return Rewrite(leaf.cell, exists, contents, (leaf.entries.size() / 4 + 1) * entrySize);
+		}
+
+
+		uint32_t WriteIndex(uint32_t cell, bool exists, const std::vector<uint32_t>& leaves)
+		{
+			std::vector<uint8_t> contents(4 + leaves.size() * 4);
+			contents[0] = 'r';
+			contents[1] = 'i';
+			hive_detail::Put16(contents.data() + 2, static_cast<uint16_t>(leaves.size()));
+			memcpy(contents.data() + 4, leaves.data(), leaves.size() * 4);
+			return Rewrite(cell, exists, contents, 4);
+		}
+
+
+		std::wstring KeyName(uint32_t key) const
+		{
+			return HiveKey(View(), key).Name();
+		}
+
+
+		// The entry of a key in a leaf of the given kind
+		ListEntry MakeEntry(const char (&signature)[2], uint32_t key, const std::wstring& name) const
+		{
+			using namespace hive_detail;
+
+			if (signature[1] == 'h')
+			{
+				return ListEntry{ key, NameHash(name) };
+			}
+			if (signature[1] == 'f')
+			{
+				// The first 4 characters, as stored
+				uint32_t dataSize = 0;
+				const uint8_t* nk = CellData(key, dataSize);
+				const uint16_t length = Get16(nk + NkNameLength);
+				const bool compressed = (Get16(nk + NkFlags) & KeyCompressedName) != 0;
+				uint8_t hint[4] = {};
+				for (uint16_t i = 0; i < 4; i++)
+				{
+					const uint32_t at = compressed ? i : i * 2;
+					if (at < length)
+					{
+						hint[i] = nk[NkName + at];
+					}
+				}
+				return ListEntry{ key, Get32(hint) };
+			}
+			return ListEntry{ key, 0 };
+		}
+
+
+		void InsertSubKey(uint32_t parent, uint32_t key, const std::wstring& name)
+		{
+			using namespace hive_detail;
+
+			const uint32_t count = Field32(parent, NkSubKeyCount);
+			if (count == 0)
+			{
+				Leaf leaf{ InvalidOffset, { 'l', 'h' }, {} };
+				leaf.entries.push_back(MakeEntry(leaf.signature, key, name));
+				WriteField32(parent, NkSubKeyList, WriteLeaf(leaf, false));
+				WriteField32(parent, NkSubKeyCount, 1);
+				return;
+			}
+
+			// The leaf where the name goes: the first whose last name is larger
+			const uint32_t list = Field32(parent, NkSubKeyList);
+			bool indexed = false;
+			std::vector<uint32_t> leaves = LeafCells(list, indexed);
+			size_t leafIndex = leaves.size() - 1;
+			for (size_t i = 0; i + 1 < leaves.size(); i++)
+			{
+				const Leaf candidate = ReadLeaf(leaves[i]);
+				if (!candidate.entries.empty() && CompareNames(KeyName(candidate.entries.back().key), name) > 0)
+				{
+					leafIndex = i;
+					break;
+				}
+			}
+
+			Leaf leaf = ReadLeaf(leaves[leafIndex]);
+			size_t low = 0;
+			size_t high = leaf.entries.size();
+			while (low < high)
+			{
+				const size_t middle = (low + high) / 2;
+				if (CompareNames(KeyName(leaf.entries[middle].key), name) < 0)
+				{
+					low = middle + 1;
+				}
+				else
+				{
+					high = middle;
+				}
+			}
+			const char signature[2] = { leaf.signature[0], leaf.signature[1] };
+			leaf.entries.insert(leaf.entries.begin() + low, MakeEntry(signature, key, name));
+
+			if (leaf.entries.size() <= MaxLeafEntries)
+			{
+				leaves[leafIndex] = WriteLeaf(leaf, true);
+			}
+			else
+			{
+				// Split in two halves
+				Leaf upper{ InvalidOffset, { leaf.signature[0], leaf.signature[1] },
+					std::vector<ListEntry>(leaf.entries.begin() + leaf.entries.size() / 2, leaf.entries.end()) };
+				leaf.entries.resize(leaf.entries.size() / 2);
+				leaves[leafIndex] = WriteLeaf(leaf, true);
+				leaves.insert(leaves.begin() + leafIndex + 1, WriteLeaf(upper, false));
+			}
+
+			if (indexed || leaves.size() > 1)
+			{
+				WriteField32(parent, NkSubKeyList, WriteIndex(list, indexed, leaves));
+			}
+			else
+			{
+				WriteField32(parent, NkSubKeyList, leaves[0]);
+			}
+			WriteField32(parent, NkSubKeyCount, count + 1);
+		}
+
+
+		void RemoveSubKey(uint32_t parent, uint32_t key)
+		{
+			using namespace hive_detail;
+
+			const uint32_t list = Field32(parent, NkSubKeyList);
+			bool indexed = false;
+			std::vector<uint32_t> leaves = LeafCells(list, indexed);
+			for (size_t i = 0; i < leaves.size(); i++)
+			{
+				Leaf leaf = ReadLeaf(leaves[i]);
+				const auto it = std::find_if(leaf.entries.begin(), leaf.entries.end(),
+					[&](const ListEntry& entry) { return entry.key == key; });
+				if (it == leaf.entries.end())
+				{
+					continue;
+				}
+
+				leaf.entries.erase(it);
+				if (!leaf.entries.empty())
+				{
+					WriteLeaf(leaf, true);
+				}
+				else
+				{
+					Free(leaves[i]);
+					leaves.erase(leaves.begin() + i);
+					if (indexed && !leaves.empty())
+					{
+						WriteIndex(list, true, leaves);
+					}
+					else
+					{
+						if (indexed)
+						{
+							Free(list);
+						}
+						WriteField32(parent, NkSubKeyList, InvalidOffset);
+					}
+				}
+				WriteField32(parent, NkSubKeyCount, Field32(parent, NkSubKeyCount) - 1);
+				return;
+			}
+			ThrowCorrupt(L"HiveEditor: key missing from the sub-key list of its parent.");
+		}
+	};
+
+} // namespace winreg
@@ -0,0 +1,500 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_hive_log.h
+// DESC: Recovery of dirty offline hives from their transaction logs.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// A registry writes the changes of a hive to a transaction log (the .LOG1 and
+// .LOG2 files) before the primary file (see wreg_hive.h). A hive copied from a
+// running system, or after a crash, is "dirty": the sequence numbers of its
+// base block differ, and its latest data is in the logs only.
+//
+// A log file (format of Windows 8.1 and later) is a 512-byte copy of the base
+// block, then log entries: "HvLE", the size of the entry (a multiple of 512),
+// its sequence number, the size of the hive bins after it, and the dirty pages
+// it holds: their offsets and sizes, then their data. Each entry has two
+// Marvin32 hashes: of its first 32 bytes, and of the rest after the header.
+//
+// RecoverHive() reads the primary file, then replays the entries of the logs
+// onto it, in a single pass over each log, keeping one entry in memory at a
+// time: the logs are applied by sequence number, starting from the secondary
+// sequence number of the hive; the first entry with a wrong signature, size,
+// hash or sequence number ends a log (stale entries of older writes follow the
+// valid ones). The recovered base block is clean, with a new checksum.
+// RecoverHiveFile() does the same into a copy of the primary file, mapped in
+// memory, so the hive is not read into memory.
+//
+// The logs of the former format ("DIRT" bitmaps) are rejected, with
+// ERROR_BADDB, as are hives and logs with invalid base blocks.
+//
+// HiveLogWriter writes logs in the same format, e.g. to journal changes
+// before writing them to a hive, or to test the recovery.
+//
+//==============================================================================
+#include "wreg_hive.h"  // hive_detail
+#include "wreg_file.h"  // OpenFile(), WritableMappedFile
+#include <algorithm>    // std::sort
+#include <cstdio>       // FILE, fread(), fwrite()
+#include <filesystem>   // std::filesystem::path, copy_file()
+#include <memory>       // std::unique_ptr
+#include <string>       // std::wstring
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	namespace hive_log_detail
+	{
+		using namespace hive_detail;
+
+		constexpr uint32_t LogBaseBlockSize = 512;
+		constexpr uint32_t LogEntryAlignment = 512;
+		constexpr uint32_t LogFileType = 6;                 // base block file type of the logs
+		constexpr uint64_t MarvinSeed = 0x82EF4D887A4E55C5ULL;
+
+		// Log entry fields
+		enum : uint32_t
+		{
+			LogSignature = 0, LogSize = 4, LogFlags = 8, LogSequence = 12, LogBinsSize = 16,
+			LogPageCount = 20, LogHash1 = 24, LogHash2 = 32, LogPageList = 40
+		};
+
+
+		inline uint32_t RotateLeft(uint32_t value, int bits) noexcept
+		{
+			return (value << bits) | (value >> (32 - bits));
+		}
+
+
+		// Marvin32 hash, as used by the logs
+		inline uint64_t Marvin32(const uint8_t* data, size_t size, uint64_t seed = MarvinSeed) noexcept
+		{
+			uint32_t lo = static_cast<uint32_t>(seed);
+			uint32_t hi = static_cast<uint32_t>(seed >> 32);
+			auto mix = [&]()
+			{
+				hi ^= lo;
+				lo = RotateLeft(lo, 20);
+				lo += hi;
+				hi = RotateLeft(hi, 9);
+				hi ^= lo;
+				lo = RotateLeft(lo, 27);
+				lo += hi;
+				hi = RotateLeft(hi, 19);
+			};
+
+			for (; size >= 4; data += 4, size -= 4)
+			{
+				lo += Get32(data);
+				mix();
+			}
+
+			// The last 0-3 bytes, then a 0x80 byte
+			uint32_t last = 0x80;
+			switch (size)
+			{
+			case 3: last = (last << 8) | data[2]; // fall through
+			case 2: last = (last << 8) | data[1]; // fall through
+			case 1: last = (last << 8) | data[0]; break;
+			default: break;
+			}
+			lo += last;
+			mix();
+			mix();
+			return (uint64_t(hi) << 32) | lo;
+		}
+
+
+		// Whether a 512-byte base block (of a hive or of a log) is sound
+		inline bool BaseBlockValid(const uint8_t* baseBlock) noexcept
+		{
+			return memcmp(baseBlock, "regf", 4) == 0
+				&& Get32(baseBlock + RegfChecksum) == BaseBlockChecksum(baseBlock);
+		}
+
+
+		// Where the pages of the log entries go: a vector or a mapped file
+		class RecoveryTarget
+		{
+		public:
+			explicit RecoveryTarget(std::vector<uint8_t>& image) : m_image(&image) {}
+			explicit RecoveryTarget(WritableMappedFile& file) : m_file(&file) {}
+
+			uint8_t* Data() const noexcept
+			{
+				return m_file ? reinterpret_cast<uint8_t*>(m_file->Data()) : m_image->data();
+			}
+
+			size_t Size() const noexcept
+			{
+				return m_file ? m_file->Size() : m_image->size();
+			}
+
+			void Reserve(size_t size)
+			{
+				if (size <= Size())
+				{
+					return;
+				}
+				if (m_file)
+				{
+					m_file->Resize(size);
+				}
+				else
+				{
+					m_image->resize(size, 0);
+				}
+			}
+
+		private:
+			std::vector<uint8_t>* m_image = nullptr;
+			WritableMappedFile* m_file = nullptr;
+		};
+
+	} // namespace hive_log_detail
+
+
+	//------------------------------------------------------------------------------
+	// Results of RecoverHive()
+	//------------------------------------------------------------------------------
+	struct HiveRecoveryResult
+	{
+		bool wasDirty = false;
+		size_t entriesApplied = 0;
+		size_t entriesSkipped = 0;      // older than the primary file
+		size_t pagesApplied = 0;
+		uint64_t logBytesRead = 0;
+		uint32_t sequenceNumber = 0;    // of the recovered base block
+
+		// Why the last log read ended, e.g. "end of file", "hash mismatch"
+		std::wstring endReason;
+	};
+
+
+	namespace hive_log_detail
+	{
+		// Replays the logs onto the primary file in target
+		inline HiveRecoveryResult ReplayLogs(RecoveryTarget& target, const std::vector<std::filesystem::path>& logs)
+		{
+			if (target.Size() < BaseBlockSize)
+			{
+				ThrowCorrupt(L"Not a hive file: no base block.");
+			}
+
+			HiveRecoveryResult result;
+			const bool primaryValid = BaseBlockValid(target.Data());
+			result.wasDirty = !primaryValid
+				|| Get32(target.Data() + RegfPrimarySequence) != Get32(target.Data() + RegfSecondarySequence);
+			result.sequenceNumber = Get32(target.Data() + RegfSecondarySequence);
+			if (!result.wasDirty)
+			{
+				return result;
+			}
+
+			// The logs with a sound base block, by sequence number
+			struct Log
+			{
+				std::filesystem::path path;
+				uint8_t baseBlock[LogBaseBlockSize];
+			};
+			std::vector<Log> valid;
+			for (const std::filesystem::path& path : logs)
+			{
+				Log log{ path, {} };
+				FILE* f = OpenFile(path, "rb");
+				if (f == nullptr)
+				{
+					continue;
+				}
+				const bool read = fread(log.baseBlock, 1, LogBaseBlockSize, f) == LogBaseBlockSize;
+				fclose(f);
+				if (!read || !BaseBlockValid(log.baseBlock))
+				{
+					continue;
+				}
+				if (Get32(log.baseBlock + RegfFileType) != LogFileType)
+				{
+					ThrowCorrupt(L"Transaction log in the former format (before Windows 8.1): not supported.");
+				}
+				valid.push_back(log);
+			}
+			if (valid.empty())
+			{
+				ThrowCorrupt(L"Dirty hive without a valid transaction log.");
+			}
+			std::sort(valid.begin(), valid.end(), [](const Log& lhs, const Log& rhs)
+			{
+				return Get32(lhs.baseBlock + RegfPrimarySequence) < Get32(rhs.baseBlock + RegfPrimarySequence);
+			});
+
+			// Without a sound primary base block, start from the one of the oldest log
+			if (!primaryValid)
+			{
+				memset(target.Data(), 0, BaseBlockSize);
+				memcpy(target.Data(), valid.front().baseBlock, LogBaseBlockSize);
+				result.sequenceNumber = Get32(valid.front().baseBlock + RegfPrimarySequence);
+			}
+
+			uint32_t next = result.sequenceNumber;          // next sequence number to apply
+			uint32_t binsSize = Get32(target.Data() + RegfBinsSize);
+			std::vector<uint8_t> entry;
+
+			for (const Log& log : valid)
+			{
+				FILE* f = OpenFile(log.path, "rb");
+				if (f == nullptr)
+				{
+					continue;
+				}
+				std::unique_ptr<FILE, int (*)(FILE*)> file(f, &fclose);
+				fseek(f, LogBaseBlockSize, SEEK_SET);
+				result.logBytesRead += LogBaseBlockSize;
+
+				for (;;)
+				{
+					uint8_t header[LogPageList];
+					if (fread(header, 1, sizeof(header), f) != sizeof(header))
+					{
+						result.endReason = L"end of file";
+						break;
+					}
+					result.logBytesRead += sizeof(header);
+					const uint32_t size = Get32(header + LogSize);
+					const uint32_t pageCount = Get32(header + LogPageCount);
+					const uint32_t sequence = Get32(header + LogSequence);
+					if (memcmp(header, "HvLE", 4) != 0)
+					{
+						result.endReason = L"no entry signature";
+						break;
+					}
+					if (size < LogEntryAlignment || size % LogEntryAlignment != 0
+						|| pageCount > (size - LogPageList) / 8)
+					{
+						result.endReason = L"invalid entry size";
+						break;
+					}
+					if (Marvin32(header, LogHash2) != Get64(header + LogHash2))
+					{
+						result.endReason = L"header hash mismatch";
+						break;
+					}
+
+					entry.resize(size);
+					memcpy(entry.data(), header, sizeof(header));
+					if (fread(entry.data() + sizeof(header), 1, size - sizeof(header), f) != size - sizeof(header))
+					{
+						result.endReason = L"truncated entry";
+						break;
+					}
+					result.logBytesRead += size - sizeof(header);
+					if (Marvin32(entry.data() + LogPageList, size - LogPageList) != Get64(header + LogHash1))
+					{
+						result.endReason = L"data hash mismatch";
+						break;
+					}
+
+					if (sequence < next)
+					{
+						result.entriesSkipped++;
+						continue;
+					}
+					if (sequence != next)
+					{
+						result.endReason = L"sequence gap";
+						break;
+					}
+
+					// The pages: within the bins of the entry, and within the entry
+					const uint32_t entryBins = Get32(header + LogBinsSize);
+					size_t dataOffset = LogPageList + size_t(pageCount) * 8;
+					bool pagesValid = entryBins % BinAlignment == 0;
+					for (uint32_t i = 0; i < pageCount && pagesValid; i++)
+					{
+						const uint32_t pageOffset = Get32(entry.data() + LogPageList + i * 8);
+						const uint32_t pageSize = Get32(entry.data() + LogPageList + i * 8 + 4);
+						pagesValid = pageSize <= entryBins && pageOffset <= entryBins - pageSize
+							&& pageSize <= size - dataOffset;
+						dataOffset += pageSize;
+					}
+					if (!pagesValid)
+					{
+						result.endReason = L"invalid dirty page";
+						break;
+					}
+
+					target.Reserve(size_t(BaseBlockSize) + entryBins);
+					dataOffset = LogPageList + size_t(pageCount) * 8;
+					for (uint32_t i = 0; i < pageCount; i++)
+					{
+						const uint32_t pageOffset = Get32(entry.data() + LogPageList + i * 8);
+						const uint32_t pageSize = Get32(entry.data() + LogPageList + i * 8 + 4);
+						memcpy(target.Data() + BaseBlockSize + pageOffset, entry.data() + dataOffset, pageSize);
+						dataOffset += pageSize;
+					}
+					binsSize = entryBins;
+					result.pagesApplied += pageCount;
+					result.entriesApplied++;
+					next = sequence + 1;
+				}
+			}
+
+			// A clean base block, past the last entry applied
+			uint8_t* base = target.Data();
+			Put32(base + RegfPrimarySequence, next);
+			Put32(base + RegfSecondarySequence, next);
+			Put32(base + RegfBinsSize, binsSize);
+			Put32(base + RegfFileType, 0);
+			Put32(base + RegfChecksum, BaseBlockChecksum(base));
+			result.sequenceNumber = next;
+			return result;
+		}
+
+	} // namespace hive_log_detail
+
+
+	//------------------------------------------------------------------------------
+	// Reads a hive file, applying its transaction logs if it's dirty (see the notes
+	// at the top of this file). The logs that don't exist are ignored.
+	// Throws std::runtime_error if the hive can't be read, RegException with
+	// ERROR_BADDB if it's dirty without a usable log.
+	//------------------------------------------------------------------------------
+	inline HiveRecoveryResult RecoverHive(const std::filesystem::path& hiveFile,
+		const std::vector<std::filesystem::path>& logs, std::vector<uint8_t>& image)
+	{
+		{
+			const MappedFile file(hiveFile);
+			image.assign(file.Data(), file.Data() + file.Size());
+		}
+		hive_log_detail::RecoveryTarget target(image);
+		return hive_log_detail::ReplayLogs(target, logs);
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Writes the recovered hive to outputFile (a copy of hiveFile, replaced if it
+	// exists). Throws as RecoverHive().
+	//------------------------------------------------------------------------------
+	inline HiveRecoveryResult RecoverHiveFile(const std::filesystem::path& hiveFile,
+		const std::vector<std::filesystem::path>& logs, const std::filesystem::path& outputFile)
+	{
+		std::filesystem::copy_file(hiveFile, outputFile, std::filesystem::copy_options::overwrite_existing);
+		WritableMappedFile file(outputFile);
+		hive_log_detail::RecoveryTarget target(file);
+		const HiveRecoveryResult result = hive_log_detail::ReplayLogs(target, logs);
+		file.Flush(0, file.Size());
+		return result;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Writes a transaction log (see the notes at the top of this file).
+	// Throws std::runtime_error if the file can't be written.
+	//------------------------------------------------------------------------------
+	class HiveLogWriter
+	{
+	public:
+
+		// Creates the log, with a copy of the base block of the hive. The first
+		// entry gets its secondary sequence number: it applies to the hive as
+		// last written completely.
+		HiveLogWriter(const std::filesystem::path& fileName, const uint8_t* hiveBaseBlock)
+			: m_sequence(hive_detail::Get32(hiveBaseBlock + hive_detail::RegfSecondarySequence))
+		{
+			using namespace hive_log_detail;
+
+			m_file = OpenFile(fileName, "wb");
+			if (m_file == nullptr)
+			{
+				throw std::runtime_error("HiveLogWriter: can't create the log file.");
+			}
+
+			uint8_t base[LogBaseBlockSize];
+			memcpy(base, hiveBaseBlock, sizeof(base));
+			Put32(base + RegfPrimarySequence, m_sequence);
+			Put32(base + RegfSecondarySequence, m_sequence);
+			Put32(base + RegfFileType, LogFileType);
+			Put32(base + RegfChecksum, BaseBlockChecksum(base));
+			try
+			{
+				WriteBytes(base, sizeof(base));
+			}
+			catch (...)
+			{
+				fclose(m_file);
+				throw;
+			}
+		}
+
+
+		~HiveLogWriter()
+		{
+			fclose(m_file);
+		}
+
+
+		HiveLogWriter(const HiveLogWriter&) = delete;
+		HiveLogWriter& operator=(const HiveLogWriter&) = delete;
+
+
+		// The sequence number of the next entry
+		uint32_t Sequence() const noexcept { return m_sequence; }
+
+
+		// Appends an entry with the given pages (offsets and sizes, multiples of
+		// 4 KB) of the hive bins, whose size is binsSize; returns its sequence number
+		uint32_t Append(const uint8_t* bins, uint32_t binsSize, const std::vector<std::pair<uint32_t, uint32_t>>& pages)
+		{
+			using namespace hive_log_detail;
+
+			size_t size = LogPageList + pages.size() * 8;
+			for (const auto& page : pages)
+			{
+				_ASSERTE(page.first % BinAlignment == 0 && page.second % BinAlignment == 0);
+				_ASSERTE(page.first + page.second <= binsSize);
+				size += page.second;
+			}
+			size = (size + LogEntryAlignment - 1) & ~size_t(LogEntryAlignment - 1);
+
+			std::vector<uint8_t> entry(size, 0);
+			memcpy(entry.data(), "HvLE", 4);
+			Put32(entry.data() + LogSize, static_cast<uint32_t>(size));
+			Put32(entry.data() + LogSequence, m_sequence);
+			Put32(entry.data() + LogBinsSize, binsSize);
+			Put32(entry.data() + LogPageCount, static_cast<uint32_t>(pages.size()));
+			size_t dataOffset = LogPageList + pages.size() * 8;
+			for (size_t i = 0; i < pages.size(); i++)
+			{
+				Put32(entry.data() + LogPageList + i * 8, pages[i].first);
+				Put32(entry.data() + LogPageList + i * 8 + 4, pages[i].second);
+				memcpy(entry.data() + dataOffset, bins + pages[i].first, pages[i].second);
+				dataOffset += pages[i].second;
+			}
+			Put64(entry.data() + LogHash1, Marvin32(entry.data() + LogPageList, size - LogPageList));
+			Put64(entry.data() + LogHash2, Marvin32(entry.data(), LogHash2));
+			WriteBytes(entry.data(), entry.size());
+			return m_sequence++;
+		}
+
+	private:
+		FILE* m_file = nullptr;
+		uint32_t m_sequence;
+
+		void WriteBytes(const uint8_t* data, size_t size)
+		{
+			if (fwrite(data, 1, size, m_file) != size || fflush(m_file) != 0)
+			{
+				throw std::runtime_error("HiveLogWriter: can't write the log file.");
+			}
+		}
+	};
+
+} // namespace winreg
@@ -0,0 +1,671 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_hive_scan.h
+// DESC: Linear scan of all the keys and values of an offline hive, decoding
+//       its bins in parallel.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// Walking the key tree of a hive (HiveKey, see wreg_hive.h) follows offsets
+// from cell to cell, one key after the other. When all the keys and values are
+// needed, in any order (an export, an index, statistics), ScanHive() reads the
+// hive bins front to back instead:
+//
+//  1. the bin headers are walked, and the bins grouped in chunks of about
+//     chunkSize bytes (a single thread takes all the bins as one chunk);
+//
+//  2. worker threads decode the chunks, reading their cells in order: the
+//     cells other than "nk" (key) and "vk" (value) are skipped at their
+//     signature, the others are decoded, and their names appended to the
+//     names of the chunk. Each chunk is then copied to its own part of the
+//     results (a single chunk is moved);
+//
+//  3. the keys and values found are sorted by offset (the chunks are in file
+//     order), and the keys are linked to their parents through the offsets:
+//     a key is kept if it's the root, or if it's in the sub-key list of its
+//     parent, itself kept. This drops the cells that only look like keys,
+//     e.g. value data starting with "nk";
+//
+//  4. each value is linked to the key listing it; values listed by no key
+//     are dropped in the same way.
+//
+// The names are kept in one string, HiveScan::names, that the records point
+// into (HiveScan::Name()): no allocation per key or value. The key paths are
+// rebuilt afterwards from the parents, on demand (HiveScan::KeyPath(),
+// KeyPaths()). The data of the values isn't read: use HiveValue, with the
+// offsets of the results, for the values needed.
+//
+// Steps 2 to 4 run on the threads of the options. Free cells (deleted keys
+// and values) are skipped; a bin with an invalid cell size is skipped from
+// that cell on, and reported.
+//
+// The scan reads the size of every cell, data cells included, which a tree
+// walk skips. On a single core, with a hive already in memory, it takes about
+// as long as a walk keeping the same records (the tests), and about 1.5x a
+// walk only reading the names; the decoding, the copies of the chunks and
+// the linking run on the threads. Mapped files not in the cache yet are read
+// front to back, instead of at the offsets of the tree.
+//
+//==============================================================================
+#include "wreg_hive.h"  // HiveView, hive_detail
+#include "wreg_file.h"  // MappedFile
+#include <algorithm>    // std::lower_bound, std::min, std::max
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <cstring>      // memcmp
+#include <filesystem>   // std::filesystem::path
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <vector>       // std::vector
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define WINREG_SCAN_PREFETCH 1
+#include <xmmintrin.h>  // _mm_prefetch
+#endif
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Options of ScanHive()
+	//------------------------------------------------------------------------------
+	struct HiveScanOptions
+	{
+		size_t threads = 4;
+		size_t chunkSize = 1024 * 1024;     // bytes of bins per task
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A key found by ScanHive()
+	//------------------------------------------------------------------------------
+	struct ScannedKey
+	{
+		static constexpr size_t NoParent = static_cast<size_t>(-1);
+
+		uint32_t cellOffset;
+		size_t parent;                  // index in HiveScan::keys, NoParent for the root
+		uint32_t nameOffset;            // in HiveScan::names, see HiveScan::Name()
+		uint32_t nameLength;
+		uint64_t lastWriteTime;
+		uint32_t subKeyCount;
+		uint32_t valueCount;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A value found by ScanHive()
+	//------------------------------------------------------------------------------
+	struct ScannedValue
+	{
+		uint32_t cellOffset;            // e.g. for HiveValue, to read the data
+		size_t key;                     // index in HiveScan::keys
+		uint32_t nameOffset;            // in HiveScan::names, see HiveScan::Name()
+		uint32_t nameLength;
+		DWORD type;
+		uint32_t dataSize;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Results of ScanHive()
+	//------------------------------------------------------------------------------
+	struct HiveScan
+	{
+		std::vector<ScannedKey> keys;       // by cell offset
+		std::vector<ScannedValue> values;   // by cell offset
+		std::wstring names;                 // of the keys and values, back to back
+		size_t droppedKeys = 0;             // "nk" cells not in the tree
+		size_t droppedValues = 0;           // "vk" cells listed by no key
+		size_t badBins = 0;                 // with an invalid cell size
+		uint64_t bytesScanned = 0;
+		double seconds = 0;
+
+
+		std::wstring_view Name(const ScannedKey& key) const noexcept
+		{
+			return std::wstring_view(names.data() + key.nameOffset, key.nameLength);
+		}
+
+		std::wstring_view Name(const ScannedValue& value) const noexcept
+		{
+			return std::wstring_view(names.data() + value.nameOffset, value.nameLength);
+		}
+
+
+		// The path of a key, from the root of the hive ("" for the root)
+		std::wstring KeyPath(size_t key) const
+		{
+			std::vector<size_t> chain;
+			for (size_t k = key; keys[k].parent != ScannedKey::NoParent; k = keys[k].parent)
+			{
+				chain.push_back(k);
+			}
+			std::wstring path;
+			for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+			{
+				if (!path.empty())
+				{
+					path += L'\\';
+				}
+				path += Name(keys[*it]);
+			}
+			return path;
+		}
+
+
+		// The paths of all the keys, by index, each built from the one of its parent
+		std::vector<std::wstring> KeyPaths() const
+		{
+			std::vector<std::wstring> paths(keys.size());
+			std::vector<bool> done(keys.size(), false);
+			std::vector<size_t> pending;
+			for (size_t i = 0; i < keys.size(); i++)
+			{
+				for (size_t k = i; !done[k]; k = keys[k].parent)
+				{
+					pending.push_back(k);
+					if (keys[k].parent == ScannedKey::NoParent)
+					{
+						break;
+					}
+				}
+				for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+				{
+					const ScannedKey& key = keys[*it];
+					if (key.parent != ScannedKey::NoParent)
+					{
+						const std::wstring& parentPath = paths[key.parent];
+						paths[*it].reserve(parentPath.size() + 1 + key.nameLength);
+						paths[*it] = parentPath;
+						if (!parentPath.empty())
+						{
+							paths[*it] += L'\\';
+						}
+						paths[*it] += Name(key);
+					}
+					done[*it] = true;
+				}
+				pending.clear();
+			}
+			return paths;
+		}
+	};
+
+
+	namespace hive_scan_detail
+	{
+		using namespace hive_detail;
+
+
+		// Offsets of a key cell, to link it once all the cells are decoded
+		struct KeyLinks
+		{
+			uint32_t parent;
+			uint32_t subKeyList;
+			uint32_t valueList;
+		};
+
+		// What a chunk holds
+		struct Chunk
+		{
+			Chunk(uint32_t first, uint32_t last) noexcept
+				: begin(first), end(last)
+			{
+			}
+
+			uint32_t begin;     // offsets of the bins
+			uint32_t end;
+			std::vector<ScannedKey> keys;
+			std::vector<KeyLinks> links;
+			std::vector<ScannedValue> values;
+			std::wstring names;                 // name offsets are in the chunk until merged
+			std::vector<char16_t> units;        // a UTF-16 name, aligned
+			size_t badBins = 0;
+		};
+
+
+		// Appends a name to the names of the chunk, and returns its length
+		inline uint32_t AppendName(Chunk& chunk, const uint8_t* p, size_t byteLength, bool compressed)
+		{
+			const size_t offset = chunk.names.size();
+			if (compressed)
+			{
+				chunk.names.resize(offset + byteLength);
+				wchar_t* out = &chunk.names[offset];
+				for (size_t i = 0; i < byteLength; i++)
+				{
+					out[i] = p[i];
+				}
+				return static_cast<uint32_t>(byteLength);
+			}
+			chunk.units.resize(byteLength / 2);
+			if (chunk.units.empty())
+			{
+				return 0;
+			}
+			memcpy(chunk.units.data(), p, chunk.units.size() * sizeof(char16_t));
+			chunk.names.resize(offset + chunk.units.size());
+			chunk.names.resize(offset + utf_detail::Utf16ToWide(chunk.units.data(), chunk.units.size(), &chunk.names[offset]));
+			return static_cast<uint32_t>(chunk.names.size() - offset);
+		}
+
+
+		// The size of the bin at this offset, checked with its header
+		inline uint32_t CheckedBinSize(const HiveView& hive, uint32_t bin)
+		{
+			const uint8_t* header = hive.Bins() + bin;
+			const uint32_t size = Get32(header + BinSize);
+			if (memcmp(header, "hbin", 4) != 0 || Get32(header + BinOffset) != bin
+				|| size == 0 || size % BinAlignment != 0 || size > hive.BinsSize() - bin)
+			{
+				ThrowCorrupt(L"ScanHive: invalid bin header.");
+			}
+			return size;
+		}
+
+
+		inline void DecodeChunk(const HiveView& hive, Chunk& chunk)
+		{
+			const uint8_t* bins = hive.Bins();
+			for (uint32_t bin = chunk.begin; bin < chunk.end; bin += Get32(bins + bin + BinSize))
+			{
+				const uint32_t binEnd = bin + CheckedBinSize(hive, bin);
+				for (uint32_t cell = bin + BinHeaderSize; cell < binEnd; )
+				{
+					const int32_t size = static_cast<int32_t>(Get32(bins + cell));
+					const uint32_t length = (size < 0) ? 0u - static_cast<uint32_t>(size) : static_cast<uint32_t>(size);
+					if (length < 8 || length % 8 != 0 || length > binEnd - cell)
+					{
+						chunk.badBins++;
+						break;
+					}
+
+					// Free cells, and the allocated ones other than keys and
+					// values (data, lists), stop at the second signature byte
+					const uint8_t* data = bins + cell + 4;
+					const uint32_t dataSize = length - 4;
+					if (size >= 0 || data[1] != 'k')
+					{
+						cell += length;
+						continue;
+					}
+					if (data[0] == 'n' && dataSize >= NkName && Get16(data + NkNameLength) <= dataSize - NkName)
+					{
+						const uint32_t nameOffset = static_cast<uint32_t>(chunk.names.size());
+						const uint32_t nameLength = AppendName(chunk, data + NkName, Get16(data + NkNameLength),
+							(Get16(data + NkFlags) & KeyCompressedName) != 0);
+						chunk.keys.push_back(ScannedKey{ cell, ScannedKey::NoParent, nameOffset, nameLength,
+							Get64(data + NkLastWrite), Get32(data + NkSubKeyCount), Get32(data + NkValueCount) });
+						chunk.links.push_back(KeyLinks{ Get32(data + NkParent), Get32(data + NkSubKeyList),
+							Get32(data + NkValueList) });
+					}
+					else if (data[0] == 'v' && dataSize >= VkName && Get16(data + VkNameLength) <= dataSize - VkName)
+					{
+						const uint32_t nameOffset = static_cast<uint32_t>(chunk.names.size());
+						const uint32_t nameLength = AppendName(chunk, data + VkName, Get16(data + VkNameLength),
+							(Get16(data + VkFlags) & ValueCompressedName) != 0);
+						chunk.values.push_back(ScannedValue{ cell, ScannedKey::NoParent, nameOffset, nameLength,
+							Get32(data + VkType), Get32(data + VkDataSize) & ~ResidentData });
+					}
+					cell += length;
+				}
+			}
+		}
+
+
+		// Moves the items of the chunks to the results, in file order: each chunk
+		// is copied to its own part on the threads, and a single chunk handed over
+		inline void MergeChunks(size_t threads, std::vector<Chunk>& chunks, HiveScan& scan, std::vector<KeyLinks>& links)
+		{
+			if (chunks.size() == 1)
+			{
+				scan.keys.swap(chunks.front().keys);
+				scan.values.swap(chunks.front().values);
+				scan.names.swap(chunks.front().names);
+				links.swap(chunks.front().links);
+				scan.badBins = chunks.front().badBins;
+				return;
+			}
+
+			struct Bases { size_t key; size_t value; size_t name; };
+			std::vector<Bases> bases(chunks.size() + 1, Bases{ 0, 0, 0 });
+			for (size_t i = 0; i < chunks.size(); i++)
+			{
+				bases[i + 1].key = bases[i].key + chunks[i].keys.size();
+				bases[i + 1].value = bases[i].value + chunks[i].values.size();
+				bases[i + 1].name = bases[i].name + chunks[i].names.size();
+				scan.badBins += chunks[i].badBins;
+			}
+			scan.keys.resize(bases.back().key);
+			scan.values.resize(bases.back().value);
+			scan.names.resize(bases.back().name);
+			links.resize(bases.back().key);
+			ParallelFor(threads, chunks.size(), [&](size_t index, size_t)
+			{
+				Chunk& chunk = chunks[index];
+				const Bases& base = bases[index];
+				const uint32_t nameBase = static_cast<uint32_t>(base.name);
+				for (size_t i = 0; i < chunk.keys.size(); i++)
+				{
+					scan.keys[base.key + i] = chunk.keys[i];
+					scan.keys[base.key + i].nameOffset += nameBase;
+				}
+				for (size_t i = 0; i < chunk.values.size(); i++)
+				{
+					scan.values[base.value + i] = chunk.values[i];
+					scan.values[base.value + i].nameOffset += nameBase;
+				}
+				std::copy(chunk.names.begin(), chunk.names.end(), scan.names.begin() + base.name);
+				std::copy(chunk.links.begin(), chunk.links.end(), links.begin() + base.key);
+				chunk = Chunk(chunk.begin, chunk.end);
+			});
+		}
+
+
+		// The cell offsets of the keys or of the values, sorted, with the first
+		// one of each page of the bins: lookups only search their own page
+		class OffsetIndex
+		{
+		public:
+			template <typename Items>
+			OffsetIndex(const Items& items, uint32_t binsSize)
+				: m_offsets(items.size())
+				, m_pages(binsSize / BinAlignment + 1)
+			{
+				for (size_t i = 0; i < items.size(); i++)
+				{
+					m_offsets[i] = items[i].cellOffset;
+				}
+				size_t item = 0;
+				for (size_t page = 0; page < m_pages.size(); page++)
+				{
+					while (item < m_offsets.size() && m_offsets[item] / BinAlignment < page)
+					{
+						item++;
+					}
+					m_pages[page] = static_cast<uint32_t>(item);
+				}
+			}
+
+			// Index of the item at this offset, or NoParent; the item at hint is
+			// tried first (e.g. the values of a key usually follow each other)
+			size_t Find(uint32_t offset, size_t hint = ScannedKey::NoParent) const noexcept
+			{
+				if (hint < m_offsets.size() && m_offsets[hint] == offset)
+				{
+					return hint;
+				}
+				const size_t page = offset / BinAlignment;
+				if (page + 1 >= m_pages.size())
+				{
+					return ScannedKey::NoParent;
+				}
+				const auto end = m_offsets.begin() + m_pages[page + 1];
+				const auto it = std::lower_bound(m_offsets.begin() + m_pages[page], end, offset);
+				return (it != end && *it == offset) ? static_cast<size_t>(it - m_offsets.begin()) : ScannedKey::NoParent;
+			}
+
+		private:
+			std::vector<uint32_t> m_offsets;
+			std::vector<uint32_t> m_pages;
+		};
+
+
+		// Calls onEntry(offset, isIndex) for the entries of a sub-key list cell
+		// ("ri" indexes list other lists); invalid cells are ignored
+		template <typename OnEntry>
+		void ForEachListEntry(const HiveView& hive, uint32_t list, OnEntry onEntry)
+		{
+			if (list % 8 != 0 || list >= hive.BinsSize())
+			{
+				return;
+			}
+			const int32_t size = static_cast<int32_t>(Get32(hive.Bins() + list));
+			if (size >= -8 || 0u - static_cast<uint32_t>(size) > hive.BinsSize() - list)
+			{
+				return;
+			}
+			const uint8_t* data = hive.Bins() + list + 4;
+			const uint32_t dataSize = 0u - static_cast<uint32_t>(size) - 4;
+			const bool index = HasSignature(data, "ri");
+			const uint32_t entrySize = (index || HasSignature(data, "li")) ? 4
+				: (HasSignature(data, "lf") || HasSignature(data, "lh")) ? 8 : 0;
+			const uint32_t count = Get16(data + 2);
+			if (entrySize == 0 || count > (dataSize - 4) / entrySize)
+			{
+				return;
+			}
+			for (uint32_t i = 0; i < count; i++)
+			{
+				onEntry(Get32(data + 4 + i * entrySize), index);
+			}
+		}
+
+	} // namespace hive_scan_detail
+
+
+	//------------------------------------------------------------------------------
+	// Finds all the keys and values of a hive by scanning its bins (see the notes
+	// at the top of this file). Throws RegException with ERROR_BADDB if the bin
+	// headers are invalid.
+	//------------------------------------------------------------------------------
+	inline HiveScan ScanHive(const HiveView& hive, const HiveScanOptions& options = {})
+	{
+		using namespace hive_scan_detail;
+
+		const auto start = std::chrono::steady_clock::now();
+		const size_t threads = (std::max)(options.threads, size_t(1));
+		HiveScan scan;
+
+		// 1. Chunks of whole bins; a single thread decodes all the bins in one,
+		// checking the bin headers as it goes
+		std::vector<Chunk> chunks;
+		if (threads == 1)
+		{
+			chunks.emplace_back(0, hive.BinsSize());
+		}
+		for (uint32_t bin = 0; threads > 1 && bin < hive.BinsSize(); )
+		{
+			if (chunks.empty() || chunks.back().end - chunks.back().begin >= options.chunkSize)
+			{
+				chunks.emplace_back(bin, bin);
+			}
+			bin += CheckedBinSize(hive, bin);
+			chunks.back().end = bin;
+		}
+		scan.bytesScanned = hive.BinsSize();
+
+		// 2. Decode the cells
+		ParallelFor(threads, chunks.size(), [&](size_t index, size_t)
+		{
+			DecodeChunk(hive, chunks[index]);
+		});
+
+		// 3. Keys in offset order (the chunks are in file order), linked to the
+		// parents listing them
+		std::vector<ScannedKey>& keys = scan.keys;
+		std::vector<KeyLinks> links;
+		std::vector<ScannedValue>& values = scan.values;
+		MergeChunks(threads, chunks, scan, links);
+		chunks.clear();
+
+		// The offsets are looked up apart from the records, in tables small
+		// enough to stay in the cache
+		const OffsetIndex keyIndex(keys, hive.BinsSize());
+
+		// Listed by their parent: each key is written by the single key it points to
+		constexpr size_t Block = 1024;
+		std::vector<uint8_t> listed(keys.size(), 0);
+		ParallelFor(threads, (keys.size() + Block - 1) / Block, [&](size_t block, size_t)
+		{
+			const size_t end = (std::min)(keys.size(), (block + 1) * Block);
+			for (size_t i = block * Block; i < end; i++)
+			{
+				if (keys[i].subKeyCount == 0)
+				{
+					continue;
+				}
+				auto onEntry = [&](uint32_t offset)
+				{
+					const size_t child = keyIndex.Find(offset);
+					if (child != ScannedKey::NoParent && links[child].parent == keys[i].cellOffset)
+					{
+						listed[child] = 1;
+					}
+				};
+				ForEachListEntry(hive, links[i].subKeyList, [&](uint32_t offset, bool index)
+				{
+					if (index)
+					{
+						ForEachListEntry(hive, offset, [&](uint32_t leafEntry, bool) { onEntry(leafEntry); });
+					}
+					else
+					{
+						onEntry(offset);
+					}
+				});
+			}
+		});
+
+		// Kept if the root, or listed by a kept parent
+		enum : uint8_t { Unknown, Kept, Dropped, Visiting };
+		std::vector<uint8_t> state(keys.size(), Unknown);
+		std::vector<size_t> parents(keys.size(), ScannedKey::NoParent);
+		std::vector<size_t> chain;
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			for (size_t k = i; state[k] == Unknown; k = parents[k])
+			{
+				state[k] = Visiting;
+				chain.push_back(k);
+				if (keys[k].cellOffset == hive.RootCell() || !listed[k])
+				{
+					break;
+				}
+				parents[k] = keyIndex.Find(links[k].parent, (k > 0) ? parents[k - 1] : ScannedKey::NoParent);
+				if (parents[k] == ScannedKey::NoParent)
+				{
+					break;
+				}
+			}
+
+			// Resolved from the top of the chain down
+			for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+			{
+				const size_t parent = parents[*it];
+				state[*it] = (keys[*it].cellOffset == hive.RootCell()
+					|| (listed[*it] && parent != ScannedKey::NoParent && state[parent] == Kept)) ? Kept : Dropped;
+			}
+			chain.clear();
+		}
+
+		// 4. Values, linked to a kept key listing them (any of them, for a value
+		// listed twice)
+		const OffsetIndex valueIndex(values, hive.BinsSize());
+		std::vector<std::atomic<size_t>> owners(values.size());
+		for (std::atomic<size_t>& owner : owners)
+		{
+			owner.store(ScannedKey::NoParent, std::memory_order_relaxed);
+		}
+		ParallelFor(threads, (keys.size() + Block - 1) / Block, [&](size_t block, size_t)
+		{
+			const size_t end = (std::min)(keys.size(), (block + 1) * Block);
+			size_t next = ScannedKey::NoParent;
+			for (size_t i = block * Block; i < end; i++)
+			{
+#ifdef WINREG_SCAN_PREFETCH
+				if (i + 8 < end && links[i + 8].valueList < hive.BinsSize())
+				{
+					_mm_prefetch(reinterpret_cast<const char*>(hive.Bins() + links[i + 8].valueList), _MM_HINT_T0);
+				}
+#endif
+				const uint32_t list = links[i].valueList;
+				const uint32_t count = (state[i] == Kept) ? keys[i].valueCount : 0;
+				if (count == 0 || list % 8 != 0 || list >= hive.BinsSize())
+				{
+					continue;
+				}
+				const int32_t size = static_cast<int32_t>(Get32(hive.Bins() + list));
+				if (size >= 0 || 0u - static_cast<uint32_t>(size) > hive.BinsSize() - list
+					|| count > (0u - static_cast<uint32_t>(size) - 4) / 4)
+				{
+					continue;
+				}
+				for (uint32_t v = 0; v < count; v++)
+				{
+					const size_t value = valueIndex.Find(Get32(hive.Bins() + list + 4 + v * 4), next);
+					if (value != ScannedKey::NoParent)
+					{
+						owners[value].store(i, std::memory_order_relaxed);
+						next = value + 1;
+					}
+				}
+			}
+		});
+
+		// The dropped items removed in place, and the indexes renumbered
+		std::vector<size_t> newIndex(keys.size(), ScannedKey::NoParent);
+		size_t kept = 0;
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			if (state[i] == Kept)
+			{
+				newIndex[i] = kept;
+				if (kept != i)
+				{
+					keys[kept] = keys[i];
+				}
+				kept++;
+			}
+		}
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			if (state[i] == Kept && parents[i] != ScannedKey::NoParent)
+			{
+				keys[newIndex[i]].parent = newIndex[parents[i]];
+			}
+		}
+		scan.droppedKeys = keys.size() - kept;
+		keys.resize(kept);
+
+		kept = 0;
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			const size_t owner = owners[i].load(std::memory_order_relaxed);
+			if (owner != ScannedKey::NoParent)
+			{
+				values[i].key = newIndex[owner];
+				if (kept != i)
+				{
+					values[kept] = values[i];
+				}
+				kept++;
+			}
+		}
+		scan.droppedValues = values.size() - kept;
+		values.resize(kept);
+
+		scan.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return scan;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Scans a hive file, mapped in memory.
+	// Throws std::runtime_error if the file can't be mapped.
+	//------------------------------------------------------------------------------
+	inline HiveScan ScanHiveFile(const std::filesystem::path& fileName, const HiveScanOptions& options = {})
+	{
+		const MappedFile file(fileName);
+		return ScanHive(HiveView(file.Data(), file.Size()), options);
+	}
+
+} // namespace winreg
@@ -0,0 +1,794 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_hive_verify.h
+// DESC: Integrity check of offline hive files, checking bins in parallel.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// VerifyHive() checks a hive file (see wreg_hive.h) in memory, e.g. mapped
+// with MappedFile, before it's read, loaded or repaired:
+//
+//  1. the base block: signature, version, sequence numbers (a "dirty" hive has
+//     changes in its log files), checksum, and the size of the hive bins;
+//
+//  2. the chain of bin headers, in order: each bin records its own offset and
+//     size, so the bins can then be checked independently;
+//
+//  3. in parallel, bin by bin: the cell sizes, which must be multiples of 8
+//     and tile the bin exactly. The start of each allocated cell is recorded
+//     in a bitmap, one bit per 8 bytes: bins are 4 KB aligned, so the threads
+//     never write to the same word of it;
+//
+//  4. in parallel, level by level from the root key: the cells each key
+//     references, with their types: the offsets must point at the start of
+//     an allocated cell (per the bitmap), of the expected kind and large
+//     enough for its contents. Sub-keys must point back at their parent, and
+//     be sorted with matching hashes; a key reached twice (e.g. a loop) or
+//     nested too deep is reported, and not walked again.
+//
+// Each issue records the offset of the offending bytes in the file, and the
+// cell holding them. The report is sorted by file offset.
+//
+// Steps 3 and 4 scale with the threads: the base block checksum covers only
+// 508 bytes, and steps 1 and 2 touch a few bytes per 4 KB.
+//
+//==============================================================================
+#include "wreg_hive.h"  // HiveView, hive_detail
+#include "wreg_file.h"  // MappedFile
+#include <algorithm>    // std::stable_sort, std::min, std::max
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <filesystem>   // std::filesystem::path
+#include <iterator>     // std::make_move_iterator
+#include <string>       // std::wstring, std::to_wstring
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Kinds of problems found by VerifyHive()
+	//------------------------------------------------------------------------------
+	enum class HiveIssueCode
+	{
+		Truncated,          // file shorter than the base block, or than the hive bins
+		BadBaseBlock,       // signature, version, file type or format
+		DirtyBaseBlock,     // sequence numbers differ: the log files have newer data
+		BadChecksum,        // of the base block
+		BadBin,             // bin header: signature, offset or size
+		BadCellSize,        // not a multiple of 8, or past the end of the bin
+		BadReference,       // offset not pointing at the start of an allocated cell
+		BadCell,            // wrong signature, or contents not fitting the cell
+		BadCount,           // count not matching a list
+		UnsortedList,       // sub-keys out of order, or duplicated
+		BadHash,            // "lh" hash or "lf" hint not matching the name
+		BadParent,          // sub-key not pointing back at its parent
+		KeyLoop,            // key referenced twice, or nested too deep
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A problem found by VerifyHive()
+	//------------------------------------------------------------------------------
+	struct HiveIssue
+	{
+		HiveIssueCode code;
+		uint64_t fileOffset;        // of the offending bytes
+		uint32_t cellOffset;        // of the cell holding them (hive_detail::InvalidOffset if none)
+		std::wstring description;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Options of VerifyHive()
+	//------------------------------------------------------------------------------
+	struct HiveVerifyOptions
+	{
+		size_t threads = 4;
+		size_t maxIssues = 1000;    // reported; the check goes on
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Results of VerifyHive()
+	//------------------------------------------------------------------------------
+	struct HiveVerifyResult
+	{
+		std::vector<HiveIssue> issues;      // by file offset
+		size_t issuesFound = 0;             // including those past maxIssues
+		size_t bins = 0;
+		size_t allocatedCells = 0;
+		size_t freeCells = 0;
+		size_t keys = 0;                    // reachable from the root
+		size_t values = 0;
+		double seconds = 0;
+
+		bool IsValid() const noexcept
+		{
+			return issuesFound == 0;
+		}
+
+		bool Has(HiveIssueCode code) const noexcept
+		{
+			for (const HiveIssue& issue : issues)
+			{
+				if (issue.code == code)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+
+	namespace hive_verify_detail
+	{
+		using namespace hive_detail;
+
+
+		// Issues and counts of one thread
+		struct ThreadReport
+		{
+			std::vector<HiveIssue> issues;
+			size_t issuesFound = 0;
+			size_t allocatedCells = 0;
+			size_t freeCells = 0;
+			size_t keys = 0;
+			size_t values = 0;
+		};
+
+
+		class Verifier
+		{
+		public:
+			Verifier(const uint8_t* data, size_t size, const HiveVerifyOptions& options)
+				: m_data(data), m_size(size), m_options(options)
+			{
+			}
+
+
+			HiveVerifyResult Run()
+			{
+				const auto start = std::chrono::steady_clock::now();
+				const size_t threads = (std::max)(m_options.threads, size_t(1));
+				m_reports.resize(threads);
+
+				HiveVerifyResult result;
+				if (CheckBaseBlock())
+				{
+					CheckBinChain();
+					result.bins = m_bins.size();
+
+					// 3. Cells, bin by bin
+					m_cellStarts.assign((m_binsSize / 8 + 63) / 64, 0);
+					ParallelFor(threads, m_bins.size(), [&](size_t index, size_t thread)
+					{
+						CheckBinCells(m_bins[index], m_reports[thread]);
+					});
+
+					// 4. Keys, level by level
+					CheckKeys(threads);
+				}
+
+				for (ThreadReport& report : m_reports)
+				{
+					result.issuesFound += report.issuesFound;
+					result.allocatedCells += report.allocatedCells;
+					result.freeCells += report.freeCells;
+					result.keys += report.keys;
+					result.values += report.values;
+					result.issues.insert(result.issues.end(),
+						std::make_move_iterator(report.issues.begin()), std::make_move_iterator(report.issues.end()));
+				}
+				std::stable_sort(result.issues.begin(), result.issues.end(),
+					[](const HiveIssue& lhs, const HiveIssue& rhs) { return lhs.fileOffset < rhs.fileOffset; });
+				if (result.issues.size() > m_options.maxIssues)
+				{
+					result.issues.resize(m_options.maxIssues);
+				}
+
+				result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				return result;
+			}
+
+		private:
+			struct Bin
+			{
+				uint32_t offset;
+				uint32_t size;
+			};
+
+			// A key to check, with the key whose list referenced it
+			struct PendingKey
+			{
+				uint32_t offset;
+				uint32_t parent;
+				uint64_t referenceOffset;   // file offset of the reference
+			};
+
+			const uint8_t* m_data;
+			size_t m_size;
+			const HiveVerifyOptions& m_options;
+			std::vector<ThreadReport> m_reports;
+
+			uint32_t m_binsSize = 0;        // checked: whole bins present in the file
+			uint32_t m_rootCell = InvalidOffset;
+			std::vector<Bin> m_bins;
+			std::vector<uint64_t> m_cellStarts;             // bitmap of allocated cells
+			std::vector<std::atomic<uint64_t>> m_keysSeen;  // bitmap of the keys walked
+
+
+			const uint8_t* Bins() const noexcept
+			{
+				return m_data + BaseBlockSize;
+			}
+
+			static uint64_t FileOffset(uint32_t cellOffset) noexcept
+			{
+				return uint64_t(BaseBlockSize) + cellOffset;
+			}
+
+
+			static void Report(ThreadReport& report, HiveIssueCode code, uint64_t fileOffset, uint32_t cellOffset,
+				std::wstring description, size_t maxIssues)
+			{
+				report.issuesFound++;
+				if (report.issues.size() < maxIssues)
+				{
+					report.issues.push_back(HiveIssue{ code, fileOffset, cellOffset, std::move(description) });
+				}
+			}
+
+			void Report(ThreadReport& report, HiveIssueCode code, uint64_t fileOffset, uint32_t cellOffset,
+				std::wstring description) const
+			{
+				Report(report, code, fileOffset, cellOffset, std::move(description), m_options.maxIssues);
+			}
+
+
+			// 1. Returns false if the bins can't be located
+			bool CheckBaseBlock()
+			{
+				ThreadReport& report = m_reports[0];
+				if (m_size < BaseBlockSize)
+				{
+					Report(report, HiveIssueCode::Truncated, m_size, InvalidOffset,
+						L"File shorter than the base block.");
+					return false;
+				}
+				if (memcmp(m_data, "regf", 4) != 0)
+				{
+					Report(report, HiveIssueCode::BadBaseBlock, RegfSignature, InvalidOffset,
+						L"No \"regf\" signature.");
+					return false;
+				}
+
+				if (Get32(m_data + RegfPrimarySequence) != Get32(m_data + RegfSecondarySequence))
+				{
+					Report(report, HiveIssueCode::DirtyBaseBlock, RegfPrimarySequence, InvalidOffset,
+						L"Sequence numbers differ: the log files must be applied.");
+				}
+				const uint32_t checksum = BaseBlockChecksum(m_data);
+				if (Get32(m_data + RegfChecksum) != checksum)
+				{
+					Report(report, HiveIssueCode::BadChecksum, RegfChecksum, InvalidOffset,
+						L"Base block checksum is " + std::to_wstring(Get32(m_data + RegfChecksum))
+						+ L", expected " + std::to_wstring(checksum) + L".");
+				}
+				if (Get32(m_data + RegfMajorVersion) != 1 || Get32(m_data + RegfMinorVersion) < 2
+					|| Get32(m_data + RegfMinorVersion) > 6)
+				{
+					Report(report, HiveIssueCode::BadBaseBlock, RegfMajorVersion, InvalidOffset,
+						L"Unsupported hive version.");
+				}
+				if (Get32(m_data + RegfFileType) != 0 || Get32(m_data + RegfFileFormat) != 1)
+				{
+					Report(report, HiveIssueCode::BadBaseBlock, RegfFileType, InvalidOffset,
+						L"Not a primary hive file in direct memory load format.");
+				}
+
+				const uint32_t binsSize = Get32(m_data + RegfBinsSize);
+				const size_t available = (m_size - BaseBlockSize) & ~size_t(BinAlignment - 1);
+				m_binsSize = static_cast<uint32_t>((std::min)(size_t(binsSize & ~(BinAlignment - 1)), available));
+				if (binsSize % BinAlignment != 0)
+				{
+					Report(report, HiveIssueCode::BadBaseBlock, RegfBinsSize, InvalidOffset,
+						L"Hive bins size not a multiple of 4 KB.");
+				}
+				if (binsSize > m_size - BaseBlockSize)
+				{
+					Report(report, HiveIssueCode::Truncated, m_size, InvalidOffset,
+						L"File ends " + std::to_wstring(binsSize - (m_size - BaseBlockSize))
+						+ L" bytes before the end of the hive bins.");
+				}
+				m_rootCell = Get32(m_data + RegfRootCell);
+				return true;
+			}
+
+
+			// 2. Follows the bin headers; the bins after a bad header are left out
+			void CheckBinChain()
+			{
+				ThreadReport& report = m_reports[0];
+				uint32_t offset = 0;
+				while (offset < m_binsSize)
+				{
+					const uint8_t* bin = Bins() + offset;
+					const uint32_t size = Get32(bin + BinSize);
+					if (memcmp(bin, "hbin", 4) != 0)
+					{
+						Report(report, HiveIssueCode::BadBin, FileOffset(offset), InvalidOffset,
+							L"No \"hbin\" signature.");
+						break;
+					}
+					if (Get32(bin + BinOffset) != offset)
+					{
+						Report(report, HiveIssueCode::BadBin, FileOffset(offset + BinOffset), InvalidOffset,
+							L"Bin records offset " + std::to_wstring(Get32(bin + BinOffset))
+							+ L", found at " + std::to_wstring(offset) + L".");
+						break;
+					}
+					if (size == 0 || size % BinAlignment != 0 || size > m_binsSize - offset)
+					{
+						Report(report, HiveIssueCode::BadBin, FileOffset(offset + BinSize), InvalidOffset,
+							L"Invalid bin size " + std::to_wstring(size) + L".");
+						break;
+					}
+					m_bins.push_back(Bin{ offset, size });
+					offset += size;
+				}
+			}
+
+
+			// 3.
+			void CheckBinCells(const Bin& bin, ThreadReport& report)
+			{
+				const uint32_t end = bin.offset + bin.size;
+				uint32_t offset = bin.offset + BinHeaderSize;
+				while (offset < end)
+				{
+					const int32_t size = static_cast<int32_t>(Get32(Bins() + offset));
+					const uint32_t length = (size < 0) ? 0u - static_cast<uint32_t>(size) : static_cast<uint32_t>(size);
+					if (length < 8 || length % 8 != 0 || length > end - offset)
+					{
+						Report(report, HiveIssueCode::BadCellSize, FileOffset(offset), offset,
+							L"Invalid cell size " + std::to_wstring(size) + L".");
+						return;
+					}
+					if (size < 0)
+					{
+						m_cellStarts[offset / 8 / 64] |= uint64_t(1) << (offset / 8 % 64);
+						report.allocatedCells++;
+					}
+					else
+					{
+						report.freeCells++;
+					}
+					offset += length;
+				}
+			}
+
+
+			// The data of the allocated cell at offset, or nullptr (reported as referenced from referenceOffset)
+			const uint8_t* Cell(uint32_t offset, uint32_t& dataSize, uint64_t referenceOffset, uint32_t referencingCell,
+				const wchar_t* what, ThreadReport& report) const
+			{
+				if (offset % 8 != 0 || offset >= m_binsSize
+					|| (m_cellStarts[offset / 8 / 64] & (uint64_t(1) << (offset / 8 % 64))) == 0)
+				{
+					Report(report, HiveIssueCode::BadReference, referenceOffset, referencingCell,
+						std::wstring(what) + L" offset " + std::to_wstring(offset) + L" not pointing at an allocated cell.");
+					return nullptr;
+				}
+				dataSize = 0u - Get32(Bins() + offset) - 4;
+				return Bins() + offset + 4;
+			}
+
+
+			// 4.
+			void CheckKeys(size_t threads)
+			{
+				m_keysSeen = std::vector<std::atomic<uint64_t>>((m_binsSize / 8 + 63) / 64);
+
+				std::vector<PendingKey> level{ PendingKey{ m_rootCell, InvalidOffset, RegfRootCell } };
+				std::vector<std::vector<PendingKey>> next(threads);
+				for (uint32_t depth = 0; !level.empty(); depth++)
+				{
+					if (depth == MaxKeyDepth)
+					{
+						for (const PendingKey& key : level)
+						{
+							Report(m_reports[0], HiveIssueCode::KeyLoop, key.referenceOffset, InvalidOffset,
+								L"Keys nested more than " + std::to_wstring(MaxKeyDepth) + L" levels deep.");
+						}
+						break;
+					}
+
+					ParallelFor(threads, level.size(), [&](size_t index, size_t thread)
+					{
+						CheckKey(level[index], m_reports[thread], next[thread]);
+					});
+
+					level.clear();
+					for (std::vector<PendingKey>& keys : next)
+					{
+						level.insert(level.end(), keys.begin(), keys.end());
+						keys.clear();
+					}
+				}
+			}
+
+
+			void CheckKey(const PendingKey& pending, ThreadReport& report, std::vector<PendingKey>& subKeys)
+			{
+				const uint32_t offset = pending.offset;
+				uint32_t size = 0;
+				const uint8_t* nk = Cell(offset, size, pending.referenceOffset, InvalidOffset, L"Key", report);
+				if (nk == nullptr)
+				{
+					return;
+				}
+				const uint64_t cellStart = FileOffset(offset) + 4;
+				if (size < NkName || !HasSignature(nk, "nk") || Get16(nk + NkNameLength) > size - NkName)
+				{
+					Report(report, HiveIssueCode::BadCell, cellStart, offset, L"Invalid key node cell.");
+					return;
+				}
+
+				const uint64_t bit = uint64_t(1) << (offset / 8 % 64);
+				if ((m_keysSeen[offset / 8 / 64].fetch_or(bit) & bit) != 0)
+				{
+					Report(report, HiveIssueCode::KeyLoop, pending.referenceOffset, InvalidOffset,
+						L"Key at offset " + std::to_wstring(offset) + L" referenced more than once.");
+					return;
+				}
+				report.keys++;
+
+				if (pending.parent == InvalidOffset)
+				{
+					if ((Get16(nk + NkFlags) & KeyHiveEntry) == 0)
+					{
+						Report(report, HiveIssueCode::BadCell, cellStart + NkFlags, offset,
+							L"Root key without the hive entry flag.");
+					}
+				}
+				else if (Get32(nk + NkParent) != pending.parent)
+				{
+					Report(report, HiveIssueCode::BadParent, cellStart + NkParent, offset,
+						L"Parent offset " + std::to_wstring(Get32(nk + NkParent)) + L", listed by the key at "
+						+ std::to_wstring(pending.parent) + L".");
+				}
+
+				uint32_t skSize = 0;
+				const uint8_t* sk = Cell(Get32(nk + NkSecurity), skSize, cellStart + NkSecurity, offset, L"Security", report);
+				if (sk != nullptr && (skSize < SkDescriptor || !HasSignature(sk, "sk")
+					|| Get32(sk + SkDescriptorSize) > skSize - SkDescriptor))
+				{
+					Report(report, HiveIssueCode::BadCell, FileOffset(Get32(nk + NkSecurity)) + 4,
+						Get32(nk + NkSecurity), L"Invalid security cell.");
+				}
+
+				const uint16_t classLength = Get16(nk + NkClassLength);
+				if (classLength != 0)
+				{
+					uint32_t classSize = 0;
+					if (Cell(Get32(nk + NkClass), classSize, cellStart + NkClass, offset, L"Class name", report) != nullptr
+						&& classSize < classLength)
+					{
+						Report(report, HiveIssueCode::BadCell, cellStart + NkClassLength, offset,
+							L"Class name longer than its cell.");
+					}
+				}
+
+				CheckValues(nk, offset, report);
+				CheckSubKeyList(nk, offset, report, subKeys);
+			}
+
+
+			void CheckValues(const uint8_t* nk, uint32_t keyOffset, ThreadReport& report) const
+			{
+				const uint64_t keyStart = FileOffset(keyOffset) + 4;
+				const uint32_t count = Get32(nk + NkValueCount);
+				if (count == 0)
+				{
+					return;
+				}
+				uint32_t listSize = 0;
+				const uint32_t listOffset = Get32(nk + NkValueList);
+				const uint8_t* list = Cell(listOffset, listSize, keyStart + NkValueList, keyOffset, L"Value list", report);
+				if (list == nullptr)
+				{
+					return;
+				}
+				if (count > listSize / 4)
+				{
+					Report(report, HiveIssueCode::BadCount, keyStart + NkValueCount, keyOffset,
+						std::to_wstring(count) + L" values, in a list with room for " + std::to_wstring(listSize / 4) + L".");
+					return;
+				}
+
+				for (uint32_t i = 0; i < count; i++)
+				{
+					const uint64_t reference = FileOffset(listOffset) + 4 + i * 4;
+					const uint32_t valueOffset = Get32(list + i * 4);
+					uint32_t size = 0;
+					const uint8_t* vk = Cell(valueOffset, size, reference, listOffset, L"Value", report);
+					if (vk == nullptr)
+					{
+						continue;
+					}
+					const uint64_t valueStart = FileOffset(valueOffset) + 4;
+					if (size < VkName || !HasSignature(vk, "vk") || Get16(vk + VkNameLength) > size - VkName)
+					{
+						Report(report, HiveIssueCode::BadCell, valueStart, valueOffset, L"Invalid value cell.");
+						continue;
+					}
+					report.values++;
+					CheckValueData(vk, valueOffset, report);
+				}
+			}
+
+
+			void CheckValueData(const uint8_t* vk, uint32_t valueOffset, ThreadReport& report) const
+			{
+				const uint64_t valueStart = FileOffset(valueOffset) + 4;
+				const uint32_t rawSize = Get32(vk + VkDataSize);
+				const uint32_t size = rawSize & ~ResidentData;
+				if ((rawSize & ResidentData) != 0)
+				{
+					if (size > 4)
+					{
+						Report(report, HiveIssueCode::BadCell, valueStart + VkDataSize, valueOffset,
+							L"Resident value data longer than 4 bytes.");
+					}
+					return;
+				}
+				if (size == 0)
+				{
+					return;
+				}
+
+				uint32_t cellSize = 0;
+				const uint32_t dataOffset = Get32(vk + VkDataOffset);
+				const uint8_t* cell = Cell(dataOffset, cellSize, valueStart + VkDataOffset, valueOffset, L"Value data", report);
+				if (cell == nullptr)
+				{
+					return;
+				}
+				if (size <= MaxSegmentSize || cellSize < DbSize || !HasSignature(cell, "db"))
+				{
+					if (cellSize < size)
+					{
+						Report(report, HiveIssueCode::BadCell, valueStart + VkDataSize, valueOffset,
+							L"Value data of " + std::to_wstring(size) + L" bytes, in a cell of " + std::to_wstring(cellSize) + L".");
+					}
+					return;
+				}
+
+				// Big data: the segments must hold the data
+				const uint64_t dbStart = FileOffset(dataOffset) + 4;
+				const uint32_t count = Get16(cell + DbCount);
+				if (uint64_t(count) * MaxSegmentSize < size)
+				{
+					Report(report, HiveIssueCode::BadCount, dbStart + DbCount, dataOffset,
+						std::to_wstring(count) + L" big data segments, for " + std::to_wstring(size) + L" bytes.");
+					return;
+				}
+				uint32_t listSize = 0;
+				const uint32_t listOffset = Get32(cell + DbSegmentList);
+				const uint8_t* list = Cell(listOffset, listSize, dbStart + DbSegmentList, dataOffset, L"Segment list", report);
+				if (list == nullptr)
+				{
+					return;
+				}
+				if (count > listSize / 4)
+				{
+					Report(report, HiveIssueCode::BadCount, dbStart + DbCount, dataOffset,
+						L"Segment list shorter than the segment count.");
+					return;
+				}
+				uint32_t remaining = size;
+				for (uint32_t i = 0; i < count && remaining != 0; i++)
+				{
+					uint32_t segmentSize = 0;
+					if (Cell(Get32(list + i * 4), segmentSize, FileOffset(listOffset) + 4 + i * 4, listOffset,
+						L"Segment", report) == nullptr)
+					{
+						return;
+					}
+					const uint32_t expected = (std::min)(remaining, MaxSegmentSize);
+					if (segmentSize < expected)
+					{
+						Report(report, HiveIssueCode::BadCell, FileOffset(Get32(list + i * 4)), Get32(list + i * 4),
+							L"Big data segment shorter than its data.");
+						return;
+					}
+					remaining -= expected;
+				}
+			}
+
+
+			// The sub-key lists, the names of the sub-keys, and their order
+			void CheckSubKeyList(const uint8_t* nk, uint32_t keyOffset, ThreadReport& report,
+				std::vector<PendingKey>& subKeys) const
+			{
+				const uint64_t keyStart = FileOffset(keyOffset) + 4;
+				const uint32_t count = Get32(nk + NkSubKeyCount);
+				if (count == 0)
+				{
+					return;
+				}
+
+				uint32_t listSize = 0;
+				const uint32_t listOffset = Get32(nk + NkSubKeyList);
+				const uint8_t* list = Cell(listOffset, listSize, keyStart + NkSubKeyList, keyOffset, L"Sub-key list", report);
+				if (list == nullptr)
+				{
+					return;
+				}
+
+				// The leaves: the list itself, or the lists of an index
+				std::vector<uint32_t> leaves;
+				if (listSize >= 4 && HasSignature(list, "ri"))
+				{
+					const uint32_t leafCount = Get16(list + 2);
+					if (leafCount > (listSize - 4) / 4)
+					{
+						Report(report, HiveIssueCode::BadCount, FileOffset(listOffset) + 6, listOffset,
+							L"Sub-key index longer than its cell.");
+						return;
+					}
+					for (uint32_t i = 0; i < leafCount; i++)
+					{
+						leaves.push_back(Get32(list + 4 + i * 4));
+					}
+				}
+				else
+				{
+					leaves.push_back(InvalidOffset);        // the list itself
+				}
+
+				uint32_t found = 0;
+				std::wstring previous;
+				for (size_t leaf = 0; leaf < leaves.size(); leaf++)
+				{
+					uint32_t leafOffset = listOffset;
+					const uint8_t* leafList = list;
+					uint32_t leafSize = listSize;
+					if (leaves[leaf] != InvalidOffset)
+					{
+						leafOffset = leaves[leaf];
+						leafList = Cell(leafOffset, leafSize, FileOffset(listOffset) + 8 + leaf * 4, listOffset,
+							L"Sub-key list", report);
+						if (leafList == nullptr)
+						{
+							continue;
+						}
+					}
+
+					const uint64_t leafStart = FileOffset(leafOffset) + 4;
+					const uint32_t entrySize = (leafSize < 4) ? 0 : HasSignature(leafList, "li") ? 4
+						: (HasSignature(leafList, "lf") || HasSignature(leafList, "lh")) ? 8 : 0;
+					if (entrySize == 0)
+					{
+						Report(report, HiveIssueCode::BadCell, leafStart, leafOffset, L"Invalid sub-key list cell.");
+						continue;
+					}
+					const uint32_t entries = Get16(leafList + 2);
+					if (entries > (leafSize - 4) / entrySize)
+					{
+						Report(report, HiveIssueCode::BadCount, leafStart + 2, leafOffset,
+							L"Sub-key list longer than its cell.");
+						continue;
+					}
+
+					for (uint32_t i = 0; i < entries; i++)
+					{
+						const uint8_t* entry = leafList + 4 + i * entrySize;
+						const uint64_t reference = leafStart + 4 + i * entrySize;
+						const uint32_t subKeyOffset = Get32(entry);
+						found++;
+						if (subKeyOffset == m_rootCell)
+						{
+							Report(report, HiveIssueCode::KeyLoop, reference, leafOffset,
+								L"Sub-key list referencing the root key.");
+							continue;
+						}
+
+						uint32_t size = 0;
+						const uint8_t* subKey = Cell(subKeyOffset, size, reference, leafOffset, L"Sub-key", report);
+						if (subKey == nullptr)
+						{
+							continue;
+						}
+						if (size < NkName || !HasSignature(subKey, "nk") || Get16(subKey + NkNameLength) > size - NkName)
+						{
+							Report(report, HiveIssueCode::BadCell, FileOffset(subKeyOffset) + 4, subKeyOffset,
+								L"Invalid key node cell.");
+							continue;
+						}
+
+						const bool compressed = (Get16(subKey + NkFlags) & KeyCompressedName) != 0;
+						std::wstring name = DecodeName(subKey + NkName, Get16(subKey + NkNameLength), compressed);
+						if (found > 1 && CompareNames(previous, name) >= 0)
+						{
+							Report(report, HiveIssueCode::UnsortedList, reference, leafOffset,
+								L"Sub-key \"" + name + L"\" out of order, after \"" + previous + L"\".");
+						}
+						if (HasSignature(leafList, "lh") && Get32(entry + 4) != NameHash(name))
+						{
+							Report(report, HiveIssueCode::BadHash, reference + 4, leafOffset,
+								L"Hash not matching the name \"" + name + L"\".");
+						}
+						else if (HasSignature(leafList, "lf") && !HintMatches(entry + 4, subKey + NkName,
+							Get16(subKey + NkNameLength), compressed))
+						{
+							Report(report, HiveIssueCode::BadHash, reference + 4, leafOffset,
+								L"Name hint not matching the name \"" + name + L"\".");
+						}
+						previous = std::move(name);
+						subKeys.push_back(PendingKey{ subKeyOffset, keyOffset, reference });
+					}
+				}
+
+				if (found != count)
+				{
+					Report(report, HiveIssueCode::BadCount, keyStart + NkSubKeyCount, keyOffset,
+						std::to_wstring(count) + L" sub-keys, " + std::to_wstring(found) + L" in the lists.");
+				}
+			}
+
+
+			// "lf" hints: the first 4 characters of the name, as stored (zero-padded)
+			static bool HintMatches(const uint8_t* hint, const uint8_t* name, uint16_t length, bool compressed) noexcept
+			{
+				uint8_t expected[4] = {};
+				if (compressed)
+				{
+					memcpy(expected, name, (std::min)(length, uint16_t(4)));
+				}
+				else
+				{
+					// The low bytes of the first UTF-16 units
+					for (uint16_t i = 0; i < 4 && i * 2 < length; i++)
+					{
+						expected[i] = name[i * 2];
+					}
+				}
+				return memcmp(hint, expected, 4) == 0;
+			}
+		};
+
+	} // namespace hive_verify_detail
+
+
+	//------------------------------------------------------------------------------
+	// Checks a hive file in memory (see the notes at the top of this file).
+	// Problems are reported in the results: only allocation failures throw.
+	//------------------------------------------------------------------------------
+	inline HiveVerifyResult VerifyHive(const void* data, size_t size, const HiveVerifyOptions& options = {})
+	{
+		_ASSERTE(data != nullptr || size == 0);
+		return hive_verify_detail::Verifier(static_cast<const uint8_t*>(data), size, options).Run();
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Checks a hive file, mapped in memory.
+	// Throws std::runtime_error if the file can't be mapped.
+	//------------------------------------------------------------------------------
+	inline HiveVerifyResult VerifyHiveFile(const std::filesystem::path& fileName, const HiveVerifyOptions& options = {})
+	{
+		const MappedFile file(fileName);
+		return VerifyHive(file.Data(), file.Size(), options);
+	}
+
+} // namespace winreg
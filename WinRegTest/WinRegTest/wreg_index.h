@@ -0,0 +1,798 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_index.h
+// DESC: Persistent inverted index for substring searches in registry value data.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// ValueIndexBuilder walks a key tree once (or is fed values from any other
+// source, e.g. an offline hive) and writes an index file; ValueIndex maps that
+// file in memory and answers case-insensitive substring queries on the data of
+// REG_SZ, REG_EXPAND_SZ, REG_MULTI_SZ and REG_BINARY values, returning the
+// (key path, value name) pairs containing the searched text.
+//
+// The searchable text of a value is:
+//
+//  - REG_SZ, REG_EXPAND_SZ     the string
+//  - REG_MULTI_SZ              the strings, separated by NULs
+//  - REG_BINARY                the bytes, each taken as a Latin-1 character
+//
+// upper-cased, and encoded in UTF-8 (code units not forming valid UTF-16
+// surrogate pairs are encoded one by one). The index maps each trigram (three
+// consecutive bytes) of these texts to the sorted list of values containing it.
+// A query looks up the trigrams of the searched text, intersects their lists
+// (shortest first), then confirms the candidates against the stored texts, so
+// results are exact. Queries shorter than a trigram scan all the texts.
+//
+// The file stores each key's last-write time: a builder created from an
+// existing index re-reads only the keys whose last-write time has changed.
+//
+// File layout (little-endian, sections aligned to 8 bytes):
+//
+//  IndexHeader
+//  IndexKeyEntry[keyCount]         key paths and last-write times
+//  IndexValueEntry[valueCount]     value names, types and texts
+//  IndexTermEntry[termCount]       trigrams, sorted, with their posting lists
+//  uint32_t[postingCount]          value indexes, sorted within each list
+//  char[stringsSize]               UTF-8 key paths, value names and texts
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include "wreg_file.h"  // MappedFile, OpenFile()
+#include <algorithm>    // std::sort, std::search, std::set_intersection
+#include <cstddef>      // offsetof
+#include <cstdint>      // uint32_t, uint64_t
+#include <cstdio>       // fwrite()
+#include <cstring>      // memcpy(), memcmp()
+#include <functional>   // std::boyer_moore_horspool_searcher
+#include <map>          // std::map
+#include <memory>       // std::shared_ptr
+#include <set>          // std::set
+#include <stdexcept>    // std::runtime_error
+#include <string>       // std::wstring, std::string
+#include <unordered_map>// std::unordered_map
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// On-disk structures of the index file
+	//------------------------------------------------------------------------------
+	struct IndexHeader
+	{
+		char magic[8];              // "WRIDX001"
+		uint64_t keyCount;
+		uint64_t valueCount;
+		uint64_t termCount;
+		uint64_t postingCount;
+		uint64_t stringsSize;
+		uint64_t fileSize;
+	};
+
+	struct IndexKeyEntry
+	{
+		uint64_t pathOffset;        // in the strings section
+		uint64_t pathSize;
+		uint64_t lastWriteTime;     // FILETIME
+	};
+
+	struct IndexValueEntry
+	{
+		uint32_t key;               // index of the key entry
+		uint32_t type;              // REG_SZ, etc.
+		uint64_t nameOffset;
+		uint64_t nameSize;
+		uint64_t textOffset;
+		uint64_t textSize;
+	};
+
+	struct IndexTermEntry
+	{
+		uint32_t trigram;           // three bytes, the first one in the high byte
+		uint32_t postingCount;
+		uint64_t postingOffset;     // index of the first posting
+	};
+
+
+	//------------------------------------------------------------------------------
+	// A value found by ValueIndex::Find()
+	//------------------------------------------------------------------------------
+	struct ValueIndexMatch
+	{
+		std::wstring keyPath;
+		std::wstring valueName;
+		DWORD type;
+	};
+
+
+	namespace index_detail
+	{
+		// Appends a code unit (or a code point, for 32-bit wchar_t) as UTF-8
+		inline void AppendUtf8(std::string& out, uint32_t cp)
+		{
+			if (cp < 0x80)
+			{
+				out.push_back(static_cast<char>(cp));
+			}
+			else if (cp < 0x800)
+			{
+				out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+				out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+			}
+			else if (cp < 0x10000)
+			{
+				out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+				out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+				out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+			}
+			else
+			{
+				out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+				out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+				out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+				out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+			}
+		}
+
+
+		// Encodes a wide string in UTF-8, optionally upper-casing it
+		inline std::string ToUtf8(std::wstring_view str, bool fold)
+		{
+			std::string out;
+			out.reserve(str.size());
+			for (size_t i = 0; i < str.size(); i++)
+			{
+				uint32_t cp = static_cast<uint32_t>(fold ? ::towupper(str[i]) : str[i]);
+
+				// Combine UTF-16 surrogate pairs
+				if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp <= 0xDBFF && i + 1 < str.size()
+					&& str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF)
+				{
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (static_cast<uint32_t>(str[i + 1]) - 0xDC00);
+					i++;
+				}
+				AppendUtf8(out, cp);
+			}
+			return out;
+		}
+
+
+		inline std::wstring FromUtf8(const char* data, size_t size)
+		{
+			std::wstring out;
+			out.reserve(size);
+			for (size_t i = 0; i < size; )
+			{
+				const unsigned char c = static_cast<unsigned char>(data[i]);
+				uint32_t cp = c;
+				size_t length = 1;
+				if (c >= 0xF0)      { cp = c & 0x07; length = 4; }
+				else if (c >= 0xE0) { cp = c & 0x0F; length = 3; }
+				else if (c >= 0xC0) { cp = c & 0x1F; length = 2; }
+
+				for (size_t j = 1; j < length && i + j < size; j++)
+				{
+					cp = (cp << 6) | (static_cast<unsigned char>(data[i + j]) & 0x3F);
+				}
+				i += length;
+
+				if (sizeof(wchar_t) == 2 && cp >= 0x10000)
+				{
+					cp -= 0x10000;
+					out.push_back(static_cast<wchar_t>(0xD800 + (cp >> 10)));
+					out.push_back(static_cast<wchar_t>(0xDC00 + (cp & 0x3FF)));
+				}
+				else
+				{
+					out.push_back(static_cast<wchar_t>(cp));
+				}
+			}
+			return out;
+		}
+
+
+		inline bool IsIndexedType(DWORD type)
+		{
+			return type == REG_SZ || type == REG_EXPAND_SZ || type == REG_MULTI_SZ || type == REG_BINARY;
+		}
+
+
+		// Searchable text of a value (see the notes at the top of this file)
+		inline std::string ValueText(const RegValue& value)
+		{
+			switch (value.GetType())
+			{
+			case REG_SZ:        return ToUtf8(value.String(), true);
+			case REG_EXPAND_SZ: return ToUtf8(value.ExpandString(), true);
+
+			case REG_MULTI_SZ:
+			{
+				std::string text;
+				const std::vector<std::wstring>& strings = value.MultiString();
+				for (size_t i = 0; i < strings.size(); i++)
+				{
+					if (i != 0)
+					{
+						text.push_back('\0');
+					}
+					text += ToUtf8(strings[i], true);
+				}
+				return text;
+			}
+
+			case REG_BINARY:
+			{
+				const std::vector<BYTE>& data = value.Binary();
+				return ToUtf8(std::wstring(data.begin(), data.end()), true);
+			}
+
+			default:
+				return std::string();
+			}
+		}
+
+
+		inline uint32_t Trigram(const char* p)
+		{
+			return (static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16)
+				| (static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8)
+				| static_cast<uint32_t>(static_cast<unsigned char>(p[2]));
+		}
+
+
+		inline std::vector<uint32_t> Trigrams(const std::string& text)
+		{
+			std::vector<uint32_t> grams;
+			for (size_t i = 0; i + 3 <= text.size(); i++)
+			{
+				grams.push_back(Trigram(text.data() + i));
+			}
+			std::sort(grams.begin(), grams.end());
+			grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+			return grams;
+		}
+
+
+		inline size_t AlignUp(size_t size)
+		{
+			return (size + 7) & ~size_t(7);
+		}
+
+	} // namespace index_detail
+
+
+	//------------------------------------------------------------------------------
+	// Read-only view of an index file, normally memory-mapped.
+	// Copies share the same mapping.
+	//------------------------------------------------------------------------------
+	class ValueIndex
+	{
+	public:
+
+		// Maps an index file in memory.
+		// Throws std::runtime_error if the file can't be read or isn't a valid index.
+		static ValueIndex Open(const std::wstring& fileName)
+		{
+			auto file = std::make_shared<MappedFile>(fileName);
+			return ValueIndex(file, file->Data(), file->Size());
+		}
+
+
+		// Uses an index already in memory (e.g. from ValueIndexBuilder::Serialize()).
+		static ValueIndex FromBuffer(std::vector<BYTE> buffer)
+		{
+			auto owned = std::make_shared<std::vector<BYTE>>(std::move(buffer));
+			return ValueIndex(owned, reinterpret_cast<const char*>(owned->data()), owned->size());
+		}
+
+
+		size_t KeyCount() const noexcept { return static_cast<size_t>(m_header->keyCount); }
+		size_t ValueCount() const noexcept { return static_cast<size_t>(m_header->valueCount); }
+
+
+		// Finds the values whose data contains the given text, ignoring case
+		std::vector<ValueIndexMatch> Find(std::wstring_view text) const
+		{
+			return FindFolded(index_detail::ToUtf8(text, true));
+		}
+
+
+		// Finds the REG_BINARY values containing the given bytes.
+		// (Like the data, the bytes are compared ignoring the case of Latin-1 letters.)
+		std::vector<ValueIndexMatch> FindBytes(const BYTE* data, size_t size) const
+		{
+			return FindFolded(index_detail::ToUtf8(std::wstring(data, data + size), true), REG_BINARY);
+		}
+
+
+		//
+		// Raw access, used by ValueIndexBuilder to update an existing index
+		//
+
+		const IndexKeyEntry& Key(size_t index) const { return m_keys[index]; }
+		const IndexValueEntry& Value(size_t index) const { return m_values[index]; }
+
+		std::wstring KeyPath(size_t index) const
+		{
+			return index_detail::FromUtf8(m_strings + m_keys[index].pathOffset,
+				static_cast<size_t>(m_keys[index].pathSize));
+		}
+
+		std::wstring ValueName(size_t index) const
+		{
+			return index_detail::FromUtf8(m_strings + m_values[index].nameOffset,
+				static_cast<size_t>(m_values[index].nameSize));
+		}
+
+		std::string ValueText(size_t index) const
+		{
+			return std::string(m_strings + m_values[index].textOffset,
+				static_cast<size_t>(m_values[index].textSize));
+		}
+
+	private:
+		std::shared_ptr<const void> m_owner;    // mapping or buffer holding the data
+		const IndexHeader* m_header = nullptr;
+		const IndexKeyEntry* m_keys = nullptr;
+		const IndexValueEntry* m_values = nullptr;
+		const IndexTermEntry* m_terms = nullptr;
+		const uint32_t* m_postings = nullptr;
+		const char* m_strings = nullptr;
+
+
+		ValueIndex(std::shared_ptr<const void> owner, const char* data, size_t size)
+			: m_owner(std::move(owner))
+		{
+			using index_detail::AlignUp;
+
+			if (size < sizeof(IndexHeader) || memcmp(data, "WRIDX001", 8) != 0)
+			{
+				throw std::runtime_error("ValueIndex: not an index file.");
+			}
+
+			m_header = reinterpret_cast<const IndexHeader*>(data);
+			const IndexHeader& h = *m_header;
+
+			// Check that all sections fit in the file, before trusting any offset
+			const uint64_t counts[] = { 1, h.keyCount, h.valueCount, h.termCount, h.postingCount,
+				h.stringsSize };
+			const uint64_t entrySizes[] = { sizeof(IndexHeader), sizeof(IndexKeyEntry),
+				sizeof(IndexValueEntry), sizeof(IndexTermEntry), sizeof(uint32_t), 1 };
+			uint64_t offsets[6] = {};
+			uint64_t end = 0;
+			for (int i = 0; i < 6; i++)
+			{
+				if (counts[i] > size / entrySizes[i])
+				{
+					throw std::runtime_error("ValueIndex: corrupted index file.");
+				}
+				offsets[i] = end;
+				end = AlignUp(static_cast<size_t>(end + counts[i] * entrySizes[i]));
+			}
+			if (h.fileSize != size || end > size)
+			{
+				throw std::runtime_error("ValueIndex: corrupted index file.");
+			}
+
+			m_keys = reinterpret_cast<const IndexKeyEntry*>(data + offsets[1]);
+			m_values = reinterpret_cast<const IndexValueEntry*>(data + offsets[2]);
+			m_terms = reinterpret_cast<const IndexTermEntry*>(data + offsets[3]);
+			m_postings = reinterpret_cast<const uint32_t*>(data + offsets[4]);
+			m_strings = data + offsets[5];
+
+			for (uint64_t i = 0; i < h.keyCount; i++)
+			{
+				CheckString(m_keys[i].pathOffset, m_keys[i].pathSize);
+			}
+			for (uint64_t i = 0; i < h.valueCount; i++)
+			{
+				if (m_values[i].key >= h.keyCount)
+				{
+					throw std::runtime_error("ValueIndex: corrupted index file.");
+				}
+				CheckString(m_values[i].nameOffset, m_values[i].nameSize);
+				CheckString(m_values[i].textOffset, m_values[i].textSize);
+			}
+			// Terms sorted by trigram (FindTerm() searches them), their postings in range
+			// and sorted by value (intersected as sorted lists)
+			for (uint64_t i = 0; i < h.termCount; i++)
+			{
+				const IndexTermEntry& term = m_terms[i];
+				if (term.postingOffset > h.postingCount || term.postingCount > h.postingCount - term.postingOffset
+					|| (i > 0 && m_terms[i - 1].trigram >= term.trigram))
+				{
+					throw std::runtime_error("ValueIndex: corrupted index file.");
+				}
+				const uint32_t* postings = m_postings + term.postingOffset;
+				for (uint32_t j = 0; j < term.postingCount; j++)
+				{
+					if (postings[j] >= h.valueCount || (j > 0 && postings[j - 1] >= postings[j]))
+					{
+						throw std::runtime_error("ValueIndex: corrupted index file.");
+					}
+				}
+			}
+		}
+
+
+		void CheckString(uint64_t offset, uint64_t size) const
+		{
+			if (offset > m_header->stringsSize || size > m_header->stringsSize - offset)
+			{
+				throw std::runtime_error("ValueIndex: corrupted index file.");
+			}
+		}
+
+
+		const IndexTermEntry* FindTerm(uint32_t trigram) const
+		{
+			const IndexTermEntry* end = m_terms + m_header->termCount;
+			const IndexTermEntry* it = std::lower_bound(m_terms, end, trigram,
+				[](const IndexTermEntry& term, uint32_t value) { return term.trigram < value; });
+			return (it != end && it->trigram == trigram) ? it : nullptr;
+		}
+
+
+		std::vector<ValueIndexMatch> FindFolded(const std::string& needle, DWORD onlyType = REG_NONE) const
+		{
+			std::vector<uint32_t> candidates;
+
+			if (needle.size() < 3)
+			{
+				// Too short for the trigram lists: check every value
+				candidates.resize(static_cast<size_t>(m_header->valueCount));
+				for (size_t i = 0; i < candidates.size(); i++)
+				{
+					candidates[i] = static_cast<uint32_t>(i);
+				}
+			}
+			else
+			{
+				std::vector<const IndexTermEntry*> terms;
+				for (uint32_t gram : index_detail::Trigrams(needle))
+				{
+					const IndexTermEntry* term = FindTerm(gram);
+					if (term == nullptr)
+					{
+						return {};
+					}
+					terms.push_back(term);
+				}
+
+				// Intersect the shortest lists first
+				std::sort(terms.begin(), terms.end(),
+					[](const IndexTermEntry* a, const IndexTermEntry* b)
+				{
+					return a->postingCount < b->postingCount;
+				});
+
+				const uint32_t* first = m_postings + terms[0]->postingOffset;
+				candidates.assign(first, first + terms[0]->postingCount);
+
+				std::vector<uint32_t> narrowed;
+				for (size_t i = 1; i < terms.size() && !candidates.empty(); i++)
+				{
+					const uint32_t* postings = m_postings + terms[i]->postingOffset;
+					narrowed.clear();
+					std::set_intersection(candidates.begin(), candidates.end(),
+						postings, postings + terms[i]->postingCount, std::back_inserter(narrowed));
+					candidates.swap(narrowed);
+				}
+			}
+
+			// Confirm the candidates: the trigrams may be there, but not next to each other
+			const std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher(
+				needle.begin(), needle.end());
+
+			std::vector<ValueIndexMatch> matches;
+			for (uint32_t candidate : candidates)
+			{
+				const IndexValueEntry& value = m_values[candidate];
+				if (onlyType != REG_NONE && value.type != onlyType)
+				{
+					continue;
+				}
+
+				const char* text = m_strings + value.textOffset;
+				const char* textEnd = text + value.textSize;
+				if (std::search(text, textEnd, searcher) != textEnd || needle.empty())
+				{
+					matches.push_back(ValueIndexMatch{ KeyPath(value.key), ValueName(candidate),
+						value.type });
+				}
+			}
+			return matches;
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Builds (or updates) a ValueIndex.
+	//------------------------------------------------------------------------------
+	class ValueIndexBuilder
+	{
+	public:
+
+		// Counters of an AddTree() walk
+		struct UpdateStats
+		{
+			size_t keysRead = 0;        // keys whose values were (re-)read
+			size_t keysUnchanged = 0;   // keys skipped, as their last-write time didn't change
+			size_t keysRemoved = 0;     // keys no longer in the registry
+		};
+
+
+		ValueIndexBuilder() = default;
+
+
+		// Starts from the content of an existing index, to update it incrementally
+		explicit ValueIndexBuilder(const ValueIndex& existing)
+		{
+			for (size_t k = 0; k < existing.KeyCount(); k++)
+			{
+				m_keys[existing.KeyPath(k)].lastWriteTime = existing.Key(k).lastWriteTime;
+			}
+			for (size_t v = 0; v < existing.ValueCount(); v++)
+			{
+				const IndexValueEntry& entry = existing.Value(v);
+				m_keys[existing.KeyPath(entry.key)].values.push_back(
+					IndexedValue{ existing.ValueName(v), entry.type, existing.ValueText(v) });
+			}
+		}
+
+
+		// Adds a key with its values, replacing what was indexed for it.
+		// Values of types that aren't indexed are ignored.
+		void SetKey(const std::wstring& keyPath, uint64_t lastWriteTime,
+			const std::vector<RegValue>& values)
+		{
+			KeyRecord& record = m_keys[keyPath];
+			record.lastWriteTime = lastWriteTime;
+			record.values.clear();
+			for (const RegValue& value : values)
+			{
+				if (index_detail::IsIndexedType(value.GetType()))
+				{
+					record.values.push_back(IndexedValue{ value.name(), value.GetType(),
+						index_detail::ValueText(value) });
+				}
+			}
+		}
+
+
+		void RemoveKey(const std::wstring& keyPath)
+		{
+			m_keys.erase(keyPath);
+		}
+
+
+		//
+		// Indexes the tree below hKey, whose keys are recorded as rootPath\...
+		//
+		// Keys already indexed with the same last-write time keep their indexed values,
+		// without reading them again; keys indexed below rootPath that no longer exist
+		// are removed. Keys that can't be opened are skipped.
+		//
+		UpdateStats AddTree(HKEY hKey, const std::wstring& rootPath)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			UpdateStats stats;
+			std::set<std::wstring> seen;
+			Visit(hKey, rootPath, seen, stats);
+
+			const std::wstring prefix = rootPath + L"\\";
+			for (auto it = m_keys.lower_bound(rootPath); it != m_keys.end(); )
+			{
+				const bool below = rootPath.empty() || (it->first == rootPath)
+					|| (it->first.compare(0, prefix.size(), prefix) == 0);
+				if (!below && it->first > prefix)
+				{
+					break;
+				}
+				if (below && seen.count(it->first) == 0)
+				{
+					it = m_keys.erase(it);
+					stats.keysRemoved++;
+				}
+				else
+				{
+					++it;
+				}
+			}
+			return stats;
+		}
+
+
+		// Lays out the index file in memory
+		std::vector<BYTE> Serialize() const
+		{
+			using index_detail::AlignUp;
+
+			std::vector<IndexKeyEntry> keys;
+			std::vector<IndexValueEntry> values;
+			std::string strings;
+			std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+
+			for (const auto& key : m_keys)
+			{
+				const uint32_t keyIndex = static_cast<uint32_t>(keys.size());
+				const std::string path = index_detail::ToUtf8(key.first, false);
+				keys.push_back(IndexKeyEntry{ strings.size(), path.size(), key.second.lastWriteTime });
+				strings += path;
+
+				for (const IndexedValue& value : key.second.values)
+				{
+					const uint32_t valueIndex = static_cast<uint32_t>(values.size());
+					const std::string name = index_detail::ToUtf8(value.name, false);
+
+					IndexValueEntry entry = {};
+					entry.key = keyIndex;
+					entry.type = value.type;
+					entry.nameOffset = strings.size();
+					entry.nameSize = name.size();
+					strings += name;
+					entry.textOffset = strings.size();
+					entry.textSize = value.text.size();
+					strings += value.text;
+					values.push_back(entry);
+
+					// Values are visited in order, so each posting list is sorted
+					for (uint32_t gram : index_detail::Trigrams(value.text))
+					{
+						postings[gram].push_back(valueIndex);
+					}
+				}
+			}
+
+			std::vector<uint32_t> grams;
+			grams.reserve(postings.size());
+			for (const auto& p : postings)
+			{
+				grams.push_back(p.first);
+			}
+			std::sort(grams.begin(), grams.end());
+
+			std::vector<IndexTermEntry> terms;
+			std::vector<uint32_t> allPostings;
+			for (uint32_t gram : grams)
+			{
+				const std::vector<uint32_t>& list = postings[gram];
+				terms.push_back(IndexTermEntry{ gram, static_cast<uint32_t>(list.size()), allPostings.size() });
+				allPostings.insert(allPostings.end(), list.begin(), list.end());
+			}
+
+			IndexHeader header = {};
+			memcpy(header.magic, "WRIDX001", 8);
+			header.keyCount = keys.size();
+			header.valueCount = values.size();
+			header.termCount = terms.size();
+			header.postingCount = allPostings.size();
+			header.stringsSize = strings.size();
+
+			std::vector<BYTE> file;
+			auto append = [&file](const void* data, size_t size)
+			{
+				const BYTE* p = static_cast<const BYTE*>(data);
+				file.insert(file.end(), p, p + size);
+				file.resize(AlignUp(file.size()));
+			};
+			append(&header, sizeof(header));
+			append(keys.data(), keys.size() * sizeof(IndexKeyEntry));
+			append(values.data(), values.size() * sizeof(IndexValueEntry));
+			append(terms.data(), terms.size() * sizeof(IndexTermEntry));
+			append(allPostings.data(), allPostings.size() * sizeof(uint32_t));
+			append(strings.data(), strings.size());
+
+			const uint64_t fileSize = file.size();
+			memcpy(file.data() + offsetof(IndexHeader, fileSize), &fileSize, sizeof(fileSize));
+			return file;
+		}
+
+
+		// Writes the index file.
+		// Throws std::runtime_error if the file can't be written.
+		void Save(const std::wstring& fileName) const
+		{
+			const std::vector<BYTE> file = Serialize();
+
+			FILE* f = OpenFile(fileName, "wb");
+			if (f == nullptr)
+			{
+				throw std::runtime_error("ValueIndexBuilder: can't create the index file.");
+			}
+			const size_t written = fwrite(file.data(), 1, file.size(), f);
+			const bool closed = (fclose(f) == 0);
+			if (written != file.size() || !closed)
+			{
+				throw std::runtime_error("ValueIndexBuilder: can't write the index file.");
+			}
+		}
+
+	private:
+
+		struct IndexedValue
+		{
+			std::wstring name;
+			DWORD type;
+			std::string text;       // searchable text
+		};
+
+		struct KeyRecord
+		{
+			uint64_t lastWriteTime = 0;
+			std::vector<IndexedValue> values;
+		};
+
+		std::map<std::wstring, KeyRecord> m_keys;
+
+
+		void Visit(HKEY hKey, const std::wstring& path, std::set<std::wstring>& seen, UpdateStats& stats)
+		{
+			FILETIME lastWrite = {};
+			LONG result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+				nullptr, nullptr, nullptr, nullptr, &lastWrite);
+			if (result != ERROR_SUCCESS)
+			{
+				return;
+			}
+			const uint64_t lastWriteTime =
+				(static_cast<uint64_t>(lastWrite.dwHighDateTime) << 32) | lastWrite.dwLowDateTime;
+
+			seen.insert(path);
+
+			auto it = m_keys.find(path);
+			if (it != m_keys.end() && it->second.lastWriteTime == lastWriteTime)
+			{
+				stats.keysUnchanged++;
+			}
+			else
+			{
+				const DWORD indexedTypes = ValueTypeMask(REG_SZ) | ValueTypeMask(REG_EXPAND_SZ)
+					| ValueTypeMask(REG_MULTI_SZ) | ValueTypeMask(REG_BINARY);
+				try
+				{
+					SetKey(path, lastWriteTime, EnumerateValues(hKey, indexedTypes));
+					stats.keysRead++;
+				}
+				catch (const RegException&)
+				{
+					seen.erase(path);   // e.g. deleted meanwhile
+					return;
+				}
+			}
+
+			// Values changed in sub-keys don't update the parent's last-write time:
+			// sub-keys are always visited.
+			std::vector<std::wstring> subkeyNames;
+			try
+			{
+				subkeyNames = EnumerateSubKeyNames(hKey);
+			}
+			catch (const RegException&)
+			{
+				return;
+			}
+
+			for (const std::wstring& name : subkeyNames)
+			{
+				HKEY hSubKey = nullptr;
+				if (::RegOpenKeyEx(hKey, name.c_str(), 0, KEY_READ, &hSubKey) != ERROR_SUCCESS)
+				{
+					continue;
+				}
+				RegKey subKey(hSubKey);
+				Visit(subKey.Handle(), path.empty() ? name : path + L"\\" + name, seen, stats);
+			}
+		}
+	};
+
+} // namespace winreg
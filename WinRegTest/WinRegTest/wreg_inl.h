@@ -0,0 +1,1206 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_inl.h
+// DESC: Definitions of the non-template functions declared in wreg.h.
+//       Compiled once, in wreg.cpp; or included by wreg.h as inline
+//       functions, when WINREG_HEADER_ONLY is defined.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "wreg.h"       // WinReg public header
+#include "wreg_internal.h" // helpers declared for this file only
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	//                      Non-Member Functions and Private Helpers
+	//------------------------------------------------------------------------------
+
+
+	namespace detail
+	{
+		WINREG_INLINE DWORD SafeSizeToDwordCast(size_t size)
+		{
+	#if defined(_WIN64) || (!defined(_WIN32) && (SIZE_MAX > UINT32_MAX))
+			if (size > static_cast<size_t>((std::numeric_limits<DWORD>::max)()))
+			{
+				throw std::overflow_error(
+					"SafeSizeToDwordCast(): Input size_t too long, it doesn't fit in a DWORD.");
+			}
+
+			// This cast is now safe
+			return static_cast<DWORD>(size);
+	#else
+			// Just fine in 32-bit builds
+			return size;
+	#endif
+		}
+
+
+		WINREG_INLINE winreg::RegValue ReadValueDwordInternal(HKEY hKey, const std::wstring& valueName)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			DWORD valueData = 0;
+			DWORD valueSize = sizeof(valueData);
+
+			LONG result = ::RegQueryValueEx(
+				hKey,
+				valueName.c_str(),
+				nullptr, // reserved
+				nullptr, // type not required in this helper: we're called as dispatching by QueryValue()
+				reinterpret_cast<BYTE*>(&valueData),   // where data will be read
+				&valueSize
+			);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_DWORD value.", result);
+			}
+			_ASSERTE(valueSize == sizeof(DWORD)); // we read a DWORD
+
+			winreg::RegValue value(valueName, REG_DWORD);
+			value.Dword() = valueData;
+			return value;
+		}
+
+
+		WINREG_INLINE winreg::RegValue ReadValueStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			// valueSize is in bytes, we need string length in wchar_ts
+			const DWORD stringBufferLenInWchars = valueSize / sizeof(wchar_t);
+
+			// Make room for result string
+			std::wstring str;
+			str.resize(stringBufferLenInWchars);
+
+			DWORD sizeInBytes = valueSize;
+
+			LONG result = ::RegQueryValueEx(
+				hKey,
+				valueName.c_str(),
+				nullptr, // reserved
+				nullptr, // not interested in type (we know it's REG_SZ)
+				reinterpret_cast<BYTE*>(&str[0]),   // where data will be read
+				&sizeInBytes
+			);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_SZ value.", result);
+			}
+
+			//
+			// In the remarks section of RegQueryValueEx()
+			//
+			// https://msdn.microsoft.com/en-us/library/windows/desktop/ms724911(v=vs.85).aspx
+			//
+			// they specify that we should check if the string is NUL-terminated, and if it isn't,
+			// we must add a NUL-terminator.
+			//
+			if (str[stringBufferLenInWchars - 1] == L'\0')
+			{
+				// Strip off the NUL-terminator written by the API
+				str.resize(stringBufferLenInWchars - 1);
+			}
+			// The API didn't write a NUL terminator, at the end of the string, which is just fine,
+			// as wstrings are automatically NUL-terminated.
+
+			winreg::RegValue value(valueName,REG_SZ);
+			value.String() = str;
+			return value;
+		}
+
+
+		WINREG_INLINE winreg::RegValue ReadValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		{
+			// Almost copy-and-paste from ReadValueStringInternal()
+			_ASSERTE(hKey != nullptr);
+
+			// valueSize is in bytes, we need string length in wchar_ts
+			const DWORD stringBufferLenInWchars = valueSize / sizeof(wchar_t);
+
+			// Make room for result string
+			std::wstring str;
+			str.resize(stringBufferLenInWchars);
+			DWORD sizeInBytes = valueSize;
+
+			LONG result = ::RegQueryValueEx(
+				hKey,
+				valueName.c_str(),
+				nullptr, // reserved
+				nullptr, // not interested in type (we know it's REG_EXPAND_SZ)
+				reinterpret_cast<BYTE*>(&str[0]),   // where data will be read
+				&sizeInBytes
+			);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_EXPAND_SZ value.",
+					result);
+			}
+
+			//
+			// In the remarks section of RegQueryValueEx()
+			//
+			// https://msdn.microsoft.com/en-us/library/windows/desktop/ms724911(v=vs.85).aspx
+			//
+			// they specify that we should check if the string is NUL-terminated, and if it isn't,
+			// we must add a NUL-terminator.
+			//
+			if (str[stringBufferLenInWchars - 1] == L'\0')
+			{
+				// Strip off the NUL-terminator written by the API
+				str.resize(stringBufferLenInWchars - 1);
+			}
+			// The API didn't write a NUL terminator, at the end of the string, which is just fine,
+			// as wstrings are automatically NUL-terminated.
+
+			winreg::RegValue value(valueName, REG_EXPAND_SZ);
+			value.ExpandString() = str;
+			return value;
+		}
+
+
+		WINREG_INLINE winreg::RegValue ReadValueBinaryInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			// Data to be read from the registry
+			std::vector<BYTE> binaryData(valueSize);
+			DWORD sizeInBytes = valueSize;
+
+			LONG result = ::RegQueryValueEx(
+				hKey,
+				valueName.c_str(),
+				nullptr, // reserved
+				nullptr, // not interested in type (we know it's REG_BINARY)
+				binaryData.data(),   // where data will be read
+				&sizeInBytes
+			);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_BINARY value.", result);
+			}
+
+			// The value may have shrunk since its size was queried
+			binaryData.resize(sizeInBytes);
+
+			winreg::RegValue value(valueName,REG_BINARY);
+			value.Binary() = std::move(binaryData);
+			return value;
+		}
+
+
+		WINREG_INLINE winreg::RegValue ReadValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			// Multi-string parsed into a vector of strings
+			std::vector<std::wstring> multiStrings;
+
+			// Buffer containing the multi-string
+			std::vector<wchar_t> buffer(valueSize);
+
+			DWORD sizeInBytes = valueSize;
+			LONG result = ::RegQueryValueEx(
+				hKey,
+				valueName.c_str(),
+				nullptr, // reserved
+				nullptr, // not interested in type (we know it's REG_MULTI_SZ)
+				reinterpret_cast<BYTE*>(buffer.data()),   // where data will be read
+				&sizeInBytes
+			);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegQueryValueEx() failed in returning REG_MULTI_SZ value.",
+					result);
+			}
+
+			// Scan the read multi-string buffer, and parse the single various strings,
+			// adding them to the result vector<wstring>.
+			const wchar_t* pszz = buffer.data();
+			while (*pszz != L'\0')
+			{
+				// Get current string length
+				const size_t len = wcslen(pszz);
+
+				// Add this string to the resulting vector
+				multiStrings.push_back(std::wstring(pszz, len));
+
+				// Point to next string (or end: \0)
+				pszz += len + 1;
+			}
+
+			winreg::RegValue value(valueName,REG_MULTI_SZ);
+			value.MultiString() = multiStrings;
+			return value;
+		}
+
+
+		WINREG_INLINE bool IsSupportedValueType(DWORD typeId)
+		{
+			switch (typeId)
+			{
+			case REG_BINARY:
+			case REG_DWORD:
+			case REG_SZ:
+			case REG_EXPAND_SZ:
+			case REG_MULTI_SZ:
+				return true;
+
+			default:
+				return false;
+			}
+		}
+
+
+		WINREG_INLINE winreg::RegValue MakeRegValue(const std::wstring& valueName, DWORD typeId,
+			const BYTE* data, DWORD dataSize)
+		{
+			winreg::RegValue value(valueName, typeId);
+
+			switch (typeId)
+			{
+			case REG_DWORD:
+			{
+				// Any size can be stored (e.g. by other programs, or in offline hives):
+				// shorter data is zero-extended, longer data truncated
+				DWORD dw = 0;
+				memcpy(&dw, data, (dataSize < sizeof(dw)) ? dataSize : sizeof(dw));
+				value.Dword() = dw;
+			}
+			break;
+
+			case REG_SZ:
+			case REG_EXPAND_SZ:
+			{
+				std::wstring str(dataSize / sizeof(wchar_t), L'\0');
+				if (!str.empty())
+				{
+					memcpy(&str[0], data, str.size() * sizeof(wchar_t));
+				}
+
+				// Strip off the NUL-terminator, if stored with the data
+				if (!str.empty() && str.back() == L'\0')
+				{
+					str.pop_back();
+				}
+
+				if (typeId == REG_SZ)
+				{
+					value.String() = std::move(str);
+				}
+				else
+				{
+					value.ExpandString() = std::move(str);
+				}
+			}
+			break;
+
+			case REG_MULTI_SZ:
+			{
+				std::wstring buffer(dataSize / sizeof(wchar_t), L'\0');
+				if (!buffer.empty())
+				{
+					memcpy(&buffer[0], data, buffer.size() * sizeof(wchar_t));
+				}
+
+				// Parse the single strings, up to the double-NUL or the end of the data
+				size_t pos = 0;
+				while (pos < buffer.size() && buffer[pos] != L'\0')
+				{
+					size_t end = buffer.find(L'\0', pos);
+					if (end == std::wstring::npos)
+					{
+						end = buffer.size();
+					}
+
+					value.MultiString().push_back(buffer.substr(pos, end - pos));
+					pos = end + 1;
+				}
+			}
+			break;
+
+			case REG_BINARY:
+				value.Binary().assign(data, data + dataSize);
+				break;
+
+			default:
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+
+			return value;
+		}
+
+
+		WINREG_INLINE std::vector<BYTE>& WriteDataScratch()
+		{
+			thread_local std::vector<BYTE> buffer;
+			return buffer;
+		}
+
+
+		WINREG_INLINE const wchar_t* TerminatedValueName(std::wstring_view valueName)
+		{
+			thread_local std::vector<wchar_t> buffer;
+			buffer.assign(valueName.begin(), valueName.end());
+			buffer.push_back(L'\0');
+			return buffer.data();
+		}
+
+
+		WINREG_INLINE void WriteRawValueInternal(HKEY hKey, std::wstring_view valueName, DWORD type,
+			const BYTE* data, size_t dataSize, const wchar_t* errorMessage)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::SetValue, hKey, valueName);
+			trace.Data(type, dataSize);
+
+			LONG result = ::RegSetValueEx(
+				hKey,
+				TerminatedValueName(valueName),
+				0, // reserved
+				type,
+				data,
+				SafeSizeToDwordCast(dataSize));
+			trace.Status(result);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(errorMessage, result);
+			}
+		}
+
+
+		WINREG_INLINE size_t ValueDataSize(const winreg::RegValue& value)
+		{
+			switch (value.GetType())
+			{
+			case REG_BINARY:    return value.Binary().size();
+			case REG_DWORD:     return sizeof(DWORD);
+			case REG_SZ:        return (value.String().size() + 1) * sizeof(wchar_t);
+			case REG_EXPAND_SZ: return (value.ExpandString().size() + 1) * sizeof(wchar_t);
+			case REG_MULTI_SZ:
+			{
+				size_t length = 1;
+				for (const std::wstring& s : value.MultiString())
+				{
+					length += s.size() + 1;
+				}
+				return (std::max)(length, size_t(2)) * sizeof(wchar_t);
+			}
+			default:            return 0;
+			}
+		}
+
+
+		WINREG_INLINE void WriteValueBinaryInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(value.GetType() == REG_BINARY);
+
+			const std::vector<BYTE> & data = value.Binary();
+			const DWORD dataSize = SafeSizeToDwordCast(data.size());
+			LONG result = ::RegSetValueEx(
+				hKey,
+				valueName.c_str(),
+				0, // reserved
+				REG_BINARY,
+				&data[0],
+				dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_BINARY value.", result);
+			}
+		}
+
+
+		WINREG_INLINE void WriteValueDwordInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(value.GetType() == REG_DWORD);
+
+			const DWORD data = value.Dword();
+			const DWORD dataSize = sizeof(data);
+			LONG result = ::RegSetValueEx(
+				hKey,
+				valueName.c_str(),
+				0, // reserved
+				REG_DWORD,
+				reinterpret_cast<const BYTE*>(&data),
+				dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_DWORD value.", result);
+			}
+		}
+
+
+		WINREG_INLINE void WriteValueStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(value.GetType() == REG_SZ);
+
+			const std::wstring& str = value.String();
+
+			// According to MSDN doc, this size must include the terminating NUL
+			// Note that size is in *BYTES*, so we must scale by wchar_t.
+			const DWORD dataSize = SafeSizeToDwordCast((str.size() + 1) * sizeof(wchar_t));
+
+			LONG result = ::RegSetValueEx(
+				hKey,
+				valueName.c_str(),
+				0, // reserved
+				REG_SZ,
+				reinterpret_cast<const BYTE*>(str.c_str()),
+				dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_SZ value.", result);
+			}
+		}
+
+
+		WINREG_INLINE void WriteValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(value.GetType() == REG_EXPAND_SZ);
+
+			const std::wstring & str = value.ExpandString();
+
+			// According to MSDN doc, this size must include the terminating NUL.
+			// Note that size is in *BYTES*, so we must scale by wchar_t.
+			const DWORD dataSize = SafeSizeToDwordCast((str.size() + 1) * sizeof(wchar_t));
+
+			LONG result = ::RegSetValueEx(
+				hKey,
+				valueName.c_str(),
+				0, // reserved
+				REG_EXPAND_SZ,
+				reinterpret_cast<const BYTE*>(str.c_str()),
+				dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_EXPAND_SZ value.", result);
+			}
+		}
+
+
+		WINREG_INLINE void WriteValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(value.GetType() == REG_MULTI_SZ);
+
+			// The double-NUL-terminated buffer is laid out in the per-thread scratch buffer
+			const std::vector<BYTE>& buffer = LayoutMultiString(value.MultiString());
+
+			// Size is in *BYTES*
+			const DWORD dataSize = SafeSizeToDwordCast(buffer.size());
+
+			LONG result = ::RegSetValueEx(
+				hKey,
+				valueName.c_str(),
+				0, // reserved
+				REG_MULTI_SZ,
+				buffer.data(),
+				dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw winreg::RegException(L"RegSetValueEx() failed in writing REG_MULTI_SZ value.", result);
+			}
+		}
+
+	} // namespace detail
+
+
+	WINREG_INLINE std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey, bool& concurrentChange)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::EnumerateSubKeys, hKey);
+
+		concurrentChange = false;
+
+		// Get sub-keys count and max sub-key name length
+		DWORD subkeyCount = 0;
+		DWORD maxSubkeyNameLength = 0;
+		LONG result = ::RegQueryInfoKey(
+			hKey,
+			nullptr, nullptr,           // not interested in user-defined class of the key 
+			nullptr,                    // reserved
+			&subkeyCount,               // how many sub-keys here? 
+			&maxSubkeyNameLength,       // useful to preallocate a buffer for all keys
+			nullptr, nullptr, nullptr,  // not interested in all this stuff
+			nullptr, nullptr, nullptr   // (see MSDN doc)
+		);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryInfoKey() failed while trying to get sub-keys info.", result);
+		}
+
+		// Result of the function
+		std::vector<std::wstring> subkeyNames;
+		subkeyNames.reserve(subkeyCount);
+
+		// Temporary buffer to read sub-key names into
+		std::vector<wchar_t> subkeyNameBuffer(maxSubkeyNameLength + 1); // +1 for terminating NUL
+
+		// For each sub-key, until the API says there are no more:
+		for (DWORD subkeyIndex = 0; ; )
+		{
+			DWORD subkeyNameLength = detail::SafeSizeToDwordCast(subkeyNameBuffer.size()); // including NUL
+
+			result = ::RegEnumKeyEx(
+				hKey,
+				subkeyIndex,
+				&subkeyNameBuffer[0],
+				&subkeyNameLength,
+				nullptr, nullptr, nullptr, nullptr);
+			if (result == ERROR_NO_MORE_ITEMS)
+			{
+				break;
+			}
+			if ((result == ERROR_MORE_DATA) && (subkeyNameBuffer.size() <= MaxKeyNameLength))
+			{
+				// A longer sub-key was added meanwhile: grow the buffer and read it again
+				concurrentChange = true;
+				subkeyNameBuffer.resize(MaxKeyNameLength + 1);
+				continue;
+			}
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegEnumKeyEx() failed trying to get sub-key name.", result);
+			}
+
+			// When the RegEnumKeyEx() function returns, subkeyNameBufferSize
+			// contains the number of characters read, *NOT* including the terminating NUL
+			subkeyNames.push_back(std::wstring(subkeyNameBuffer.data(), subkeyNameLength));
+			subkeyIndex++;
+		}
+
+		if (subkeyNames.size() != subkeyCount)
+		{
+			concurrentChange = true;
+		}
+
+		trace.Data(REG_NONE, subkeyNames.size());
+		return subkeyNames;
+	}
+
+
+	WINREG_INLINE std::vector<std::wstring> EnumerateSubKeyNames(HKEY hKey)
+	{
+		bool concurrentChange = false;
+		return EnumerateSubKeyNames(hKey, concurrentChange);
+	}
+
+
+	WINREG_INLINE std::vector<std::wstring> EnumerateValueNames(HKEY hKey, bool& concurrentChange)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::EnumerateValueNames, hKey);
+
+		concurrentChange = false;
+
+		// Get values count and max value name length
+		DWORD valueCount = 0;
+		DWORD maxValueNameLength = 0;
+		LONG result = ::RegQueryInfoKey(
+			hKey,
+			nullptr, nullptr,
+			nullptr,
+			nullptr, nullptr,
+			nullptr,
+			&valueCount, &maxValueNameLength,
+			nullptr, nullptr, nullptr);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryInfoKey() failed while trying to get value info.", result);
+		}
+
+		std::vector<std::wstring> valueNames;
+		valueNames.reserve(valueCount);
+
+		// Temporary buffer to read value names into
+		std::vector<wchar_t> valueNameBuffer(maxValueNameLength + 1); // +1 for including NUL
+
+		// For each value in this key, until the API says there are no more:
+		for (DWORD valueIndex = 0; ; )
+		{
+			DWORD valueNameLength = detail::SafeSizeToDwordCast(valueNameBuffer.size()); // including NUL
+
+			// We are just interested in the value's name
+			result = ::RegEnumValue(
+				hKey,
+				valueIndex,
+				&valueNameBuffer[0],
+				&valueNameLength,
+				nullptr,    // reserved
+				nullptr,    // not interested in type
+				nullptr,    // not interested in data
+				nullptr     // not interested in data size
+			);
+			if (result == ERROR_NO_MORE_ITEMS)
+			{
+				break;
+			}
+			if ((result == ERROR_MORE_DATA) && (valueNameBuffer.size() <= MaxValueNameLength))
+			{
+				// A longer value name was added meanwhile: grow the buffer and read it again
+				concurrentChange = true;
+				valueNameBuffer.resize((std::min)(valueNameBuffer.size() * 2,
+					static_cast<size_t>(MaxValueNameLength) + 1));
+				continue;
+			}
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegEnumValue() failed to get value name.", result);
+			}
+
+			// When the RegEnumValue() function returns, valueNameLength
+			// contains the number of characters read, not including the terminating NUL
+			valueNames.push_back(std::wstring(valueNameBuffer.data(), valueNameLength));
+			valueIndex++;
+		}
+
+		if (valueNames.size() != valueCount)
+		{
+			concurrentChange = true;
+		}
+
+		trace.Data(REG_NONE, valueNames.size());
+		return valueNames;
+	}
+
+
+	WINREG_INLINE std::vector<std::wstring> EnumerateValueNames(HKEY hKey)
+	{
+		bool concurrentChange = false;
+		return EnumerateValueNames(hKey, concurrentChange);
+	}
+
+
+	WINREG_INLINE RegValue QueryValue(HKEY hKey, const std::wstring& valueName)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		DWORD valueType = 0;
+
+		// According to this MSDN web page:
+		//
+		// "Registry Element Size Limits"
+		//  https://msdn.microsoft.com/en-us/library/windows/desktop/ms724872(v=vs.85).aspx
+		//
+		// "Long values (more than 2,048 bytes) should be stored in a file, 
+		// and the location of the file should be stored in the registry. 
+		// This helps the registry perform efficiently."
+		//
+
+		DWORD dataSize = 0;
+
+		trace_detail::Scope trace(TraceOp::QueryValue, hKey, valueName);
+
+		// Query the value type and the data size for that value
+		LONG result = ::RegQueryValueEx(
+			hKey,
+			valueName.c_str(),
+			nullptr,        // reserved
+			&valueType,
+			nullptr,        // not ready to pass buffer to write data into yet
+			&dataSize       // ask this API the total bytes for the data
+		);
+		trace.Status(result);
+		trace.Data(valueType, dataSize);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryValueEx() failed in returning value info.", result);
+		}
+
+		// Dispatch to internal helper function based on the value's type.
+		// A failure reading the data is traced with its status too.
+		try
+		{
+			switch (valueType)
+			{
+			case REG_BINARY:    return detail::ReadValueBinaryInternal(hKey, valueName, (DWORD)dataSize);
+				break;
+			case REG_DWORD:     return detail::ReadValueDwordInternal(hKey, valueName);
+				break;
+			case REG_SZ:        return detail::ReadValueStringInternal(hKey, valueName, (DWORD)dataSize);
+				break;
+			case REG_EXPAND_SZ: return detail::ReadValueExpandStringInternal(hKey, valueName, (DWORD)dataSize);
+				break;
+			case REG_MULTI_SZ:  return detail::ReadValueMultiStringInternal(hKey, valueName, (DWORD)dataSize);
+				break;
+			default:
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+		}
+		catch (const RegException& e)
+		{
+			trace.Status(e.ErrorCode());
+			throw;
+		}
+	}
+
+
+	WINREG_INLINE size_t QueryBinaryValueSize(HKEY hKey, std::wstring_view valueName)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		DWORD valueType = 0;
+		DWORD dataSize = 0;
+		LONG result = ::RegQueryValueEx(
+			hKey,
+			detail::TerminatedValueName(valueName),
+			nullptr,        // reserved
+			&valueType,
+			nullptr,        // only the size is needed
+			&dataSize
+		);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryValueEx() failed in returning value info.", result);
+		}
+		if (valueType != REG_BINARY)
+		{
+			throw std::invalid_argument("The registry value is not a REG_BINARY value.");
+		}
+
+		return dataSize;
+	}
+
+
+	WINREG_INLINE size_t QueryBinaryValue(HKEY hKey, std::wstring_view valueName, BYTE* buffer, size_t bufferSize)
+	{
+		_ASSERTE(hKey != nullptr);
+		_ASSERTE(buffer != nullptr || bufferSize == 0);
+
+		DWORD valueType = 0;
+		DWORD dataSize = static_cast<DWORD>(
+			(std::min)(bufferSize, static_cast<size_t>((std::numeric_limits<DWORD>::max)())));
+		LONG result = ::RegQueryValueEx(
+			hKey,
+			detail::TerminatedValueName(valueName),
+			nullptr,        // reserved
+			&valueType,
+			(bufferSize != 0) ? buffer : nullptr,
+			&dataSize
+		);
+
+		// Without a buffer, the API succeeds just returning the size
+		if (result == ERROR_SUCCESS && bufferSize == 0 && dataSize != 0)
+		{
+			result = ERROR_MORE_DATA;
+		}
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegQueryValueEx() failed in returning REG_BINARY value.", result);
+		}
+		if (valueType != REG_BINARY)
+		{
+			throw std::invalid_argument("The registry value is not a REG_BINARY value.");
+		}
+
+		return dataSize;
+	}
+
+
+	WINREG_INLINE std::vector<RegValueResult> QueryMultipleValues(HKEY hKey,
+		const std::vector<std::wstring>& valueNames)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		std::vector<RegValueResult> results;
+		results.reserve(valueNames.size());
+		for (const std::wstring& valueName : valueNames)
+		{
+			results.push_back(RegValueResult{ ERROR_SUCCESS, RegValue(valueName, REG_NONE) });
+		}
+
+		// Indexes of the values still to be read
+		std::vector<size_t> pending(valueNames.size());
+		std::iota(pending.begin(), pending.end(), size_t(0));
+
+		std::vector<VALENT> entries;
+
+		// Never pass a null buffer: with values that are all empty, the required size is 0,
+		// and a null buffer would be reported too small again and again
+		std::vector<BYTE> buffer(1);
+
+		// RegQueryMultipleValues() fails as a whole with ERROR_CANTREAD if any of the values
+		// is missing. In that case, find out which ones exist with type-only queries, and
+		// retry the batch with them. Values concurrently deleted by someone else make the
+		// retry fail again, so the attempts are bounded.
+		const int maxAttempts = 3;
+		for (int attempt = 0; (attempt < maxAttempts) && !pending.empty(); attempt++)
+		{
+			entries.assign(pending.size(), VALENT{});
+			for (size_t i = 0; i < pending.size(); i++)
+			{
+				entries[i].ve_valuename = const_cast<wchar_t*>(valueNames[pending[i]].c_str());
+			}
+
+			LONG result = ERROR_SUCCESS;
+			for (;;)
+			{
+				DWORD totalSize = detail::SafeSizeToDwordCast(buffer.size());
+				result = ::RegQueryMultipleValues(
+					hKey,
+					entries.data(),
+					detail::SafeSizeToDwordCast(entries.size()),
+					reinterpret_cast<LPWSTR>(buffer.data()),
+					&totalSize
+				);
+
+				// Grow the buffer to the required size, and try again; a required size that
+				// doesn't grow wouldn't make progress, so the failure is reported as it is
+				if (((result == ERROR_MORE_DATA) || (result == ERROR_SUCCESS))
+					&& (totalSize > buffer.size()))
+				{
+					buffer.resize(totalSize);
+					continue;
+				}
+				break;
+			}
+
+			if (result == ERROR_SUCCESS)
+			{
+				for (size_t i = 0; i < pending.size(); i++)
+				{
+					RegValueResult& r = results[pending[i]];
+					const VALENT& entry = entries[i];
+					if (detail::IsSupportedValueType(entry.ve_type))
+					{
+						r.value = detail::MakeRegValue(valueNames[pending[i]], entry.ve_type,
+							reinterpret_cast<const BYTE*>(entry.ve_valueptr), entry.ve_valuelen);
+					}
+					else
+					{
+						r.status = ERROR_UNSUPPORTED_TYPE;
+					}
+				}
+				pending.clear();
+				break;
+			}
+
+			if (result != ERROR_CANTREAD)
+			{
+				throw RegException(L"RegQueryMultipleValues() failed.", result);
+			}
+
+			std::vector<size_t> present;
+			for (size_t index : pending)
+			{
+				result = ::RegQueryValueEx(hKey, valueNames[index].c_str(),
+					nullptr, nullptr, nullptr, nullptr);
+				if (result == ERROR_SUCCESS)
+				{
+					present.push_back(index);
+				}
+				else
+				{
+					results[index].status = result;
+				}
+			}
+			pending.swap(present);
+		}
+
+		// Still racing with concurrent deletions: read the rest one at a time
+		for (size_t index : pending)
+		{
+			try
+			{
+				results[index].value = QueryValue(hKey, valueNames[index]);
+			}
+			catch (const RegException& ex)
+			{
+				results[index].status = ex.ErrorCode();
+			}
+			catch (const std::invalid_argument&)
+			{
+				results[index].status = ERROR_UNSUPPORTED_TYPE;
+			}
+		}
+
+		return results;
+	}
+
+
+	WINREG_INLINE void SetDwordValue(HKEY hKey, std::wstring_view valueName, DWORD data)
+	{
+		detail::WriteRawValueInternal(hKey, valueName, REG_DWORD, reinterpret_cast<const BYTE*>(&data),
+			sizeof(data), L"RegSetValueEx() failed in writing REG_DWORD value.");
+	}
+
+
+	WINREG_INLINE void SetStringValue(HKEY hKey, std::wstring_view valueName, std::wstring_view data,
+		DWORD typeId)
+	{
+		_ASSERTE(typeId == REG_SZ || typeId == REG_EXPAND_SZ);
+		if (typeId != REG_SZ && typeId != REG_EXPAND_SZ)
+		{
+			throw std::invalid_argument("SetStringValue() called with a non-string value type.");
+		}
+
+		// According to MSDN doc, the size must include the terminating NUL
+		std::vector<BYTE>& buffer = detail::WriteDataScratch();
+		buffer.resize((data.size() + 1) * sizeof(wchar_t));
+		if (!data.empty())
+		{
+			memcpy(buffer.data(), data.data(), data.size() * sizeof(wchar_t));
+		}
+		memset(buffer.data() + data.size() * sizeof(wchar_t), 0, sizeof(wchar_t));
+
+		detail::WriteRawValueInternal(hKey, valueName, typeId, buffer.data(), buffer.size(),
+			(typeId == REG_SZ) ? L"RegSetValueEx() failed in writing REG_SZ value."
+			: L"RegSetValueEx() failed in writing REG_EXPAND_SZ value.");
+	}
+
+
+	WINREG_INLINE void SetBinaryValue(HKEY hKey, std::wstring_view valueName, const BYTE* data, size_t dataSize)
+	{
+		_ASSERTE(data != nullptr || dataSize == 0);
+
+		detail::WriteRawValueInternal(hKey, valueName, REG_BINARY, data, dataSize,
+			L"RegSetValueEx() failed in writing REG_BINARY value.");
+	}
+
+
+	WINREG_INLINE void SetMultiStringValue(HKEY hKey, std::wstring_view valueName,
+		std::initializer_list<std::wstring_view> strings)
+	{
+		SetMultiStringValue<std::initializer_list<std::wstring_view>>(hKey, valueName, strings);
+	}
+
+
+	namespace detail
+	{
+		WINREG_INLINE void SetValueInternal(HKEY hKey, const std::wstring& valueName, const RegValue& value)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::SetValue, hKey, valueName);
+			trace.Data(value.GetType(), ValueDataSize(value));
+
+			switch (value.GetType())
+			{
+			case REG_BINARY:    return WriteValueBinaryInternal(hKey, valueName, value);
+			case REG_DWORD:     return WriteValueDwordInternal(hKey, valueName, value);
+			case REG_SZ:        return WriteValueStringInternal(hKey, valueName, value);
+			case REG_EXPAND_SZ: return WriteValueExpandStringInternal(hKey, valueName, value);
+			case REG_MULTI_SZ:  return WriteValueMultiStringInternal(hKey, valueName, value);
+
+			default:
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+		}
+
+	} // namespace detail
+
+
+	WINREG_INLINE void DeleteValue(HKEY hKey, const std::wstring& valueName)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::DeleteValue, hKey, valueName);
+		LONG result = ::RegDeleteValue(hKey, valueName.c_str());
+		trace.Status(result);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegDeleteValue() failed.", result);
+		}
+	}
+
+
+	WINREG_INLINE void DeleteKey(HKEY hKey, const std::wstring& subKey, REGSAM view)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::DeleteKey, hKey, subKey);
+		trace.Data(view, 0);
+		LONG result = ::RegDeleteKeyEx(hKey, subKey.c_str(), view, 0);
+		trace.Status(result);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegDeleteKeyEx() failed.", result);
+		}
+	}
+
+
+	WINREG_INLINE std::wstring ExpandEnvironmentStrings(const std::wstring& source)
+	{
+		DWORD requiredLen = ::ExpandEnvironmentStrings(source.c_str(), nullptr, 0);
+		if (requiredLen == 0)
+		{
+			return std::wstring(); // empty
+		}
+
+		std::wstring str;
+		str.resize(requiredLen);
+		DWORD len = ::ExpandEnvironmentStrings(source.c_str(), &str[0], requiredLen);
+		if (len == 0)
+		{
+			// Probably error?
+			// ...but just return an empty string if can't expand.
+			return std::wstring();
+		}
+
+		// Size (len) returned by ExpandEnvironmentStrings() includes the terminating NUL,
+		// so subtract - 1 to remove it.
+		str.resize(len - 1);
+		return str;
+	}
+
+
+	WINREG_INLINE std::wstring ValueTypeIdToString(DWORD typeId)
+	{
+		switch (typeId)
+		{
+		case REG_BINARY:    return L"REG_BINARY";       break;
+		case REG_DWORD:     return L"REG_DWORD";        break;
+		case REG_EXPAND_SZ: return L"REG_EXPAND_SZ";    break;
+		case REG_MULTI_SZ:  return L"REG_MULTI_SZ";     break;
+		case REG_SZ:        return L"REG_SZ";           break;
+
+		default:
+			// Should I throw?
+			return L"Unsupported/Unknown registry value type";
+			break;
+		}
+	}
+
+
+	WINREG_INLINE void LoadKey(HKEY hKey, const std::wstring& subKey, const std::wstring& filename)
+	{
+		LONG result = ::RegLoadKey(hKey, subKey.c_str(), filename.c_str());
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegLoadKey failed.", result);
+		}
+	}
+
+
+	WINREG_INLINE void SaveKey(HKEY hKey, const std::wstring& filename, LPSECURITY_ATTRIBUTES security)
+	{
+		LONG result = ::RegSaveKey(hKey, filename.c_str(), security);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegSaveKey failed.", result);
+		}
+	}
+
+
+	//------------------------------------------------------------------------------
+	//                      RegKey
+	//------------------------------------------------------------------------------
+
+
+	WINREG_INLINE RegKey RegKey::ConnectRegistry(const std::wstring& machineName, HKEY hKey)
+	{
+		HKEY hKeyResult = nullptr;
+		LONG result = ::RegConnectRegistry(machineName.c_str(), hKey, &hKeyResult);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegConnectRegistry failed.", result);
+		}
+
+		return RegKey(hKeyResult);
+	}
+
+
+	WINREG_INLINE RegKey RegKey::OpenKey(HKEY hKey, const std::wstring& subKeyName, REGSAM accessRights)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::OpenKey, hKey, subKeyName);
+		trace.Data(accessRights, 0);
+
+		HKEY hKeyResult = nullptr;
+		LONG result = ::RegOpenKeyEx(
+			hKey,
+			subKeyName.c_str(),
+			0, // no special option of symbolic link
+			accessRights,
+			&hKeyResult
+		);
+		trace.Status(result);
+		trace.Result(hKeyResult);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(
+				L"RegOpenKeyEx() failed trying opening a key:{" + subKeyName + L"}",
+				result
+			);
+		}
+
+		_ASSERTE(hKey != NULL); // DBJ added
+
+		return RegKey(hKeyResult);
+	}
+
+
+	WINREG_INLINE RegKey RegKey::CreateKey(
+		HKEY hKey,
+		const std::wstring& subKeyName,
+		DWORD options,
+		REGSAM accessRights,
+		LPSECURITY_ATTRIBUTES securityAttributes,
+		LPDWORD disposition)
+	{
+		_ASSERTE(hKey != nullptr);
+
+		trace_detail::Scope trace(TraceOp::CreateKey, hKey, subKeyName);
+		trace.Data(accessRights, 0);
+
+		HKEY hKeyResult = nullptr;
+		LONG result = ::RegCreateKeyEx(
+			hKey,
+			subKeyName.c_str(),
+			0,          // reserved
+			nullptr,    // no user defined class
+			options,
+			accessRights,
+			securityAttributes,
+			&hKeyResult,
+			disposition
+		);
+		trace.Status(result);
+		trace.Result(hKeyResult);
+		if (result != ERROR_SUCCESS)
+		{
+			throw RegException(L"RegCreateKeyEx() failed.", result);
+		}
+
+		return RegKey(hKeyResult);
+	}
+
+
+	WINREG_INLINE void RegKey::Close() noexcept
+	{
+		if (m_hKey != nullptr)
+		{
+			// Traced before the handle is released: its value may be reused right after
+			{
+				trace_detail::Scope trace(TraceOp::CloseKey, m_hKey);
+			}
+			// Not inside _ASSERTE(): the key must be closed in release builds too
+			const LONG result = ::RegCloseKey(m_hKey);
+			_ASSERTE(result == ERROR_SUCCESS);
+			static_cast<void>(result);
+		}
+		m_hKey = nullptr;
+	}
+
+
+	WINREG_INLINE void swap(RegKey& lhs, RegKey& rhs) noexcept
+	{
+		lhs.Swap(rhs);
+	}
+
+} // namespace winreg
@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_internal.h
+// DESC: Declarations of the helpers used only by the definitions in wreg_inl.h.
+//       Internal: included by wreg_inl.h and wreg.cpp, not by the users of wreg.h.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "wreg.h"       // WinReg public header
+
+namespace winreg
+{
+	namespace detail
+	{
+		//
+		// Helpers called by QueryValue() to read actual data from the registry.
+		//
+		// NOTE: The "valueSize" parameter contains the size of the value to be read in *BYTES*.
+		// This is important for example to helper functions reading strings (REG_SZ, etc.), 
+		// as usually std::wstring methods consider sizes in wchar_ts.
+		//
+
+		// Reads a REG_DWORD value.
+		winreg::RegValue ReadValueDwordInternal(HKEY hKey, const std::wstring& valueName);
+
+
+		// Reads a REG_SZ value.
+		winreg::RegValue ReadValueStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize);
+
+
+		// Reads a REG_EXPAND_SZ value.
+		winreg::RegValue ReadValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize);
+
+
+		// Reads a REG_BINARY value.
+		winreg::RegValue ReadValueBinaryInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize);
+
+
+		// Reads a REG_MULTI_SZ value.
+		winreg::RegValue ReadValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, DWORD valueSize);
+
+
+		//
+		// Helpers for SetValue()
+		//
+
+		// Size in bytes of the data written for a value (for tracing)
+		size_t ValueDataSize(const winreg::RegValue& value);
+
+
+		void WriteValueBinaryInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value);
+
+
+		void WriteValueDwordInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value);
+
+
+		void WriteValueStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value);
+
+
+		void WriteValueExpandStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value);
+
+
+		void WriteValueMultiStringInternal(HKEY hKey, const std::wstring& valueName, const winreg::RegValue& value);
+
+	} // namespace detail
+
+} // namespace winreg
@@ -0,0 +1,444 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_mirror.h
+// DESC: In-memory copy of a key tree, refreshed incrementally.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// RegistryMirror reads a key tree once, keeping its values as RegValues, then
+// Refresh() brings it up to date and returns what changed (a MirrorDelta).
+//
+// The last-write time of a key changes when its values, or its list of sub-keys,
+// change; not when something changes further below. So Refresh():
+//
+//  - checks the last-write time of every mirrored key, with RegQueryInfoKey()
+//    on a handle kept open since the key was read (no RegOpenKeyEx() and no
+//    enumeration for unchanged keys);
+//
+//  - re-reads the values and the sub-key names of the keys whose last-write
+//    time changed, comparing them with the mirrored ones;
+//
+//  - reads the new sub-keys, with their whole sub-trees, and drops the sub-trees
+//    of the sub-keys gone.
+//
+// The reads and the comparisons are proportional to the amount of change; what
+// remains proportional to the size of the tree is one RegQueryInfoKey() call
+// (and one open handle) per key.
+//
+// A key deleted and created again under the same name between two refreshes
+// is reported as changed, comparing its new values with the old ones.
+//
+// Key paths are relative to the mirrored key ("" for the key itself), and are
+// compared case-insensitively, like registry names.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::lexicographical_compare, std::find_if
+#include <cstdint>      // uint64_t
+#include <map>          // std::map
+#include <memory>       // std::unique_ptr
+#include <string>       // std::wstring
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// A value added, changed or removed, in MirrorDelta
+	//------------------------------------------------------------------------------
+	struct MirrorValueChange
+	{
+		std::wstring keyPath;
+		std::wstring valueName;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// What a RegistryMirror::Refresh() found changed
+	//------------------------------------------------------------------------------
+	struct MirrorDelta
+	{
+		std::vector<std::wstring> addedKeys;            // parents before their sub-keys
+		std::vector<std::wstring> removedKeys;
+		std::vector<MirrorValueChange> addedValues;     // including those of added keys
+		std::vector<MirrorValueChange> changedValues;   // new type or data
+		std::vector<MirrorValueChange> removedValues;   // not including those of removed keys
+
+		size_t keysChecked = 0;     // last-write times queried
+		size_t keysRead = 0;        // keys (re-)enumerated
+
+		bool Empty() const noexcept
+		{
+			return addedKeys.empty() && removedKeys.empty() && addedValues.empty()
+				&& changedValues.empty() && removedValues.empty();
+		}
+	};
+
+
+	namespace mirror_detail
+	{
+		// Orders key paths ignoring case, folded as SameName() compares them
+		struct KeyPathLess
+		{
+			bool operator()(const std::wstring& lhs, const std::wstring& rhs) const
+			{
+				return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+					[](wchar_t a, wchar_t b) { return FoldNameChar(a) < FoldNameChar(b); });
+			}
+		};
+
+
+		inline bool SameName(const std::wstring& lhs, const std::wstring& rhs)
+		{
+			return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(), NameCharsEqual);
+		}
+
+
+		inline std::vector<RegValue>::const_iterator FindValue(const std::vector<RegValue>& values,
+			const std::wstring& name)
+		{
+			return std::find_if(values.begin(), values.end(),
+				[&](const RegValue& value) { return SameName(value.name(), name); });
+		}
+
+
+		inline bool SameData(const RegValue& lhs, const RegValue& rhs)
+		{
+			if (lhs.GetType() != rhs.GetType())
+			{
+				return false;
+			}
+			switch (lhs.GetType())
+			{
+			case REG_DWORD:     return lhs.Dword() == rhs.Dword();
+			case REG_SZ:        return lhs.String() == rhs.String();
+			case REG_EXPAND_SZ: return lhs.ExpandString() == rhs.ExpandString();
+			case REG_MULTI_SZ:  return lhs.MultiString() == rhs.MultiString();
+			case REG_BINARY:    return lhs.Binary() == rhs.Binary();
+			default:            return true;
+			}
+		}
+
+
+		inline std::wstring ChildPath(const std::wstring& path, const std::wstring& name)
+		{
+			return path.empty() ? name : path + L"\\" + name;
+		}
+
+	} // namespace mirror_detail
+
+
+	//------------------------------------------------------------------------------
+	// Copy of a key tree, kept up to date by Refresh() (see the notes at the top of
+	// this file). Not thread-safe: synchronize Refresh() with the readers.
+	//------------------------------------------------------------------------------
+	class RegistryMirror
+	{
+	public:
+
+		// A mirrored key
+		struct Key
+		{
+			uint64_t lastWriteTime = 0;             // FILETIME
+			std::vector<RegValue> values;           // in enumeration order
+			std::vector<std::wstring> subKeyNames;
+		};
+
+
+		// Reads the tree below subKey of hKey.
+		// Throws RegException if subKey can't be opened.
+		RegistryMirror(HKEY hKey, const std::wstring& subKey)
+			: m_root(hKey), m_rootPath(subKey)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			HKEY hRoot = nullptr;
+			LONG result = ::RegOpenKeyEx(m_root, m_rootPath.c_str(), 0, KEY_READ, &hRoot);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegOpenKeyEx() failed trying opening the key to mirror.", result);
+			}
+
+			MirrorDelta ignored;
+			AddTree(std::wstring(), std::make_unique<RegKey>(hRoot), ignored);
+		}
+
+
+		RegistryMirror(const RegistryMirror&) = delete;
+		RegistryMirror& operator=(const RegistryMirror&) = delete;
+
+
+		// Brings the mirror up to date, returning what changed
+		MirrorDelta Refresh()
+		{
+			MirrorDelta delta;
+
+			// Keys added meanwhile are read whole: only the ones there now are checked
+			std::vector<std::wstring> paths;
+			paths.reserve(m_keys.size());
+			for (const auto& key : m_keys)
+			{
+				paths.push_back(key.first);
+			}
+
+			for (const std::wstring& path : paths)
+			{
+				auto it = m_keys.find(path);
+				if (it == m_keys.end())
+				{
+					continue;       // in a sub-tree removed meanwhile
+				}
+				RefreshKey(it, delta);
+			}
+			return delta;
+		}
+
+
+		size_t KeyCount() const noexcept
+		{
+			return m_keys.size();
+		}
+
+
+		// Returns the mirrored key, or nullptr if it isn't in the tree
+		const Key* FindKey(const std::wstring& keyPath) const
+		{
+			auto it = m_keys.find(keyPath);
+			return (it != m_keys.end()) ? &it->second.key : nullptr;
+		}
+
+
+		// Returns the mirrored value, or nullptr if it isn't in the tree
+		const RegValue* FindValue(const std::wstring& keyPath, const std::wstring& valueName) const
+		{
+			const Key* key = FindKey(keyPath);
+			if (key == nullptr)
+			{
+				return nullptr;
+			}
+			auto it = mirror_detail::FindValue(key->values, valueName);
+			return (it != key->values.end()) ? &*it : nullptr;
+		}
+
+
+		// Calls onKey(keyPath, key) for each mirrored key, parents first
+		template <typename OnKey>
+		void ForEachKey(OnKey onKey) const
+		{
+			for (const auto& key : m_keys)
+			{
+				onKey(key.first, key.second.key);
+			}
+		}
+
+	private:
+
+		struct Record
+		{
+			Key key;
+			std::unique_ptr<RegKey> handle;     // kept open to query the last-write time
+		};
+
+		typedef std::map<std::wstring, Record, mirror_detail::KeyPathLess> KeyMap;
+
+		HKEY m_root;
+		std::wstring m_rootPath;
+		KeyMap m_keys;
+
+
+		static uint64_t LastWriteTime(HKEY hKey, LONG& result)
+		{
+			FILETIME lastWrite = {};
+			result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+				nullptr, nullptr, nullptr, nullptr, &lastWrite);
+			return (static_cast<uint64_t>(lastWrite.dwHighDateTime) << 32) | lastWrite.dwLowDateTime;
+		}
+
+
+		// Reads the values and sub-key names of a key; false if it's gone meanwhile
+		static bool ReadKey(HKEY hKey, Key& key)
+		{
+			LONG result = ERROR_SUCCESS;
+			key.lastWriteTime = LastWriteTime(hKey, result);
+			if (result != ERROR_SUCCESS)
+			{
+				return false;
+			}
+			try
+			{
+				key.values = EnumerateValues(hKey);
+				key.subKeyNames = EnumerateSubKeyNames(hKey);
+			}
+			catch (const RegException&)
+			{
+				return false;
+			}
+			return true;
+		}
+
+
+		std::unique_ptr<RegKey> OpenKey(const std::wstring& path) const
+		{
+			const std::wstring fullPath = path.empty() ? m_rootPath : m_rootPath + L"\\" + path;
+			HKEY hKey = nullptr;
+			if (::RegOpenKeyEx(m_root, fullPath.c_str(), 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+			{
+				return nullptr;
+			}
+			return std::make_unique<RegKey>(hKey);
+		}
+
+
+		// Reads a new key and its sub-tree
+		void AddTree(const std::wstring& path, std::unique_ptr<RegKey> handle, MirrorDelta& delta)
+		{
+			Record record;
+			if (!ReadKey(handle->Handle(), record.key))
+			{
+				return;
+			}
+			record.handle = std::move(handle);
+			delta.keysRead++;
+			delta.addedKeys.push_back(path);
+			for (const RegValue& value : record.key.values)
+			{
+				delta.addedValues.push_back(MirrorValueChange{ path, value.name() });
+			}
+
+			const std::vector<std::wstring> subKeyNames = record.key.subKeyNames;
+			m_keys[path] = std::move(record);
+
+			for (const std::wstring& name : subKeyNames)
+			{
+				std::unique_ptr<RegKey> subKey = OpenKey(mirror_detail::ChildPath(path, name));
+				if (subKey != nullptr)
+				{
+					AddTree(mirror_detail::ChildPath(path, name), std::move(subKey), delta);
+				}
+			}
+		}
+
+
+		// Drops a key and its sub-tree
+		void RemoveTree(KeyMap::iterator it, MirrorDelta& delta)
+		{
+			const std::wstring path = it->first;
+			for (const std::wstring& name : it->second.key.subKeyNames)
+			{
+				auto child = m_keys.find(mirror_detail::ChildPath(path, name));
+				if (child != m_keys.end())
+				{
+					RemoveTree(child, delta);
+				}
+			}
+			m_keys.erase(path);
+			delta.removedKeys.push_back(path);
+		}
+
+
+		void RefreshKey(KeyMap::iterator it, MirrorDelta& delta)
+		{
+			const std::wstring path = it->first;
+			Record& record = it->second;
+
+			delta.keysChecked++;
+			LONG result = ERROR_SUCCESS;
+			const uint64_t lastWriteTime = LastWriteTime(record.handle->Handle(), result);
+			if (result == ERROR_SUCCESS && lastWriteTime == record.key.lastWriteTime)
+			{
+				return;
+			}
+
+			// Deleted (and maybe created again): start over from a new handle
+			Key current;
+			std::unique_ptr<RegKey> handle = (result == ERROR_SUCCESS) ? nullptr : OpenKey(path);
+			if (result != ERROR_SUCCESS && handle == nullptr)
+			{
+				RemoveTree(it, delta);
+				return;
+			}
+			if (handle != nullptr)
+			{
+				record.handle = std::move(handle);
+			}
+			if (!ReadKey(record.handle->Handle(), current))
+			{
+				RemoveTree(it, delta);
+				return;
+			}
+			delta.keysRead++;
+
+			DiffValues(path, record.key.values, current.values, delta);
+
+			// Sub-keys gone, then sub-keys new
+			for (const std::wstring& name : record.key.subKeyNames)
+			{
+				if (!ContainsName(current.subKeyNames, name))
+				{
+					auto child = m_keys.find(mirror_detail::ChildPath(path, name));
+					if (child != m_keys.end())
+					{
+						RemoveTree(child, delta);
+					}
+				}
+			}
+			const std::vector<std::wstring> oldSubKeyNames = std::move(record.key.subKeyNames);
+			record.key = std::move(current);    // record stays valid: only other keys are added
+
+			for (const std::wstring& name : record.key.subKeyNames)
+			{
+				if (!ContainsName(oldSubKeyNames, name))
+				{
+					const std::wstring childPath = mirror_detail::ChildPath(path, name);
+					std::unique_ptr<RegKey> subKey = OpenKey(childPath);
+					if (subKey != nullptr && m_keys.find(childPath) == m_keys.end())
+					{
+						AddTree(childPath, std::move(subKey), delta);
+					}
+				}
+			}
+		}
+
+
+		static bool ContainsName(const std::vector<std::wstring>& names, const std::wstring& name)
+		{
+			return std::find_if(names.begin(), names.end(),
+				[&](const std::wstring& other) { return mirror_detail::SameName(other, name); }) != names.end();
+		}
+
+
+		static void DiffValues(const std::wstring& path, const std::vector<RegValue>& before,
+			const std::vector<RegValue>& after, MirrorDelta& delta)
+		{
+			using mirror_detail::FindValue;
+
+			for (const RegValue& value : after)
+			{
+				auto old = FindValue(before, value.name());
+				if (old == before.end())
+				{
+					delta.addedValues.push_back(MirrorValueChange{ path, value.name() });
+				}
+				else if (!mirror_detail::SameData(*old, value))
+				{
+					delta.changedValues.push_back(MirrorValueChange{ path, value.name() });
+				}
+			}
+			for (const RegValue& value : before)
+			{
+				if (FindValue(after, value.name()) == after.end())
+				{
+					delta.removedValues.push_back(MirrorValueChange{ path, value.name() });
+				}
+			}
+		}
+	};
+
+} // namespace winreg
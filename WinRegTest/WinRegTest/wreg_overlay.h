@@ -0,0 +1,526 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_overlay.h
+// DESC: Merged view of several key trees (layers) with a defined precedence,
+//       like HKEY_CLASSES_ROOT merging the Classes keys of HKCU and HKLM.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// RegistryOverlay stacks layers, e.g. a policy key, then a user key, then the
+// machine defaults: the first layer having a value wins. Key paths are relative
+// to the layer roots, and a key of the overlay exists if it exists in any layer;
+// its values and sub-keys are the union of those of the layers.
+//
+// Reading a value by trying each layer in turn costs a failed registry call
+// (and, with QueryValue(), a thrown RegException) for each layer missing it.
+// Instead, the first lookup in a key builds its merge index: each layer's key
+// is opened and its value names enumerated once, and a hash table maps each
+// name to the layer it comes from. A lookup is then a hash probe, plus one
+// successful read in the winning layer; a value missing from all the layers
+// costs no registry call at all. An indexed key keeps a handle open in each
+// layer having it, so only the most recently used indexes are kept (1024 by
+// default): the least recently used one is dropped, with its handles, to make
+// room for a new one.
+//
+// Each layer root is watched, with its sub-tree, by a change notification
+// (a layer root that doesn't exist yet is watched through its nearest existing
+// parent). A change in any layer marks all the merge indexes stale, and each
+// is rebuilt at the next lookup in its key. Notifications are asynchronous:
+// a change is seen shortly after it's written; Invalidate() makes the writes
+// of this process seen at once.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::max
+#include <atomic>       // std::atomic
+#include <cstdint>      // uint64_t
+#include <list>         // std::list
+#include <memory>       // std::shared_ptr, std::unique_ptr
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <unordered_map>// std::unordered_map
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// A layer of a RegistryOverlay: the key tree subKey of root
+	//------------------------------------------------------------------------------
+	struct OverlayLayer
+	{
+		HKEY root;
+		std::wstring subKey;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Counters of a RegistryOverlay
+	//------------------------------------------------------------------------------
+	struct OverlayStats
+	{
+		size_t lookups = 0;
+		size_t missing = 0;         // values in no layer, answered by the index alone
+		size_t indexBuilds = 0;
+		size_t layersRead = 0;      // keys enumerated to build the indexes
+		size_t indexesEvicted = 0;  // least recently used indexes dropped
+	};
+
+
+	namespace overlay_detail
+	{
+		// Case-insensitive hashing and comparison of key paths and value names
+		struct NameHash
+		{
+			size_t operator()(const std::wstring& name) const noexcept
+			{
+				uint64_t hash = 14695981039346656037ULL;
+				for (wchar_t ch : name)
+				{
+					hash ^= static_cast<uint64_t>(FoldNameChar(ch));
+					hash *= 1099511628211ULL;
+				}
+				return static_cast<size_t>(hash);
+			}
+		};
+
+		struct NameEqual
+		{
+			bool operator()(const std::wstring& a, const std::wstring& b) const noexcept
+			{
+				if (a.size() != b.size())
+				{
+					return false;
+				}
+				for (size_t i = 0; i < a.size(); i++)
+				{
+					if (!NameCharsEqual(a[i], b[i]))
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+		};
+
+
+		// Adds the names not already in merged (in a previous layer)
+		inline void MergeNames(std::vector<std::wstring>& merged,
+			std::unordered_map<std::wstring, size_t, NameHash, NameEqual>& layerOf,
+			const std::vector<std::wstring>& names, size_t layer)
+		{
+			for (const std::wstring& name : names)
+			{
+				if (layerOf.emplace(name, layer).second)
+				{
+					merged.push_back(name);
+				}
+			}
+		}
+
+
+		inline std::wstring ParentPath(const std::wstring& path)
+		{
+			const size_t separator = path.find_last_of(L'\\');
+			return (separator == std::wstring::npos) ? std::wstring() : path.substr(0, separator);
+		}
+
+	} // namespace overlay_detail
+
+
+	//------------------------------------------------------------------------------
+	// Merged view of several key trees (see the notes at the top of this file).
+	// Thread-safe.
+	//------------------------------------------------------------------------------
+	class RegistryOverlay
+	{
+	public:
+
+		// The layers are given by decreasing precedence. Layer roots that don't exist
+		// are allowed (and used once created). Up to maxIndexes merge indexes are kept.
+		// Throws RegException if a layer can't be watched.
+		explicit RegistryOverlay(std::vector<OverlayLayer> layers, size_t maxIndexes = 1024)
+			: m_maxIndexes((std::max)(maxIndexes, size_t(1)))
+		{
+			_ASSERTE(!layers.empty());
+
+			m_layers.reserve(layers.size());
+			for (OverlayLayer& layer : layers)
+			{
+				_ASSERTE(layer.root != nullptr);
+				auto watched = std::make_unique<WatchedLayer>();
+				watched->layer = std::move(layer);
+				watched->owner = this;
+				m_layers.push_back(std::move(watched));
+			}
+
+			for (const std::unique_ptr<WatchedLayer>& layer : m_layers)
+			{
+				layer->event = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+				const LONG result = (layer->event != nullptr) ? Arm(*layer) : ERROR_NOT_ENOUGH_MEMORY;
+				if (result != ERROR_SUCCESS
+					|| !::RegisterWaitForSingleObject(&layer->wait, layer->event, OnChange, layer.get(),
+						INFINITE, WT_EXECUTEDEFAULT))
+				{
+					layer->wait = nullptr;
+					Release();
+					throw RegException(L"Can't watch a layer of the overlay.",
+						(result != ERROR_SUCCESS) ? result : ERROR_NOT_ENOUGH_MEMORY);
+				}
+			}
+		}
+
+
+		~RegistryOverlay()
+		{
+			Release();
+		}
+
+
+		RegistryOverlay(const RegistryOverlay&) = delete;
+		RegistryOverlay& operator=(const RegistryOverlay&) = delete;
+
+
+		size_t LayerCount() const noexcept
+		{
+			return m_layers.size();
+		}
+
+
+		// Returns true if the key exists in any layer
+		bool KeyExists(const std::wstring& keyPath)
+		{
+			return Index(keyPath)->exists;
+		}
+
+
+		// Returns the index of the layer the value comes from, or -1 if it's in none
+		int FindValueLayer(const std::wstring& keyPath, const std::wstring& valueName)
+		{
+			const std::shared_ptr<const KeyIndex> index = Index(keyPath);
+			auto it = index->layerOfValue.find(valueName);
+			return (it != index->layerOfValue.end()) ? static_cast<int>(it->second) : -1;
+		}
+
+
+		// Reads a value from the first layer having it: status is ERROR_FILE_NOT_FOUND
+		// if no layer has it, instead of a thrown RegException.
+		RegValueResult TryQueryValue(const std::wstring& keyPath, const std::wstring& valueName)
+		{
+			const std::shared_ptr<const KeyIndex> index = Index(keyPath);
+
+			auto it = index->layerOfValue.find(valueName);
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stats.lookups++;
+				m_stats.missing += (it == index->layerOfValue.end()) ? 1 : 0;
+			}
+			if (it == index->layerOfValue.end())
+			{
+				return RegValueResult{ ERROR_FILE_NOT_FOUND, RegValue(valueName, REG_NONE) };
+			}
+
+			RegValueResult result{ ERROR_SUCCESS, RegValue(valueName, REG_NONE) };
+			try
+			{
+				result.value = winreg::QueryValue(index->keys[it->second]->Handle(), valueName);
+			}
+			catch (const RegException& e)
+			{
+				// e.g. deleted since the index was built
+				result.status = e.ErrorCode();
+			}
+			return result;
+		}
+
+
+		// Reads a value from the first layer having it.
+		// Throws RegException (ERROR_FILE_NOT_FOUND) if no layer has it.
+		RegValue QueryValue(const std::wstring& keyPath, const std::wstring& valueName)
+		{
+			RegValueResult result = TryQueryValue(keyPath, valueName);
+			if (result.status != ERROR_SUCCESS)
+			{
+				throw RegException(L"No layer of the overlay has the value.", result.status);
+			}
+			return std::move(result.value);
+		}
+
+
+		// Names of the values of the key in all the layers: those of the first layer
+		// having the key, then those only found in the next layers
+		std::vector<std::wstring> EnumerateValueNames(const std::wstring& keyPath)
+		{
+			return Index(keyPath)->valueNames;
+		}
+
+
+		// Values of the key, each one read from the first layer having it
+		std::vector<RegValue> EnumerateValues(const std::wstring& keyPath)
+		{
+			const std::shared_ptr<const KeyIndex> index = Index(keyPath);
+
+			std::unordered_map<std::wstring, RegValue, overlay_detail::NameHash, overlay_detail::NameEqual> read;
+			for (size_t layer = 0; layer < index->keys.size(); layer++)
+			{
+				if (index->keys[layer] == nullptr)
+				{
+					continue;
+				}
+				for (RegValue& value : winreg::EnumerateValues(index->keys[layer]->Handle()))
+				{
+					auto it = index->layerOfValue.find(value.name());
+					if (it != index->layerOfValue.end() && it->second == layer)
+					{
+						read.emplace(value.name(), std::move(value));
+					}
+				}
+			}
+
+			std::vector<RegValue> values;
+			values.reserve(read.size());
+			for (const std::wstring& name : index->valueNames)
+			{
+				auto it = read.find(name);
+				if (it != read.end())
+				{
+					values.push_back(std::move(it->second));
+				}
+			}
+			return values;
+		}
+
+
+		// Names of the sub-keys of the key in all the layers, in the same order as
+		// EnumerateValueNames()
+		std::vector<std::wstring> EnumerateSubKeyNames(const std::wstring& keyPath)
+		{
+			return Index(keyPath)->subKeyNames;
+		}
+
+
+		// Rebuilds the merge indexes at their next use, e.g. after this process wrote
+		// to a layer
+		void Invalidate() noexcept
+		{
+			m_changes.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+
+		OverlayStats Stats() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_stats;
+		}
+
+	private:
+
+		// Merge index of a key
+		struct KeyIndex
+		{
+			uint64_t builtAt = 0;                           // value of m_changes
+			bool exists = false;
+			std::vector<std::unique_ptr<RegKey>> keys;      // by layer; nullptr if missing
+			std::unordered_map<std::wstring, size_t, overlay_detail::NameHash,
+				overlay_detail::NameEqual> layerOfValue;
+			std::vector<std::wstring> valueNames;
+			std::vector<std::wstring> subKeyNames;
+		};
+
+		struct WatchedLayer
+		{
+			OverlayLayer layer;
+			RegistryOverlay* owner = nullptr;
+			HKEY watched = nullptr;         // the layer root, or its nearest existing parent
+			bool watchingRoot = false;
+			HANDLE event = nullptr;
+			HANDLE wait = nullptr;
+		};
+
+		struct CachedIndex
+		{
+			std::wstring keyPath;
+			std::shared_ptr<const KeyIndex> index;
+		};
+
+		std::vector<std::unique_ptr<WatchedLayer>> m_layers;
+		std::atomic<uint64_t> m_changes{ 1 };
+		size_t m_maxIndexes;
+
+		mutable std::mutex m_mutex;
+		std::list<CachedIndex> m_recent;        // most recently used first
+		std::unordered_map<std::wstring, std::list<CachedIndex>::iterator, overlay_detail::NameHash,
+			overlay_detail::NameEqual> m_indexes;
+		OverlayStats m_stats;
+
+
+		// Re-arms the notification first, so that no change is missed
+		static void CALLBACK OnChange(PVOID context, BOOLEAN /* timedOut */)
+		{
+			WatchedLayer* layer = static_cast<WatchedLayer*>(context);
+			layer->owner->Arm(*layer);
+			layer->owner->Invalidate();
+		}
+
+
+		// Watches the layer root, or while it doesn't exist, its nearest existing parent.
+		// Called by the constructor, then only by the wait callback of the layer.
+		LONG Arm(WatchedLayer& layer)
+		{
+			if (layer.watched != nullptr && !layer.watchingRoot)
+			{
+				// Maybe the root exists now
+				::RegCloseKey(layer.watched);
+				layer.watched = nullptr;
+			}
+
+			std::wstring path = layer.layer.subKey;
+			LONG result = ERROR_SUCCESS;
+			for (;;)
+			{
+				if (layer.watched == nullptr)
+				{
+					result = ::RegOpenKeyEx(layer.layer.root, path.c_str(), 0, KEY_NOTIFY, &layer.watched);
+					if (result != ERROR_SUCCESS)
+					{
+						layer.watched = nullptr;
+					}
+					layer.watchingRoot = (path.size() == layer.layer.subKey.size());
+				}
+				if (layer.watched != nullptr)
+				{
+					result = ::RegNotifyChangeKeyValue(layer.watched, TRUE,
+						REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC,
+						layer.event, TRUE);
+					if (result == ERROR_SUCCESS)
+					{
+						return ERROR_SUCCESS;
+					}
+
+					// e.g. the key was deleted
+					::RegCloseKey(layer.watched);
+					layer.watched = nullptr;
+				}
+				if (path.empty())
+				{
+					return result;
+				}
+				path = overlay_detail::ParentPath(path);
+			}
+		}
+
+
+		// Returns the merge index of the key, building it first if it's stale
+		std::shared_ptr<const KeyIndex> Index(const std::wstring& keyPath)
+		{
+			const uint64_t changes = m_changes.load(std::memory_order_acquire);
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_indexes.find(keyPath);
+				if (it != m_indexes.end() && it->second->index->builtAt == changes)
+				{
+					m_recent.splice(m_recent.begin(), m_recent, it->second);
+					return it->second->index;
+				}
+			}
+
+			// Built without holding the lock: concurrent builds of a key are harmless
+			auto index = std::make_shared<KeyIndex>();
+			index->builtAt = changes;
+			index->keys.resize(m_layers.size());
+			std::unordered_map<std::wstring, size_t, overlay_detail::NameHash,
+				overlay_detail::NameEqual> layerOfSubKey;
+			size_t layersRead = 0;
+
+			for (size_t layer = 0; layer < m_layers.size(); layer++)
+			{
+				const OverlayLayer& l = m_layers[layer]->layer;
+				std::wstring path = l.subKey;
+				if (!keyPath.empty())
+				{
+					path = path.empty() ? keyPath : path + L"\\" + keyPath;
+				}
+
+				HKEY hKey = nullptr;
+				if (::RegOpenKeyEx(l.root, path.c_str(), 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+				{
+					continue;
+				}
+				auto key = std::make_unique<RegKey>(hKey);
+
+				// Both lists read before merging either: a layer is indexed whole or not at all
+				std::vector<std::wstring> valueNames;
+				std::vector<std::wstring> subKeyNames;
+				try
+				{
+					valueNames = winreg::EnumerateValueNames(key->Handle());
+					subKeyNames = winreg::EnumerateSubKeyNames(key->Handle());
+				}
+				catch (const RegException&)
+				{
+					continue;       // e.g. deleted meanwhile
+				}
+				overlay_detail::MergeNames(index->valueNames, index->layerOfValue, valueNames, layer);
+				overlay_detail::MergeNames(index->subKeyNames, layerOfSubKey, subKeyNames, layer);
+				index->exists = true;
+				index->keys[layer] = std::move(key);
+				layersRead++;
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stats.indexBuilds++;
+			m_stats.layersRead += layersRead;
+
+			auto it = m_indexes.find(keyPath);
+			if (it != m_indexes.end())
+			{
+				it->second->index = index;
+				m_recent.splice(m_recent.begin(), m_recent, it->second);
+				return index;
+			}
+			m_recent.push_front(CachedIndex{ keyPath, index });
+			m_indexes.emplace(keyPath, m_recent.begin());
+			if (m_recent.size() > m_maxIndexes)
+			{
+				m_indexes.erase(m_recent.back().keyPath);
+				m_recent.pop_back();
+				m_stats.indexesEvicted++;
+			}
+			return index;
+		}
+
+
+		void Release() noexcept
+		{
+			for (const std::unique_ptr<WatchedLayer>& layer : m_layers)
+			{
+				if (layer->wait != nullptr)
+				{
+					::UnregisterWaitEx(layer->wait, INVALID_HANDLE_VALUE);
+					layer->wait = nullptr;
+				}
+			}
+			for (const std::unique_ptr<WatchedLayer>& layer : m_layers)
+			{
+				if (layer->watched != nullptr)
+				{
+					::RegCloseKey(layer->watched);
+					layer->watched = nullptr;
+				}
+				if (layer->event != nullptr)
+				{
+					::CloseHandle(layer->event);
+					layer->event = nullptr;
+				}
+			}
+		}
+	};
+
+} // namespace winreg
@@ -0,0 +1,589 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_pmr.h
+// DESC: Values, enumerations and key trees allocated from a caller-supplied
+//       std::pmr::memory_resource.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// RegValue and the enumeration functions allocate from the global heap: one
+// allocation per name, per string and per multi-string element. The functions
+// in namespace winreg::pmr take a std::pmr::memory_resource instead, and build
+// std::pmr containers (winreg::pmr::RegValue, std::pmr::vector of
+// std::pmr::wstring) whose every allocation comes from that resource.
+//
+// With a std::pmr::monotonic_buffer_resource per request (or per thread), a
+// whole scan makes no call to the global heap once the arena has grown, and is
+// freed at once by releasing the arena: destroying the containers first is
+// cheap, as a monotonic resource ignores deallocations.
+// A std::pmr::unsynchronized_pool_resource suits long-lived results instead.
+//
+// The containers are allocator-aware: copying or moving a value into a
+// std::pmr::vector allocates from the vector's resource (uses-allocator
+// construction), and the strings of a multi-string use the value's resource.
+//
+// The name and data buffers passed to the registry are per-thread, and reused.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <memory_resource> // std::pmr::memory_resource, std::pmr::polymorphic_allocator
+#include <string>       // std::pmr::wstring
+#include <string_view>  // std::wstring_view
+#include <vector>       // std::pmr::vector
+#include <string.h>     // memcpy()
+
+namespace winreg
+{
+	namespace pmr
+	{
+		//------------------------------------------------------------------------------
+		// A registry value, with the accessors of winreg::RegValue, whose name and
+		// data are allocated from a memory resource
+		//------------------------------------------------------------------------------
+		class RegValue
+		{
+		public:
+
+			typedef DWORD TypeId;
+			typedef std::pmr::polymorphic_allocator<BYTE> allocator_type;
+
+			explicit RegValue(allocator_type alloc = {})
+				: RegValue(std::wstring_view(), REG_NONE, alloc)
+			{
+			}
+
+			RegValue(std::wstring_view name, TypeId typeId, allocator_type alloc = {})
+				: m_name(name, alloc)
+				, m_typeId(typeId)
+				, m_string(alloc)
+				, m_multiString(alloc)
+				, m_binary(alloc)
+			{
+			}
+
+			RegValue(const RegValue& other) = default;
+			RegValue(RegValue&& other) noexcept = default;
+			RegValue& operator=(const RegValue& other) = default;
+			RegValue& operator=(RegValue&& other) = default;
+
+			// Allocator-extended copy and move: the copy uses alloc, not other's resource
+			RegValue(const RegValue& other, allocator_type alloc)
+				: m_name(other.m_name, alloc)
+				, m_typeId(other.m_typeId)
+				, m_dword(other.m_dword)
+				, m_string(other.m_string, alloc)
+				, m_multiString(other.m_multiString, alloc)
+				, m_binary(other.m_binary, alloc)
+			{
+			}
+
+			RegValue(RegValue&& other, allocator_type alloc)
+				: m_name(std::move(other.m_name), alloc)
+				, m_typeId(other.m_typeId)
+				, m_dword(other.m_dword)
+				, m_string(std::move(other.m_string), alloc)
+				, m_multiString(std::move(other.m_multiString), alloc)
+				, m_binary(std::move(other.m_binary), alloc)
+			{
+			}
+
+			allocator_type get_allocator() const noexcept { return m_binary.get_allocator(); }
+
+			const std::pmr::wstring& name() const noexcept { return m_name; }
+			TypeId GetType() const noexcept { return m_typeId; }
+			bool IsEmpty() const noexcept { return m_typeId == REG_NONE; }
+
+			DWORD Dword() const
+			{
+				Check(REG_DWORD, "Dword() called on a non-DWORD registry value.");
+				return m_dword;
+			}
+
+			const std::pmr::wstring& String() const
+			{
+				Check(REG_SZ, "String() called on a non-REG_SZ registry value.");
+				return m_string;
+			}
+
+			const std::pmr::wstring& ExpandString() const
+			{
+				Check(REG_EXPAND_SZ, "ExpandString() called on a non-REG_EXPAND_SZ registry value.");
+				return m_string;
+			}
+
+			const std::pmr::vector<std::pmr::wstring>& MultiString() const
+			{
+				Check(REG_MULTI_SZ, "MultiString() called on a non-REG_MULTI_SZ registry value.");
+				return m_multiString;
+			}
+
+			const std::pmr::vector<BYTE>& Binary() const
+			{
+				Check(REG_BINARY, "Binary() called on a non-REG_BINARY registry value.");
+				return m_binary;
+			}
+
+			DWORD& Dword()
+			{
+				Check(REG_DWORD, "Dword() called on a non-DWORD registry value.");
+				return m_dword;
+			}
+
+			std::pmr::wstring& String()
+			{
+				Check(REG_SZ, "String() called on a non-REG_SZ registry value.");
+				return m_string;
+			}
+
+			std::pmr::wstring& ExpandString()
+			{
+				Check(REG_EXPAND_SZ, "ExpandString() called on a non-REG_EXPAND_SZ registry value.");
+				return m_string;
+			}
+
+			std::pmr::vector<std::pmr::wstring>& MultiString()
+			{
+				Check(REG_MULTI_SZ, "MultiString() called on a non-REG_MULTI_SZ registry value.");
+				return m_multiString;
+			}
+
+			std::pmr::vector<BYTE>& Binary()
+			{
+				Check(REG_BINARY, "Binary() called on a non-REG_BINARY registry value.");
+				return m_binary;
+			}
+
+			// A copy on the global heap
+			winreg::RegValue ToRegValue() const
+			{
+				winreg::RegValue value(std::wstring(m_name), m_typeId);
+				switch (m_typeId)
+				{
+				case REG_DWORD:     value.Dword() = m_dword; break;
+				case REG_SZ:        value.String().assign(m_string); break;
+				case REG_EXPAND_SZ: value.ExpandString().assign(m_string); break;
+				case REG_MULTI_SZ:
+					value.MultiString().reserve(m_multiString.size());
+					for (const std::pmr::wstring& str : m_multiString)
+					{
+						value.MultiString().emplace_back(str);
+					}
+					break;
+				case REG_BINARY:    value.Binary().assign(m_binary.begin(), m_binary.end()); break;
+				default:            break;
+				}
+				return value;
+			}
+
+		private:
+			std::pmr::wstring m_name;
+			TypeId m_typeId;
+
+			DWORD m_dword = 0;                                  // REG_DWORD
+			std::pmr::wstring m_string;                         // REG_SZ, REG_EXPAND_SZ
+			std::pmr::vector<std::pmr::wstring> m_multiString;  // REG_MULTI_SZ
+			std::pmr::vector<BYTE> m_binary;                    // REG_BINARY
+
+			void Check(TypeId typeId, const char* message) const
+			{
+				_ASSERTE(m_typeId == typeId);
+				if (m_typeId != typeId)
+				{
+					throw std::invalid_argument(message);
+				}
+			}
+		};
+
+
+		//------------------------------------------------------------------------------
+		// A key of a tree read by ReadKeyTree(): its values and its sub-keys, all
+		// allocated from the same memory resource
+		//------------------------------------------------------------------------------
+		struct KeyNode
+		{
+			typedef std::pmr::polymorphic_allocator<BYTE> allocator_type;
+
+			std::pmr::wstring name;                 // "" for the root of the tree
+			std::pmr::vector<RegValue> values;
+			std::pmr::vector<KeyNode> subKeys;
+
+			explicit KeyNode(allocator_type alloc = {})
+				: name(alloc), values(alloc), subKeys(alloc)
+			{
+			}
+
+			KeyNode(std::wstring_view keyName, allocator_type alloc)
+				: name(keyName, alloc), values(alloc), subKeys(alloc)
+			{
+			}
+
+			KeyNode(const KeyNode& other) = default;
+			KeyNode(KeyNode&& other) noexcept = default;
+			KeyNode& operator=(const KeyNode& other) = default;
+			KeyNode& operator=(KeyNode&& other) = default;
+
+			KeyNode(const KeyNode& other, allocator_type alloc)
+				: name(other.name, alloc), values(other.values, alloc), subKeys(other.subKeys, alloc)
+			{
+			}
+
+			KeyNode(KeyNode&& other, allocator_type alloc)
+				: name(std::move(other.name), alloc)
+				, values(std::move(other.values), alloc)
+				, subKeys(std::move(other.subKeys), alloc)
+			{
+			}
+
+			allocator_type get_allocator() const noexcept { return values.get_allocator(); }
+
+			// Number of keys in the tree, including this one
+			size_t KeyCount() const noexcept
+			{
+				size_t count = 1;
+				for (const KeyNode& subKey : subKeys)
+				{
+					count += subKey.KeyCount();
+				}
+				return count;
+			}
+		};
+
+
+		namespace detail
+		{
+			// Builds a value from raw registry data, like MakeRegValue().
+			// The data doesn't need to be aligned for wchar_t, nor to be NUL-terminated.
+			inline void AssignValue(RegValue& value, const BYTE* data, DWORD dataSize)
+			{
+				const size_t unitCount = dataSize / sizeof(wchar_t);
+
+				switch (value.GetType())
+				{
+				case REG_DWORD:
+				{
+					// Any size can be stored (e.g. by other programs, or in offline hives):
+					// shorter data is zero-extended, longer data truncated
+					DWORD dw = 0;
+					memcpy(&dw, data, (dataSize < sizeof(dw)) ? dataSize : sizeof(dw));
+					value.Dword() = dw;
+				}
+				break;
+
+				case REG_SZ:
+				case REG_EXPAND_SZ:
+				{
+					std::pmr::wstring& str = (value.GetType() == REG_SZ) ? value.String() : value.ExpandString();
+					str.resize(unitCount);
+					if (unitCount != 0)
+					{
+						memcpy(&str[0], data, unitCount * sizeof(wchar_t));
+					}
+
+					// Strip off the NUL-terminator, if stored with the data
+					if (!str.empty() && str.back() == L'\0')
+					{
+						str.pop_back();
+					}
+				}
+				break;
+
+				case REG_MULTI_SZ:
+				{
+					auto unitAt = [data](size_t index)
+					{
+						wchar_t unit;
+						memcpy(&unit, data + index * sizeof(wchar_t), sizeof(unit));
+						return unit;
+					};
+
+					// Parse the single strings, up to the double-NUL or the end of the data:
+					// once to count them (a single allocation for the vector), then to copy them
+					size_t count = 0;
+					for (size_t pos = 0; pos < unitCount && unitAt(pos) != L'\0'; pos++, count++)
+					{
+						while (pos < unitCount && unitAt(pos) != L'\0')
+						{
+							pos++;
+						}
+					}
+
+					std::pmr::vector<std::pmr::wstring>& strings = value.MultiString();
+					strings.reserve(count);
+					for (size_t pos = 0; count-- != 0; pos++)
+					{
+						size_t end = pos;
+						while (end < unitCount && unitAt(end) != L'\0')
+						{
+							end++;
+						}
+
+						std::pmr::wstring& str = strings.emplace_back(end - pos, L'\0');
+						memcpy(&str[0], data + pos * sizeof(wchar_t), (end - pos) * sizeof(wchar_t));
+						pos = end;
+					}
+				}
+				break;
+
+				case REG_BINARY:
+					value.Binary().assign(data, data + dataSize);
+					break;
+
+				default:
+					throw std::invalid_argument("Unsupported Windows Registry value type.");
+				}
+			}
+
+
+			// Calls onName(std::wstring_view name) for each sub-key of a key. Before the first
+			// call, subkeyCount is set to the count reported by RegQueryInfoKey(), to reserve room.
+			template <typename OnName>
+			void ForEachSubKeyName(HKEY hKey, OnName onName, DWORD& subkeyCount)
+			{
+				_ASSERTE(hKey != nullptr);
+
+				trace_detail::Scope trace(TraceOp::EnumerateSubKeys, hKey);
+
+				DWORD maxSubkeyNameLength = 0;
+				LONG result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, &subkeyCount,
+					&maxSubkeyNameLength, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+				if (result != ERROR_SUCCESS)
+				{
+					throw RegException(L"RegQueryInfoKey() failed while trying to get sub-keys info.", result);
+				}
+
+				thread_local std::vector<wchar_t> nameBuffer;
+				nameBuffer.resize((std::max)(nameBuffer.size(), static_cast<size_t>(maxSubkeyNameLength) + 1));
+
+				DWORD subkeyIndex = 0;
+				for (;;)
+				{
+					DWORD nameLength = winreg::detail::SafeSizeToDwordCast(nameBuffer.size());
+					result = ::RegEnumKeyEx(hKey, subkeyIndex, nameBuffer.data(), &nameLength,
+						nullptr, nullptr, nullptr, nullptr);
+					if (result == ERROR_NO_MORE_ITEMS)
+					{
+						break;
+					}
+					if ((result == ERROR_MORE_DATA) && (nameBuffer.size() <= MaxKeyNameLength))
+					{
+						// A longer sub-key was added meanwhile
+						nameBuffer.resize(MaxKeyNameLength + 1);
+						continue;
+					}
+					if (result != ERROR_SUCCESS)
+					{
+						throw RegException(L"RegEnumKeyEx() failed trying to get sub-key name.", result);
+					}
+
+					onName(std::wstring_view(nameBuffer.data(), nameLength));
+					subkeyIndex++;
+				}
+
+				trace.Data(REG_NONE, subkeyIndex);
+			}
+
+		} // namespace detail
+
+
+		//------------------------------------------------------------------------------
+		// Enumerations and reads allocating from a memory resource
+		//------------------------------------------------------------------------------
+
+		inline std::pmr::vector<std::pmr::wstring> EnumerateSubKeyNames(HKEY hKey,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		{
+			std::pmr::vector<std::pmr::wstring> subkeyNames(resource);
+			DWORD subkeyCount = 0;
+			detail::ForEachSubKeyName(hKey, [&](std::wstring_view name)
+			{
+				if (subkeyNames.empty())
+				{
+					subkeyNames.reserve(subkeyCount);
+				}
+				subkeyNames.emplace_back(name);
+			}, subkeyCount);
+			return subkeyNames;
+		}
+
+
+		inline std::pmr::vector<std::pmr::wstring> EnumerateValueNames(HKEY hKey,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::EnumerateValueNames, hKey);
+
+			DWORD valueCount = 0;
+			DWORD maxValueNameLength = 0;
+			LONG result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+				&valueCount, &maxValueNameLength, nullptr, nullptr, nullptr);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryInfoKey() failed while trying to get value info.", result);
+			}
+
+			std::pmr::vector<std::pmr::wstring> valueNames(resource);
+			valueNames.reserve(valueCount);
+
+			thread_local std::vector<wchar_t> nameBuffer;
+			nameBuffer.resize((std::max)(nameBuffer.size(), static_cast<size_t>(maxValueNameLength) + 1));
+
+			for (DWORD valueIndex = 0; ; )
+			{
+				DWORD nameLength = winreg::detail::SafeSizeToDwordCast(nameBuffer.size());
+				result = ::RegEnumValue(hKey, valueIndex, nameBuffer.data(), &nameLength,
+					nullptr, nullptr, nullptr, nullptr);
+				if (result == ERROR_NO_MORE_ITEMS)
+				{
+					break;
+				}
+				if ((result == ERROR_MORE_DATA) && (nameBuffer.size() <= MaxValueNameLength))
+				{
+					// A longer value name was added meanwhile
+					nameBuffer.resize((std::min)(nameBuffer.size() * 2,
+						static_cast<size_t>(MaxValueNameLength) + 1));
+					continue;
+				}
+				if (result != ERROR_SUCCESS)
+				{
+					throw RegException(L"RegEnumValue() failed to get value name.", result);
+				}
+
+				valueNames.emplace_back(std::wstring_view(nameBuffer.data(), nameLength));
+				valueIndex++;
+			}
+
+			trace.Data(REG_NONE, valueNames.size());
+			return valueNames;
+		}
+
+
+		// Like winreg::EnumerateValues(): one RegEnumValue() call per value,
+		// and values of types not supported by RegValue are skipped.
+		template <typename NamePredicate = AnyName>
+		std::pmr::vector<RegValue> EnumerateValues(HKEY hKey,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+			DWORD typeMask = AllValueTypes, NamePredicate matches = NamePredicate())
+		{
+			std::pmr::vector<RegValue> values(resource);
+			winreg::detail::ForEachRawValue(hKey, [&](std::wstring_view name, DWORD valueType, const BYTE* data, DWORD dataSize)
+			{
+				if ((typeMask & ValueTypeMask(valueType)) != 0 && winreg::detail::IsSupportedValueType(valueType)
+					&& matches(name))
+				{
+					detail::AssignValue(values.emplace_back(name, valueType), data, dataSize);
+				}
+			});
+			return values;
+		}
+
+
+		inline RegValue QueryValue(HKEY hKey, std::wstring_view valueName,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::QueryValue, hKey, valueName);
+
+			// Read straight into a per-thread buffer, growing it if the data doesn't fit
+			thread_local std::vector<BYTE> buffer(256);
+			DWORD valueType = REG_NONE;
+			DWORD dataSize = 0;
+			LONG result = ERROR_MORE_DATA;
+			while (result == ERROR_MORE_DATA)
+			{
+				dataSize = winreg::detail::SafeSizeToDwordCast(buffer.size());
+				result = ::RegQueryValueEx(hKey, winreg::detail::TerminatedValueName(valueName), nullptr, &valueType,
+					buffer.data(), &dataSize);
+				if (result == ERROR_MORE_DATA)
+				{
+					buffer.resize(dataSize);
+				}
+			}
+			trace.Status(result);
+			trace.Data(valueType, dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryValueEx() failed in reading value data.", result);
+			}
+
+			RegValue value(valueName, valueType, resource);
+			detail::AssignValue(value, buffer.data(), dataSize);
+			return value;
+		}
+
+
+		namespace detail
+		{
+			inline void ReadKeyTree(HKEY hKey, KeyNode& node, DWORD typeMask)
+			{
+				node.values = EnumerateValues(hKey, node.get_allocator().resource(), typeMask);
+
+				DWORD subkeyCount = 0;
+				ForEachSubKeyName(hKey, [&](std::wstring_view name)
+				{
+					if (node.subKeys.empty())
+					{
+						node.subKeys.reserve(subkeyCount);
+					}
+					node.subKeys.emplace_back(name);
+				}, subkeyCount);
+
+				for (auto it = node.subKeys.begin(); it != node.subKeys.end(); )
+				{
+					HKEY hSubKey = nullptr;
+					LONG result = ::RegOpenKeyEx(hKey, it->name.c_str(), 0, KEY_READ, &hSubKey);
+					if (result == ERROR_FILE_NOT_FOUND)
+					{
+						// Deleted since it was enumerated
+						it = node.subKeys.erase(it);
+						continue;
+					}
+					if (result != ERROR_SUCCESS)
+					{
+						throw RegException(L"RegOpenKeyEx() failed trying opening a key:{" +
+							std::wstring(it->name) + L"}", result);
+					}
+
+					RegKey subKey(hSubKey);
+					ReadKeyTree(subKey.Handle(), *it, typeMask);
+					++it;
+				}
+			}
+
+		} // namespace detail
+
+
+		//------------------------------------------------------------------------------
+		// Reads a key tree (the values of the types in typeMask, and all the sub-keys)
+		// into nodes allocated from resource. Sub-keys deleted while the tree is read
+		// are left out. Throws RegException on other errors.
+		//------------------------------------------------------------------------------
+		inline KeyNode ReadKeyTree(HKEY hKey, const std::wstring& subKey,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+			DWORD typeMask = AllValueTypes)
+		{
+			KeyNode root(resource);
+			if (subKey.empty())
+			{
+				detail::ReadKeyTree(hKey, root, typeMask);
+			}
+			else
+			{
+				RegKey key = RegKey::OpenKey(hKey, subKey, KEY_READ);
+				detail::ReadKeyTree(key.Handle(), root, typeMask);
+			}
+			return root;
+		}
+
+	} // namespace pmr
+
+} // namespace winreg
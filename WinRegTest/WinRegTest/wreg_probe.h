@@ -0,0 +1,348 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_probe.h
+// DESC: Negative lookups of value names, for keys probed for values that are
+//       usually absent.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// Probing a key for a missing value costs a registry call and, with QueryValue(),
+// a thrown RegException. ValueProbeFilter keeps a Bloom filter of the names of
+// the values of a key, built from one enumeration, and answers "definitely
+// absent" for most missing names without calling the registry.
+//
+// The filter is rebuilt when the key changes: a change notification on the key
+// (RegNotifyChangeKeyValue(), with REG_NOTIFY_CHANGE_LAST_SET) marks it stale,
+// from a thread pool callback, and the next probe rebuilds it. Probes don't
+// make any system call while the key doesn't change. As notifications are
+// asynchronous, a value added by another thread or process is seen shortly
+// after it's written; Invalidate() makes the writes of this process seen at once.
+//
+// Names are hashed case-insensitively. A name passing the filter may still be
+// missing (a false positive): QueryValue() counts them, to compare the observed
+// rate with the configured one.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::max
+#include <atomic>       // std::atomic
+#include <cmath>        // std::log, std::ceil
+#include <cstdint>      // uint64_t
+#include <memory>       // std::shared_ptr
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <string_view>  // std::wstring_view
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// Counters of a ValueProbeFilter
+	//------------------------------------------------------------------------------
+	struct ValueProbeStats
+	{
+		size_t probes = 0;
+		size_t definitelyAbsent = 0;    // answered without calling the registry
+		size_t found = 0;
+		size_t falsePositives = 0;      // passed the filter, but missing
+		size_t rebuilds = 0;            // including the first build
+
+		// Fraction of the missing names that passed the filter
+		double FalsePositiveRate() const noexcept
+		{
+			const size_t missing = definitelyAbsent + falsePositives;
+			return (missing != 0) ? static_cast<double>(falsePositives) / missing : 0;
+		}
+	};
+
+
+	namespace probe_detail
+	{
+		// Bloom filter of value names
+		class NameFilter
+		{
+		public:
+			NameFilter(size_t nameCount, double falsePositiveRate)
+			{
+				// m = -n ln(p) / ln(2)^2 bits, k = m/n ln(2) hashes
+				const double ln2 = 0.6931471805599453;
+				const double n = static_cast<double>((std::max)(nameCount, size_t(1)));
+				const double bits = std::ceil(-n * std::log(falsePositiveRate) / (ln2 * ln2));
+				// A power of two: any odd stride of the double hashing visits all the bits
+				m_bits = 64;
+				while (m_bits < bits)
+				{
+					m_bits *= 2;
+				}
+				m_hashes = (std::max)(static_cast<uint32_t>(bits / n * ln2 + 0.5), uint32_t(1));
+				m_words.assign(static_cast<size_t>((m_bits + 63) / 64), 0);
+			}
+
+			void Add(std::wstring_view name) noexcept
+			{
+				const uint64_t hash = Hash(name);
+				for (uint32_t i = 0; i < m_hashes; i++)
+				{
+					const uint64_t bit = Bit(hash, i);
+					m_words[bit / 64] |= uint64_t(1) << (bit % 64);
+				}
+			}
+
+			bool MayContain(std::wstring_view name) const noexcept
+			{
+				const uint64_t hash = Hash(name);
+				for (uint32_t i = 0; i < m_hashes; i++)
+				{
+					const uint64_t bit = Bit(hash, i);
+					if ((m_words[bit / 64] & (uint64_t(1) << (bit % 64))) == 0)
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+
+		private:
+			std::vector<uint64_t> m_words;
+			uint64_t m_bits;
+			uint32_t m_hashes;
+
+			// FNV-1a of the upper-cased name, then mixed (splitmix64's finalizer)
+			static uint64_t Hash(std::wstring_view name) noexcept
+			{
+				uint64_t hash = 14695981039346656037ULL;
+				for (wchar_t ch : name)
+				{
+					hash ^= static_cast<uint64_t>(FoldNameChar(ch));
+					hash *= 1099511628211ULL;
+				}
+				hash ^= hash >> 30;
+				hash *= 0xBF58476D1CE4E5B9ULL;
+				hash ^= hash >> 27;
+				hash *= 0x94D049BB133111EBULL;
+				hash ^= hash >> 31;
+				return hash;
+			}
+
+			// Double hashing: h1 + i * h2, h2 odd
+			uint64_t Bit(uint64_t hash, uint32_t i) const noexcept
+			{
+				const uint64_t h1 = hash & 0xFFFFFFFF;
+				const uint64_t h2 = (hash >> 32) | 1;
+				return (h1 + i * h2) & (m_bits - 1);
+			}
+		};
+
+	} // namespace probe_detail
+
+
+	//------------------------------------------------------------------------------
+	// Answers "definitely absent" for most missing value names of a key, without
+	// calling the registry (see the notes at the top of this file). Thread-safe.
+	//------------------------------------------------------------------------------
+	class ValueProbeFilter
+	{
+	public:
+
+		// Watches (a new handle to) hKey. Throws RegException if the key can't be
+		// opened or watched.
+		explicit ValueProbeFilter(HKEY hKey, double falsePositiveRate = 0.01)
+			: m_falsePositiveRate(falsePositiveRate)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE(falsePositiveRate > 0 && falsePositiveRate < 1);
+
+			LONG result = ::RegOpenKeyEx(hKey, L"", 0, KEY_QUERY_VALUE | KEY_NOTIFY, &m_hKey);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegOpenKeyEx() failed trying opening the key to filter.", result);
+			}
+
+			m_event = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+			if (m_event == nullptr
+				|| !::RegisterWaitForSingleObject(&m_wait, m_event, OnChange, this, INFINITE, WT_EXECUTEDEFAULT))
+			{
+				m_wait = nullptr;
+				Release();
+				throw RegException(L"Can't wait for the changes of the key to filter.", ERROR_NOT_ENOUGH_MEMORY);
+			}
+		}
+
+
+		~ValueProbeFilter()
+		{
+			Release();
+		}
+
+
+		ValueProbeFilter(const ValueProbeFilter&) = delete;
+		ValueProbeFilter& operator=(const ValueProbeFilter&) = delete;
+
+
+		// Returns false if the key has (almost certainly) no value with this name
+		bool MayContain(std::wstring_view valueName)
+		{
+			const std::shared_ptr<const probe_detail::NameFilter> filter = CurrentFilter();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stats.probes++;
+			if (filter != nullptr && !filter->MayContain(valueName))
+			{
+				m_stats.definitelyAbsent++;
+				return false;
+			}
+			return true;
+		}
+
+
+		// Reads a value, unless the filter says it's absent: status is ERROR_FILE_NOT_FOUND
+		// for a missing value, instead of a thrown RegException.
+		RegValueResult QueryValue(const std::wstring& valueName)
+		{
+			if (!MayContain(valueName))
+			{
+				return RegValueResult{ ERROR_FILE_NOT_FOUND, RegValue(valueName, REG_NONE) };
+			}
+
+			RegValueResult result{ ERROR_SUCCESS, RegValue(valueName, REG_NONE) };
+			try
+			{
+				result.value = winreg::QueryValue(m_hKey, valueName);
+			}
+			catch (const RegException& e)
+			{
+				result.status = e.ErrorCode();
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (result.status == ERROR_SUCCESS)
+			{
+				m_stats.found++;
+			}
+			else if (result.status == ERROR_FILE_NOT_FOUND)
+			{
+				m_stats.falsePositives++;
+			}
+			return result;
+		}
+
+
+		// Rebuilds the filter at the next probe, e.g. after this process added a value
+		void Invalidate() noexcept
+		{
+			m_changes.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+
+		ValueProbeStats Stats() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_stats;
+		}
+
+	private:
+		HKEY m_hKey = nullptr;          // KEY_QUERY_VALUE | KEY_NOTIFY
+		HANDLE m_event = nullptr;
+		HANDLE m_wait = nullptr;
+		double m_falsePositiveRate;
+
+		// The filter is current while m_builtAt == m_changes
+		std::atomic<uint64_t> m_changes{ 1 };
+		std::atomic<uint64_t> m_builtAt{ 0 };
+		std::mutex m_rebuildMutex;
+
+		mutable std::mutex m_mutex;
+		std::shared_ptr<const probe_detail::NameFilter> m_filter;   // nullptr: no filtering
+		ValueProbeStats m_stats;
+
+
+		static void CALLBACK OnChange(PVOID context, BOOLEAN /* timedOut */)
+		{
+			static_cast<ValueProbeFilter*>(context)->Invalidate();
+		}
+
+
+		// Returns the filter, rebuilding it first if the key changed
+		std::shared_ptr<const probe_detail::NameFilter> CurrentFilter()
+		{
+			if (m_builtAt.load(std::memory_order_acquire) == m_changes.load(std::memory_order_acquire))
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_filter;
+			}
+
+			// Other probes wait for the rebuild, rather than using the old filter
+			std::lock_guard<std::mutex> rebuildLock(m_rebuildMutex);
+			const uint64_t changes = m_changes.load(std::memory_order_acquire);
+			if (m_builtAt.load(std::memory_order_acquire) == changes)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_filter;
+			}
+
+			// Watch first, so that changes made while enumerating cause another rebuild
+			LONG result = ::RegNotifyChangeKeyValue(m_hKey, FALSE,
+				REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, m_event, TRUE);
+
+			std::shared_ptr<const probe_detail::NameFilter> filter;
+			if (result == ERROR_SUCCESS)
+			{
+				try
+				{
+					const std::vector<std::wstring> names = EnumerateValueNames(m_hKey);
+					auto built = std::make_shared<probe_detail::NameFilter>(names.size(), m_falsePositiveRate);
+					for (const std::wstring& name : names)
+					{
+						built->Add(name);
+					}
+					filter = std::move(built);
+				}
+				catch (const RegException&)
+				{
+					// Not filtering: every probe goes to the registry
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_filter = filter;
+				m_stats.rebuilds++;
+			}
+			if (filter != nullptr)
+			{
+				// Otherwise, the next probe tries again
+				m_builtAt.store(changes, std::memory_order_release);
+			}
+			return filter;
+		}
+
+
+		void Release() noexcept
+		{
+			if (m_wait != nullptr)
+			{
+				::UnregisterWaitEx(m_wait, INVALID_HANDLE_VALUE);
+				m_wait = nullptr;
+			}
+			if (m_hKey != nullptr)
+			{
+				::RegCloseKey(m_hKey);
+				m_hKey = nullptr;
+			}
+			if (m_event != nullptr)
+			{
+				::CloseHandle(m_event);
+				m_event = nullptr;
+			}
+		}
+	};
+
+} // namespace winreg
@@ -0,0 +1,412 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_query.h
+// DESC: Path-glob queries over registry key trees.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// A KeyPathQuery is compiled from a pattern like:
+//
+//     SOFTWARE\*\Uninstall\*\DisplayName
+//     HKLM\SYSTEM\ControlSet*\Services\**\ImagePath
+//
+// Segments are separated by backslashes, and are matched case-insensitively:
+//
+//  *, ?, [...]  wildcards within a single key name (see winreg::NameGlob)
+//  **           any number of nested keys, including none
+//
+// The pattern is compiled into a small automaton, whose states are positions in
+// the list of segments. The key tree is walked from the root, tracking the set
+// of states reached by the path so far: a sub-key is opened only if it leads to
+// at least one live state, and keys whose live states only need plain names
+// (without wildcards) are not even enumerated: those names are opened directly.
+//
+// Results are streamed to a callback, during the walk.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::sort, std::unique, std::equal, std::none_of
+#include <stdexcept>    // std::invalid_argument
+#include <string>       // std::wstring
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	class KeyPathQuery
+	{
+	public:
+
+		// Counters collected while evaluating a query
+		struct Stats
+		{
+			size_t keysOpened = 0;          // sub-keys opened during the walk
+			size_t keysEnumerated = 0;      // keys whose sub-keys were enumerated
+			size_t matches = 0;             // results passed to the callback
+		};
+
+
+		// Compiles the pattern. A leading predefined key name (HKLM, HKEY_CURRENT_USER, etc.)
+		// is recognized, and used as the default root (see RootKey()).
+		// Throws std::invalid_argument for an empty or malformed pattern.
+		explicit KeyPathQuery(const std::wstring& pattern)
+		{
+			std::vector<std::wstring> parts;
+			std::wstring current;
+			for (wchar_t ch : pattern)
+			{
+				if (ch == L'\\')
+				{
+					if (!current.empty())
+					{
+						parts.push_back(current);
+						current.clear();
+					}
+				}
+				else
+				{
+					current.push_back(ch);
+				}
+			}
+			if (!current.empty())
+			{
+				parts.push_back(current);
+			}
+
+			size_t first = 0;
+			if (!parts.empty())
+			{
+				m_rootKey = PredefinedKeyFromName(parts[0]);
+				if (m_rootKey != nullptr)
+				{
+					m_rootName = parts[0];
+					first = 1;
+				}
+			}
+
+			if (first == parts.size())
+			{
+				throw std::invalid_argument("KeyPathQuery: empty pattern.");
+			}
+
+			for (size_t i = first; i < parts.size(); i++)
+			{
+				if (parts[i] == L"**")
+				{
+					// Consecutive "**" are the same as one
+					if (m_segments.empty() || !m_segments.back().anyDepth)
+					{
+						m_segments.push_back(Segment{ parts[i], NameGlob(L"*"), true, false });
+					}
+				}
+				else
+				{
+					NameGlob glob(parts[i]);
+					const bool literal = glob.IsLiteral();
+					m_segments.push_back(Segment{ parts[i], std::move(glob), false, literal });
+				}
+			}
+		}
+
+
+		// The predefined key named at the start of the pattern, or nullptr if none
+		HKEY RootKey() const noexcept
+		{
+			return m_rootKey;
+		}
+
+
+		//
+		// Calls onKey(const std::wstring& path, HKEY hKey) for each key below root whose
+		// path matches the whole pattern. Paths are relative to root (prefixed by the
+		// predefined key name, if the pattern started with one). The key handle is only
+		// valid during the call.
+		//
+		template <typename OnKey>
+		Stats ForEachKey(HKEY root, OnKey onKey) const
+		{
+			_ASSERTE(root != nullptr);
+
+			Stats stats;
+			Walk(root, m_rootName, Start(m_segments.size()), m_segments.size(), stats,
+				[&](const std::wstring& path, HKEY hKey)
+			{
+				onKey(path, hKey);
+				stats.matches++;
+			});
+			return stats;
+		}
+
+
+		template <typename OnKey>
+		Stats ForEachKey(OnKey onKey) const
+		{
+			return ForEachKey(CheckedRootKey(), onKey);
+		}
+
+
+		//
+		// Treats the last segment of the pattern as a value name, and calls
+		// onValue(const std::wstring& keyPath, const RegValue& value) for each value
+		// matching it, in the keys matching the other segments.
+		// Values of types not supported by RegValue are skipped.
+		//
+		template <typename OnValue>
+		Stats ForEachValue(HKEY root, OnValue onValue) const
+		{
+			_ASSERTE(root != nullptr);
+
+			const Segment& valueSegment = m_segments.back();
+			if (valueSegment.anyDepth)
+			{
+				throw std::invalid_argument("KeyPathQuery: a value name can't be \"**\".");
+			}
+
+			const size_t keySegments = m_segments.size() - 1;
+
+			Stats stats;
+			Walk(root, m_rootName, Start(keySegments), keySegments, stats,
+				[&](const std::wstring& path, HKEY hKey)
+			{
+				if (valueSegment.literal)
+				{
+					// Probe the value, to avoid throwing for the (common) keys without it
+					LONG result = ::RegQueryValueEx(hKey, valueSegment.text.c_str(),
+						nullptr, nullptr, nullptr, nullptr);
+					if (result != ERROR_SUCCESS)
+					{
+						return;
+					}
+
+					RegValue value(valueSegment.text, REG_NONE);
+					try
+					{
+						value = QueryValue(hKey, valueSegment.text);
+					}
+					catch (const RegException&)
+					{
+						return;     // deleted meanwhile
+					}
+					catch (const std::invalid_argument&)
+					{
+						return;     // unsupported type
+					}
+
+					onValue(path, static_cast<const RegValue&>(value));
+					stats.matches++;
+				}
+				else
+				{
+					for (const RegValue& value : EnumerateValues(hKey, AllValueTypes, valueSegment.glob))
+					{
+						onValue(path, value);
+						stats.matches++;
+					}
+				}
+			});
+			return stats;
+		}
+
+
+		template <typename OnValue>
+		Stats ForEachValue(OnValue onValue) const
+		{
+			return ForEachValue(CheckedRootKey(), onValue);
+		}
+
+
+		// Maps HKLM, HKEY_LOCAL_MACHINE, etc. (any case) to the predefined key,
+		// or returns nullptr if the name isn't one of them.
+		static HKEY PredefinedKeyFromName(const std::wstring& name)
+		{
+			struct Root { const wchar_t* shortName; const wchar_t* longName; HKEY hKey; };
+			const Root roots[] = {
+				{ L"HKCR", L"HKEY_CLASSES_ROOT", HKEY_CLASSES_ROOT },
+				{ L"HKCU", L"HKEY_CURRENT_USER", HKEY_CURRENT_USER },
+				{ L"HKLM", L"HKEY_LOCAL_MACHINE", HKEY_LOCAL_MACHINE },
+				{ L"HKU", L"HKEY_USERS", HKEY_USERS },
+				{ L"HKCC", L"HKEY_CURRENT_CONFIG", HKEY_CURRENT_CONFIG },
+			};
+
+			for (const Root& root : roots)
+			{
+				if (EqualNames(name, root.shortName) || EqualNames(name, root.longName))
+				{
+					return root.hKey;
+				}
+			}
+			return nullptr;
+		}
+
+	private:
+
+		struct Segment
+		{
+			std::wstring text;
+			NameGlob glob;
+			bool anyDepth;      // "**"
+			bool literal;       // plain name, without wildcards
+		};
+
+		// Sorted set of automaton states: state i means "segments [0, i) matched"
+		typedef std::vector<size_t> StateSet;
+
+		std::vector<Segment> m_segments;
+		HKEY m_rootKey = nullptr;
+		std::wstring m_rootName;
+
+
+		static bool EqualNames(std::wstring_view lhs, std::wstring_view rhs)
+		{
+			return lhs.size() == rhs.size()
+				&& std::equal(lhs.begin(), lhs.end(), rhs.begin(), NameCharsEqual);
+		}
+
+
+		HKEY CheckedRootKey() const
+		{
+			if (m_rootKey == nullptr)
+			{
+				throw std::invalid_argument("KeyPathQuery: the pattern doesn't name a root key.");
+			}
+			return m_rootKey;
+		}
+
+
+		// Adds the states reachable without consuming a key name: "**" can match no key at all
+		void Close(StateSet& states, size_t accept) const
+		{
+			for (size_t i = 0; i < states.size(); i++)
+			{
+				const size_t state = states[i];
+				if (state < accept && m_segments[state].anyDepth)
+				{
+					states.push_back(state + 1);
+				}
+			}
+			std::sort(states.begin(), states.end());
+			states.erase(std::unique(states.begin(), states.end()), states.end());
+		}
+
+
+		StateSet Start(size_t accept) const
+		{
+			StateSet states{ 0 };
+			Close(states, accept);
+			return states;
+		}
+
+
+		// States reached from the given ones by descending into a sub-key with the given name
+		StateSet Step(const StateSet& states, std::wstring_view name, size_t accept) const
+		{
+			StateSet next;
+			for (size_t state : states)
+			{
+				if (state == accept)
+				{
+					continue;
+				}
+
+				const Segment& segment = m_segments[state];
+				if (segment.anyDepth)
+				{
+					next.push_back(state);
+				}
+				else if (segment.glob(name))
+				{
+					next.push_back(state + 1);
+				}
+			}
+			Close(next, accept);
+			return next;
+		}
+
+
+		template <typename OnMatch>
+		void Walk(HKEY hKey, const std::wstring& path, const StateSet& states, size_t accept,
+			Stats& stats, const OnMatch& onMatch) const
+		{
+			if (std::binary_search(states.begin(), states.end(), accept))
+			{
+				onMatch(path, hKey);
+			}
+
+			// Can any state still consume a key name? If all of them need plain names,
+			// open those names directly, without enumerating the sub-keys.
+			bool live = false;
+			bool literalOnly = true;
+			for (size_t state : states)
+			{
+				if (state < accept)
+				{
+					live = true;
+					literalOnly = literalOnly && m_segments[state].literal;
+				}
+			}
+			if (!live)
+			{
+				return;
+			}
+
+			std::vector<std::wstring> subkeyNames;
+			if (literalOnly)
+			{
+				for (size_t state : states)
+				{
+					const std::wstring& name = m_segments[state].text;
+					if (state < accept && std::none_of(subkeyNames.begin(), subkeyNames.end(),
+						[&](const std::wstring& other) { return EqualNames(name, other); }))
+					{
+						subkeyNames.push_back(name);
+					}
+				}
+			}
+			else
+			{
+				stats.keysEnumerated++;
+				try
+				{
+					subkeyNames = EnumerateSubKeyNames(hKey, [&](std::wstring_view name)
+					{
+						return !Step(states, name, accept).empty();
+					});
+				}
+				catch (const RegException&)
+				{
+					return;     // e.g. no enumeration rights, or key deleted meanwhile
+				}
+			}
+
+			for (const std::wstring& name : subkeyNames)
+			{
+				const StateSet next = Step(states, name, accept);
+				if (next.empty())
+				{
+					continue;
+				}
+
+				// Keys that vanished or can't be read are skipped, not reported
+				HKEY hSubKey = nullptr;
+				LONG result = ::RegOpenKeyEx(hKey, name.c_str(), 0, KEY_READ, &hSubKey);
+				if (result != ERROR_SUCCESS)
+				{
+					continue;
+				}
+				RegKey subKey(hSubKey);
+				stats.keysOpened++;
+
+				Walk(subKey.Handle(), path.empty() ? name : path + L"\\" + name, next, accept,
+					stats, onMatch);
+			}
+		}
+	};
+
+} // namespace winreg
@@ -0,0 +1,694 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_trace.h
+// DESC: Recording of the registry calls made through WinReg, and their replay.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// TraceRecorder is a TraceSink (see wreg.h) writing the traced calls to a file;
+// ReplayTrace() makes the same calls again, on whatever registry the program
+// is built against (the real one, or the emulation of wreg_emu.h), and measures
+// their latency and throughput.
+//
+// Recording appends fixed-size records to a buffer, under a mutex, and writes
+// the buffer out when it's full: no allocation, and no I/O, per call. Value
+// data isn't recorded, only its type and size: the replay writes zeros.
+//
+// Keys are recorded by handle. The replay maps each handle to the one opened by
+// the replay of the call that opened it, and a call on a key waits until that
+// call has been replayed, even on another thread. Calls on keys opened outside
+// of the traced wrappers (e.g. RegKey objects built from a raw HKEY) can't be
+// replayed, and are counted as skipped.
+//
+// Each recorded thread is replayed by a thread of its own, as fast as possible,
+// or following the recorded timestamps (scaled by a speed factor).
+//
+// Names are stored as UTF-16, whatever the size of wchar_t.
+//
+// File layout (little-endian):
+//
+//  TraceFileHeader
+//  { TraceRecordHeader, char16_t[nameLength] } for each call, in completion order
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include "wreg_file.h"  // OpenFile(), MappedFile
+#include <algorithm>    // std::sort, std::max
+#include <atomic>       // std::atomic
+#include <chrono>       // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <cstdint>      // uint64_t, uint32_t
+#include <cstdio>       // fwrite(), fclose()
+#include <cstring>      // memcpy(), memcmp()
+#include <filesystem>   // std::filesystem::path
+#include <map>          // std::map
+#include <mutex>        // std::mutex
+#include <stdexcept>    // std::runtime_error
+#include <string>       // std::wstring
+#include <thread>       // std::thread
+#include <vector>       // std::vector
+
+namespace winreg
+{
+	//------------------------------------------------------------------------------
+	// On-disk structures of the trace file
+	//------------------------------------------------------------------------------
+	struct TraceFileHeader
+	{
+		char magic[8];              // "WRTRC001"
+		uint64_t reserved;
+	};
+
+	struct TraceRecordHeader
+	{
+		uint64_t timestamp;         // ns since the recording started, when the call started
+		uint64_t hKey;              // handle values, as recorded
+		uint64_t result;
+		uint32_t duration;          // ns (saturated)
+		uint32_t thread;            // threads numbered from 1, in order of first call
+		uint32_t type;
+		uint32_t size;              // saturated
+		int32_t status;
+		uint16_t nameLength;        // UTF-16 code units following the header
+		uint8_t op;                 // TraceOp
+		uint8_t reserved;
+	};
+
+	static_assert(sizeof(TraceRecordHeader) == 48, "Unexpected trace record layout");
+
+
+	//------------------------------------------------------------------------------
+	// A call read from a trace file
+	//------------------------------------------------------------------------------
+	struct TraceRecord
+	{
+		TraceOp op;
+		uint32_t thread;
+		uint64_t timestamp;         // ns
+		uint32_t duration;          // ns
+		uint64_t hKey;
+		uint64_t result;
+		DWORD type;
+		size_t size;
+		LONG status;
+		std::wstring name;
+	};
+
+
+	namespace trace_detail
+	{
+		// Appends the name as UTF-16 (at most 65535 code units)
+		inline uint16_t AppendUtf16(std::vector<BYTE>& buffer, std::wstring_view name)
+		{
+			const size_t offset = buffer.size();
+			buffer.resize(offset + 2 * (std::min)(name.size(), size_t(0x7FFF)) * sizeof(uint16_t));
+			BYTE* const units = buffer.data() + offset;
+
+			size_t length = 0;
+			auto append = [&](uint32_t unit)
+			{
+				const uint16_t u = static_cast<uint16_t>(unit);
+				memcpy(units + length * sizeof(u), &u, sizeof(u));
+				length++;
+			};
+			for (size_t i = 0; i < name.size() && length + 2 <= 0xFFFE; i++)
+			{
+				const uint32_t c = static_cast<uint32_t>(name[i]);
+				if (c > 0xFFFF)
+				{
+					append(0xD800 + ((c - 0x10000) >> 10));
+					append(0xDC00 + ((c - 0x10000) & 0x3FF));
+				}
+				else
+				{
+					append(c);
+				}
+			}
+			buffer.resize(offset + length * sizeof(uint16_t));
+			return static_cast<uint16_t>(length);
+		}
+
+
+		inline std::wstring FromUtf16(const BYTE* data, size_t length)
+		{
+			std::wstring name;
+			name.reserve(length);
+			for (size_t i = 0; i < length; i++)
+			{
+				uint16_t unit = 0;
+				memcpy(&unit, data + i * sizeof(unit), sizeof(unit));
+				uint16_t next = 0;
+				if (sizeof(wchar_t) == 4 && unit >= 0xD800 && unit < 0xDC00 && i + 1 < length)
+				{
+					memcpy(&next, data + (i + 1) * sizeof(next), sizeof(next));
+				}
+				if (next >= 0xDC00 && next < 0xE000)
+				{
+					name.push_back(static_cast<wchar_t>(0x10000 + ((unit - 0xD800) << 10) + (next - 0xDC00)));
+					i++;
+				}
+				else
+				{
+					name.push_back(static_cast<wchar_t>(unit));
+				}
+			}
+			return name;
+		}
+
+
+		// Predefined keys (HKEY_CURRENT_USER, etc.), possibly sign-extended to 64 bits
+		inline bool IsPredefinedKey(uint64_t hKey) noexcept
+		{
+			const uint64_t high = hKey >> 32;
+			const uint32_t low = static_cast<uint32_t>(hKey);
+			return (high == 0 || high == 0xFFFFFFFF) && low >= 0x80000000 && low <= 0x80000006;
+		}
+
+
+		// The predefined key of this process for a recorded one (nullptr if not available)
+		inline HKEY PredefinedKey(uint64_t hKey) noexcept
+		{
+			switch (static_cast<uint32_t>(hKey) - 0x80000000)
+			{
+			case 0:     return HKEY_CLASSES_ROOT;
+			case 1:     return HKEY_CURRENT_USER;
+			case 2:     return HKEY_LOCAL_MACHINE;
+			case 3:     return HKEY_USERS;
+			case 5:     return HKEY_CURRENT_CONFIG;
+			default:    return nullptr;
+			}
+		}
+
+
+		inline const wchar_t* PredefinedKeyName(uint64_t hKey) noexcept
+		{
+			static const wchar_t* const names[] = { L"HKEY_CLASSES_ROOT", L"HKEY_CURRENT_USER",
+				L"HKEY_LOCAL_MACHINE", L"HKEY_USERS", L"HKEY_PERFORMANCE_DATA", L"HKEY_CURRENT_CONFIG",
+				L"HKEY_DYN_DATA" };
+			return names[static_cast<uint32_t>(hKey) - 0x80000000];
+		}
+
+	} // namespace trace_detail
+
+
+	//------------------------------------------------------------------------------
+	// Records the traced calls to a file (see the notes at the top of this file).
+	// Start() and Stop() recording; the destructor stops it too.
+	//------------------------------------------------------------------------------
+	class TraceRecorder : public TraceSink
+	{
+	public:
+
+		// Creates the trace file; records are written out every bufferSize bytes.
+		// Throws std::runtime_error if the file can't be created.
+		explicit TraceRecorder(const std::filesystem::path& fileName, size_t bufferSize = 1 << 20)
+			: m_bufferSize(bufferSize), m_start(std::chrono::steady_clock::now())
+		{
+			m_file = OpenFile(fileName, "wb");
+			if (m_file == nullptr)
+			{
+				throw std::runtime_error("TraceRecorder: can't create the trace file.");
+			}
+
+			TraceFileHeader header = {};
+			memcpy(header.magic, "WRTRC001", 8);
+			m_buffer.reserve(m_bufferSize + sizeof(TraceRecordHeader) + 2 * 0xFFFF);
+			m_buffer.insert(m_buffer.end(), reinterpret_cast<const BYTE*>(&header),
+				reinterpret_cast<const BYTE*>(&header) + sizeof(header));
+		}
+
+
+		~TraceRecorder() override
+		{
+			TraceSink* expected = this;
+			trace_detail::ActiveSink().compare_exchange_strong(expected, nullptr);
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				Flush();
+			}
+			fclose(m_file);
+		}
+
+
+		TraceRecorder(const TraceRecorder&) = delete;
+		TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+
+		// Installs this recorder as the trace sink
+		void Start() noexcept
+		{
+			SetTraceSink(this);
+		}
+
+
+		// Removes this recorder (if it's the trace sink), and writes out the buffer.
+		// Throws std::runtime_error if the file can't be written.
+		void Stop()
+		{
+			TraceSink* expected = this;
+			trace_detail::ActiveSink().compare_exchange_strong(expected, nullptr);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Flush();
+			if (m_failed)
+			{
+				throw std::runtime_error("TraceRecorder: can't write the trace file.");
+			}
+		}
+
+
+		size_t EventCount() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_events;
+		}
+
+
+		void Record(const TraceEvent& event) noexcept override
+		{
+			thread_local uint32_t threadNumber = 0;
+			if (threadNumber == 0)
+			{
+				threadNumber = ++NextThreadNumber();
+			}
+
+			TraceRecordHeader record = {};
+			record.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				event.start - m_start).count());
+			record.hKey = reinterpret_cast<uintptr_t>(event.hKey);
+			record.result = reinterpret_cast<uintptr_t>(event.result);
+			record.duration = Saturate(static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(event.duration).count()));
+			record.thread = threadNumber;
+			record.type = event.type;
+			record.size = Saturate(event.size);
+			record.status = event.status;
+			record.op = static_cast<uint8_t>(event.op);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const size_t offset = m_buffer.size();
+			m_buffer.resize(offset + sizeof(record));
+			record.nameLength = trace_detail::AppendUtf16(m_buffer, event.name);
+			memcpy(m_buffer.data() + offset, &record, sizeof(record));
+			m_events++;
+			if (m_buffer.size() >= m_bufferSize)
+			{
+				Flush();
+			}
+		}
+
+	private:
+		FILE* m_file = nullptr;
+		size_t m_bufferSize;
+		std::chrono::steady_clock::time_point m_start;
+
+		mutable std::mutex m_mutex;
+		std::vector<BYTE> m_buffer;
+		size_t m_events = 0;
+		bool m_failed = false;
+
+
+		static std::atomic<uint32_t>& NextThreadNumber() noexcept
+		{
+			static std::atomic<uint32_t> next{ 0 };
+			return next;
+		}
+
+		static uint32_t Saturate(uint64_t n) noexcept
+		{
+			return static_cast<uint32_t>((std::min)(n, static_cast<uint64_t>(0xFFFFFFFF)));
+		}
+
+		// Called with the mutex held
+		void Flush() noexcept
+		{
+			if (!m_buffer.empty() && fwrite(m_buffer.data(), 1, m_buffer.size(), m_file) != m_buffer.size())
+			{
+				m_failed = true;
+			}
+			m_buffer.clear();
+			if (fflush(m_file) != 0)
+			{
+				m_failed = true;
+			}
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Reads a whole trace file.
+	// Throws std::runtime_error if the file can't be read, or isn't a trace.
+	//------------------------------------------------------------------------------
+	inline std::vector<TraceRecord> ReadTrace(const std::filesystem::path& fileName)
+	{
+		const MappedFile file(fileName);
+		const BYTE* data = reinterpret_cast<const BYTE*>(file.Data());
+		const size_t size = file.Size();
+		if (size < sizeof(TraceFileHeader) || memcmp(data, "WRTRC001", 8) != 0)
+		{
+			throw std::runtime_error("ReadTrace: not a trace file.");
+		}
+
+		std::vector<TraceRecord> records;
+		for (size_t offset = sizeof(TraceFileHeader); offset < size; )
+		{
+			TraceRecordHeader header;
+			if (size - offset < sizeof(header))
+			{
+				throw std::runtime_error("ReadTrace: truncated trace file.");
+			}
+			memcpy(&header, data + offset, sizeof(header));
+			offset += sizeof(header);
+
+			const size_t nameSize = header.nameLength * sizeof(uint16_t);
+			if (size - offset < nameSize)
+			{
+				throw std::runtime_error("ReadTrace: truncated trace file.");
+			}
+			records.push_back(TraceRecord{ static_cast<TraceOp>(header.op), header.thread, header.timestamp,
+				header.duration, header.hKey, header.result, header.type, header.size, header.status,
+				trace_detail::FromUtf16(data + offset, header.nameLength) });
+			offset += nameSize;
+		}
+		return records;
+	}
+
+
+	//------------------------------------------------------------------------------
+	// Options of ReplayTrace()
+	//------------------------------------------------------------------------------
+	struct ReplayOptions
+	{
+		// Follow the recorded timestamps, divided by speed; otherwise go as fast as possible
+		bool originalTiming = false;
+		double speed = 1.0;
+
+		// When set, the predefined keys of the trace are replaced with sub-keys of this
+		// key named after them (e.g. "HKEY_CURRENT_USER"), created as needed
+		HKEY redirectKey = nullptr;
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Latencies of the replayed calls of one kind, in microseconds
+	//------------------------------------------------------------------------------
+	struct ReplayLatency
+	{
+		size_t count = 0;
+		double mean = 0;
+		double median = 0;
+		double p99 = 0;
+		double max = 0;
+		double recordedMean = 0;    // of the same calls, when recorded
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Results of ReplayTrace()
+	//------------------------------------------------------------------------------
+	struct ReplayStats
+	{
+		size_t calls = 0;               // replayed
+		size_t skipped = 0;             // on keys not opened through the traced wrappers
+		size_t statusMismatches = 0;    // succeeded when recorded and failed when replayed, or the opposite
+		double seconds = 0;
+		std::map<TraceOp, ReplayLatency> latencies;
+
+		double CallsPerSecond() const noexcept
+		{
+			return (seconds > 0) ? calls / seconds : 0;
+		}
+	};
+
+
+	namespace trace_detail
+	{
+		// Replays one call on hKey; result receives the key opened or created
+		inline LONG ReplayCall(const TraceRecord& record, HKEY hKey, HKEY& result, std::vector<BYTE>& buffer)
+		{
+			result = nullptr;
+			try
+			{
+				switch (record.op)
+				{
+				case TraceOp::OpenKey:
+					return ::RegOpenKeyEx(hKey, record.name.c_str(), 0, record.type, &result);
+
+				case TraceOp::CreateKey:
+					return ::RegCreateKeyEx(hKey, record.name.c_str(), 0, nullptr, 0, record.type, nullptr,
+						&result, nullptr);
+
+				case TraceOp::CloseKey:
+					return ::RegCloseKey(hKey);
+
+				case TraceOp::QueryValue:
+				{
+					DWORD type = REG_NONE;
+					DWORD dataSize = 0;
+					LONG status = ::RegQueryValueEx(hKey, record.name.c_str(), nullptr, &type, nullptr, &dataSize);
+					if (status == ERROR_SUCCESS)
+					{
+						buffer.resize((std::max)(dataSize, DWORD(1)));
+						status = ::RegQueryValueEx(hKey, record.name.c_str(), nullptr, &type, buffer.data(),
+							&dataSize);
+					}
+					return status;
+				}
+
+				case TraceOp::SetValue:
+					buffer.assign(record.size, 0);
+					return ::RegSetValueEx(hKey, record.name.c_str(), 0, record.type, buffer.data(),
+						static_cast<DWORD>(record.size));
+
+				case TraceOp::EnumerateSubKeys:
+					EnumerateSubKeyNames(hKey);
+					return ERROR_SUCCESS;
+
+				case TraceOp::EnumerateValueNames:
+					EnumerateValueNames(hKey);
+					return ERROR_SUCCESS;
+
+				case TraceOp::EnumerateValues:
+					detail::ForEachRawValue(hKey, [](std::wstring_view, DWORD, const BYTE*, DWORD) {});
+					return ERROR_SUCCESS;
+
+				case TraceOp::DeleteValue:
+					return ::RegDeleteValue(hKey, record.name.c_str());
+
+				case TraceOp::DeleteKey:
+					return ::RegDeleteKeyEx(hKey, record.name.c_str(), record.type, 0);
+				}
+			}
+			catch (const RegException& e)
+			{
+				return e.ErrorCode();
+			}
+			return ERROR_CALL_NOT_IMPLEMENTED;
+		}
+
+	} // namespace trace_detail
+
+
+	//------------------------------------------------------------------------------
+	// Replays the calls of a trace (see the notes at the top of this file).
+	// Keys still open at the end of the trace are closed.
+	//------------------------------------------------------------------------------
+	inline ReplayStats ReplayTrace(const std::vector<TraceRecord>& records,
+		const ReplayOptions& options = ReplayOptions())
+	{
+		using trace_detail::IsPredefinedKey;
+
+		const size_t none = static_cast<size_t>(-1);
+		const size_t count = records.size();
+
+		// The call that opened the key of each call, if any
+		std::vector<size_t> opener(count, none);
+		{
+			std::map<uint64_t, size_t> openKeys;
+			for (size_t i = 0; i < count; i++)
+			{
+				const TraceRecord& record = records[i];
+				auto it = openKeys.find(record.hKey);
+				if (it != openKeys.end())
+				{
+					opener[i] = it->second;
+					if (record.op == TraceOp::CloseKey)
+					{
+						openKeys.erase(it);
+					}
+				}
+				if ((record.op == TraceOp::OpenKey || record.op == TraceOp::CreateKey)
+					&& record.status == ERROR_SUCCESS && record.result != 0)
+				{
+					openKeys[record.result] = i;
+				}
+			}
+		}
+
+		// Predefined keys, possibly redirected
+		std::map<uint64_t, HKEY> roots;
+		std::vector<HKEY> redirected;
+		auto rootKey = [&](uint64_t hKey) -> HKEY
+		{
+			auto it = roots.find(hKey);
+			if (it != roots.end())
+			{
+				return it->second;
+			}
+			HKEY root = trace_detail::PredefinedKey(hKey);
+			if (options.redirectKey != nullptr)
+			{
+				root = nullptr;
+				::RegCreateKeyEx(options.redirectKey, trace_detail::PredefinedKeyName(hKey), 0, nullptr, 0,
+					KEY_ALL_ACCESS, nullptr, &root, nullptr);
+				redirected.push_back(root);
+			}
+			roots[hKey] = root;
+			return root;
+		};
+		for (const TraceRecord& record : records)
+		{
+			if (IsPredefinedKey(record.hKey))
+			{
+				rootKey(record.hKey);
+			}
+		}
+
+		// Calls of each thread, in order
+		std::map<uint32_t, std::vector<size_t>> threadCalls;
+		for (size_t i = 0; i < count; i++)
+		{
+			threadCalls[records[i].thread].push_back(i);
+		}
+
+		std::mutex mutex;
+		std::condition_variable replayed;
+		std::vector<char> done(count, 0);
+		std::vector<HKEY> opened(count, nullptr);   // by the replay of each call
+		std::vector<LONG> statuses(count, ERROR_SUCCESS);
+		std::vector<double> latencies(count, -1);   // microseconds; -1 if skipped
+
+		const auto start = std::chrono::steady_clock::now();
+		auto replayThread = [&](const std::vector<size_t>& calls)
+		{
+			std::vector<BYTE> buffer;
+			for (size_t i : calls)
+			{
+				const TraceRecord& record = records[i];
+				if (options.originalTiming && options.speed > 0)
+				{
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+						static_cast<int64_t>(record.timestamp / options.speed)));
+				}
+
+				HKEY hKey = nullptr;
+				if (opener[i] != none)
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					replayed.wait(lock, [&] { return done[opener[i]] != 0; });
+					hKey = opened[opener[i]];
+				}
+				else if (IsPredefinedKey(record.hKey))
+				{
+					hKey = roots.at(record.hKey);
+				}
+
+				HKEY result = nullptr;
+				LONG status = ERROR_INVALID_HANDLE;
+				double latency = -1;
+				if (hKey != nullptr && !(record.op == TraceOp::CloseKey && opener[i] == none))
+				{
+					const auto callStart = std::chrono::steady_clock::now();
+					status = trace_detail::ReplayCall(record, hKey, result, buffer);
+					latency = std::chrono::duration<double, std::micro>(
+						std::chrono::steady_clock::now() - callStart).count();
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (record.op == TraceOp::CloseKey && opener[i] != none)
+				{
+					opened[opener[i]] = nullptr;
+				}
+				opened[i] = (status == ERROR_SUCCESS) ? result : nullptr;
+				statuses[i] = status;
+				latencies[i] = latency;
+				done[i] = 1;
+				replayed.notify_all();
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (const auto& calls : threadCalls)
+		{
+			threads.emplace_back(replayThread, std::cref(calls.second));
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		ReplayStats stats;
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// Keys the trace didn't close
+		for (size_t i = 0; i < count; i++)
+		{
+			if (opened[i] != nullptr)
+			{
+				::RegCloseKey(opened[i]);
+			}
+		}
+		for (HKEY root : redirected)
+		{
+			if (root != nullptr)
+			{
+				::RegCloseKey(root);
+			}
+		}
+
+		std::map<TraceOp, std::vector<double>> samples;
+		std::map<TraceOp, double> recordedTotals;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (latencies[i] < 0)
+			{
+				stats.skipped++;
+				continue;
+			}
+			stats.calls++;
+			if ((records[i].status == ERROR_SUCCESS) != (statuses[i] == ERROR_SUCCESS))
+			{
+				stats.statusMismatches++;
+			}
+			samples[records[i].op].push_back(latencies[i]);
+			recordedTotals[records[i].op] += records[i].duration / 1000.0;
+		}
+		for (auto& sample : samples)
+		{
+			std::vector<double>& values = sample.second;
+			std::sort(values.begin(), values.end());
+
+			ReplayLatency& latency = stats.latencies[sample.first];
+			latency.count = values.size();
+			for (double value : values)
+			{
+				latency.mean += value;
+			}
+			latency.mean /= values.size();
+			latency.median = values[values.size() / 2];
+			latency.p99 = values[(values.size() * 99) / 100];
+			latency.max = values.back();
+			latency.recordedMean = recordedTotals[sample.first] / values.size();
+		}
+		return stats;
+	}
+
+} // namespace winreg
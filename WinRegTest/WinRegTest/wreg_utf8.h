@@ -0,0 +1,1027 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_utf8.h
+// DESC: UTF-8 (std::string_view) and UTF-16 (std::u16string_view) overloads of
+//       the functions opening keys, reading, writing and enumerating values.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// The registry API takes wchar_t strings. The overloads in this file transcode
+// key paths, value names and string data between UTF-8 (or char16_t UTF-16)
+// and wchar_t straight into the buffers passed to the registry (per-thread
+// scratch buffers, or the data buffer of the write functions), and back into
+// the returned strings: no intermediate std::wstring is built.
+//
+// Transcoding runs of ASCII characters is vectorized (SSE2, on x86 and x64):
+// 16 bytes of UTF-8, or 8 wchar_ts, are checked and widened (or narrowed) at
+// once; other characters are transcoded one by one. On other processors, ASCII
+// runs are checked 8 bytes at a time.
+//
+// wchar_t is UTF-16 on Windows, where char16_t strings are copied as they are.
+// Where wchar_t is 32-bit (the emulation of wreg_emu.h), surrogate pairs are
+// combined, and split again on the way back.
+//
+// Ill-formed UTF-8 (and, converting to UTF-8, unpaired surrogates) is replaced
+// by U+FFFD: names that aren't valid UTF-16 can't be read back through UTF-8;
+// the char16_t overloads keep them as they are.
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <cstdint>      // uint32_t, uint64_t
+#include <string>       // std::string, std::u16string
+#include <string_view>  // std::string_view, std::u16string_view
+#include <type_traits>  // std::is_same
+#include <vector>       // std::vector
+#include <string.h>     // memcpy()
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define WINREG_UTF_SSE2 1
+#include <emmintrin.h>  // SSE2 intrinsics
+#endif
+
+namespace winreg
+{
+	namespace utf_detail
+	{
+		// Code units written (at most) for each wchar_t read
+		constexpr size_t MaxUtf8PerWide = (sizeof(wchar_t) == 2) ? 3 : 4;
+		constexpr size_t MaxUtf16PerWide = (sizeof(wchar_t) == 2) ? 1 : 2;
+
+
+		inline bool IsSurrogate(uint32_t cp) noexcept
+		{
+			return cp >= 0xD800 && cp <= 0xDFFF;
+		}
+
+
+		inline wchar_t* AppendWide(wchar_t* out, uint32_t cp) noexcept
+		{
+			if constexpr (sizeof(wchar_t) == 2)
+			{
+				if (cp >= 0x10000)
+				{
+					cp -= 0x10000;
+					*out++ = static_cast<wchar_t>(0xD800 + (cp >> 10));
+					*out++ = static_cast<wchar_t>(0xDC00 + (cp & 0x3FF));
+					return out;
+				}
+			}
+			*out++ = static_cast<wchar_t>(cp);
+			return out;
+		}
+
+
+		inline char* AppendUtf8(char* out, uint32_t cp) noexcept
+		{
+			if (cp < 0x80)
+			{
+				*out++ = static_cast<char>(cp);
+			}
+			else if (cp < 0x800)
+			{
+				*out++ = static_cast<char>(0xC0 | (cp >> 6));
+				*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+			}
+			else if (cp < 0x10000)
+			{
+				*out++ = static_cast<char>(0xE0 | (cp >> 12));
+				*out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+			}
+			else
+			{
+				*out++ = static_cast<char>(0xF0 | (cp >> 18));
+				*out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+				*out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+			}
+			return out;
+		}
+
+
+		//
+		// Transcodes UTF-8 to wchar_t; out must have room for size wchar_ts.
+		// Returns the number of wchar_ts written.
+		//
+		inline size_t Utf8ToWide(const char* in, size_t size, wchar_t* out) noexcept
+		{
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+			const unsigned char* const end = p + size;
+			wchar_t* const start = out;
+
+			while (p < end)
+			{
+				// Runs of ASCII characters
+#ifdef WINREG_UTF_SSE2
+				while (end - p >= 16)
+				{
+					const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+					if (_mm_movemask_epi8(chunk) != 0)
+					{
+						break;
+					}
+					const __m128i zero = _mm_setzero_si128();
+					const __m128i low = _mm_unpacklo_epi8(chunk, zero);
+					const __m128i high = _mm_unpackhi_epi8(chunk, zero);
+					if constexpr (sizeof(wchar_t) == 2)
+					{
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out), low);
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), high);
+					}
+					else
+					{
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi16(low, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(low, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpacklo_epi16(high, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm_unpackhi_epi16(high, zero));
+					}
+					p += 16;
+					out += 16;
+				}
+#else
+				while (end - p >= 8)
+				{
+					uint64_t word = 0;
+					memcpy(&word, p, sizeof(word));
+					if ((word & 0x8080808080808080ULL) != 0)
+					{
+						break;
+					}
+					for (int i = 0; i < 8; i++)
+					{
+						out[i] = static_cast<wchar_t>(p[i]);
+					}
+					p += 8;
+					out += 8;
+				}
+#endif
+
+				// Then a block of characters one by one
+				const unsigned char* const blockEnd = p + (((end - p) < 16) ? (end - p) : 16);
+				while (p < blockEnd)
+				{
+					uint32_t cp = *p;
+					if (cp < 0x80)
+					{
+						*out++ = static_cast<wchar_t>(cp);
+						p++;
+						continue;
+					}
+
+					size_t length = 0;
+					uint32_t minimum = 0;
+					if (cp >= 0xC2 && cp <= 0xDF)       { length = 2; cp &= 0x1F; minimum = 0x80; }
+					else if ((cp & 0xF0) == 0xE0)       { length = 3; cp &= 0x0F; minimum = 0x800; }
+					else if (cp >= 0xF0 && cp <= 0xF4)  { length = 4; cp &= 0x07; minimum = 0x10000; }
+
+					size_t i = 1;
+					if (length != 0 && static_cast<size_t>(end - p) >= length)
+					{
+						for (; i < length && (p[i] & 0xC0) == 0x80; i++)
+						{
+							cp = (cp << 6) | (p[i] & 0x3F);
+						}
+					}
+					if (i != length || cp < minimum || cp > 0x10FFFF || IsSurrogate(cp))
+					{
+						// Ill-formed: one replacement character for each byte
+						*out++ = static_cast<wchar_t>(0xFFFD);
+						p++;
+						continue;
+					}
+					out = AppendWide(out, cp);
+					p += length;
+				}
+			}
+			return out - start;
+		}
+
+
+		//
+		// Transcodes wchar_t to UTF-8; out must have room for size * MaxUtf8PerWide bytes.
+		// Returns the number of bytes written.
+		//
+		inline size_t WideToUtf8(const wchar_t* in, size_t size, char* out) noexcept
+		{
+			const wchar_t* p = in;
+			const wchar_t* const end = in + size;
+			char* const start = out;
+
+			while (p < end)
+			{
+				// Runs of ASCII characters
+#ifdef WINREG_UTF_SSE2
+				while (end - p >= 8)
+				{
+					__m128i packed;
+					if constexpr (sizeof(wchar_t) == 2)
+					{
+						const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+						const __m128i nonAscii = _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80)));
+						if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) != 0xFFFF)
+						{
+							break;
+						}
+						packed = _mm_packus_epi16(units, units);
+					}
+					else
+					{
+						const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+						const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4));
+						const __m128i nonAscii = _mm_and_si128(_mm_or_si128(low, high),
+							_mm_set1_epi32(static_cast<int>(0xFFFFFF80)));
+						if (_mm_movemask_epi8(_mm_cmpeq_epi32(nonAscii, _mm_setzero_si128())) != 0xFFFF)
+						{
+							break;
+						}
+						const __m128i units = _mm_packs_epi32(low, high);
+						packed = _mm_packus_epi16(units, units);
+					}
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+					p += 8;
+					out += 8;
+				}
+#else
+				while (end - p >= 8)
+				{
+					uint32_t bits = 0;
+					for (int i = 0; i < 8; i++)
+					{
+						bits |= static_cast<uint32_t>(p[i]);
+					}
+					if (bits >= 0x80)
+					{
+						break;
+					}
+					for (int i = 0; i < 8; i++)
+					{
+						out[i] = static_cast<char>(p[i]);
+					}
+					p += 8;
+					out += 8;
+				}
+#endif
+
+				// Then a block of characters one by one
+				const wchar_t* const blockEnd = p + (((end - p) < 8) ? (end - p) : 8);
+				while (p < blockEnd)
+				{
+					uint32_t cp = static_cast<uint32_t>(*p++);
+					if constexpr (sizeof(wchar_t) == 2)
+					{
+						if (cp >= 0xD800 && cp <= 0xDBFF && p < end && *p >= 0xDC00 && *p <= 0xDFFF)
+						{
+							cp = 0x10000 + ((cp - 0xD800) << 10) + (static_cast<uint32_t>(*p++) - 0xDC00);
+						}
+					}
+					if (IsSurrogate(cp) || cp > 0x10FFFF)
+					{
+						cp = 0xFFFD;
+					}
+					out = AppendUtf8(out, cp);
+				}
+			}
+			return out - start;
+		}
+
+
+		//
+		// Transcodes char16_t UTF-16 to wchar_t; out must have room for size wchar_ts.
+		// Returns the number of wchar_ts written. Unpaired surrogates are kept.
+		//
+		inline size_t Utf16ToWide(const char16_t* in, size_t size, wchar_t* out) noexcept
+		{
+			if constexpr (sizeof(wchar_t) == 2)
+			{
+				if (size != 0)
+				{
+					memcpy(out, in, size * sizeof(wchar_t));
+				}
+				return size;
+			}
+
+			const char16_t* p = in;
+			const char16_t* const end = in + size;
+			wchar_t* const start = out;
+			while (p < end)
+			{
+#ifdef WINREG_UTF_SSE2
+				// Runs without surrogates
+				while (end - p >= 8)
+				{
+					const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+					const __m128i surrogates = _mm_cmpeq_epi16(
+						_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))),
+						_mm_set1_epi16(static_cast<short>(0xD800)));
+					if (_mm_movemask_epi8(surrogates) != 0)
+					{
+						break;
+					}
+					const __m128i zero = _mm_setzero_si128();
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi16(units, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(units, zero));
+					p += 8;
+					out += 8;
+				}
+#endif
+				const char16_t* const blockEnd = p + (((end - p) < 8) ? (end - p) : 8);
+				while (p < blockEnd)
+				{
+					uint32_t cp = *p++;
+					if (cp >= 0xD800 && cp <= 0xDBFF && p < end && *p >= 0xDC00 && *p <= 0xDFFF)
+					{
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (static_cast<uint32_t>(*p++) - 0xDC00);
+					}
+					*out++ = static_cast<wchar_t>(cp);
+				}
+			}
+			return out - start;
+		}
+
+
+		//
+		// Transcodes wchar_t to char16_t UTF-16; out must have room for size * MaxUtf16PerWide
+		// char16_ts. Returns the number of char16_ts written.
+		//
+		inline size_t WideToUtf16(const wchar_t* in, size_t size, char16_t* out) noexcept
+		{
+			if constexpr (sizeof(wchar_t) == 2)
+			{
+				if (size != 0)
+				{
+					memcpy(out, in, size * sizeof(wchar_t));
+				}
+				return size;
+			}
+
+			const wchar_t* p = in;
+			const wchar_t* const end = in + size;
+			char16_t* const start = out;
+			while (p < end)
+			{
+#ifdef WINREG_UTF_SSE2
+				// Runs of characters of the BMP: packed with a signed saturation,
+				// after moving them to the signed range
+				while (end - p >= 8)
+				{
+					const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+					const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4));
+					const __m128i beyond = _mm_and_si128(_mm_or_si128(low, high),
+						_mm_set1_epi32(static_cast<int>(0xFFFF0000)));
+					if (_mm_movemask_epi8(_mm_cmpeq_epi32(beyond, _mm_setzero_si128())) != 0xFFFF)
+					{
+						break;
+					}
+					const __m128i bias = _mm_set1_epi32(0x8000);
+					const __m128i packed = _mm_packs_epi32(_mm_sub_epi32(low, bias), _mm_sub_epi32(high, bias));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+						_mm_add_epi16(packed, _mm_set1_epi16(static_cast<short>(0x8000))));
+					p += 8;
+					out += 8;
+				}
+#endif
+				const wchar_t* const blockEnd = p + (((end - p) < 8) ? (end - p) : 8);
+				while (p < blockEnd)
+				{
+					uint32_t cp = static_cast<uint32_t>(*p++);
+					if (cp > 0x10FFFF)
+					{
+						cp = 0xFFFD;
+					}
+					if (cp >= 0x10000)
+					{
+						cp -= 0x10000;
+						*out++ = static_cast<char16_t>(0xD800 + (cp >> 10));
+						*out++ = static_cast<char16_t>(0xDC00 + (cp & 0x3FF));
+					}
+					else
+					{
+						*out++ = static_cast<char16_t>(cp);
+					}
+				}
+			}
+			return out - start;
+		}
+
+
+		//
+		// The same, by character type of the other side
+		//
+
+		inline size_t ToWide(const char* in, size_t size, wchar_t* out) noexcept
+		{
+			return Utf8ToWide(in, size, out);
+		}
+
+		inline size_t ToWide(const char16_t* in, size_t size, wchar_t* out) noexcept
+		{
+			return Utf16ToWide(in, size, out);
+		}
+
+		inline size_t FromWide(const wchar_t* in, size_t size, char* out) noexcept
+		{
+			return WideToUtf8(in, size, out);
+		}
+
+		inline size_t FromWide(const wchar_t* in, size_t size, char16_t* out) noexcept
+		{
+			return WideToUtf16(in, size, out);
+		}
+
+		template <typename CharT>
+		constexpr size_t MaxPerWide = std::is_same<CharT, char>::value ? MaxUtf8PerWide : MaxUtf16PerWide;
+
+
+		template <typename CharT>
+		std::basic_string<CharT> FromWide(const wchar_t* in, size_t size)
+		{
+			std::basic_string<CharT> out(size * MaxPerWide<CharT>, CharT());
+			if (size != 0)
+			{
+				out.resize(FromWide(in, size, &out[0]));
+			}
+			return out;
+		}
+
+
+		//
+		// Per-thread buffers holding NUL-terminated wchar_t copies of names, valid until
+		// the next call on this thread with the same slot
+		//
+
+		enum NameSlot { KeySlot, ValueSlot };
+
+		template <typename CharT>
+		std::wstring_view WideName(std::basic_string_view<CharT> name, NameSlot slot)
+		{
+			thread_local std::vector<wchar_t> buffers[2];
+			std::vector<wchar_t>& buffer = buffers[slot];
+			if (buffer.size() < name.size() + 1)
+			{
+				buffer.resize(name.size() + 1);
+			}
+			const size_t length = ToWide(name.data(), name.size(), buffer.data());
+			buffer[length] = L'\0';
+			return std::wstring_view(buffer.data(), length);
+		}
+
+	} // namespace utf_detail
+
+
+	//------------------------------------------------------------------------------
+	// A registry value read through the UTF-8 (CharT = char) or UTF-16
+	// (CharT = char16_t) overloads, with the accessors of RegValue
+	//------------------------------------------------------------------------------
+	template <typename CharT>
+	class BasicRegValue
+	{
+	public:
+
+		typedef DWORD TypeId;
+		typedef std::basic_string<CharT> StringType;
+
+		BasicRegValue(StringType name, TypeId typeId)
+			: m_name(std::move(name)), m_typeId(typeId)
+		{
+		}
+
+		const StringType& name() const noexcept { return m_name; }
+		TypeId GetType() const noexcept { return m_typeId; }
+		bool IsEmpty() const noexcept { return m_typeId == REG_NONE; }
+
+		DWORD Dword() const
+		{
+			Check(REG_DWORD, "Dword() called on a non-DWORD registry value.");
+			return m_dword;
+		}
+
+		const StringType& String() const
+		{
+			Check(REG_SZ, "String() called on a non-REG_SZ registry value.");
+			return m_string;
+		}
+
+		const StringType& ExpandString() const
+		{
+			Check(REG_EXPAND_SZ, "ExpandString() called on a non-REG_EXPAND_SZ registry value.");
+			return m_string;
+		}
+
+		const std::vector<StringType>& MultiString() const
+		{
+			Check(REG_MULTI_SZ, "MultiString() called on a non-REG_MULTI_SZ registry value.");
+			return m_multiString;
+		}
+
+		const std::vector<BYTE>& Binary() const
+		{
+			Check(REG_BINARY, "Binary() called on a non-REG_BINARY registry value.");
+			return m_binary;
+		}
+
+		DWORD& Dword()
+		{
+			Check(REG_DWORD, "Dword() called on a non-DWORD registry value.");
+			return m_dword;
+		}
+
+		StringType& String()
+		{
+			Check(REG_SZ, "String() called on a non-REG_SZ registry value.");
+			return m_string;
+		}
+
+		StringType& ExpandString()
+		{
+			Check(REG_EXPAND_SZ, "ExpandString() called on a non-REG_EXPAND_SZ registry value.");
+			return m_string;
+		}
+
+		std::vector<StringType>& MultiString()
+		{
+			Check(REG_MULTI_SZ, "MultiString() called on a non-REG_MULTI_SZ registry value.");
+			return m_multiString;
+		}
+
+		std::vector<BYTE>& Binary()
+		{
+			Check(REG_BINARY, "Binary() called on a non-REG_BINARY registry value.");
+			return m_binary;
+		}
+
+	private:
+		StringType m_name;
+		TypeId m_typeId;
+
+		DWORD m_dword = 0;                          // REG_DWORD
+		StringType m_string;                        // REG_SZ, REG_EXPAND_SZ
+		std::vector<StringType> m_multiString;      // REG_MULTI_SZ
+		std::vector<BYTE> m_binary;                 // REG_BINARY
+
+		void Check(TypeId typeId, const char* message) const
+		{
+			_ASSERTE(m_typeId == typeId);
+			if (m_typeId != typeId)
+			{
+				throw std::invalid_argument(message);
+			}
+		}
+	};
+
+	typedef BasicRegValue<char> RegValueUtf8;
+	typedef BasicRegValue<char16_t> RegValueUtf16;
+
+
+	namespace utf_detail
+	{
+		// Builds a value from raw registry data, like MakeRegValue(), transcoding the strings
+		template <typename CharT>
+		BasicRegValue<CharT> MakeValue(std::basic_string<CharT> name, DWORD typeId,
+			const BYTE* data, DWORD dataSize)
+		{
+			BasicRegValue<CharT> value(std::move(name), typeId);
+
+			// String data is laid out by the registry in wchar_t-aligned buffers
+			const wchar_t* units = reinterpret_cast<const wchar_t*>(data);
+			size_t unitCount = dataSize / sizeof(wchar_t);
+
+			switch (typeId)
+			{
+			case REG_DWORD:
+			{
+				// Any size can be stored (e.g. by other programs, or in offline hives):
+				// shorter data is zero-extended, longer data truncated
+				DWORD dw = 0;
+				memcpy(&dw, data, (dataSize < sizeof(dw)) ? dataSize : sizeof(dw));
+				value.Dword() = dw;
+			}
+			break;
+
+			case REG_SZ:
+			case REG_EXPAND_SZ:
+			{
+				// Strip off the NUL-terminator, if stored with the data
+				if (unitCount != 0 && units[unitCount - 1] == L'\0')
+				{
+					unitCount--;
+				}
+				std::basic_string<CharT>& str = (typeId == REG_SZ) ? value.String() : value.ExpandString();
+				str = FromWide<CharT>(units, unitCount);
+			}
+			break;
+
+			case REG_MULTI_SZ:
+			{
+				// Parse the single strings, up to the double-NUL or the end of the data
+				size_t pos = 0;
+				while (pos < unitCount && units[pos] != L'\0')
+				{
+					size_t end = pos;
+					while (end < unitCount && units[end] != L'\0')
+					{
+						end++;
+					}
+					value.MultiString().push_back(FromWide<CharT>(units + pos, end - pos));
+					pos = end + 1;
+				}
+			}
+			break;
+
+			case REG_BINARY:
+				value.Binary().assign(data, data + dataSize);
+				break;
+
+			default:
+				throw std::invalid_argument("Unsupported Windows Registry value type.");
+			}
+			return value;
+		}
+
+
+		template <typename CharT>
+		RegKey OpenKey(HKEY hKey, std::basic_string_view<CharT> subKey, REGSAM accessRights)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			const std::wstring_view wideSubKey = WideName(subKey, KeySlot);
+			trace_detail::Scope trace(TraceOp::OpenKey, hKey, wideSubKey);
+			trace.Data(accessRights, 0);
+
+			HKEY hKeyResult = nullptr;
+			LONG result = ::RegOpenKeyEx(hKey, wideSubKey.data(), 0, accessRights, &hKeyResult);
+			trace.Result(hKeyResult);
+			trace.Status(result);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegOpenKeyEx() failed trying opening a key.", result);
+			}
+			return RegKey(hKeyResult);
+		}
+
+
+		template <typename CharT>
+		RegKey CreateKey(HKEY hKey, std::basic_string_view<CharT> subKey, REGSAM accessRights)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			const std::wstring_view wideSubKey = WideName(subKey, KeySlot);
+			trace_detail::Scope trace(TraceOp::CreateKey, hKey, wideSubKey);
+			trace.Data(accessRights, 0);
+
+			HKEY hKeyResult = nullptr;
+			LONG result = ::RegCreateKeyEx(hKey, wideSubKey.data(), 0, nullptr, 0, accessRights, nullptr,
+				&hKeyResult, nullptr);
+			trace.Result(hKeyResult);
+			trace.Status(result);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegCreateKeyEx() failed.", result);
+			}
+			return RegKey(hKeyResult);
+		}
+
+
+		template <typename CharT>
+		BasicRegValue<CharT> QueryValue(HKEY hKey, std::basic_string_view<CharT> valueName)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			const std::wstring_view wideName = WideName(valueName, ValueSlot);
+			trace_detail::Scope trace(TraceOp::QueryValue, hKey, wideName);
+
+			// Read straight into a per-thread buffer, growing it if the data doesn't fit
+			thread_local std::vector<BYTE> buffer(256);
+			DWORD valueType = REG_NONE;
+			DWORD dataSize = 0;
+			LONG result = ERROR_MORE_DATA;
+			while (result == ERROR_MORE_DATA)
+			{
+				dataSize = detail::SafeSizeToDwordCast(buffer.size());
+				result = ::RegQueryValueEx(hKey, wideName.data(), nullptr, &valueType, buffer.data(), &dataSize);
+				if (result == ERROR_MORE_DATA)
+				{
+					buffer.resize(dataSize);
+				}
+			}
+			trace.Status(result);
+			trace.Data(valueType, dataSize);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryValueEx() failed in reading value data.", result);
+			}
+			return MakeValue<CharT>(std::basic_string<CharT>(valueName), valueType, buffer.data(), dataSize);
+		}
+
+
+		template <typename CharT>
+		void SetStringValue(HKEY hKey, std::basic_string_view<CharT> valueName,
+			std::basic_string_view<CharT> data, DWORD typeId)
+		{
+			_ASSERTE(typeId == REG_SZ || typeId == REG_EXPAND_SZ);
+			if (typeId != REG_SZ && typeId != REG_EXPAND_SZ)
+			{
+				throw std::invalid_argument("SetStringValue() called with a non-string value type.");
+			}
+
+			// Transcoded straight into the data buffer, followed by the terminating NUL
+			std::vector<BYTE>& buffer = detail::WriteDataScratch();
+			buffer.resize((data.size() + 1) * sizeof(wchar_t));
+			wchar_t* units = reinterpret_cast<wchar_t*>(buffer.data());
+			const size_t length = ToWide(data.data(), data.size(), units);
+			units[length] = L'\0';
+
+			detail::WriteRawValueInternal(hKey, WideName(valueName, ValueSlot), typeId, buffer.data(),
+				(length + 1) * sizeof(wchar_t),
+				(typeId == REG_SZ) ? L"RegSetValueEx() failed in writing REG_SZ value."
+				: L"RegSetValueEx() failed in writing REG_EXPAND_SZ value.");
+		}
+
+
+		template <typename CharT, typename StringRange>
+		void SetMultiStringValue(HKEY hKey, std::basic_string_view<CharT> valueName, const StringRange& strings)
+		{
+			// Each string, its NUL, and the final NUL (two for an empty multi-string)
+			size_t capacity = 2;
+			for (const auto& s : strings)
+			{
+				capacity += std::basic_string_view<CharT>(s).size() + 1;
+			}
+
+			std::vector<BYTE>& buffer = detail::WriteDataScratch();
+			buffer.resize(capacity * sizeof(wchar_t));
+			wchar_t* const units = reinterpret_cast<wchar_t*>(buffer.data());
+			size_t length = 0;
+			for (const auto& s : strings)
+			{
+				const std::basic_string_view<CharT> view(s);
+				length += ToWide(view.data(), view.size(), units + length);
+				units[length++] = L'\0';
+			}
+			units[length++] = L'\0';
+			if (length == 1)
+			{
+				units[length++] = L'\0';
+			}
+
+			detail::WriteRawValueInternal(hKey, WideName(valueName, ValueSlot), REG_MULTI_SZ, buffer.data(),
+				length * sizeof(wchar_t), L"RegSetValueEx() failed in writing REG_MULTI_SZ value.");
+		}
+
+
+		template <typename CharT>
+		std::vector<std::basic_string<CharT>> EnumerateSubKeyNames(HKEY hKey)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::EnumerateSubKeys, hKey);
+
+			DWORD subkeyCount = 0;
+			DWORD maxSubkeyNameLength = 0;
+			LONG result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, &subkeyCount,
+				&maxSubkeyNameLength, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryInfoKey() failed while trying to get sub-keys info.", result);
+			}
+
+			std::vector<std::basic_string<CharT>> subkeyNames;
+			subkeyNames.reserve(subkeyCount);
+
+			thread_local std::vector<wchar_t> nameBuffer;
+			nameBuffer.resize((std::max)(nameBuffer.size(), static_cast<size_t>(maxSubkeyNameLength) + 1));
+
+			for (DWORD subkeyIndex = 0; ; )
+			{
+				DWORD nameLength = detail::SafeSizeToDwordCast(nameBuffer.size());
+				result = ::RegEnumKeyEx(hKey, subkeyIndex, nameBuffer.data(), &nameLength,
+					nullptr, nullptr, nullptr, nullptr);
+				if (result == ERROR_NO_MORE_ITEMS)
+				{
+					break;
+				}
+				if ((result == ERROR_MORE_DATA) && (nameBuffer.size() <= MaxKeyNameLength))
+				{
+					// A longer sub-key was added meanwhile
+					nameBuffer.resize(MaxKeyNameLength + 1);
+					continue;
+				}
+				if (result != ERROR_SUCCESS)
+				{
+					throw RegException(L"RegEnumKeyEx() failed trying to get sub-key name.", result);
+				}
+
+				subkeyNames.push_back(FromWide<CharT>(nameBuffer.data(), nameLength));
+				subkeyIndex++;
+			}
+
+			trace.Data(REG_NONE, subkeyNames.size());
+			return subkeyNames;
+		}
+
+
+		template <typename CharT>
+		std::vector<std::basic_string<CharT>> EnumerateValueNames(HKEY hKey)
+		{
+			_ASSERTE(hKey != nullptr);
+
+			trace_detail::Scope trace(TraceOp::EnumerateValueNames, hKey);
+
+			DWORD valueCount = 0;
+			DWORD maxValueNameLength = 0;
+			LONG result = ::RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+				&valueCount, &maxValueNameLength, nullptr, nullptr, nullptr);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegQueryInfoKey() failed while trying to get value info.", result);
+			}
+
+			std::vector<std::basic_string<CharT>> valueNames;
+			valueNames.reserve(valueCount);
+
+			thread_local std::vector<wchar_t> nameBuffer;
+			nameBuffer.resize((std::max)(nameBuffer.size(), static_cast<size_t>(maxValueNameLength) + 1));
+
+			for (DWORD valueIndex = 0; ; )
+			{
+				DWORD nameLength = detail::SafeSizeToDwordCast(nameBuffer.size());
+				result = ::RegEnumValue(hKey, valueIndex, nameBuffer.data(), &nameLength,
+					nullptr, nullptr, nullptr, nullptr);
+				if (result == ERROR_NO_MORE_ITEMS)
+				{
+					break;
+				}
+				if ((result == ERROR_MORE_DATA) && (nameBuffer.size() <= MaxValueNameLength))
+				{
+					// A longer value name was added meanwhile
+					nameBuffer.resize((std::min)(nameBuffer.size() * 2,
+						static_cast<size_t>(MaxValueNameLength) + 1));
+					continue;
+				}
+				if (result != ERROR_SUCCESS)
+				{
+					throw RegException(L"RegEnumValue() failed to get value name.", result);
+				}
+
+				valueNames.push_back(FromWide<CharT>(nameBuffer.data(), nameLength));
+				valueIndex++;
+			}
+
+			trace.Data(REG_NONE, valueNames.size());
+			return valueNames;
+		}
+
+
+		template <typename CharT>
+		std::vector<BasicRegValue<CharT>> EnumerateValues(HKEY hKey, DWORD typeMask)
+		{
+			std::vector<BasicRegValue<CharT>> values;
+			detail::ForEachRawValue(hKey, [&](std::wstring_view name, DWORD valueType, const BYTE* data, DWORD dataSize)
+			{
+				if ((typeMask & ValueTypeMask(valueType)) != 0 && detail::IsSupportedValueType(valueType))
+				{
+					values.push_back(MakeValue<CharT>(FromWide<CharT>(name.data(), name.size()),
+						valueType, data, dataSize));
+				}
+			});
+			return values;
+		}
+
+	} // namespace utf_detail
+
+
+	//
+	// UTF-8 overloads
+	//
+
+	inline RegKey OpenKey(HKEY hKey, std::string_view subKey, REGSAM accessRights = KEY_READ)
+	{
+		return utf_detail::OpenKey(hKey, subKey, accessRights);
+	}
+
+	inline RegKey CreateKey(HKEY hKey, std::string_view subKey, REGSAM accessRights = KEY_READ | KEY_WRITE)
+	{
+		return utf_detail::CreateKey(hKey, subKey, accessRights);
+	}
+
+	inline RegValueUtf8 QueryValue(HKEY hKey, std::string_view valueName)
+	{
+		return utf_detail::QueryValue(hKey, valueName);
+	}
+
+	inline void SetDwordValue(HKEY hKey, std::string_view valueName, DWORD data)
+	{
+		SetDwordValue(hKey, utf_detail::WideName(valueName, utf_detail::ValueSlot), data);
+	}
+
+	inline void SetStringValue(HKEY hKey, std::string_view valueName, std::string_view data,
+		DWORD typeId = REG_SZ)
+	{
+		utf_detail::SetStringValue(hKey, valueName, data, typeId);
+	}
+
+	inline void SetBinaryValue(HKEY hKey, std::string_view valueName, const BYTE* data, size_t dataSize)
+	{
+		SetBinaryValue(hKey, utf_detail::WideName(valueName, utf_detail::ValueSlot), data, dataSize);
+	}
+
+	// Any range of strings convertible to std::string_view
+	template <typename StringRange>
+	void SetMultiStringValue(HKEY hKey, std::string_view valueName, const StringRange& strings)
+	{
+		utf_detail::SetMultiStringValue<char>(hKey, valueName, strings);
+	}
+
+	inline void SetMultiStringValue(HKEY hKey, std::string_view valueName,
+		std::initializer_list<std::string_view> strings)
+	{
+		utf_detail::SetMultiStringValue<char>(hKey, valueName, strings);
+	}
+
+	inline std::vector<std::string> EnumerateSubKeyNamesUtf8(HKEY hKey)
+	{
+		return utf_detail::EnumerateSubKeyNames<char>(hKey);
+	}
+
+	inline std::vector<std::string> EnumerateValueNamesUtf8(HKEY hKey)
+	{
+		return utf_detail::EnumerateValueNames<char>(hKey);
+	}
+
+	inline std::vector<RegValueUtf8> EnumerateValuesUtf8(HKEY hKey, DWORD typeMask = AllValueTypes)
+	{
+		return utf_detail::EnumerateValues<char>(hKey, typeMask);
+	}
+
+
+	//
+	// char16_t overloads
+	//
+
+	inline RegKey OpenKey(HKEY hKey, std::u16string_view subKey, REGSAM accessRights = KEY_READ)
+	{
+		return utf_detail::OpenKey(hKey, subKey, accessRights);
+	}
+
+	inline RegKey CreateKey(HKEY hKey, std::u16string_view subKey, REGSAM accessRights = KEY_READ | KEY_WRITE)
+	{
+		return utf_detail::CreateKey(hKey, subKey, accessRights);
+	}
+
+	inline RegValueUtf16 QueryValue(HKEY hKey, std::u16string_view valueName)
+	{
+		return utf_detail::QueryValue(hKey, valueName);
+	}
+
+	inline void SetDwordValue(HKEY hKey, std::u16string_view valueName, DWORD data)
+	{
+		SetDwordValue(hKey, utf_detail::WideName(valueName, utf_detail::ValueSlot), data);
+	}
+
+	inline void SetStringValue(HKEY hKey, std::u16string_view valueName, std::u16string_view data,
+		DWORD typeId = REG_SZ)
+	{
+		utf_detail::SetStringValue(hKey, valueName, data, typeId);
+	}
+
+	inline void SetBinaryValue(HKEY hKey, std::u16string_view valueName, const BYTE* data, size_t dataSize)
+	{
+		SetBinaryValue(hKey, utf_detail::WideName(valueName, utf_detail::ValueSlot), data, dataSize);
+	}
+
+	// Any range of strings convertible to std::u16string_view
+	template <typename StringRange>
+	void SetMultiStringValue(HKEY hKey, std::u16string_view valueName, const StringRange& strings)
+	{
+		utf_detail::SetMultiStringValue<char16_t>(hKey, valueName, strings);
+	}
+
+	inline void SetMultiStringValue(HKEY hKey, std::u16string_view valueName,
+		std::initializer_list<std::u16string_view> strings)
+	{
+		utf_detail::SetMultiStringValue<char16_t>(hKey, valueName, strings);
+	}
+
+	inline std::vector<std::u16string> EnumerateSubKeyNamesUtf16(HKEY hKey)
+	{
+		return utf_detail::EnumerateSubKeyNames<char16_t>(hKey);
+	}
+
+	inline std::vector<std::u16string> EnumerateValueNamesUtf16(HKEY hKey)
+	{
+		return utf_detail::EnumerateValueNames<char16_t>(hKey);
+	}
+
+	inline std::vector<RegValueUtf16> EnumerateValuesUtf16(HKEY hKey, DWORD typeMask = AllValueTypes)
+	{
+		return utf_detail::EnumerateValues<char16_t>(hKey, typeMask);
+	}
+
+} // namespace winreg
@@ -0,0 +1,458 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinReg -- C++ Wrappers around Windows Registry APIs
+//
+// FILE: wreg_watch.h
+// DESC: Change notifications for many keys, delivered by a few threads.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//==============================================================================
+//
+// *** NOTES ***
+//
+// RegNotifyChangeKeyValue() signals an event once, at the next change of a key.
+// Waiting on the events with WaitForMultipleObjects() limits a thread to 63
+// keys, and a thread per key doesn't scale to thousands of them. WatchService:
+//
+//  - registers the waits with RegisterWaitForSingleObject(): the system thread
+//    pool multiplexes them, a wait thread serving up to 63 events;
+//
+//  - re-arms the notification as soon as it fires (before delivering it), so
+//    that the changes made meanwhile aren't missed;
+//
+//  - coalesces the notifications of each key: the first one starts a window
+//    (coalesceWindow), and the ones arriving during the window are merged in a
+//    single KeyChange, delivered when the window ends;
+//
+//  - delivers the KeyChanges on a fixed number of dispatcher threads. The
+//    callbacks of a watch are never called concurrently: the changes arriving
+//    during a callback are delivered after it returns.
+//
+// A notification doesn't say what changed, so each kind of change watched for
+// (values, sub-keys) is registered with its own event, to report which kind(s)
+// fired. When the key is deleted (or the notification can't be re-armed for
+// another reason), the last KeyChange reports it, and the watch stays inactive
+// until Unwatch().
+//
+// The notifications are registered with REG_NOTIFY_THREAD_AGNOSTIC, as the
+// thread pool thread re-arming them may exit at any time (Windows 8 and later).
+//
+//==============================================================================
+#include "wreg.h"       // WinReg public header
+#include <algorithm>    // std::max
+#include <chrono>       // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <cstdint>      // uint64_t
+#include <deque>        // std::deque
+#include <functional>   // std::function
+#include <map>          // std::map
+#include <memory>       // std::shared_ptr, std::unique_ptr
+#include <mutex>        // std::mutex
+#include <string>       // std::wstring
+#include <thread>       // std::thread
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+#ifndef REG_NOTIFY_THREAD_AGNOSTIC
+#define REG_NOTIFY_THREAD_AGNOSTIC 0x10000000L
+#endif
+
+namespace winreg
+{
+	// Kinds of changes, combined as a bit mask
+	enum KeyChangeType : DWORD
+	{
+		KeyChangeValues = 0x1,      // values set or deleted (REG_NOTIFY_CHANGE_LAST_SET)
+		KeyChangeSubKeys = 0x2,     // sub-keys created or deleted (REG_NOTIFY_CHANGE_NAME)
+		KeyChangeDeleted = 0x4,     // the key itself is gone: the watch is over
+	};
+
+
+	typedef uint64_t WatchId;
+
+
+	//------------------------------------------------------------------------------
+	// Changes to a watched key, coalesced over the coalescing window
+	//------------------------------------------------------------------------------
+	struct KeyChange
+	{
+		WatchId watch;
+		std::wstring keyPath;       // as passed to WatchService::Watch()
+		DWORD changes;              // KeyChangeType bits
+		size_t notifications;       // notifications merged in this change
+		LONG errorCode;             // other than ERROR_SUCCESS, the watch is over
+
+		bool Has(KeyChangeType type) const noexcept
+		{
+			return (changes & type) != 0;
+		}
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Options of WatchService
+	//------------------------------------------------------------------------------
+	struct WatchServiceOptions
+	{
+		size_t dispatcherThreads = 2;
+		std::chrono::milliseconds coalesceWindow{ 50 };
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Counters of WatchService
+	//------------------------------------------------------------------------------
+	struct WatchServiceStats
+	{
+		size_t notifications = 0;       // received from the registry
+		size_t deliveries = 0;          // callbacks called
+		size_t callbackFailures = 0;    // callbacks that threw (the exceptions are dropped)
+	};
+
+
+	//------------------------------------------------------------------------------
+	// Watches many keys, delivering their changes on a few dispatcher threads
+	// (see the notes at the top of this file). Thread-safe.
+	//------------------------------------------------------------------------------
+	class WatchService
+	{
+	public:
+		typedef std::function<void(const KeyChange& change)> Callback;
+
+
+		explicit WatchService(const WatchServiceOptions& options = WatchServiceOptions())
+			: m_options(options)
+		{
+			for (size_t i = 0; i < (std::max)(options.dispatcherThreads, size_t(1)); i++)
+			{
+				m_dispatchers.emplace_back([this] { Dispatch(); });
+			}
+		}
+
+
+		// Stops watching; the changes not delivered yet are dropped
+		~WatchService()
+		{
+			std::vector<std::shared_ptr<Entry>> entries;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (auto& watch : m_watches)
+				{
+					watch.second->removed = true;
+					entries.push_back(std::move(watch.second));
+				}
+				m_watches.clear();
+			}
+			for (auto& entry : entries)
+			{
+				Release(*entry);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stopping = true;
+			}
+			m_changed.notify_all();
+			for (std::thread& dispatcher : m_dispatchers)
+			{
+				dispatcher.join();
+			}
+		}
+
+
+		WatchService(const WatchService&) = delete;
+		WatchService& operator=(const WatchService&) = delete;
+
+
+		// Watches subKey of hKey (and its whole sub-tree, with watchSubtree) for the
+		// changes in the changes mask (KeyChangeValues, KeyChangeSubKeys).
+		// Throws RegException if the key can't be opened or watched.
+		WatchId Watch(HKEY hKey, const std::wstring& subKey, DWORD changes, Callback callback,
+			bool watchSubtree = false)
+		{
+			_ASSERTE(hKey != nullptr);
+			_ASSERTE((changes & (KeyChangeValues | KeyChangeSubKeys)) != 0);
+			_ASSERTE(callback);
+
+			auto entry = std::make_shared<Entry>();
+			entry->keyPath = subKey;
+			entry->subtree = watchSubtree;
+			entry->callback = std::make_shared<const Callback>(std::move(callback));
+
+			LONG result = ::RegOpenKeyEx(hKey, subKey.c_str(), 0, KEY_NOTIFY, &entry->key);
+			if (result != ERROR_SUCCESS)
+			{
+				throw RegException(L"RegOpenKeyEx() failed trying opening the key to watch.", result);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				entry->id = ++m_lastId;
+			}
+
+			const std::pair<KeyChangeType, DWORD> kinds[] =
+			{
+				{ KeyChangeValues, REG_NOTIFY_CHANGE_LAST_SET },
+				{ KeyChangeSubKeys, REG_NOTIFY_CHANGE_NAME },
+			};
+			for (const auto& kind : kinds)
+			{
+				if ((changes & kind.first) == 0)
+				{
+					continue;
+				}
+
+				entry->arms.push_back(std::make_unique<Arm>(
+					Arm{ this, entry.get(), kind.first, static_cast<DWORD>(kind.second | REG_NOTIFY_THREAD_AGNOSTIC) }));
+				Arm& arm = *entry->arms.back();
+
+				arm.event = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+				result = (arm.event != nullptr)
+					? ::RegNotifyChangeKeyValue(entry->key, watchSubtree, arm.filter, arm.event, TRUE)
+					: ERROR_NOT_ENOUGH_MEMORY;
+				if (result == ERROR_SUCCESS
+					&& !::RegisterWaitForSingleObject(&arm.wait, arm.event, OnSignaled, &arm, INFINITE, WT_EXECUTEDEFAULT))
+				{
+					arm.wait = nullptr;
+					result = ERROR_NOT_ENOUGH_MEMORY;
+				}
+				if (result != ERROR_SUCCESS)
+				{
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						entry->removed = true;
+					}
+					Release(*entry);
+					throw RegException(L"RegNotifyChangeKeyValue() failed trying watching a key.", result);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_watches.emplace(entry->id, entry);
+			return entry->id;
+		}
+
+
+		// Stops watching. When it returns, no callback of the watch is running (but
+		// when called from that callback) nor will be called any more.
+		void Unwatch(WatchId id)
+		{
+			std::shared_ptr<Entry> entry;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				auto it = m_watches.find(id);
+				if (it == m_watches.end())
+				{
+					return;
+				}
+				entry = std::move(it->second);
+				m_watches.erase(it);
+				entry->removed = true;
+
+				m_changed.wait(lock, [&]
+				{
+					return !entry->dispatching || entry->dispatcher == std::this_thread::get_id();
+				});
+			}
+			Release(*entry);
+		}
+
+
+		size_t WatchCount() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_watches.size();
+		}
+
+
+		WatchServiceStats Stats() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_stats;
+		}
+
+	private:
+		struct Entry;
+
+		// A notification registration, for one kind of change of a key
+		struct Arm
+		{
+			WatchService* service;
+			Entry* entry;
+			KeyChangeType type;
+			DWORD filter;                   // REG_NOTIFY_xxx
+			HANDLE event = nullptr;
+			HANDLE wait = nullptr;
+		};
+
+		struct Entry : std::enable_shared_from_this<Entry>
+		{
+			WatchId id = 0;
+			std::wstring keyPath;
+			HKEY key = nullptr;
+			bool subtree = false;
+			std::shared_ptr<const Callback> callback;
+			std::vector<std::unique_ptr<Arm>> arms;
+
+			// Guarded by the service mutex
+			DWORD pendingChanges = 0;
+			size_t pendingNotifications = 0;
+			LONG errorCode = ERROR_SUCCESS;
+			bool queued = false;            // in the due queue
+			bool dispatching = false;       // its callback is running
+			std::thread::id dispatcher;
+			bool removed = false;
+		};
+
+		typedef std::chrono::steady_clock Clock;
+
+		WatchServiceOptions m_options;
+		std::vector<std::thread> m_dispatchers;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_changed;
+		std::map<WatchId, std::shared_ptr<Entry>> m_watches;
+		std::deque<std::pair<Clock::time_point, std::shared_ptr<Entry>>> m_due;  // by due time
+		WatchId m_lastId = 0;
+		WatchServiceStats m_stats;
+		bool m_stopping = false;
+
+
+		// Stops the waits (waiting for the running callbacks), then closes the handles
+		static void Release(Entry& entry)
+		{
+			for (auto& arm : entry.arms)
+			{
+				if (arm->wait != nullptr)
+				{
+					::UnregisterWaitEx(arm->wait, INVALID_HANDLE_VALUE);
+				}
+			}
+			if (entry.key != nullptr)
+			{
+				::RegCloseKey(entry.key);
+				entry.key = nullptr;
+			}
+			for (auto& arm : entry.arms)
+			{
+				if (arm->event != nullptr)
+				{
+					::CloseHandle(arm->event);
+				}
+			}
+			entry.arms.clear();
+		}
+
+
+		// Called by the thread pool when the event of an Arm is signaled
+		static void CALLBACK OnSignaled(PVOID context, BOOLEAN /* timedOut */)
+		{
+			Arm& arm = *static_cast<Arm*>(context);
+			arm.service->OnNotification(arm);
+		}
+
+
+		void OnNotification(Arm& arm)
+		{
+			Entry& entry = *arm.entry;
+
+			// Re-arm first, not to miss the changes coming while this one is delivered
+			const LONG result = ::RegNotifyChangeKeyValue(entry.key, entry.subtree, arm.filter, arm.event, TRUE);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stats.notifications++;
+			if (entry.removed || entry.errorCode != ERROR_SUCCESS)
+			{
+				return;
+			}
+
+			entry.pendingChanges |= arm.type;
+			entry.pendingNotifications++;
+			if (result != ERROR_SUCCESS)
+			{
+				entry.errorCode = result;
+				if (result == ERROR_KEY_DELETED)
+				{
+					entry.pendingChanges |= KeyChangeDeleted;
+				}
+			}
+
+			if (!entry.queued && !entry.dispatching)
+			{
+				Schedule(entry);
+			}
+		}
+
+
+		// Queues a watch for delivery at the end of the coalescing window.
+		// Called with the mutex held.
+		void Schedule(Entry& entry)
+		{
+			entry.queued = true;
+			m_due.emplace_back(Clock::now() + m_options.coalesceWindow, entry.shared_from_this());
+			m_changed.notify_all();
+		}
+
+
+		// Body of the dispatcher threads
+		void Dispatch()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stopping)
+			{
+				if (m_due.empty())
+				{
+					m_changed.wait(lock);
+					continue;
+				}
+				const Clock::time_point due = m_due.front().first;
+				if (Clock::now() < due)
+				{
+					m_changed.wait_until(lock, due);
+					continue;
+				}
+
+				std::shared_ptr<Entry> entry = std::move(m_due.front().second);
+				m_due.pop_front();
+				entry->queued = false;
+				if (entry->removed)
+				{
+					continue;
+				}
+
+				const KeyChange change{ entry->id, entry->keyPath, entry->pendingChanges,
+					entry->pendingNotifications, entry->errorCode };
+				entry->pendingChanges = 0;
+				entry->pendingNotifications = 0;
+				entry->dispatching = true;
+				entry->dispatcher = std::this_thread::get_id();
+				const std::shared_ptr<const Callback> callback = entry->callback;
+
+				lock.unlock();
+				bool failed = false;
+				try
+				{
+					(*callback)(change);
+				}
+				catch (...)
+				{
+					failed = true;
+				}
+				lock.lock();
+
+				m_stats.deliveries++;
+				m_stats.callbackFailures += failed ? 1 : 0;
+				entry->dispatching = false;
+				if (entry->pendingNotifications != 0 && !entry->removed)
+				{
+					Schedule(*entry);
+				}
+				m_changed.notify_all();
+			}
+		}
+	};
+
+} // namespace winreg